@@ -46,10 +46,46 @@ void BSP_init(void) {
 
 	STM_EVAL_COMInit(COM1, &USART_InitStructure);
 
+#ifdef USB_OTG_RAMFUNC
+	BSP_RelocateVectorTable();
+#endif
+
 	printf("\n\n\rUSART Printf Example: retarget the C library printf function to the USART\n");
 
 
 }
+#ifdef USB_OTG_RAMFUNC
+/* Start and end of the flash vector table, see prj/stm32_flash.ld */
+extern uint32_t _sisr_vector[], _eisr_vector[];
+
+/* 16 system + 81 STM32F2 vectors, VTOR wants it aligned on 128 words */
+#define RAM_VECTOR_WORDS	128
+static uint32_t ram_vectors[RAM_VECTOR_WORDS] __attribute__ ((section (".ram_vector"), aligned (RAM_VECTOR_WORDS * 4)));
+
+/**
+  * @brief  Copies the vector table into SRAM and points VTOR at it, so the
+  *         vector fetch of the OTG interrupts does not wait on flash and
+  *         handlers can be swapped at run time.
+  * @param  None
+  * @retval None
+  */
+void BSP_RelocateVectorTable(void)
+{
+	uint32_t i;
+	uint32_t n = _eisr_vector - _sisr_vector;
+
+	if (n > RAM_VECTOR_WORDS)
+		n = RAM_VECTOR_WORDS;
+	for (i = 0; i < n; i++)
+		ram_vectors[i] = _sisr_vector[i];
+
+	__disable_irq();
+	SCB->VTOR = (uint32_t)ram_vectors;
+	__DSB();
+	__enable_irq();
+}
+#endif
+
 static uint32_t tick_time = 0;
 uint32_t millis(void) {
 	return tick_time;
@@ -97,11 +133,22 @@ void Default_Handler_c(unsigned int * hardfault_args) {
 
 	while (1);
 }
-void OTG_FS_IRQHandler(void)
+__RAMFUNC void OTG_HS_IRQHandler(void)
+{
+	USBH_OTG_IRQ_Handler(USB_OTG_HS_CORE_ID);
+}
+
+__RAMFUNC void OTG_FS_IRQHandler(void)
 {
-	USBH_OTG_ISR_Handler(&USB_OTG_Core_dev);
+	USBH_OTG_IRQ_Handler(USB_OTG_FS_CORE_ID);
 	//while(1);
 }
 
+/* Bottom half of the OTG interrupts, pended by USBH_OTG_IRQ_Handler */
+__RAMFUNC void PendSV_Handler(void)
+{
+	USBH_OTG_DeferredHandler();
+}
+
 void __cxa_pure_virtual(void) { while (1); }
 uint8_t pgm_read_byte (const uint8_t *abc) {return *abc;}
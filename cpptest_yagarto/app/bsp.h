@@ -18,6 +18,9 @@
 #include "stm322xg_eval.h"
 
 void BSP_init(void);
+#ifdef USB_OTG_RAMFUNC
+void BSP_RelocateVectorTable(void);
+#endif
 uint8_t GetKey(void);
 uint32_t millis(void);
 __inline void delay_ms(uint32_t count) {
@@ -17,6 +17,14 @@ USB_OTG_CORE_HANDLE USB_OTG_Core_dev;
 USB Usb(&USB_OTG_Core_dev);
 USBHub Hub(&Usb);
 
+#ifdef USB_OTG_DUAL_HOST
+// A second, independent host on the other OTG core. Class drivers constructed
+// with &Usb2 serve it, e.g. storage on the HS core and HID/Bluetooth on the FS one.
+USB_OTG_CORE_HANDLE USB_OTG_Core_dev2;
+USB Usb2(&USB_OTG_Core_dev2, (USB_HOST_CORE_ID == USB_OTG_FS_CORE_ID) ? USB_OTG_HS_CORE_ID : USB_OTG_FS_CORE_ID);
+USBHub Hub2(&Usb2);
+#endif
+
 int main(void)
 {
 	BSP_init();
@@ -39,12 +47,23 @@ int main(void)
 
 	if (Usb.Init() != -1)
 		printf("\nUsb is initialized.\n");
+#ifdef USB_OTG_DUAL_HOST
+	if (Usb2.Init() != -1)
+		printf("\nUsb2 is initialized.\n");
+#endif
+
+#ifdef USBH_ISR_CYCLE_STATS
+	USBH_ISR_Cycles_Reset();
+#endif
 
 	uint32_t heart_cnt = 0;
 
 	for(;;) {
 
 		Usb.Task(&USB_OTG_Core_dev);
+#ifdef USB_OTG_DUAL_HOST
+		Usb2.Task(&USB_OTG_Core_dev2);
+#endif
 
 		check_fatstatus();
 		check_btdstatus();
@@ -61,11 +80,55 @@ int main(void)
 			case 's':
 				demo_speedtest();
 				break;
+			case 'c':
+				demo_savecache();
+				break;
+			case 'p':
+				demo_parserbench();
+				break;
+			case 't':
+				demo_topology();
+				break;
+			case 'q':
+				demo_queuebench();
+				break;
+			case 'r':
+				demo_streambench();
+				break;
+#ifdef USBH_FAULT_INJECT
+			case 'j':
+				demo_faultbench();
+				break;
+#endif
+#ifdef USBH_ISR_CYCLE_STATS
+			case 'i':
+				for (uint8_t core = 0; core < 2; core++) {
+					if (!USBH_ISR_Cycles[core].count)
+						continue;
+					printf("\r\n%s ISR: %lu calls, cycles min %lu max %lu last %lu, %lu halts not deferred", (core == USB_OTG_HS_CORE_ID) ? "HS" : "FS",
+						USBH_ISR_Cycles[core].count, USBH_ISR_Cycles[core].min,
+						USBH_ISR_Cycles[core].max, USBH_ISR_Cycles[core].last,
+						USBH_OTG_Core[core]->host.EventOverrun);
+				}
+				USBH_ISR_Cycles_Reset();
+				break;
+#endif
 			case 'h':
 				printf("\r\nCommand list:\r\n");
 				printf(" b : demo directory browsing\n");
 				printf(" f : demo file operation\n");
 				printf(" s : demo file operation speed\n");
+				printf(" c : save usb descriptor cache\n");
+				printf(" p : configuration descriptor parser benchmark\n");
+				printf(" t : usb device topology and address pool check\n");
+				printf(" q : storage queue benchmark over all bulk-only luns\n");
+				printf(" r : streaming read into a parser, against a buffered read\n");
+#ifdef USBH_FAULT_INJECT
+				printf(" j : fault injection and recovery bench\n");
+#endif
+#ifdef USBH_ISR_CYCLE_STATS
+				printf(" i : usb interrupt cycle statistics\n");
+#endif
 			}
 		}
 
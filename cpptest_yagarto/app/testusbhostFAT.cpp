@@ -8,11 +8,16 @@
 #include <bsp.h>
 #include <Usb.h>
 #include <masstorage.h>
+#include <uas.h>
 #include <Storage.h>
+#include <ReadAhead/ReadAhead.h>
+#include <WriteCache/WriteCache.h>
+#include <StorageQueue/StorageQueue.h>
 
 #include <PCpartition/PCPartition.h>
 #include <FAT/FAT.h>
 #include <string.h>
+#include "testusbhostFAT.h"
 
 volatile int brightness = 0; // how bright the LED is
 volatile int fadeAmount = 80; // how many points to fade the LED by
@@ -39,8 +44,13 @@ static storage_t sto[_VOLUMES];
 #define mbxs 128
 static uint8_t My_Buff_x[mbxs]; /* File read buffer */
 
+/* USB descriptor cache is kept here between power cycles */
+#define DESCR_CACHE_FILE "0:/USBDESCR.BIN"
+static uint8_t descr_cache_blob[8 + USB_DESCR_CACHE_ENTRIES * sizeof (DescriptorCacheEntry)];
+
 
 BulkOnly *Bulk[MAX_USB_MS_DRIVERS];
+UAS *Uas[MAX_USB_UAS_DRIVERS];
 
 /**
  * This must be called before using generic_storage. This works around a G++ bug.
@@ -54,6 +64,10 @@ void InitClassStorage(void) {
 		((pvt_t *)sto[i].private_data)->B = 255; // impossible
     }
 
+	// Registered first, so a device with both settings gets UAS
+	for(int i=0; i< MAX_USB_UAS_DRIVERS; i++) {
+		Uas[i]= new UAS(&Usb);
+	}
 	for(int i=0; i< MAX_USB_MS_DRIVERS; i++) {
 		Bulk[i]= new BulkOnly(&Usb);
 	}
@@ -71,6 +85,43 @@ void die(FRESULT rc) {
         //for (;;);
 }
 
+/* Partitions and FAT volumes of a ready LUN, sto[i] */
+static void mount_partitions(int i) {
+	// get the partition data...
+	PT = new PCPartition;
+
+	if (!PT->Init(&sto[i])) {
+		part_t *apart;
+		for (int j = 0; j < 4; j++) {
+			apart = PT->GetPart(j);
+			if (apart != NULL && apart->type != 0x00) {
+				memcpy(&(parts[cpart]), apart, sizeof (part_t));
+				printf(PSTR("Partition %u type %#02x\r\n"), j, parts[cpart].type);
+				// for now
+				if (isfat(parts[cpart].type)) {
+					Fats[cpart] = new PFAT;
+					int r = Fats[cpart]->Init(&sto[i], cpart, parts[cpart].firstSector);
+					if (r) {
+						delete Fats[cpart];
+						Fats[cpart] = NULL;
+					} else cpart++;
+				}
+			}
+		}
+	} else {
+		// try superblock
+		Fats[cpart] = new PFAT;
+		int r = Fats[cpart]->Init(&sto[i], cpart, 0);
+		if (r) {
+			printf(PSTR("Superblock error %x\r\n"), r);
+			delete Fats[cpart];
+			Fats[cpart] = NULL;
+		} else cpart++;
+
+	}
+	delete PT;
+}
+
 void check_fatstatus(void) {
     current_state = Usb.getUsbTaskState();
 	if (current_state != last_state) {
@@ -87,6 +138,11 @@ void check_fatstatus(void) {
 					delete Fats[i];
 				Fats[i] = NULL;
 			}
+			for (int i = 0; i < _VOLUMES; i++) {
+				StorageQueueCancel(&sto[i], MASS_ERR_DEVICE_DISCONNECTED);
+				WriteCacheDetach(&sto[i]);
+				ReadAheadDetach(&sto[i]);
+			}
 			fatready = false;
 			cpart = 0;
 		}
@@ -94,10 +150,42 @@ void check_fatstatus(void) {
 	}
 
 	if (partsready && !fatready) {
-		if (cpart > 0) fatready = true;
+		if (cpart > 0) {
+			fatready = true;
+			load_descrcache();
+		}
 	}
 
     // This is horrible, and needs to be moved elsewhere!
+	for (int B = 0; B < MAX_USB_UAS_DRIVERS; B++) {
+		if (!partsready && Uas[B]->GetAddress() != NULL) {
+			int ML = Uas[B]->GetbMaxLUN() + 1;
+			for (int i = 0; i < ML; i++) {
+				if (Uas[B]->LUNIsGood(i)) {
+					partsready = true;
+					((pvt_t *)sto[i].private_data)->lun = i;
+					((pvt_t *)sto[i].private_data)->B = B;
+					sto[i].Read = *URead;
+					sto[i].Write = *UWrite;
+					sto[i].Reads = *UReads;
+					sto[i].Writes = *UWrites;
+					sto[i].Status = *UStatus;
+					sto[i].Submit = NULL; // UAS queues tags itself
+					sto[i].Finish = NULL;
+					sto[i].TotalSectors = Uas[B]->GetCapacity(i);
+					sto[i].SectorSize = Uas[B]->GetSectorSize(i);
+					printf(PSTR("UAS LUN:\t%u\r\n"), i);
+					printf(PSTR("Total Sectors:\t0x%x\t%d\r\n"), sto[i].TotalSectors, sto[i].TotalSectors);
+					printf(PSTR("Sector Size:\t0x%x\t\t%d\r\n"), sto[i].SectorSize, sto[i].SectorSize);
+					if (Uas[B]->GetCapacity64(i) > sto[i].TotalSectors)
+						printf(PSTR("Only the first 2^32 sectors are reachable through FAT\r\n"));
+					ReadAheadAttach(&sto[i]);
+					WriteCacheAttach(&sto[i]);
+					mount_partitions(i);
+				}
+			}
+		}
+	}
 	for (int B = 0; B < MAX_USB_MS_DRIVERS; B++) {
 		if (!partsready && Bulk[B]->GetAddress() != NULL) {
 				// Build a list.
@@ -114,49 +202,27 @@ void check_fatstatus(void) {
 					sto[i].Reads = *PReads;
 					sto[i].Writes = *PWrites;
 					sto[i].Status = *PStatus;
+					sto[i].Submit = *PSubmit;
+					sto[i].Finish = *PFinish;
 					sto[i].TotalSectors = Bulk[B]->GetCapacity(i);
 					sto[i].SectorSize = Bulk[B]->GetSectorSize(i);
 					printf(PSTR("LUN:\t\t%u\r\n"), i);
 					printf(PSTR("Total Sectors:\t0x%x\t%d\r\n"), sto[i].TotalSectors, sto[i].TotalSectors);
 					printf(PSTR("Sector Size:\t0x%x\t\t%d\r\n"), sto[i].SectorSize, sto[i].SectorSize);
-					// get the partition data...
-					PT = new PCPartition;
-
-					if (!PT->Init(&sto[i])) {
-							part_t *apart;
-							for (int j = 0; j < 4; j++) {
-								apart = PT->GetPart(j);
-								if (apart != NULL && apart->type != 0x00) {
-									memcpy(&(parts[cpart]), apart, sizeof (part_t));
-									printf(PSTR("Partition %u type %#02x\r\n"), j, parts[cpart].type);
-									// for now
-									if (isfat(parts[cpart].type)) {
-										Fats[cpart] = new PFAT;
-										int r = Fats[cpart]->Init(&sto[i], cpart, parts[cpart].firstSector);
-										if (r) {
-											delete Fats[cpart];
-											Fats[cpart] = NULL;
-										} else cpart++;
-									}
-								}
-							}
-					} else {
-						// try superblock
-						Fats[cpart] = new PFAT;
-						int r = Fats[cpart]->Init(&sto[i], cpart, 0);
-						if (r) {
-							printf(PSTR("Superblock error %x\r\n"), r);
-							delete Fats[cpart];
-							Fats[cpart] = NULL;
-						} else cpart++;
-
-					}
-					delete PT;
+					if (Bulk[B]->GetPhysicalSectorSize(i) != sto[i].SectorSize)
+						printf(PSTR("Physical Size:\t0x%lx\t\t%lu\r\n"), Bulk[B]->GetPhysicalSectorSize(i), Bulk[B]->GetPhysicalSectorSize(i));
+					if (Bulk[B]->GetCapacity64(i) > sto[i].TotalSectors)
+						printf(PSTR("Only the first 2^32 sectors are reachable through FAT\r\n"));
+					ReadAheadAttach(&sto[i]);
+					WriteCacheAttach(&sto[i]);
+					mount_partitions(i);
 				} else {
 					sto[i].Read = NULL;
 					sto[i].Write = NULL;
 					sto[i].Writes = NULL;
 					sto[i].Reads = NULL;
+					sto[i].Submit = NULL;
+					sto[i].Finish = NULL;
 					sto[i].TotalSectors = 0UL;
 					sto[i].SectorSize = 0;
 				}
@@ -169,7 +235,8 @@ void check_fatstatus(void) {
 		if (Fats[0] != NULL) {
 			struct Pvt * p;
 			p = ((struct Pvt *)(Fats[0]->storage->private_data));
-			if (!Bulk[p->B]->LUNIsGood(p->lun)) {
+			bool good = (Fats[0]->storage->Status == UStatus) ? Uas[p->B]->LUNIsGood(p->lun) : Bulk[p->B]->LUNIsGood(p->lun);
+			if (!good) {
 				// media change
 				fadeAmount = 80;
 				partsready = false;
@@ -178,13 +245,382 @@ void check_fatstatus(void) {
 						delete Fats[i];
 					Fats[cpart] = NULL;
 				}
+				for (int i = 0; i < _VOLUMES; i++) {
+					StorageQueueCancel(&sto[i], MASS_ERR_MEDIA_CHANGED);
+					WriteCacheDetach(&sto[i]);
+					ReadAheadDetach(&sto[i]);
+				}
 				fatready = false;
 				cpart = 0;
 			}
 
 		}
+		for (int i = 0; i < _VOLUMES; i++)
+			WriteCachePoll(&sto[i], millis());
+	}
+}
+void load_descrcache(void) {
+	FRESULT rc;
+	UINT br;
+
+	rc = f_open(&My_File_Object_x, DESCR_CACHE_FILE, FA_READ);
+	if (rc) return;
+	rc = f_read(&My_File_Object_x, descr_cache_blob, sizeof (descr_cache_blob), &br);
+	f_close(&My_File_Object_x);
+	if (!rc && !Usb.GetDescriptorCache().Import(descr_cache_blob, br))
+		printf(PSTR("\r\nDescriptor cache loaded (%u bytes)\r\n"), br);
+}
+
+void demo_savecache(void) {
+	if (fatready) {
+		FRESULT rc;
+		UINT bw;
+		uint16_t len = Usb.GetDescriptorCache().Export(descr_cache_blob, sizeof (descr_cache_blob));
+		const DescriptorCacheStats &st = Usb.GetDescriptorCache().GetStats();
+
+		printf(PSTR("\r\nDescriptor cache: %u hits, %u misses, %u requests served\r\n"), st.hits, st.misses, st.served);
+		rc = f_open(&My_File_Object_x, DESCR_CACHE_FILE, FA_WRITE | FA_CREATE_ALWAYS);
+		if (rc) {
+			die(rc);
+			return;
+		}
+		rc = f_write(&My_File_Object_x, descr_cache_blob, len, &bw);
+		f_close(&My_File_Object_x);
+		if (rc) die(rc);
+		else printf(PSTR("%u bytes written to %s\r\n"), bw, DESCR_CACHE_FILE);
+	}
+}
+
+/* Configuration descriptor of a typical flash stick, with a HID interface in front to make the parsers work */
+static const uint8_t bench_confdescr[] = {
+	0x09, 0x02, 0x39, 0x00, 0x02, 0x01, 0x00, 0x80, 0x32,
+	0x09, 0x04, 0x00, 0x00, 0x01, 0x03, 0x01, 0x01, 0x00,
+	0x09, 0x21, 0x11, 0x01, 0x00, 0x01, 0x22, 0x3f, 0x00,
+	0x07, 0x05, 0x83, 0x03, 0x08, 0x00, 0x0a,
+	0x09, 0x04, 0x01, 0x00, 0x02, 0x08, 0x06, 0x50, 0x00,
+	0x07, 0x05, 0x81, 0x02, 0x40, 0x00, 0x00,
+	0x07, 0x05, 0x02, 0x02, 0x40, 0x00, 0x00
+};
+
+class BenchXtracter : public UsbConfigXtracter {
+public:
+	uint32_t count;
+	BenchXtracter() : count(0) {};
+	virtual void EndpointXtract(uint8_t conf, uint8_t iface, uint8_t alt, uint8_t proto, const USB_ENDPOINT_DESCRIPTOR *ep) {
+		count++;
+	};
+};
+
+#define BENCH_PARSER_LOOPS 20000
+
+void demo_parserbench(void) {
+	BenchXtracter xa, xb;
+	uint32_t start, ta, tb;
+	uint16_t offset = 0;
+
+	printf(PSTR("\r\nParsing a %u byte configuration descriptor %u times\r\n"), sizeof (bench_confdescr), BENCH_PARSER_LOOPS);
+	start = millis();
+	for (uint32_t i = 0; i < BENCH_PARSER_LOOPS; i++) {
+		ConfigDescParser<USB_CLASS_MASS_STORAGE, MASS_SUBCLASS_SCSI, MASS_PROTO_BBB, CP_MASK_COMPARE_ALL> parser(&xa);
+		parser.Parse(sizeof (bench_confdescr), bench_confdescr, offset);
+	}
+	ta = millis() - start;
+	start = millis();
+	for (uint32_t i = 0; i < BENCH_PARSER_LOOPS; i++) {
+		ConfigDescWalker<USB_CLASS_MASS_STORAGE, MASS_SUBCLASS_SCSI, MASS_PROTO_BBB, CP_MASK_COMPARE_ALL> walker(&xb);
+		walker.Parse(sizeof (bench_confdescr), bench_confdescr, offset);
+	}
+	tb = millis() - start;
+	printf(PSTR("ConfigDescParser: %u ms, %u endpoints\r\n"), ta, xa.count);
+	printf(PSTR("ConfigDescWalker: %u ms, %u endpoints\r\n"), tb, xb.count);
+}
+
+#define QBENCH_BYTES 1048576UL
+
+/* Reads QBENCH_BYTES from every ready Bulk-Only LUN, one LUN after the other, then all of them through the storage queue */
+void demo_queuebench(void) {
+	storage_t qsto[STORAGEQ_UNITS];
+	pvt_t qpvt[STORAGEQ_UNITS];
+	storage_request_t rq[STORAGEQ_UNITS];
+	uint32_t left[STORAGEQ_UNITS];
+	uint32_t start, ta, tb, cnt;
+	uint8_t *buf;
+	uint8_t n = 0;
+	int rc = 0;
+
+	memset(qsto, 0, sizeof (qsto));
+	for (int B = 0; B < MAX_USB_MS_DRIVERS; B++) {
+		if (!Bulk[B]->GetAddress())
+			continue;
+		for (int lun = 0; lun <= Bulk[B]->GetbMaxLUN() && n < STORAGEQ_UNITS; lun++) {
+			if (!Bulk[B]->LUNIsGood(lun))
+				continue;
+			qpvt[n].B = B;
+			qpvt[n].lun = lun;
+			qsto[n].private_data = &qpvt[n];
+			qsto[n].Reads = *PReads;
+			qsto[n].Writes = *PWrites;
+			qsto[n].Submit = *PSubmit;
+			qsto[n].Finish = *PFinish;
+			qsto[n].SectorSize = Bulk[B]->GetSectorSize(lun);
+			qsto[n].TotalSectors = Bulk[B]->GetCapacity(lun);
+			n++;
+		}
+	}
+	if (!n) {
+		printf(PSTR("\r\nNo Bulk-Only LUN is ready\r\n"));
+		return;
+	}
+	buf = new uint8_t[STORAGEQ_SLICE];
+	printf(PSTR("\r\nReading %lu bytes from each of %u LUNs\r\n"), QBENCH_BYTES, n);
+
+	start = millis();
+	for (uint8_t i = 0; i < n && !rc; i++) {
+		cnt = STORAGEQ_SLICE / qsto[i].SectorSize;
+		for (uint32_t lba = 0; lba < QBENCH_BYTES / qsto[i].SectorSize && !rc; lba += cnt)
+			rc = PReads(lba, buf, &qsto[i], cnt);
+	}
+	ta = millis() - start;
+
+	start = millis();
+	for (uint8_t i = 0; i < n && !rc; i++) {
+		cnt = STORAGEQ_SLICE / qsto[i].SectorSize;
+		left[i] = QBENCH_BYTES / qsto[i].SectorSize - cnt;
+		StorageQueuePost(&rq[i], &qsto[i], 0, buf, cnt, false);
+	}
+	while (!rc && !StorageQueueIdle()) {
+		StorageQueueRun();
+		for (uint8_t i = 0; i < n; i++) {
+			if (rq[i].busy)
+				continue;
+			rc = rq[i].result;
+			if (rc)
+				break;
+			if (!left[i])
+				continue;
+			cnt = STORAGEQ_SLICE / qsto[i].SectorSize;
+			left[i] -= cnt;
+			StorageQueuePost(&rq[i], &qsto[i], rq[i].LBA + cnt, buf, cnt, false);
+		}
+	}
+	for (uint8_t i = 0; i < n; i++)
+		StorageQueueCancel(&qsto[i], -1);
+	tb = millis() - start;
+	delete[] buf;
+
+	if (rc)
+		printf(PSTR("Read error %x\r\n"), rc);
+	else {
+		printf(PSTR("One LUN after the other: %lu ms\r\n"), ta);
+		printf(PSTR("All through the queue:   %lu ms\r\n"), tb);
+	}
+}
+
+class SumParser : public USBReadParser {
+public:
+	uint32_t sum;
+	uint32_t bytes;
+	SumParser() : sum(0), bytes(0) {};
+	virtual void Parse(const uint16_t len, const uint8_t *pbuf, const uint16_t &offset) {
+		for (uint16_t i = 0; i < len; i++)
+			sum += pbuf[i];
+		bytes += len;
+	};
+};
+
+/* Sums QBENCH_BYTES of the first ready Bulk-Only LUN read into a buffer, then streamed through a parser */
+void demo_streambench(void) {
+	SumParser prs;
+	uint32_t start, ta, tb, cnt, sum = 0;
+	uint16_t ss;
+	uint8_t *buf;
+	uint8_t rc = 0;
+	int B, lun = 0;
+
+	for (B = 0; B < MAX_USB_MS_DRIVERS; B++) {
+		if (!Bulk[B]->GetAddress())
+			continue;
+		for (lun = 0; lun <= Bulk[B]->GetbMaxLUN(); lun++)
+			if (Bulk[B]->LUNIsGood(lun))
+				break;
+		if (lun <= Bulk[B]->GetbMaxLUN())
+			break;
+	}
+	if (B == MAX_USB_MS_DRIVERS) {
+		printf(PSTR("\r\nNo Bulk-Only LUN is ready\r\n"));
+		return;
+	}
+	ss = Bulk[B]->GetSectorSize(lun);
+	cnt = STORAGEQ_SLICE / ss;
+	buf = new uint8_t[STORAGEQ_SLICE];
+	printf(PSTR("\r\nSumming %lu bytes\r\n"), QBENCH_BYTES);
+
+	start = millis();
+	for (uint32_t lba = 0; lba < QBENCH_BYTES / ss && !rc; lba += cnt) {
+		rc = Bulk[B]->Read(lun, lba, ss, cnt, buf);
+		for (uint32_t i = 0; i < cnt * ss; i++)
+			sum += buf[i];
+	}
+	ta = millis() - start;
+	delete[] buf;
+
+	start = millis();
+	if (!rc)
+		rc = Bulk[B]->Read(lun, 0, ss, QBENCH_BYTES / ss, &prs);
+	tb = millis() - start;
+
+	if (rc)
+		printf(PSTR("Read error %x\r\n"), rc);
+	else {
+		printf(PSTR("Into a %lu byte buffer: %lu ms, sum %08lx\r\n"), STORAGEQ_SLICE, ta, sum);
+		printf(PSTR("Streamed to a parser:   %lu ms, sum %08lx, %lu bytes\r\n"), tb, prs.sum, prs.bytes);
+	}
+}
+
+static void print_usbdevice(UsbDevice *pdev) {
+	static const char *speeds[] = { "full", "low", "high" };
+
+	printf(PSTR("  addr %3u  parent %3u  port %3u  tier %u  %s speed%s"), pdev->address, pdev->parent, pdev->port,
+		pdev->tier, speeds[pdev->speed], (pdev->hub) ? "  hub" : "");
+	if (pdev->ttHub)
+		printf(PSTR("  via TT of hub %u port %u"), pdev->ttHub, pdev->ttPort);
+	printf(PSTR("\r\n"));
+	printf(PSTR("    transfers %lu  transient %lu  protocol %lu  fatal %lu  retries %lu  recovered %lu  given up %lu  failing %u\r\n"),
+		pdev->health.transfers, pdev->health.transient, pdev->health.protocol, pdev->health.fatal,
+		pdev->health.retries, pdev->health.recovered, pdev->health.exhausted, pdev->health.failStreak);
+}
+
+/* Scratch pool for the allocator check, the one of Usb is left alone */
+static AddressPoolImpl<USB_NUMADDRESSES> topo_pool;
+
+void demo_topology(void) {
+	AddressPoolImpl<USB_NUMADDRESSES> &pool = topo_pool;
+	uint8_t hubs[USB_MAX_TIER - 1];
+	uint8_t parent = 0, n = 0, bad = 0;
+
+	printf(PSTR("\r\nAddressed devices: %u\r\n"), Usb.GetAddressPool().GetNumDevices());
+	Usb.GetAddressPool().ForEachUsbDevice(&print_usbdevice);
+
+	// A chain of hubs down to the last tier, then fill the pool with devices on high port numbers
+	for (uint8_t t = 0; t < USB_MAX_TIER - 1; t++) {
+		hubs[t] = pool.AllocAddress(parent, true, 10 + t);
+		if (!hubs[t]) bad++;
+		parent = hubs[t];
+	}
+	parent = pool.AllocAddress(parent, true, 1); // a hub in the last tier can't have children
+	if (!parent || pool.AllocAddress(parent, false, 1))
+		bad++;
+	pool.FreeAddress(parent);
+	for (uint8_t port = 1; ; port++) {
+		uint8_t hub = hubs[port % (USB_MAX_TIER - 1)];
+		uint8_t addr = pool.AllocAddress(hub, false, port);
+
+		if (!addr) break;
+		if (pool.FindChildAddress(hub, port) != addr || pool.GetUsbDevicePtr(addr)->address != addr)
+			bad++;
+		n++;
+	}
+	if (pool.GetNumDevices() != USB_NUMADDRESSES - 1)
+		bad++;
+	pool.FreeAddress(hubs[0]);
+	if (pool.GetNumDevices())
+		bad++;
+	printf(PSTR("Address pool check: %u hubs, %u devices, %s\r\n"), USB_MAX_TIER - 1, n, (bad) ? "FAILED" : "ok");
+}
+
+#ifdef USBH_FAULT_INJECT
+#define FAULT_BENCH_SECTORS	32	// sectors read from the start of LUN 0 in each case
+
+static uint8_t fault_sector[_MAX_SS];
+static uint32_t fault_hash[FAULT_BENCH_SECTORS]; // of each sector read without faults
+
+/* FNV-1a, enough to tell a sector that came back wrong */
+static uint32_t hash_sector(const uint8_t *buf, uint16_t len) {
+	uint32_t h = 2166136261UL;
+
+	while (len--)
+		h = (h ^ *buf++) * 16777619UL;
+	return h;
+}
+
+/* Recovery bench, each case is run against the first mass storage LUN */
+static const struct {
+	const char *name;
+	bool recovers; // the read is expected to succeed in the end
+	UsbFaultRule rule[2];
+} fault_cases[] = {
+	{ "no faults", true, { { USB_FAULT_NONE } } },
+	{ "NAK storm", true, { { USB_FAULT_NAK, USB_FAULT_ANY, USB_FAULT_ANY, 0, 20, 500 }, { USB_FAULT_NONE } } },
+	{ "bus timeout", true, { { USB_FAULT_TIMEOUT, USB_FAULT_ANY, USB_FAULT_ANY, 0, 20, 1 }, { USB_FAULT_NONE } } },
+	{ "timeouts 1 in 50", true, { { USB_FAULT_TIMEOUT, USB_FAULT_ANY, USB_FAULT_ANY, 50, 0, 1 }, { USB_FAULT_NONE } } },
+	{ "STALL", true, { { USB_FAULT_STALL, USB_FAULT_ANY, USB_FAULT_ANY, 0, 20, 1 }, { USB_FAULT_NONE } } },
+	{ "toggle error", true, { { USB_FAULT_TOGGLE, USB_FAULT_ANY, USB_FAULT_ANY, 0, 20, 1 }, { USB_FAULT_NONE } } },
+	{ "short packet", true, { { USB_FAULT_SHORT, USB_FAULT_ANY, USB_FAULT_ANY, 0, 10, 1 }, { USB_FAULT_NONE } } },
+	{ "disconnect", false, { { USB_FAULT_DISCONNECT, USB_FAULT_ANY, USB_FAULT_ANY, 0, 20, 1 }, { USB_FAULT_NONE } } },
+};
+
+static const char *fault_probes[USB_FAULT_PROBES] = { "HandleUsbError", "ResetRecovery", "hub port reset" };
+
+void demo_faultbench(void) {
+	uint32_t us = SystemCoreClock / 1000000UL;
+	uint8_t failed = 0;
+
+	if (!fatready || sto[0].SectorSize > sizeof (fault_sector)) {
+		printf(PSTR("\r\nNo mass storage to run the fault bench on.\r\n"));
+		return;
+	}
+	// The faults have to reach the driver, not the caches in front of it
+	WriteCacheFlush(&sto[0]);
+	WriteCacheDetach(&sto[0]);
+	ReadAheadDetach(&sto[0]);
+	for (uint32_t lba = 0; lba < FAULT_BENCH_SECTORS; lba++) {
+		if (sto[0].Read(lba, fault_sector, &sto[0])) {
+			printf(PSTR("\r\nCannot read the reference sectors.\r\n"));
+			ReadAheadAttach(&sto[0]);
+			WriteCacheAttach(&sto[0]);
+			return;
+		}
+		fault_hash[lba] = hash_sector(fault_sector, sto[0].SectorSize);
+	}
+	for (uint8_t n = 0; n < sizeof (fault_cases) / sizeof (fault_cases[0]); n++) {
+		uint32_t start;
+		uint8_t wrong = 0;
+		bool ok;
+		int rc = 0;
+
+		UsbFault.Load(fault_cases[n].rule);
+		UsbFault.ClearLatency();
+		start = millis();
+		for (uint32_t lba = 0; lba < FAULT_BENCH_SECTORS && !rc; lba++) {
+			rc = sto[0].Read(lba, fault_sector, &sto[0]);
+			// success with the wrong data is no recovery
+			if (!rc && hash_sector(fault_sector, sto[0].SectorSize) != fault_hash[lba])
+				wrong++;
+		}
+		start = millis() - start;
+		UsbFault.Clear();
+
+		ok = (rc == 0 && !wrong) == fault_cases[n].recovers;
+		if (!ok)
+			failed++;
+		printf(PSTR("\r\n%-18s %5lu ms  %lu injected  result 0x%02x  %u bad sectors  %s\r\n"), fault_cases[n].name, start,
+			UsbFault.GetInjected(), rc, wrong, ok ? "ok" : "FAILED");
+		for (uint8_t i = 0; i < USB_FAULT_PROBES; i++) {
+			UsbFaultLatency *l = &UsbFault.latency[i];
+
+			if (l->count)
+				printf(PSTR("    %-15s %lu calls  last %lu us  max %lu us  avg %lu us\r\n"), fault_probes[i], l->count,
+					l->last / us, l->max / us, l->total / l->count / us);
+		}
+	}
+	printf(PSTR("Fault bench: %u of %u cases failed\r\n"), failed, sizeof (fault_cases) / sizeof (fault_cases[0]));
+	if (fatready) {
+		ReadAheadAttach(&sto[0]);
+		WriteCacheAttach(&sto[0]);
 	}
 }
+#endif
+
 void demo_fileoperation(void) {
 	if (fatready) {
 		FRESULT rc; /* Result code */
@@ -325,8 +761,12 @@ void demo_speedtest(void) {
 		FRESULT rc; /* Result code */
 		UINT bw, br, i;
 
-		ULONG ii, wt, rt, start, end;
+		ULONG ii, wt, rt, start, end, togerr;
+		readahead_stats_t *ras;
+		writecache_stats_t *wcs;
+		char name[] = "0:/WC00.TXT";
 		runtest = false;
+		togerr = Usb.GetToggleErrors();
 		f_unlink("0:/5MB.bin");
 		printf(PSTR("\r\nCreate a new 5MB test file (5MB.bin).\r\n"));
 		rc = f_open(&My_File_Object_x, "0:/5MB.bin", FA_WRITE | FA_CREATE_ALWAYS);
@@ -343,6 +783,7 @@ void demo_speedtest(void) {
 		wt = end - start;
 		printf(PSTR("Time to write 5,242,880 bytes: %d ms (%d sec) \r\n"), wt, (500 + wt) / 1000UL);
 		rc = f_open(&My_File_Object_x, "0:/5MB.bin", FA_READ);
+		ReadAheadClearStats(Fats[0]->storage);
 		start = millis();
 		if (rc) goto failed;
 		for (;;) {
@@ -354,9 +795,44 @@ void demo_speedtest(void) {
 		rc = f_close(&My_File_Object_x);
 		if (rc) goto failed;
 		rt = end - start;
-		printf(PSTR("Time to read 5,242,880 bytes: %d ms (%d sec)\r\nDelete test file\r\n"), rt, (500 + rt) / 1000UL);
+		printf(PSTR("Time to read 5,242,880 bytes: %d ms (%d sec)\r\n"), rt, (500 + rt) / 1000UL);
+		ras = ReadAheadGetStats(Fats[0]->storage);
+		if (ras)
+			printf(PSTR("Read-ahead: %lu sectors hit, %lu missed, %lu fills of %lu sectors\r\n"), ras->hitSectors, ras->missSectors, ras->fills, ras->fillSectors);
+		printf(PSTR("Delete test file\r\n"));
+		printf(PSTR("Create 32 small files (WCnn.TXT).\r\n"));
+		WriteCacheClearStats(Fats[0]->storage);
+		start = millis();
+		for (i = 0; i < 32; i++) {
+				name[5] = '0' + i / 10;
+				name[6] = '0' + i % 10;
+				rc = f_open(&My_File_Object_x, name, FA_WRITE | FA_CREATE_ALWAYS);
+				if (rc) goto failed;
+				rc = f_write(&My_File_Object_x, My_Buff_x, mbxs, &bw);
+				if (rc) goto failed;
+				rc = f_close(&My_File_Object_x);
+				if (rc) goto failed;
+		}
+		end = millis();
+		wt = end - start;
+		printf(PSTR("Time to create 32 files: %lu ms\r\n"), wt);
+		wcs = WriteCacheGetStats(Fats[0]->storage);
+		if (wcs)
+			printf(PSTR("Write cache: %lu sectors written, %lu merged, %lu flushed in %lu writes\r\n"), wcs->sectors, wcs->merged, wcs->flushedSectors, wcs->commands);
+		for (i = 0; i < 32; i++) {
+				name[5] = '0' + i / 10;
+				name[6] = '0' + i % 10;
+				f_unlink(name);
+		}
 failed:
 		if (rc) die(rc);
+		printf(PSTR("Data toggle errors: %lu\r\n"), Usb.GetToggleErrors() - togerr);
+		if (Fats[0]->storage->Status == PStatus) {
+			pvt_t *p = (pvt_t *)Fats[0]->storage->private_data;
+			MassLUNStats *ls = Bulk[p->B]->GetLUNStats(p->lun);
+
+			printf(PSTR("Recovery: %lu errors, %lu retries, %lu recovered, %lu failed, %lu ms\r\n"), ls->errors, ls->retries, ls->recovered, ls->failed, ls->recoveryTime);
+		}
 		printf(PSTR("5MB timing test finished.\r\n"));
 	}
 }
@@ -365,54 +841,81 @@ bool PStatus(storage_t *sto) {
         return (Bulk[((pvt_t *)sto->private_data)->B]->WriteProtected(((pvt_t *)sto->private_data)->lun));
 }
 
+// One call each: BulkOnly::ReadWrite() retries through UsbRetryStorage itself, a loop
+// here would multiply the attempts and count every failure twice in UsbHealth.
+// UAS does not retry on its own, the U calls below do.
 int PRead(uint32_t LBA, uint8_t *buf, storage_t *sto) {
-        uint8_t x = 0;
-        int tries = FAT_MAX_ERROR_RETRIES;
-        while (tries) {
-                tries--;
-                x = (Bulk[((pvt_t *)sto->private_data)->B]->Read(((pvt_t *)sto->private_data)->lun, LBA, (sto->SectorSize), 1, buf));
-                if (!x) break;
-        }
-        int y = x;
-        return y;
+        return Bulk[((pvt_t *)sto->private_data)->B]->Read(((pvt_t *)sto->private_data)->lun, LBA, (sto->SectorSize), 1, buf);
 }
 
 int PWrite(uint32_t LBA, uint8_t *buf, storage_t *sto) {
-        int x = 0;
-        int tries = FAT_MAX_ERROR_RETRIES;
-        while (tries) {
-                tries--;
-                x = (Bulk[((pvt_t *)sto->private_data)->B]->Write(((pvt_t *)sto->private_data)->lun, LBA, sto->SectorSize, 1, buf));
-                if (x == MASS_ERR_WRITE_PROTECTED) break;
-                if (!x) break;
-        }
-        int y = x;
-        return y;
+        return Bulk[((pvt_t *)sto->private_data)->B]->Write(((pvt_t *)sto->private_data)->lun, LBA, sto->SectorSize, 1, buf);
 }
 
 int PReads(uint32_t LBA, uint8_t *buf, storage_t *sto, uint8_t count) {
-        uint8_t x = 0;
-        int tries = FAT_MAX_ERROR_RETRIES;
-        while (tries) {
-                tries--;
-                x = (Bulk[((pvt_t *)sto->private_data)->B]->Read(((pvt_t *)sto->private_data)->lun, LBA, (sto->SectorSize), count, buf));
-                if (!x) break;
-                delay(200);
-        }
-        int y = x;
-        return y;
+        return Bulk[((pvt_t *)sto->private_data)->B]->Read(((pvt_t *)sto->private_data)->lun, LBA, (sto->SectorSize), count, buf);
 }
 
 int PWrites(uint32_t LBA, uint8_t *buf, storage_t *sto, uint8_t count) {
-        int x = 0;
-        int tries = FAT_MAX_ERROR_RETRIES;
-        while (tries) {
-                tries--;
-                x = (Bulk[((pvt_t *)sto->private_data)->B]->Write(((pvt_t *)sto->private_data)->lun, LBA, sto->SectorSize, count, buf));
-                if (x == MASS_ERR_WRITE_PROTECTED) break;
-                if (!x) break;
-                delay(200);
-        }
-        int y = x;
-        return y;
+        return Bulk[((pvt_t *)sto->private_data)->B]->Write(((pvt_t *)sto->private_data)->lun, LBA, sto->SectorSize, count, buf);
+}
+
+int PSubmit(uint32_t LBA, uint8_t *buf, storage_t *sto, uint8_t count, bool write) {
+        BulkOnly *b = Bulk[((pvt_t *)sto->private_data)->B];
+
+        if (b->Pending())
+                return STORAGE_BUSY;
+        return b->Submit(((pvt_t *)sto->private_data)->lun, LBA, sto->SectorSize, count, buf, write);
+}
+
+int PFinish(storage_t *sto) {
+        return Bulk[((pvt_t *)sto->private_data)->B]->Finish();
+}
+
+bool UStatus(storage_t *sto) {
+        return (Uas[((pvt_t *)sto->private_data)->B]->WriteProtected(((pvt_t *)sto->private_data)->lun));
+}
+
+int URead(uint32_t LBA, uint8_t *buf, storage_t *sto) {
+        UAS *u = Uas[((pvt_t *)sto->private_data)->B];
+        UsbRetry retry(&UsbRetryStorage, u->GetHealth());
+        uint8_t x;
+
+        do {
+                x = u->Read(((pvt_t *)sto->private_data)->lun, LBA, (sto->SectorSize), 1, buf);
+        } while (retry.Again(BulkOnly::ErrorClass(x)));
+        return x;
+}
+
+int UWrite(uint32_t LBA, uint8_t *buf, storage_t *sto) {
+        UAS *u = Uas[((pvt_t *)sto->private_data)->B];
+        UsbRetry retry(&UsbRetryStorage, u->GetHealth());
+        uint8_t x;
+
+        do {
+                x = u->Write(((pvt_t *)sto->private_data)->lun, LBA, sto->SectorSize, 1, buf);
+        } while (retry.Again(BulkOnly::ErrorClass(x)));
+        return x;
+}
+
+int UReads(uint32_t LBA, uint8_t *buf, storage_t *sto, uint8_t count) {
+        UAS *u = Uas[((pvt_t *)sto->private_data)->B];
+        UsbRetry retry(&UsbRetryStorage, u->GetHealth());
+        uint8_t x;
+
+        do {
+                x = u->Read(((pvt_t *)sto->private_data)->lun, LBA, (sto->SectorSize), count, buf);
+        } while (retry.Again(BulkOnly::ErrorClass(x)));
+        return x;
+}
+
+int UWrites(uint32_t LBA, uint8_t *buf, storage_t *sto, uint8_t count) {
+        UAS *u = Uas[((pvt_t *)sto->private_data)->B];
+        UsbRetry retry(&UsbRetryStorage, u->GetHealth());
+        uint8_t x;
+
+        do {
+                x = u->Write(((pvt_t *)sto->private_data)->lun, LBA, sto->SectorSize, count, buf);
+        } while (retry.Again(BulkOnly::ErrorClass(x)));
+        return x;
 }
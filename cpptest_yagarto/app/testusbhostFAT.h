@@ -13,5 +13,14 @@ void check_fatstatus(void);
 void demo_directorybrowse(void);
 void demo_fileoperation(void);
 void demo_speedtest(void);
+void demo_savecache(void);
+void demo_parserbench(void);
+void demo_queuebench(void);
+void demo_streambench(void);
+void demo_topology(void);
+#ifdef USBH_FAULT_INJECT
+void demo_faultbench(void);
+#endif
+void load_descrcache(void);
 
 #endif /* TESTUSBHOSTFAT_H_ */
@@ -90,11 +90,14 @@ int PFAT::Init(storage_t *sto, uint8_t lv) {
 
 /* Identify the FAT type. */
 int PFAT::Init(storage_t *sto, uint8_t lv, uint32_t first) {
-        uint8_t buf[sto->SectorSize];
+        uint8_t *buf;
         TCHAR lb[256];
         lb[0] = 0x00;
         int i = 0;
         if (lv > _VOLUMES) return FR_INVALID_DRIVE;
+        if (sto->SectorSize > _MAX_SS) return FR_DISK_ERR;
+        // 4K sectors don't fit the stack, take the sector from the heap
+        buf = new uint8_t[sto->SectorSize];
         //buf = (uint8_t *)malloc(sto->SectorSize);
         st = (int)((sto->Read)(first, buf, sto));
         if (!st) {
@@ -139,6 +142,7 @@ int PFAT::Init(storage_t *sto, uint8_t lv, uint32_t first) {
                         }
                 }
         }
+        delete[] buf;
         return st;
 }
 
@@ -175,6 +179,8 @@ DRESULT PFAT::disk_write(const BYTE *buff, DWORD sector, BYTE count) {
 DRESULT PFAT::disk_ioctl(BYTE cmd, void* buff) {
         switch (cmd) {
                 case CTRL_SYNC:
+                        if (storage->Sync && storage->Sync(storage))
+                                return RES_ERROR;
                         break;
                 case GET_SECTOR_COUNT:
                         *(DWORD*)buff = storage->TotalSectors;
@@ -162,7 +162,7 @@
 #endif
 
 #ifndef _MAX_SS
-#define	_MAX_SS		512U		/* 512, 1024, 2048 or 4096 */
+#define	_MAX_SS		4096U		/* 512, 1024, 2048 or 4096, 4096 for 4Kn drives */
 /* Maximum sector size to be handled.
 /  Always set 512 for memory card and hard disk but a larger value may be
 /  required for on-board flash memory, floppy disk and optical disk.
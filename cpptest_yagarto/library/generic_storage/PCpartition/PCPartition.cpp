@@ -34,8 +34,8 @@ int PCPartition::Init(storage_t *sto) {
 	if (sto->SectorSize <= _MAX_SS) {
         //uint8_t mybuf[sto->SectorSize *2];
         // WARNING, CAN FAIL!
-                // WARNING, CAN FAIL! this requires _MAX_SS stack space.
-        uint8_t buf[sto->SectorSize];
+        // 4K sectors don't fit the stack, take the sector from the heap
+        uint8_t *buf = new uint8_t[sto->SectorSize];
         //buf = (uint8_t *)malloc(sto->SectorSize);
         st = (int)((sto->Read)(0, buf, sto));
         if (!st) {
@@ -60,6 +60,7 @@ int PCPartition::Init(storage_t *sto) {
                         }
                 }
         }
+        delete[] buf;
 	}
 	return st;
 }
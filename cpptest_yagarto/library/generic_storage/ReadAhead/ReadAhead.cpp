@@ -0,0 +1,213 @@
+/*
+ * ReadAhead.cpp
+ *
+ * Sequential read-ahead, see ReadAhead.h
+ */
+
+#include <inttypes.h>
+#include <string.h>
+#include <new>
+#include <ReadAhead/ReadAhead.h>
+
+typedef struct ReadAhead {
+        storage_t *sto; // NULL if the slot is free
+        // the driver's own calls
+        int (*Read)(uint32_t, uint8_t *, struct Storage *);
+        int (*Write)(uint32_t, uint8_t *, struct Storage *);
+        int (*Reads)(uint32_t, uint8_t *, struct Storage *, uint8_t);
+        int (*Writes)(uint32_t, uint8_t *, struct Storage *, uint8_t);
+        uint8_t *window; // sectors first..first + valid - 1
+        uint8_t size; // window size, sectors
+        uint8_t valid; // sectors in the window
+        uint32_t first;
+        uint32_t next; // where a sequential read would start
+        uint8_t streak; // sequential reads in a row
+        readahead_stats_t stats;
+} readahead_t;
+
+static readahead_t ra_units[READAHEAD_UNITS];
+
+static readahead_t *ra_find(storage_t *sto) {
+        for (int i = 0; i < READAHEAD_UNITS; i++)
+                if (ra_units[i].sto == sto)
+                        return &ra_units[i];
+        return NULL;
+}
+
+/* Reads count sectors, from the window where it has them */
+static int ra_reads(uint32_t LBA, uint8_t *buf, storage_t *sto, uint8_t count) {
+        readahead_t *ra = ra_find(sto);
+        uint16_t ss = sto->SectorSize;
+        int rc;
+
+        if (!ra)
+                return -1;
+        ra->stats.reads++;
+        if (LBA == ra->next) {
+                if (ra->streak < 0xFF)
+                        ra->streak++;
+        } else
+                ra->streak = 0;
+        ra->next = LBA + count;
+
+        while (count) {
+                uint8_t n = count;
+
+                if (ra->valid && LBA >= ra->first && LBA - ra->first < ra->valid) {
+                        if (n > ra->first + ra->valid - LBA)
+                                n = ra->first + ra->valid - LBA;
+                        memcpy(buf, ra->window + (LBA - ra->first) * ss, (uint32_t)n * ss);
+                        ra->stats.hitSectors += n;
+                } else {
+                        uint32_t fill = ra->size;
+
+                        if (sto->TotalSectors)
+                                fill = (LBA < sto->TotalSectors && sto->TotalSectors - LBA < fill) ? sto->TotalSectors - LBA : fill;
+                        rc = -1;
+                        if (ra->streak >= READAHEAD_TRIGGER && count < fill) {
+                                ra->valid = 0;
+                                rc = (ra->Reads)(LBA, ra->window, sto, fill);
+                        }
+                        if (!rc) {
+                                ra->first = LBA;
+                                ra->valid = fill;
+                                ra->stats.fills++;
+                                ra->stats.fillSectors += fill;
+                                memcpy(buf, ra->window, (uint32_t)n * ss);
+                        } else {
+                                // A failed fill may be the end of the media, the caller gets the word from a plain read
+                                rc = (ra->Reads)(LBA, buf, sto, n);
+                                if (rc)
+                                        return rc;
+                        }
+                        ra->stats.missSectors += n;
+                }
+                LBA += n;
+                buf += (uint32_t)n * ss;
+                count -= n;
+        }
+        return 0;
+}
+
+static int ra_read(uint32_t LBA, uint8_t *buf, storage_t *sto) {
+        return ra_reads(LBA, buf, sto, 1);
+}
+
+/* Keeps the window in step with what went to the media */
+static void ra_written(readahead_t *ra, uint32_t LBA, const uint8_t *buf, uint8_t count, int rc) {
+        uint16_t ss = ra->sto->SectorSize;
+
+        if (rc) {
+                ra->valid = 0;
+                return;
+        }
+        for (; count; count--, LBA++, buf += ss)
+                if (ra->valid && LBA >= ra->first && LBA - ra->first < ra->valid)
+                        memcpy(ra->window + (LBA - ra->first) * ss, buf, ss);
+}
+
+static int ra_writes(uint32_t LBA, uint8_t *buf, storage_t *sto, uint8_t count) {
+        readahead_t *ra = ra_find(sto);
+        int rc;
+
+        if (!ra)
+                return -1;
+        rc = (ra->Writes)(LBA, buf, sto, count);
+        ra_written(ra, LBA, buf, count, rc);
+        return rc;
+}
+
+static int ra_write(uint32_t LBA, uint8_t *buf, storage_t *sto) {
+        readahead_t *ra = ra_find(sto);
+        int rc;
+
+        if (!ra)
+                return -1;
+        rc = (ra->Write)(LBA, buf, sto);
+        ra_written(ra, LBA, buf, 1, rc);
+        return rc;
+}
+
+/**
+ * Puts read-ahead in front of a storage, after its calls, SectorSize and
+ * TotalSectors are set. Attaching again takes the calls over afresh.
+ *
+ * @param sto storage
+ * @param window bytes fetched at once
+ * @return 0 on success, -1 if there is no free unit or no memory for the window
+ */
+int ReadAheadAttach(storage_t *sto, uint32_t window) {
+        readahead_t *ra;
+        uint32_t size;
+
+        ReadAheadDetach(sto);
+        if (!sto->SectorSize || !sto->Read || !sto->Reads)
+                return -1;
+        ra = ra_find(NULL);
+        if (!ra)
+                return -1;
+        size = window / sto->SectorSize;
+        if (!size)
+                size = 1;
+        if (size > 0xFF)
+                size = 0xFF;
+        ra->window = new (std::nothrow) uint8_t[size * sto->SectorSize];
+        if (!ra->window)
+                return -1;
+        ra->sto = sto;
+        ra->size = size;
+        ra->valid = 0;
+        ra->first = 0;
+        ra->next = 0;
+        ra->streak = 0;
+        memset(&ra->stats, 0, sizeof (readahead_stats_t));
+        ra->Read = sto->Read;
+        ra->Write = sto->Write;
+        ra->Reads = sto->Reads;
+        ra->Writes = sto->Writes;
+        sto->Read = ra_read;
+        sto->Reads = ra_reads;
+        if (sto->Write)
+                sto->Write = ra_write;
+        if (sto->Writes)
+                sto->Writes = ra_writes;
+        return 0;
+}
+
+/* Gives the storage its driver calls back, unless somebody set new ones meanwhile */
+void ReadAheadDetach(storage_t *sto) {
+        readahead_t *ra = ra_find(sto);
+
+        if (!ra || !sto)
+                return;
+        if (sto->Read == ra_read) {
+                sto->Read = ra->Read;
+                sto->Reads = ra->Reads;
+                sto->Write = ra->Write;
+                sto->Writes = ra->Writes;
+        }
+        delete[] ra->window;
+        memset(ra, 0, sizeof (readahead_t));
+}
+
+/* Drops the window, for media changes and writes behind the back of the storage */
+void ReadAheadInvalidate(storage_t *sto) {
+        readahead_t *ra = ra_find(sto);
+
+        if (ra && sto)
+                ra->valid = 0;
+}
+
+/* NULL if the storage has no read-ahead */
+readahead_stats_t *ReadAheadGetStats(storage_t *sto) {
+        readahead_t *ra = ra_find(sto);
+
+        return (ra && sto) ? &ra->stats : NULL;
+}
+
+void ReadAheadClearStats(storage_t *sto) {
+        readahead_stats_t *st = ReadAheadGetStats(sto);
+
+        if (st)
+                memset(st, 0, sizeof (readahead_stats_t));
+}
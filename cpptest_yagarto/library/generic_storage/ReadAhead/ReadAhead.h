@@ -0,0 +1,45 @@
+/*
+ * ReadAhead.h
+ *
+ * Sequential read-ahead for a storage_t, one per LUN. ReadAheadAttach() puts
+ * itself between the storage and its driver calls. After READAHEAD_TRIGGER
+ * reads in a row that each start where the last one ended, a read that misses
+ * fetches a whole window of sectors with one command, and the reads after it
+ * are served from RAM. Requests as large as the window go to the driver
+ * unchanged, so do reads with no pattern.
+ *
+ * Writes go through to the driver and update the sectors held in the window.
+ */
+
+#ifndef READAHEAD_H
+#define	READAHEAD_H
+
+#include <Storage.h>
+
+#ifndef READAHEAD_UNITS
+#define READAHEAD_UNITS 4 // storages with read-ahead at the same time
+#endif
+
+#ifndef READAHEAD_WINDOW
+#define READAHEAD_WINDOW 16384UL // bytes fetched at once, rounded down to whole sectors, 255 sectors at most
+#endif
+
+#ifndef READAHEAD_TRIGGER
+#define READAHEAD_TRIGGER 2 // sequential reads before the window is used
+#endif
+
+typedef struct ReadAheadStats {
+        uint32_t reads; // Read/Reads calls
+        uint32_t hitSectors; // served from the window
+        uint32_t missSectors; // the caller waited for the device
+        uint32_t fills; // window fills
+        uint32_t fillSectors; // sectors fetched by them
+} readahead_stats_t;
+
+int ReadAheadAttach(storage_t *sto, uint32_t window = READAHEAD_WINDOW);
+void ReadAheadDetach(storage_t *sto);
+void ReadAheadInvalidate(storage_t *sto);
+readahead_stats_t *ReadAheadGetStats(storage_t *sto);
+void ReadAheadClearStats(storage_t *sto);
+
+#endif	/* READAHEAD_H */
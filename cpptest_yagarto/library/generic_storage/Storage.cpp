@@ -1,14 +1,20 @@
 #include <Usb.h>
 #include <masstorage.h>
+#include <uas.h>
 #include <Storage.h>
 
 BulkOnly *Bulk[MAX_USB_MS_DRIVERS];
+UAS *Uas[MAX_USB_UAS_DRIVERS];
 
 /**
  * This must be called before using generic_storage. This works around a G++ bug.
  * Thanks to Lei Shi for the heads up.
  */
 void InitStorage(void) {
+        // Registered first, so a device with both settings gets UAS
+        for(int i=0; i< MAX_USB_UAS_DRIVERS; i++) {
+                Uas[i]= new UAS(&Usb);
+        }
         for(int i=0; i< MAX_USB_MS_DRIVERS; i++) {
                 Bulk[i]= new BulkOnly(&Usb);
         }
@@ -18,55 +24,81 @@ bool PStatus(storage_t *sto) {
         return (Bulk[((pvt_t *)sto->private_data)->B]->WriteProtected(((pvt_t *)sto->private_data)->lun));
 }
 
+// One call each: BulkOnly::ReadWrite() retries through UsbRetryStorage itself, a loop
+// here would multiply the attempts and count every failure twice in UsbHealth.
+// UAS does not retry on its own, the U calls below do.
 int PRead(uint32_t LBA, uint8_t *buf, storage_t *sto) {
-        uint8_t x = 0;
-        int tries = FAT_MAX_ERROR_RETRIES;
-        while (tries) {
-                tries--;
-                x = (Bulk[((pvt_t *)sto->private_data)->B]->Read(((pvt_t *)sto->private_data)->lun, LBA, (sto->SectorSize), 1, buf));
-                if (!x) break;
-        }
-        int y = x;
-        return y;
+        return Bulk[((pvt_t *)sto->private_data)->B]->Read(((pvt_t *)sto->private_data)->lun, LBA, (sto->SectorSize), 1, buf);
 }
 
 int PWrite(uint32_t LBA, uint8_t *buf, storage_t *sto) {
-        int x = 0;
-        int tries = FAT_MAX_ERROR_RETRIES;
-        while (tries) {
-                tries--;
-                x = (Bulk[((pvt_t *)sto->private_data)->B]->Write(((pvt_t *)sto->private_data)->lun, LBA, sto->SectorSize, 1, buf));
-                if (x == MASS_ERR_WRITE_PROTECTED) break;
-                if (!x) break;
-        }
-        int y = x;
-        return y;
+        return Bulk[((pvt_t *)sto->private_data)->B]->Write(((pvt_t *)sto->private_data)->lun, LBA, sto->SectorSize, 1, buf);
 }
 
 int PReads(uint32_t LBA, uint8_t *buf, storage_t *sto, uint8_t count) {
-        uint8_t x = 0;
-        int tries = FAT_MAX_ERROR_RETRIES;
-        while (tries) {
-                tries--;
-                x = (Bulk[((pvt_t *)sto->private_data)->B]->Read(((pvt_t *)sto->private_data)->lun, LBA, (sto->SectorSize), count, buf));
-                if (!x) break;
-                delay(200);
-        }
-        int y = x;
-        return y;
+        return Bulk[((pvt_t *)sto->private_data)->B]->Read(((pvt_t *)sto->private_data)->lun, LBA, (sto->SectorSize), count, buf);
 }
 
 int PWrites(uint32_t LBA, uint8_t *buf, storage_t *sto, uint8_t count) {
-        int x = 0;
-        int tries = FAT_MAX_ERROR_RETRIES;
-        while (tries) {
-                tries--;
-                x = (Bulk[((pvt_t *)sto->private_data)->B]->Write(((pvt_t *)sto->private_data)->lun, LBA, sto->SectorSize, count, buf));
-                if (x == MASS_ERR_WRITE_PROTECTED) break;
-                if (!x) break;
-                delay(200);
-        }
-        int y = x;
-        return y;
+        return Bulk[((pvt_t *)sto->private_data)->B]->Write(((pvt_t *)sto->private_data)->lun, LBA, sto->SectorSize, count, buf);
+}
+
+int PSubmit(uint32_t LBA, uint8_t *buf, storage_t *sto, uint8_t count, bool write) {
+        BulkOnly *b = Bulk[((pvt_t *)sto->private_data)->B];
+
+        if (b->Pending())
+                return STORAGE_BUSY;
+        return b->Submit(((pvt_t *)sto->private_data)->lun, LBA, sto->SectorSize, count, buf, write);
+}
+
+int PFinish(storage_t *sto) {
+        return Bulk[((pvt_t *)sto->private_data)->B]->Finish();
+}
+
+bool UStatus(storage_t *sto) {
+        return (Uas[((pvt_t *)sto->private_data)->B]->WriteProtected(((pvt_t *)sto->private_data)->lun));
 }
 
+int URead(uint32_t LBA, uint8_t *buf, storage_t *sto) {
+        UAS *u = Uas[((pvt_t *)sto->private_data)->B];
+        UsbRetry retry(&UsbRetryStorage, u->GetHealth());
+        uint8_t x;
+
+        do {
+                x = u->Read(((pvt_t *)sto->private_data)->lun, LBA, (sto->SectorSize), 1, buf);
+        } while (retry.Again(BulkOnly::ErrorClass(x)));
+        return x;
+}
+
+int UWrite(uint32_t LBA, uint8_t *buf, storage_t *sto) {
+        UAS *u = Uas[((pvt_t *)sto->private_data)->B];
+        UsbRetry retry(&UsbRetryStorage, u->GetHealth());
+        uint8_t x;
+
+        do {
+                x = u->Write(((pvt_t *)sto->private_data)->lun, LBA, sto->SectorSize, 1, buf);
+        } while (retry.Again(BulkOnly::ErrorClass(x)));
+        return x;
+}
+
+int UReads(uint32_t LBA, uint8_t *buf, storage_t *sto, uint8_t count) {
+        UAS *u = Uas[((pvt_t *)sto->private_data)->B];
+        UsbRetry retry(&UsbRetryStorage, u->GetHealth());
+        uint8_t x;
+
+        do {
+                x = u->Read(((pvt_t *)sto->private_data)->lun, LBA, (sto->SectorSize), count, buf);
+        } while (retry.Again(BulkOnly::ErrorClass(x)));
+        return x;
+}
+
+int UWrites(uint32_t LBA, uint8_t *buf, storage_t *sto, uint8_t count) {
+        UAS *u = Uas[((pvt_t *)sto->private_data)->B];
+        UsbRetry retry(&UsbRetryStorage, u->GetHealth());
+        uint8_t x;
+
+        do {
+                x = u->Write(((pvt_t *)sto->private_data)->lun, LBA, sto->SectorSize, count, buf);
+        } while (retry.Again(BulkOnly::ErrorClass(x)));
+        return x;
+}
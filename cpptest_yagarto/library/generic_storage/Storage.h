@@ -9,7 +9,11 @@
 #define	STORAGE_H
 
 #ifndef MAX_USB_MS_DRIVERS
-#define MAX_USB_MS_DRIVERS 1 // must be 1 to 4
+#define MAX_USB_MS_DRIVERS 2 // must be 1 to 4
+#endif
+
+#ifndef MAX_USB_UAS_DRIVERS
+#define MAX_USB_UAS_DRIVERS 1 // USB Attached SCSI devices, tried before Bulk-Only
 #endif
 
 /*
@@ -17,6 +21,10 @@
  * Read and Write do not care about sector counts, or how many to read.
  * The passed method needs to just read and write one full sector.
  * Reads and Writes are for multiple sectors.
+ * Sync is called when the file system syncs, for layers that hold writes back.
+ * Submit and Finish split a multiple sector transfer in two, so the storage queue
+ * can start commands on other devices in between. Both are optional.
+ * Submit returns STORAGE_BUSY while the device works for another storage.
  *
  * In order to assist these calls, a pointer to the Storage struct is also passed,
  * so that your driver can get at its own private information, if used.
@@ -43,11 +51,16 @@ typedef struct Storage {
         int (*Reads)(uint32_t, uint8_t *, struct Storage *, uint8_t); // multiple sector read
         int (*Writes)(uint32_t, uint8_t *, struct Storage *, uint8_t); // multiple sector write
         bool (*Status)(struct Storage *);
+        int (*Sync)(struct Storage *); // write out anything held back, NULL if nothing ever is
+        int (*Submit)(uint32_t, uint8_t *, struct Storage *, uint8_t, bool); // start a multiple sector read or write
+        int (*Finish)(struct Storage *); // move its data, wait for its status
         uint16_t SectorSize; // physical or translated size on the physical media
         uint32_t TotalSectors; // Total sector count. Used to guard against illegal access.
         void *private_data; // Anything you need, or nothing at all.
 } storage_t;
 
+#define STORAGE_BUSY (-2)
+
 #ifdef _usb_h_
 
 extern USB Usb;
@@ -56,9 +69,12 @@ extern USB Usb;
 
 extern BulkOnly *Bulk[MAX_USB_MS_DRIVERS];
 
+class UAS;
+extern UAS *Uas[MAX_USB_UAS_DRIVERS];
+
 typedef struct Pvt {
         uint8_t lun;
-        int B; // which "BulkOnly" instance
+        int B; // which "BulkOnly" instance, or "UAS" instance with the U functions
 } pvt_t;
 
 void InitStorage(void);
@@ -67,6 +83,13 @@ int PRead(uint32_t LBA, uint8_t *buf, storage_t *sto);
 int PWrite(uint32_t LBA, uint8_t *buf, storage_t *sto);
 int PReads(uint32_t LBA, uint8_t *buf, storage_t *sto, uint8_t count);
 int PWrites(uint32_t LBA, uint8_t *buf, storage_t *sto, uint8_t count);
+int PSubmit(uint32_t LBA, uint8_t *buf, storage_t *sto, uint8_t count, bool write);
+int PFinish(storage_t *sto);
+bool UStatus(storage_t *sto);
+int URead(uint32_t LBA, uint8_t *buf, storage_t *sto);
+int UWrite(uint32_t LBA, uint8_t *buf, storage_t *sto);
+int UReads(uint32_t LBA, uint8_t *buf, storage_t *sto, uint8_t count);
+int UWrites(uint32_t LBA, uint8_t *buf, storage_t *sto, uint8_t count);
 #endif
 // Your stuff here...
 
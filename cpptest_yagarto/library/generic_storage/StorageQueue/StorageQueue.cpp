@@ -0,0 +1,196 @@
+/*
+ * StorageQueue.cpp
+ *
+ * Round-robin storage queues, see StorageQueue.h
+ */
+
+#include <inttypes.h>
+#include <string.h>
+#include <StorageQueue/StorageQueue.h>
+#include <ReadAhead/ReadAhead.h>
+#include <WriteCache/WriteCache.h>
+
+typedef struct StorageQueue {
+        storage_t *sto; // NULL if the slot is free
+        storage_request_t *head; // served now
+        storage_request_t *tail;
+} storageq_t;
+
+static storageq_t sq_units[STORAGEQ_UNITS];
+static uint8_t sq_first; // unit served first in the next round
+
+static storageq_t *sq_find(storage_t *sto) {
+        for (int i = 0; i < STORAGEQ_UNITS; i++)
+                if (sq_units[i].sto == sto)
+                        return &sq_units[i];
+        return NULL;
+}
+
+/* Sectors of the next slice of the request at the head */
+static uint8_t sq_slice(storage_request_t *rq) {
+        uint32_t n = STORAGEQ_SLICE / rq->sto->SectorSize;
+
+        if (!n)
+                n = 1;
+        if (n > 0xFF)
+                n = 0xFF;
+        if (n > rq->count - rq->done)
+                n = rq->count - rq->done;
+        return n;
+}
+
+static int sq_move(storage_request_t *rq, uint8_t n) {
+        uint8_t *buf = rq->buf + rq->done * rq->sto->SectorSize;
+
+        if (rq->write)
+                return (rq->sto->Writes)(rq->LBA + rq->done, buf, rq->sto, n);
+        return (rq->sto->Reads)(rq->LBA + rq->done, buf, rq->sto, n);
+}
+
+/* Accounts for n sectors moved, retires the head request when done or failed */
+static void sq_advance(storageq_t *q, uint8_t n, int rc) {
+        storage_request_t *rq = q->head;
+
+        if (!rc)
+                rq->done += n;
+        if (rc || rq->done == rq->count) {
+                rq->result = rc;
+                rq->busy = false;
+                q->head = rq->next;
+                if (!q->head) {
+                        q->tail = NULL;
+                        q->sto = NULL;
+                }
+        }
+}
+
+/**
+ * Queues a read or write.
+ *
+ * @param rq request, filled in here
+ * @param sto storage
+ * @param LBA first sector
+ * @param buf data, count sectors
+ * @param count sectors
+ * @param write true to write
+ * @return 0 on success, -1 if all units are taken by other storages
+ */
+int StorageQueuePost(storage_request_t *rq, storage_t *sto, uint32_t LBA, uint8_t *buf, uint32_t count, bool write) {
+        storageq_t *q = sq_find(sto);
+
+        rq->sto = sto;
+        rq->LBA = LBA;
+        rq->buf = buf;
+        rq->count = count;
+        rq->write = write;
+        rq->done = 0;
+        rq->started = 0;
+        rq->result = 0;
+        rq->next = NULL;
+        rq->busy = false;
+        if (!count)
+                return 0;
+        if (!q)
+                q = sq_find(NULL);
+        if (!q)
+                return -1;
+        rq->busy = true;
+        if (q->tail)
+                q->tail->next = rq;
+        else {
+                q->sto = sto;
+                q->head = rq;
+        }
+        q->tail = rq;
+        return 0;
+}
+
+/* One round: a slice for every storage with work */
+void StorageQueueRun(void) {
+        storageq_t *started[STORAGEQ_UNITS];
+        bool cached[STORAGEQ_UNITS]; // the write cache kept data, the caches serve this round
+        uint8_t nstarted = 0;
+        int rc;
+
+        // Split transfers bypass the caches, nothing in them may be newer than the media
+        for (uint8_t i = 0; i < STORAGEQ_UNITS; i++) {
+                storage_request_t *rq = sq_units[i].head;
+
+                cached[i] = false;
+                if (rq && rq->sto->Submit) {
+                        if (WriteCacheFlush(rq->sto) || WriteCacheDirty(rq->sto))
+                                cached[i] = true;
+                        else if (rq->write)
+                                ReadAheadInvalidate(rq->sto);
+                }
+        }
+
+        // Start every split transfer, the others are done right away
+        for (uint8_t k = 0; k < STORAGEQ_UNITS; k++) {
+                uint8_t i = (sq_first + k) % STORAGEQ_UNITS;
+                storageq_t *q = &sq_units[i];
+                storage_request_t *rq = q->head;
+                uint8_t n;
+
+                if (!rq)
+                        continue;
+                n = sq_slice(rq);
+                if (rq->sto->Submit && rq->sto->Finish && !cached[i]) {
+                        rc = (rq->sto->Submit)(rq->LBA + rq->done, rq->buf + rq->done * rq->sto->SectorSize, rq->sto, n, rq->write);
+                        if (rc == STORAGE_BUSY)
+                                continue; // another LUN of the device has it, next round
+                        if (!rc) {
+                                rq->started = n;
+                                started[nstarted++] = q;
+                                continue;
+                        }
+                        // Refused, but the device is free: the plain call splits the slice to the device's liking
+                }
+                rc = sq_move(rq, n);
+                sq_advance(q, n, rc);
+        }
+
+        // Data and status, in the order the commands went out
+        for (uint8_t i = 0; i < nstarted; i++) {
+                storage_request_t *rq = started[i]->head;
+
+                rc = (rq->sto->Finish)(rq->sto);
+                if (rc)
+                        rc = sq_move(rq, rq->started); // once more, with the retries of the plain calls
+                sq_advance(started[i], rq->started, rc);
+        }
+        sq_first = (sq_first + 1) % STORAGEQ_UNITS;
+}
+
+/**
+ * Runs rounds until a request is done.
+ *
+ * @param rq request
+ * @return its result
+ */
+int StorageQueueWait(storage_request_t *rq) {
+        while (rq->busy)
+                StorageQueueRun();
+        return rq->result;
+}
+
+/* Fails every request of a storage, for media that went away */
+void StorageQueueCancel(storage_t *sto, int result) {
+        storageq_t *q = sq_find(sto);
+
+        if (!q || !sto)
+                return;
+        while (q->head) {
+                q->head->result = result;
+                q->head->busy = false;
+                q->head = q->head->next;
+        }
+        memset(q, 0, sizeof (storageq_t));
+}
+
+bool StorageQueueIdle(void) {
+        for (uint8_t i = 0; i < STORAGEQ_UNITS; i++)
+                if (sq_units[i].head)
+                        return false;
+        return true;
+}
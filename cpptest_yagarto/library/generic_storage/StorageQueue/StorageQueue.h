@@ -0,0 +1,51 @@
+/*
+ * StorageQueue.h
+ *
+ * Request queues for several storages at once, one per LUN. Posting a request
+ * returns at once. StorageQueueRun() serves the queues round-robin: every
+ * storage with work gets one slice of STORAGEQ_SLICE bytes per round, the one
+ * served first moves on by one each round.
+ *
+ * Storages with Submit and Finish are started all together, the data moves
+ * once every device has its command. The devices fetch or program media at
+ * the same time instead of one after the other. Storages without them are
+ * served with Reads and Writes, and so is a storage whose write cache could not
+ * be flushed, until it is.
+ *
+ * Requests belong to the caller and must stay around until they are done.
+ */
+
+#ifndef STORAGEQUEUE_H
+#define	STORAGEQUEUE_H
+
+#include <Storage.h>
+
+#ifndef STORAGEQ_UNITS
+#define STORAGEQ_UNITS 4 // storages with requests queued at the same time
+#endif
+
+#ifndef STORAGEQ_SLICE
+#define STORAGEQ_SLICE 16384UL // bytes a storage moves per round, up to 255 sectors
+#endif
+
+typedef struct StorageRequest {
+        storage_t *sto;
+        uint32_t LBA;
+        uint8_t *buf;
+        uint32_t count; // sectors
+        bool write;
+        // the queue's
+        uint32_t done; // sectors moved
+        uint8_t started; // sectors of the slice given to Submit
+        bool busy; // queued, result not valid yet
+        int result; // 0 on success, else from the storage
+        struct StorageRequest *next;
+} storage_request_t;
+
+int StorageQueuePost(storage_request_t *rq, storage_t *sto, uint32_t LBA, uint8_t *buf, uint32_t count, bool write);
+void StorageQueueRun(void);
+int StorageQueueWait(storage_request_t *rq);
+void StorageQueueCancel(storage_t *sto, int result);
+bool StorageQueueIdle(void);
+
+#endif	/* STORAGEQUEUE_H */
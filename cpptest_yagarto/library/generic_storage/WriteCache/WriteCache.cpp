@@ -0,0 +1,303 @@
+/*
+ * WriteCache.cpp
+ *
+ * Write-back cache, see WriteCache.h
+ */
+
+#include <inttypes.h>
+#include <string.h>
+#include <new>
+#include <WriteCache/WriteCache.h>
+
+typedef struct WriteCache {
+        storage_t *sto; // NULL if the slot is free
+        // the driver's own calls
+        int (*Read)(uint32_t, uint8_t *, struct Storage *);
+        int (*Write)(uint32_t, uint8_t *, struct Storage *);
+        int (*Reads)(uint32_t, uint8_t *, struct Storage *, uint8_t);
+        int (*Writes)(uint32_t, uint8_t *, struct Storage *, uint8_t);
+        int (*Sync)(struct Storage *);
+        uint8_t *data; // cached sector i at data + i * SectorSize
+        uint32_t *lba; // its sector number, ascending
+        uint8_t size; // cache size, sectors
+        uint8_t used; // dirty sectors
+        bool stamped; // since is valid
+        uint32_t since; // poll time the cache was first seen dirty
+        writecache_stats_t stats;
+} writecache_t;
+
+static writecache_t wc_units[WRITECACHE_UNITS];
+
+static writecache_t *wc_find(storage_t *sto) {
+        for (int i = 0; i < WRITECACHE_UNITS; i++)
+                if (wc_units[i].sto == sto)
+                        return &wc_units[i];
+        return NULL;
+}
+
+/* Index of LBA in the cache, or of the first sector after it */
+static uint8_t wc_lookup(writecache_t *wc, uint32_t LBA) {
+        uint8_t lo = 0;
+        uint8_t hi = wc->used;
+
+        while (lo < hi) {
+                uint8_t mid = (lo + hi) / 2;
+                if (wc->lba[mid] < LBA)
+                        lo = mid + 1;
+                else
+                        hi = mid;
+        }
+        return lo;
+}
+
+/* Writes every run of adjacent sectors with one call. On error, what was not written stays dirty. */
+static int wc_flush(writecache_t *wc) {
+        uint16_t ss = wc->sto->SectorSize;
+        uint8_t i = 0;
+        int rc = 0;
+
+        if (!wc->used)
+                return 0;
+        wc->stats.flushes++;
+        while (i < wc->used) {
+                uint8_t n = 1;
+
+                while (i + n < wc->used && wc->lba[i + n] == wc->lba[i] + n)
+                        n++;
+                rc = (wc->Writes)(wc->lba[i], wc->data + (uint32_t)i * ss, wc->sto, n);
+                if (rc)
+                        break;
+                wc->stats.commands++;
+                wc->stats.flushedSectors += n;
+                i += n;
+        }
+        if (i) {
+                memmove(wc->data, wc->data + (uint32_t)i * ss, (uint32_t)(wc->used - i) * ss);
+                memmove(wc->lba, wc->lba + i, (wc->used - i) * sizeof (uint32_t));
+                wc->used -= i;
+        }
+        if (!wc->used)
+                wc->stamped = false;
+        return rc;
+}
+
+/* Forgets cached sectors LBA..LBA + count - 1, newer data for them went to the media */
+static void wc_drop(writecache_t *wc, uint32_t LBA, uint8_t count) {
+        uint16_t ss = wc->sto->SectorSize;
+        uint8_t i = wc_lookup(wc, LBA);
+        uint8_t n = 0;
+
+        while (i + n < wc->used && wc->lba[i + n] - LBA < count)
+                n++;
+        if (!n)
+                return;
+        memmove(wc->data + (uint32_t)i * ss, wc->data + (uint32_t)(i + n) * ss, (uint32_t)(wc->used - i - n) * ss);
+        memmove(wc->lba + i, wc->lba + i + n, (wc->used - i - n) * sizeof (uint32_t));
+        wc->used -= n;
+        if (!wc->used)
+                wc->stamped = false;
+}
+
+static int wc_writes(uint32_t LBA, uint8_t *buf, storage_t *sto, uint8_t count) {
+        writecache_t *wc = wc_find(sto);
+        uint16_t ss = sto->SectorSize;
+        int rc;
+
+        if (!wc)
+                return -1;
+        wc->stats.sectors += count;
+        if (count >= wc->size) {
+                wc_drop(wc, LBA, count);
+                wc->stats.bypassed += count;
+                return (wc->Writes)(LBA, buf, sto, count);
+        }
+        for (; count; count--, LBA++, buf += ss) {
+                uint8_t i = wc_lookup(wc, LBA);
+
+                if (i < wc->used && wc->lba[i] == LBA) {
+                        wc->stats.merged++;
+                } else {
+                        if (wc->used == wc->size) {
+                                rc = wc_flush(wc);
+                                if (rc)
+                                        return rc;
+                                i = 0;
+                        }
+                        memmove(wc->data + (uint32_t)(i + 1) * ss, wc->data + (uint32_t)i * ss, (uint32_t)(wc->used - i) * ss);
+                        memmove(wc->lba + i + 1, wc->lba + i, (wc->used - i) * sizeof (uint32_t));
+                        wc->lba[i] = LBA;
+                        wc->used++;
+                }
+                memcpy(wc->data + (uint32_t)i * ss, buf, ss);
+        }
+        return 0;
+}
+
+static int wc_write(uint32_t LBA, uint8_t *buf, storage_t *sto) {
+        return wc_writes(LBA, buf, sto, 1);
+}
+
+/* Cached sectors come from RAM, the runs between them from the driver */
+static int wc_reads(uint32_t LBA, uint8_t *buf, storage_t *sto, uint8_t count) {
+        writecache_t *wc = wc_find(sto);
+        uint16_t ss = sto->SectorSize;
+        int rc;
+
+        if (!wc)
+                return -1;
+        while (count) {
+                uint8_t i = wc_lookup(wc, LBA);
+                uint8_t n = count;
+
+                if (i < wc->used && wc->lba[i] == LBA) {
+                        n = 1;
+                        memcpy(buf, wc->data + (uint32_t)i * ss, ss);
+                } else {
+                        if (i < wc->used && wc->lba[i] - LBA < count)
+                                n = wc->lba[i] - LBA;
+                        rc = (wc->Reads)(LBA, buf, sto, n);
+                        if (rc)
+                                return rc;
+                }
+                LBA += n;
+                buf += (uint32_t)n * ss;
+                count -= n;
+        }
+        return 0;
+}
+
+static int wc_read(uint32_t LBA, uint8_t *buf, storage_t *sto) {
+        return wc_reads(LBA, buf, sto, 1);
+}
+
+static int wc_sync(storage_t *sto) {
+        writecache_t *wc = wc_find(sto);
+        int rc;
+
+        if (!wc)
+                return -1;
+        rc = wc_flush(wc);
+        if (!rc && wc->Sync)
+                rc = (wc->Sync)(sto);
+        return rc;
+}
+
+/**
+ * Puts a write cache in front of a storage, after its calls, SectorSize and
+ * TotalSectors are set. Attaching again takes the calls over afresh and
+ * drops whatever the old cache held.
+ *
+ * @param sto storage
+ * @param size bytes of cache
+ * @return 0 on success, -1 if there is no free unit or no memory for the cache
+ */
+int WriteCacheAttach(storage_t *sto, uint32_t size) {
+        writecache_t *wc;
+        uint32_t sectors;
+
+        WriteCacheDetach(sto);
+        if (!sto->SectorSize || !sto->Write || !sto->Writes || !sto->Reads)
+                return -1;
+        wc = wc_find(NULL);
+        if (!wc)
+                return -1;
+        sectors = size / sto->SectorSize;
+        if (sectors < 2)
+                sectors = 2;
+        if (sectors > 0xFF)
+                sectors = 0xFF;
+        wc->data = new (std::nothrow) uint8_t[sectors * sto->SectorSize];
+        wc->lba = new (std::nothrow) uint32_t[sectors];
+        if (!wc->data || !wc->lba) {
+                delete[] wc->data;
+                delete[] wc->lba;
+                wc->data = NULL;
+                wc->lba = NULL;
+                return -1;
+        }
+        wc->sto = sto;
+        wc->size = sectors;
+        wc->used = 0;
+        wc->stamped = false;
+        memset(&wc->stats, 0, sizeof (writecache_stats_t));
+        wc->Read = sto->Read;
+        wc->Write = sto->Write;
+        wc->Reads = sto->Reads;
+        wc->Writes = sto->Writes;
+        wc->Sync = sto->Sync;
+        sto->Read = wc_read;
+        sto->Write = wc_write;
+        sto->Reads = wc_reads;
+        sto->Writes = wc_writes;
+        sto->Sync = wc_sync;
+        return 0;
+}
+
+/*
+ * Gives the storage its driver calls back, unless somebody set new ones meanwhile.
+ * Does not flush, the media may be gone. Call WriteCacheFlush() first if it is not.
+ */
+void WriteCacheDetach(storage_t *sto) {
+        writecache_t *wc = wc_find(sto);
+
+        if (!wc || !sto)
+                return;
+        if (sto->Write == wc_write) {
+                sto->Read = wc->Read;
+                sto->Write = wc->Write;
+                sto->Reads = wc->Reads;
+                sto->Writes = wc->Writes;
+                sto->Sync = wc->Sync;
+        }
+        delete[] wc->data;
+        delete[] wc->lba;
+        memset(wc, 0, sizeof (writecache_t));
+}
+
+/**
+ * Writes everything in the cache to the media.
+ *
+ * @param sto storage
+ * @return 0 once all data written so far is on the media, else the driver error
+ */
+int WriteCacheFlush(storage_t *sto) {
+        writecache_t *wc = wc_find(sto);
+
+        if (!wc || !sto)
+                return 0;
+        return wc_flush(wc);
+}
+
+/* Call now and then with millis(), flushes data that waited WRITECACHE_DELAY */
+void WriteCachePoll(storage_t *sto, uint32_t now) {
+        writecache_t *wc = wc_find(sto);
+
+        if (!wc || !sto || !wc->used)
+                return;
+        if (!wc->stamped) {
+                wc->since = now;
+                wc->stamped = true;
+        } else if (now - wc->since >= WRITECACHE_DELAY)
+                wc_flush(wc);
+}
+
+/* Sectors waiting for a flush */
+uint8_t WriteCacheDirty(storage_t *sto) {
+        writecache_t *wc = wc_find(sto);
+
+        return (wc && sto) ? wc->used : 0;
+}
+
+/* NULL if the storage has no write cache */
+writecache_stats_t *WriteCacheGetStats(storage_t *sto) {
+        writecache_t *wc = wc_find(sto);
+
+        return (wc && sto) ? &wc->stats : NULL;
+}
+
+void WriteCacheClearStats(storage_t *sto) {
+        writecache_stats_t *st = WriteCacheGetStats(sto);
+
+        if (st)
+                memset(st, 0, sizeof (writecache_stats_t));
+}
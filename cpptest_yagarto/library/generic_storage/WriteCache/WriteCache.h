@@ -0,0 +1,52 @@
+/*
+ * WriteCache.h
+ *
+ * Write-back cache for a storage_t, one per LUN. WriteCacheAttach() puts
+ * itself between the storage and its driver calls. Writes smaller than the
+ * cache are kept in RAM, sorted by sector. A flush hands every run of adjacent
+ * sectors to the driver as one multi-sector write. Reads see the cached data.
+ *
+ * The cache is flushed when:
+ * - it is full and a new sector has to go in,
+ * - FatFS syncs (f_sync, f_close, f_unmount...), through storage_t Sync,
+ * - WriteCachePoll() finds data older than WRITECACHE_DELAY,
+ * - WriteCacheFlush() is called.
+ *
+ * Data in the cache is lost if the media goes away before the flush.
+ */
+
+#ifndef WRITECACHE_H
+#define	WRITECACHE_H
+
+#include <Storage.h>
+
+#ifndef WRITECACHE_UNITS
+#define WRITECACHE_UNITS 4 // storages with a write cache at the same time
+#endif
+
+#ifndef WRITECACHE_SIZE
+#define WRITECACHE_SIZE 8192UL // bytes, rounded down to whole sectors, 255 sectors at most
+#endif
+
+#ifndef WRITECACHE_DELAY
+#define WRITECACHE_DELAY 1000 // ms dirty data may wait for a flush
+#endif
+
+typedef struct WriteCacheStats {
+        uint32_t sectors; // sectors written by the caller
+        uint32_t merged; // of them, overwrote a sector still in the cache
+        uint32_t bypassed; // of them, were in writes too large to cache
+        uint32_t flushes; // flushes that had something to write
+        uint32_t commands; // driver writes issued by the flushes
+        uint32_t flushedSectors; // sectors written by them
+} writecache_stats_t;
+
+int WriteCacheAttach(storage_t *sto, uint32_t size = WRITECACHE_SIZE);
+void WriteCacheDetach(storage_t *sto);
+int WriteCacheFlush(storage_t *sto);
+void WriteCachePoll(storage_t *sto, uint32_t now);
+uint8_t WriteCacheDirty(storage_t *sto);
+writecache_stats_t *WriteCacheGetStats(storage_t *sto);
+void WriteCacheClearStats(storage_t *sto);
+
+#endif	/* WRITECACHE_H */
@@ -1,3 +1,6 @@
 /* Yup, just a bunch of includes. */
 #include "PCpartition/PCPartition.cpp"
 #include"FAT/FAT.cpp"
+#include "ReadAhead/ReadAhead.cpp"
+#include "WriteCache/WriteCache.cpp"
+#include "StorageQueue/StorageQueue.cpp"
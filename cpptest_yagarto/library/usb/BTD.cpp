@@ -202,10 +202,10 @@ uint8_t BTD::Init(uint8_t parent, uint8_t port, bool lowspeed) {
                 // And 3 endpoints - interrupt-IN, bulk-IN, bulk-OUT, not necessarily in this order
                 for (uint8_t i = 0; i < num_of_conf; i++) {
                         if (VID == IOGEAR_GBU521_VID && PID == IOGEAR_GBU521_PID) {
-                                ConfigDescParser<USB_CLASS_VENDOR_SPECIFIC, WI_SUBCLASS_RF, WI_PROTOCOL_BT, CP_MASK_COMPARE_ALL> confDescrParser(this); // Needed for the IOGEAR GBU521
+                                ConfigDescWalker<USB_CLASS_VENDOR_SPECIFIC, WI_SUBCLASS_RF, WI_PROTOCOL_BT, CP_MASK_COMPARE_ALL> confDescrParser(this); // Needed for the IOGEAR GBU521
                                 rcode = pUsb->getConfDescr(bAddress, 0, i, &confDescrParser);
                         } else {
-                                ConfigDescParser<USB_CLASS_WIRELESS_CTRL, WI_SUBCLASS_RF, WI_PROTOCOL_BT, CP_MASK_COMPARE_ALL> confDescrParser(this);
+                                ConfigDescWalker<USB_CLASS_WIRELESS_CTRL, WI_SUBCLASS_RF, WI_PROTOCOL_BT, CP_MASK_COMPARE_ALL> confDescrParser(this);
                                 rcode = pUsb->getConfDescr(bAddress, 0, i, &confDescrParser);
                         }
                         if (rcode) // Check error code
@@ -251,11 +251,11 @@ uint8_t BTD::Init(uint8_t parent, uint8_t port, bool lowspeed) {
         }
 
         USB::USBH_Open_Channel(pUsb->coreConfig, epInfo[1].hcNumIn, bAddress,
-        		(lowspeed)?bmLOWSPEED:bmFULLSPEED, EP_TYPE_INTR, epInfo[1].maxPktSize);
+        		pUsb->GetHcSpeed(bAddress), EP_TYPE_INTR, epInfo[1].maxPktSize);
         USB::USBH_Open_Channel(pUsb->coreConfig, epInfo[2].hcNumIn, bAddress,
-        		(lowspeed)?bmLOWSPEED:bmFULLSPEED, EP_TYPE_BULK, epInfo[2].maxPktSize);
+        		pUsb->GetHcSpeed(bAddress), EP_TYPE_BULK, epInfo[2].maxPktSize);
         USB::USBH_Open_Channel(pUsb->coreConfig, epInfo[3].hcNumOut, bAddress,
-        		(lowspeed)?bmLOWSPEED:bmFULLSPEED, EP_TYPE_BULK, epInfo[3].maxPktSize);
+        		pUsb->GetHcSpeed(bAddress), EP_TYPE_BULK, epInfo[3].maxPktSize);
         pUsb->coreConfig->host.hc[epInfo[1].hcNumIn].toggle_in = 0x0;
         //pUsb->coreConfig->host.hc[epInfo[2].hcNumIn].toggle_in ^= 0x1;
 
@@ -330,12 +330,12 @@ void BTD::EndpointXtract(uint8_t conf, uint8_t iface, uint8_t alt, uint8_t proto
         // Fill the rest of endpoint data structure
 		//st bsp needs full address(0x8x for in channel)
         epInfo[index].epAddr = (pep->bEndpointAddress);	// & 0x0F);
-        epInfo[index].maxPktSize = (uint8_t)pep->wMaxPacketSize;
+        epInfo[index].maxPktSize = pep->wMaxPacketSize & 0x7FF;
 #ifdef EXTRADEBUG
         PrintEndpointDescriptor(pep);
 #endif
-        if (pollInterval < pep->bInterval) // Set the polling interval as the largest polling interval obtained from endpoints
-                pollInterval = pep->bInterval;
+        if (pollInterval < pUsb->GetPollInterval(bAddress, pep->bInterval)) // Set the polling interval as the largest polling interval obtained from endpoints
+                pollInterval = pUsb->GetPollInterval(bAddress, pep->bInterval);
         bNumEP++;
 }
 
@@ -222,6 +222,24 @@ public:
         virtual uint8_t VIDPIDOK(uint16_t vid, uint16_t pid) {
                 return ((vid == PS3_VID || vid == IOGEAR_GBU521_VID) && (pid == PS3_PID || pid == PS3NAVIGATION_PID || pid == PS3MOVE_PID || pid == IOGEAR_GBU521_PID));
         };
+
+        /**
+         * Used by the USB core to pick this driver without probing it.
+         * @param  count Number of table entries.
+         * @return       Match table with the devices listed in ::VIDPIDOK and ::DEVCLASSOK.
+         */
+        virtual const UsbMatchEntry* GetMatchTable(uint8_t *count) {
+                static const UsbMatchEntry table[] = {
+                        { USB_MATCH_VIDPID, PS3_VID, PS3_PID, 0, 0, 0 },
+                        { USB_MATCH_VIDPID, PS3_VID, PS3NAVIGATION_PID, 0, 0, 0 },
+                        { USB_MATCH_VIDPID, PS3_VID, PS3MOVE_PID, 0, 0, 0 },
+                        { USB_MATCH_VIDPID, IOGEAR_GBU521_VID, IOGEAR_GBU521_PID, 0, 0, 0 },
+                        { USB_MATCH_IF_ALL, 0, 0, USB_CLASS_WIRELESS_CTRL, WI_SUBCLASS_RF, WI_PROTOCOL_BT },
+                        { USB_MATCH_DEV_CLASS, 0, 0, USB_CLASS_WIRELESS_CTRL, 0, 0 }
+                };
+                *count = sizeof (table) / sizeof (UsbMatchEntry);
+                return table;
+        };
         /**@}*/
 
         /** @name UsbConfigXtracter implementation */
@@ -429,7 +447,7 @@ public:
          * Read the poll interval taken from the endpoint descriptors.
          * @return The poll interval in ms.
          */
-        uint8_t readPollInterval() {
+        uint16_t readPollInterval() {
                 return pollInterval;
         };
 
@@ -467,7 +485,7 @@ private:
         BluetoothService* btService[BTD_NUMSERVICES];
 
         bool bPollEnable;
-        uint8_t pollInterval;
+        uint16_t pollInterval;
 
         /* Variables used by high level HCI task */
         uint8_t hci_state; //current state of bluetooth hci connection
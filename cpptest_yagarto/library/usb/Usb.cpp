@@ -18,15 +18,17 @@ e-mail   :  support@circuitsathome.com
 
 //#include "avrpins.h"
 //#include "max3421e.h"
+#include <string.h>
 #include "usbhost.h"
 #include "Usb.h"
 #include "bsp.h"
 
-static uint8_t usb_error = 0;
-static uint8_t usb_task_state;
-
 /* constructor */
-USB::USB(USB_OTG_CORE_HANDLE *pDev) : STM32F207(pDev), bmHubPre(0) {
+USB::USB(USB_OTG_CORE_HANDLE *pDev, USB_OTG_CORE_ID_TypeDef core) : STM32F207(pDev, core),
+usb_error(0),
+qTaskDelay(0),
+bResetInitiated(false),
+toggleErrors(0) {
         usb_task_state = USB_DETACHED_SUBSTATE_INITIALIZE; //set up state machine
         init();
 }
@@ -34,7 +36,6 @@ USB::USB(USB_OTG_CORE_HANDLE *pDev) : STM32F207(pDev), bmHubPre(0) {
 /* Initialize data structures */
 void USB::init() {
         //devConfigIndex = 0;
-        bmHubPre = 0;
 }
 
 uint8_t USB::getUsbTaskState(void) {
@@ -113,21 +114,69 @@ uint8_t USB::SetAddress(uint8_t addr, uint8_t ep, EpInfo **ppep, uint16_t &nak_l
         //Serial.println( mode, HEX);
         //Serial.print("\r\nLS: ");
         //Serial.println(p->lowspeed, HEX);
-        	
-
 
-        // Set bmLOWSPEED and bmHUBPRE in case of low-speed device, reset them otherwise
-//        regWr(rMODE, (p->lowspeed) ? mode | bmLOWSPEED | bmHubPre : mode & ~(bmHUBPRE | bmLOWSPEED));
+        // Full/low speed devices behind a high speed hub go through its TT with split transactions.
+        // The control channels are shared by all devices, so this is redone for every transfer.
+        SetHcSplit((*ppep)->hcNumIn, p);
+        SetHcSplit((*ppep)->hcNumOut, p);
 
         return 0;
 }
 
+void USB::SetHcSplit(uint8_t hcnum, UsbDevice *p) {
+        USB_OTG_HC *hc = &coreConfig->host.hc[hcnum];
+
+        hc->do_split = (p->ttHub) ? 1 : 0;
+        hc->hub_addr = p->ttHub;
+        hc->hub_port = p->ttPort;
+}
+
+/* A full/low speed device on a high speed bus is reached through the TT of the nearest high speed hub upstream */
+void USB::FindTransactionTranslator(UsbDevice *p, uint8_t parent, uint8_t port) {
+        p->ttHub = 0;
+        p->ttPort = 0;
+
+        if (p->speed == USB_SPEED_HIGH)
+                return;
+
+        while (parent) {
+                UsbDevice *ph = addrPool.GetUsbDevicePtr(parent);
+
+                if (!ph)
+                        return;
+
+                if (ph->speed == USB_SPEED_HIGH) {
+                        p->ttHub = parent;
+                        p->ttPort = port;
+                        return;
+                }
+                port = ph->port;
+                parent = ph->parent;
+        }
+}
+
+/* A bulk or control split that failed half way may leave the transaction in the TT buffer, have the hub drop it */
+void USB::ClearTTBuffer(UsbDevice *p, uint8_t hcnum) {
+        USB_OTG_HC *hc = &coreConfig->host.hc[hcnum];
+
+        if (!p || !p->ttHub || (hc->ep_type != EP_TYPE_BULK && hc->ep_type != EP_TYPE_CTRL))
+                return;
+
+        for (uint8_t i = 0; i < USB_NUMDEVICES; i++) {
+                if (devConfig[i] && devConfig[i]->GetAddress() == p->ttHub) {
+                        devConfig[i]->ClearTTBuffer(hc->dev_addr, hc->ep_num | ((hc->ep_is_in) ? 0x80 : 0x00), hc->ep_type);
+                        break;
+                }
+        }
+}
+
 /* Control transfer. Sets address, endpoint, fills control packet with necessary data, dispatches control packet, and initiates bulk IN transfer,   */
 /* depending on request. Actual requests are defined as inlines                                                                                      */
 /* return codes:                */
 /* 00       =   success         */
 
 /* 01-0f    =   non-zero HRSLT  */
+/* 10       =   hrNYET (STM32)  */
 uint8_t USB::ctrlReq(uint8_t addr, uint8_t ep, uint8_t bmReqType, uint8_t bRequest, uint8_t wValLo, uint8_t wValHi,
         uint16_t wInd, uint16_t total, uint16_t nbytes, uint8_t* dataptr, USBReadParser *p) {
         bool direction = false; //request direction, IN or OUT
@@ -168,8 +217,10 @@ uint8_t USB::ctrlReq(uint8_t addr, uint8_t ep, uint8_t bmReqType, uint8_t bReque
 
         rcode = dispatchPkt(tokSETUP, ep, nak_limit, (uint8_t *)&setup_pkt, sizeof(setup_pkt), pep->hcNumOut); //dispatch packet
 
-        if (rcode) //return HRSLT if not zero
+        if (rcode) { //return HRSLT if not zero
+			RecordHealth(addr, rcode);
 			return ( rcode);
+        }
 
         if (dataptr != NULL) //data stage, if present
         {
@@ -181,12 +232,24 @@ uint8_t USB::ctrlReq(uint8_t addr, uint8_t ep, uint8_t bmReqType, uint8_t bReque
 				pdev->host.hc[pep->hcNumIn].toggle_in = 0x1;
 				pep->bmRcvToggle = pdev->host.hc[pep->hcNumIn].toggle_in;
 
-				uint16_t read = total;	//nbytes;
-				rcode = InTransfer(pep, nak_limit, &read, dataptr);
+				// More than the buffer holds (a parser reads it), in buffer sized pieces.
+				// InTransfer() keeps the toggle in EpInfo from one piece to the next.
+				while (left) {
+					uint16_t want = (left < nbytes) ? left : nbytes;
+					uint16_t read = want;
 
-				// Invoke callback function if inTransfer completed successfully and callback function pointer is specified
-				if (!rcode && p)
-					((USBReadParser*)p)->Parse(read, dataptr, total - left);
+					rcode = InTransfer(pep, nak_limit, &read, dataptr);
+					if (rcode)
+						break;
+
+					// Invoke callback function if inTransfer completed successfully and callback function pointer is specified
+					if (p)
+						((USBReadParser*)p)->Parse(read, dataptr, total - left);
+
+					left -= read;
+					if (read < want)
+						break;
+				}
 
 #else
 				while (left) {
@@ -224,11 +287,49 @@ uint8_t USB::ctrlReq(uint8_t addr, uint8_t ep, uint8_t bmReqType, uint8_t bReque
 					pep->bmSndToggle = pdev->host.hc[pep->hcNumOut].toggle_out;
 					rcode = OutTransfer(pep, nak_limit, nbytes, dataptr);
 			}
-			if (rcode) //return error
+			if (rcode) { //return error
+				RecordHealth(addr, rcode);
 				return ( rcode);
+			}
         }
         // Status stage
-        return dispatchPkt((direction) ? tokOUTHS : tokINHS, ep, nak_limit, NULL, 0, (direction) ? pep->hcNumOut : pep->hcNumIn);	//GET if direction
+        rcode = dispatchPkt((direction) ? tokOUTHS : tokINHS, ep, nak_limit, NULL, 0, (direction) ? pep->hcNumOut : pep->hcNumIn);	//GET if direction
+
+        if (!rcode && bRequest == USB_REQUEST_CLEAR_FEATURE && wValLo == USB_FEATURE_ENDPOINT_HALT &&
+                bmReqType == (USB_SETUP_HOST_TO_DEVICE | USB_SETUP_TYPE_STANDARD | USB_SETUP_RECIPIENT_ENDPOINT))
+                ResetToggle(addr, (uint8_t)wInd);
+
+        RecordHealth(addr, rcode);
+        return rcode;
+}
+
+/* CLEAR_FEATURE(ENDPOINT_HALT) restarts the endpoint at DATA0 (USB 2.0, 9.4.5).      */
+/* EpInfo is the only copy of the toggle between transfers, the channel loads it.     */
+void USB::ResetToggle(uint8_t addr, uint8_t ep) {
+        UsbDevice *p = addrPool.GetUsbDevicePtr(addr);
+
+        if (!p || !p->epinfo)
+                return;
+
+        for (uint8_t i = 0; i < p->epcount; i++) {
+                if ((p->epinfo[i].epAddr & 0x7f) != (ep & 0x7f))
+                        continue;
+                if (ep & 0x80)
+                        p->epinfo[i].bmRcvToggle = 0;
+                else
+                        p->epinfo[i].bmSndToggle = 0;
+        }
+}
+
+/* Health counters of the device. A NAK that ends a transfer is flow control, not an error. */
+void USB::RecordHealth(uint8_t addr, uint8_t rcode) {
+        UsbDevice *p;
+
+        if (rcode == hrNAK)
+                return;
+        p = addrPool.GetUsbDevicePtr(addr);
+        if (p)
+                UsbHealthRecord(&p->health, UsbErrorClass(rcode));
 }
 
 /**
@@ -271,7 +372,7 @@ USBH_Status USB::USBH_InterruptReceiveData(uint8_t *buff, uint8_t length, uint8_
 /* IN transfer to arbitrary endpoint. Assumes PERADDR is set. Handles multiple packets if necessary. Transfers 'nbytes' bytes. */
 /* Keep sending INs and writes data to memory area pointed by 'data'                                                           */
 
-/* rcode 0 if no errors. rcode 01-0f is relayed from dispatchPkt(). Rcode f0 means RCVDAVIRQ error,
+/* rcode 0 if no errors. rcode 01-0f, and hrNYET (0x10), is relayed from dispatchPkt(). Rcode f0 means RCVDAVIRQ error,
             fe USB xfer timeout */
 uint8_t USB::inTransfer(uint8_t addr, uint8_t ep, uint16_t *nbytesptr, uint8_t* data) {
         EpInfo *pep = NULL;
@@ -285,7 +386,13 @@ uint8_t USB::inTransfer(uint8_t addr, uint8_t ep, uint16_t *nbytesptr, uint8_t*
 			return rcode;
         }
 
-        return InTransfer(pep, nak_limit, nbytesptr, data);
+        rcode = InTransfer(pep, nak_limit, nbytesptr, data);
+
+        if (rcode && rcode != hrNAK && rcode != hrSTALL)
+                ClearTTBuffer(addrPool.GetUsbDevicePtr(addr), pep->hcNumIn);
+
+        RecordHealth(addr, rcode);
+        return rcode;
 }
 
 uint8_t USB::InTransfer(EpInfo *pep, uint16_t nak_limit, uint16_t *nbytesptr, uint8_t* data) {
@@ -315,8 +422,8 @@ uint8_t USB::InTransfer(EpInfo *pep, uint16_t nak_limit, uint16_t *nbytesptr, ui
 	if(ep_addr != pdev->host.hc[hcnum].ep_num)
 		pdev->host.hc[hcnum].ep_num = ep_addr;
     	//USBH_Modify_Channel(pdev, hcnum, 0, ep_addr, 0, 0, 0);
-	if(pep->bmRcvToggle != pdev->host.hc[hcnum].toggle_in)	// for hid composite
-		pdev->host.hc[hcnum].toggle_in = pep->bmRcvToggle;
+	// EpInfo holds the toggle, a channel may serve several endpoints (hid composite)
+	pdev->host.hc[hcnum].toggle_in = pep->bmRcvToggle;
 
 	while (1) // use a 'return' to exit this loop
 	{
@@ -326,7 +433,7 @@ uint8_t USB::InTransfer(EpInfo *pep, uint16_t nak_limit, uint16_t *nbytesptr, ui
 //			pep->bmRcvToggle = (regRd(rHRSL) & bmSNDTOGRD) ? 0 : 1;
 //			regWr(rHCTL, (pep->bmRcvToggle) ? bmRCVTOG1 : bmRCVTOG0); //set toggle value
 			STM_EVAL_LEDToggle(LED3);
-			//pdev->host.hc[hcnum].toggle_in ^= 0x1;	//btd hci case
+			toggleErrors++;
 			printf("\nInXfer - toggle err, hc num=%d", hcnum);	// will meet toggle error here? todo: sometimes once unplugged device, there is small chance that Poll still works here.
 			//continue;
 		}
@@ -367,16 +474,16 @@ uint8_t USB::InTransfer(EpInfo *pep, uint16_t nak_limit, uint16_t *nbytesptr, ui
 		/* 2. 'nbytes' have been transferred.                       */
 		//if ((pktsize < maxpktsize) || (*nbytesptr >= nbytes)) // have we transferred 'nbytes' bytes?
 		{	// thanks to large fifo on stm32, we don't need packet by packet handling.
-			// Save toggle value
-			// the toggle is flipped at interrupt handler.
-			//pep->bmRcvToggle = ((regRd(rHRSL) & bmRCVTOGRD)) ? 1 : 0;
-			pep->bmRcvToggle = pdev->host.hc[hcnum].toggle_in;	//save last toggle
-			//printf("\r\n");
-
 			rcode = 0;
+			// the core counted what arrived, a short packet ends the transfer early
+			if (pdev->host.hc[hcnum].xfer_count < nbytes)
+				*nbytesptr = pdev->host.hc[hcnum].xfer_count;
+			USB_FAULT_SHORTEN(pdev, hcnum, nbytesptr);
 			break;
 		} // if
 	} //while( 1 )
+	// Save toggle value, the ISR took it from the core when the channel halted
+	pep->bmRcvToggle = pdev->host.hc[hcnum].toggle_in;
 #endif		
 	return ( rcode);
 }
@@ -384,7 +491,7 @@ uint8_t USB::InTransfer(EpInfo *pep, uint16_t nak_limit, uint16_t *nbytesptr, ui
 /* OUT transfer to arbitrary endpoint. Handles multiple packets if necessary. Transfers 'nbytes' bytes. */
 /* Handles NAK bug per Maxim Application Note 4000 for single buffer transfer   */
 
-/* rcode 0 if no errors. rcode 01-0f is relayed from HRSL                       */
+/* rcode 0 if no errors. rcode 01-0f (and hrNYET, 0x10) is relayed from HRSL   */
 uint8_t USB::outTransfer(uint8_t addr, uint8_t ep, uint16_t nbytes, uint8_t* data) {
         EpInfo *pep = NULL;
         uint16_t nak_limit = 0;
@@ -394,20 +501,28 @@ uint8_t USB::outTransfer(uint8_t addr, uint8_t ep, uint16_t nbytes, uint8_t* dat
         if (rcode)
 			return rcode;
 
-        return OutTransfer(pep, nak_limit, nbytes, data);
+        rcode = OutTransfer(pep, nak_limit, nbytes, data);
+
+        if (rcode && rcode != hrNAK && rcode != hrSTALL)
+                ClearTTBuffer(addrPool.GetUsbDevicePtr(addr), pep->hcNumOut);
+
+        RecordHealth(addr, rcode);
+        return rcode;
 }
 
 uint8_t USB::OutTransfer(EpInfo *pep, uint16_t nak_limit, uint16_t nbytes, uint8_t *data) {
-	uint8_t rcode = hrSUCCESS, retry_count;
+	uint8_t rcode = hrSUCCESS;
 	uint8_t *data_p = data; //local copy of the data pointer
 	uint16_t bytes_tosend, nak_count;
+	UsbRetry retry(&UsbRetryBus);
 	uint16_t bytes_left = nbytes, last_bytesleft = nbytes;
 	USB_OTG_CORE_HANDLE *pdev = coreConfig;
 	uint32_t hcnum = pep->hcNumOut;
 
-	uint8_t maxpktsize = pep->maxPktSize;
+	uint16_t maxpktsize = pep->maxPktSize;
 
-	if (maxpktsize < 1 || maxpktsize > 64)
+	// 64 at full speed, up to 1024 for high speed interrupt endpoints
+	if (maxpktsize < 1 || maxpktsize > ((pdev->host.hc[hcnum].speed == HPRT0_PRTSPD_HIGH_SPEED) ? 1024 : 64))
 		return USB_ERROR_INVALID_MAX_PKT_SIZE;
 
 	if(maxpktsize != pdev->host.hc[hcnum].max_packet)
@@ -437,6 +552,7 @@ uint8_t USB::OutTransfer(EpInfo *pep, uint16_t nak_limit, uint16_t nbytes, uint8
         unsigned long timeout = millis() + USB_XFER_TIMEOUT;
 
         //regWr(rHCTL, (pep->bmSndToggle) ? bmSNDTOG1 : bmSNDTOG0); //set toggle value
+    	pdev->host.hc[hcnum].toggle_out = pep->bmSndToggle;
     	pdev->host.hc[hcnum].ep_is_in = 0;
     	pdev->host.hc[hcnum].xfer_buff = data; //buff;
     	pdev->host.hc[hcnum].xfer_len = nbytes;	//length;
@@ -456,7 +572,6 @@ uint8_t USB::OutTransfer(EpInfo *pep, uint16_t nak_limit, uint16_t nbytes, uint8
     		pdev->host.hc[hcnum].data_pid = HC_PID_DATA1 ;
     	}
 
-		retry_count = 0;
 		nak_count = 0;
 		while (bytes_left) {
 			// we send all data at once due to large fifo
@@ -479,7 +594,7 @@ PollStatus:
 			if(rcode != 0x00)
 				return rcode;	// todo: return for what
 
-			rcode = HCD_GetHCState(pdev, hcnum);	//(regRd(rHRSL) & 0x0f);
+			rcode = USB_FAULT_FILTER(pdev, hcnum, HCD_GetHCState(pdev, hcnum));	//(regRd(rHRSL) & 0x0f);
 			//while (rcode && (timeout > millis())) {	// we don't need pulling here because we already did it above
 				switch (rcode) {
 					case hrNAK:
@@ -501,15 +616,18 @@ PollStatus:
 						}*/
 						break;
 					case hrTIMEOUT:
-						retry_count++;
-						if (retry_count == USB_RETRY_LIMIT)
+						if (!retry.Again(USB_ERR_CLASS_TRANSIENT))
 							goto breakout;
 						//return ( rcode);
 						break;
+					case hrNYET:
+						// some packets went out, the rest follows after a PING
+						break;
 					case hrTOGERR:
 						// yes, we flip it wrong here so that next time it is actually correct!
 						//pep->bmSndToggle = (regRd(rHRSL) & bmSNDTOGRD) ? 0 : 1;
 						//regWr(rHCTL, (pep->bmSndToggle) ? bmSNDTOG1 : bmSNDTOG0); //set toggle value
+						toggleErrors++;
 						printf("\nOutTransfer - togerr");
 						//break;
 					default:
@@ -525,18 +643,27 @@ PollStatus:
 				USB_OTG_HCTSIZn_TypeDef hctsiz;
 				hctsiz.d32 = USB_OTG_READ_REG32(&pdev->regs.HC_REGS[hcnum]->HCTSIZ);
 
-				bytes_left = hctsiz.b.pktcnt << 6;
+				// a NAKed PING sent no data, and HCTSIZ holds the PING, not the transfer
+				if(hctsiz.b.dopng)
+					continue;
+
+				// pktcnt counts the packets still to go, the last one of them may be short.
+				// Resubmissions start on a packet boundary, so that holds for the whole of nbytes.
+				// Split transfers go one packet at a time, the ISR counts what the TT got through.
+				uint16_t npkts = (nbytes + maxpktsize - 1) / maxpktsize;
+				uint16_t sent = (hctsiz.b.pktcnt < npkts) ? (npkts - hctsiz.b.pktcnt) * maxpktsize : 0;
+
+				if(pdev->host.hc[hcnum].do_split)
+					sent = (nbytes - last_bytesleft) + pdev->host.hc[hcnum].split_done;
+
+				bytes_left = nbytes - sent;
 				if(last_bytesleft != bytes_left) {
 					last_bytesleft = bytes_left;
-					pdev->host.hc[hcnum].xfer_buff = data + nbytes - bytes_left;
+					pdev->host.hc[hcnum].xfer_buff = data + sent;
 					pdev->host.hc[hcnum].xfer_len = bytes_left;
-
-					if(((nbytes - bytes_left) >> 6) & 0x1) {	// if sent odd times packets
-						pdev->host.hc[hcnum].toggle_out ^= 0x1;
-						pdev->host.hc[hcnum].data_pid = (pdev->host.hc[hcnum].toggle_out) ? HC_PID_DATA1 : HC_PID_DATA0;
-					}
-					pdev->host.hc[hcnum].isEvenTimesToggle = 0;	// will be re-calculate in HCD_SubmitRequest
-					retry_count = 0;
+					// the ISR took the toggle of the next packet from the core
+					pdev->host.hc[hcnum].data_pid = (pdev->host.hc[hcnum].toggle_out) ? HC_PID_DATA1 : HC_PID_DATA0;
+					retry = UsbRetry(&UsbRetryBus); // progress, the budget starts over
 					nak_count = 0;
 				}
 				//regWr(rSNDBC, 0);
@@ -553,21 +680,22 @@ PollStatus:
 		}//while( bytes_left...
 breakout:
         //pep->bmSndToggle = (regRd(rHRSL) & bmSNDTOGRD) ? 1 : 0; //bmSNDTOG1 : bmSNDTOG0;  //update toggle
+        pep->bmSndToggle = pdev->host.hc[hcnum].toggle_out;
 #endif
         return ( rcode); //should be 0 in all cases
 }
 /* dispatch USB packet. Assumes peripheral address is set and relevant buffer is loaded/empty       */
 /* If NAK, tries to re-send up to nak_limit times                                                   */
 /* If nak_limit == 0, do not count NAKs, exit after timeout                                         */
-/* If bus timeout, re-sends up to USB_RETRY_LIMIT times                                             */
+/* If bus timeout, re-sends as long as UsbRetryBus allows (USB_RETRY_LIMIT attempts)                */
 
-/* return codes 0x00-0x0f are HRSLT( 0x00 being success ), 0xff means timeout                       */
+/* return codes 0x00-0x0f are HRSLT( 0x00 being success ), 0x10 is hrNYET, 0xff means timeout      */
 uint8_t USB::dispatchPkt(uint8_t token, uint8_t ep, uint16_t nak_limit, uint8_t *data_p = NULL, uint16_t nbytes = 0, uint8_t hcnum = 0) {
         unsigned long timeout = millis() + USB_XFER_TIMEOUT;
         //unsigned long timeout2 = timeout;
         uint8_t tmpdata;
         uint8_t rcode = hrSUCCESS;
-        uint8_t retry_count = 0;
+        UsbRetry retry(&UsbRetryBus);
         uint16_t nak_count = 0;
         USB_OTG_CORE_HANDLE *pdev = coreConfig;
         uint8_t pid = 0;
@@ -656,7 +784,7 @@ uint8_t USB::dispatchPkt(uint8_t token, uint8_t ep, uint16_t nak_limit, uint8_t
 			//if (rcode != 0x00) //exit if timeout
 			//        return ( rcode);
 
-            rcode = HCD_GetHCState(pdev, hcnum);	//(regRd(rHRSL) & 0x0f); //analyze transfer result
+            rcode = USB_FAULT_FILTER(pdev, hcnum, HCD_GetHCState(pdev, hcnum));	//(regRd(rHRSL) & 0x0f); //analyze transfer result
 			switch (rcode) {
 				case hrNAK: 	//todo: if timeout above with nak, we need to consider the next xfer.
 					nak_count = pdev->host.hc[hcnum].nak_count;
@@ -664,8 +792,7 @@ uint8_t USB::dispatchPkt(uint8_t token, uint8_t ep, uint16_t nak_limit, uint8_t
 						return (rcode);
 					break;
 				case hrTIMEOUT:
-					retry_count++;
-					if (retry_count == USB_RETRY_LIMIT)
+					if (!retry.Again(USB_ERR_CLASS_TRANSIENT))
 						return (rcode);
 					break;
 				default:
@@ -682,8 +809,8 @@ void USB::Task(USB_OTG_CORE_HANDLE *pdev) //USB state machine
 {
 	uint8_t rcode;
 	uint8_t tmpdata;
-	static unsigned long delay = 0;
 	bool lowspeed = false;
+	bool highspeed = false;
 
 	STM32F2::Task();
 
@@ -704,9 +831,11 @@ void USB::Task(USB_OTG_CORE_HANDLE *pdev) //USB state machine
 //        if ((usb_task_state & USB_STATE_MASK) == USB_STATE_DETACHED) {
 			lowspeed = true;
 //        }
+		case HSHOST:
 		case FSHOST: //attached
+			highspeed = (tmpdata == HSHOST);
 			if ((usb_task_state & USB_STATE_MASK) == USB_STATE_DETACHED) {
-				delay = millis() + USB_SETTLE_DELAY;
+				qTaskDelay = millis() + USB_SETTLE_DELAY;
 				usb_task_state = USB_ATTACHED_SUBSTATE_SETTLE;
 				STM_EVAL_LEDToggle(LED1);
 			}
@@ -725,6 +854,8 @@ void USB::Task(USB_OTG_CORE_HANDLE *pdev) //USB state machine
 					if (devConfig[i])
 							rcode = devConfig[i]->Release();
 
+				descrCache.UnbindAll();
+
 				usb_task_state = USB_DETACHED_SUBSTATE_WAIT_FOR_DEVICE;
 				break;
 		case USB_DETACHED_SUBSTATE_WAIT_FOR_DEVICE: //just sit here
@@ -732,7 +863,7 @@ void USB::Task(USB_OTG_CORE_HANDLE *pdev) //USB state machine
 		case USB_DETACHED_SUBSTATE_ILLEGAL: //just sit here
 				break;
 		case USB_ATTACHED_SUBSTATE_SETTLE: //settle time for just attached device
-			if (delay < millis())
+			if (qTaskDelay < millis())
 				usb_task_state = USB_ATTACHED_SUBSTATE_RESET_DEVICE;
 			break;
 		case USB_ATTACHED_SUBSTATE_RESET_DEVICE:
@@ -751,7 +882,7 @@ void USB::Task(USB_OTG_CORE_HANDLE *pdev) //USB state machine
 						tmpdata = regRd(rMODE) | bmSOFKAENAB; //start SOF generation
 						regWr(rMODE, tmpdata);
 						usb_task_state = USB_ATTACHED_SUBSTATE_WAIT_SOF;
-						//delay = millis() + 20; //20ms wait after reset per USB spec
+						//qTaskDelay = millis() + 20; //20ms wait after reset per USB spec
 				}
 				break;*/
 
@@ -768,11 +899,11 @@ void USB::Task(USB_OTG_CORE_HANDLE *pdev) //USB state machine
 			if(pdev->host.SofHits) {
 				//when first SOF received _and_ 20ms has passed we can continue
 				usb_task_state = USB_ATTACHED_SUBSTATE_WAIT_RESET;
-				delay = millis() + 20;
+				qTaskDelay = millis() + 20;
 			}
 			break;
 		case USB_ATTACHED_SUBSTATE_WAIT_RESET:
-			if (delay < millis()) {
+			if (qTaskDelay < millis()) {
 				usb_task_state = USB_STATE_CONFIGURING;
 			}
 			break;
@@ -781,7 +912,7 @@ void USB::Task(USB_OTG_CORE_HANDLE *pdev) //USB state machine
 					//Serial.print("\r\nConf.LS: ");
 					//Serial.println(lowspeed, HEX);
 			printf("\nTODO:Support all 8 USB pipe?");
-			rcode = Configuring(0, 0, lowspeed);
+			rcode = Configuring(0, 0, lowspeed, highspeed);
 
 			if (rcode) {
 				if (rcode != USB_DEV_CONFIG_ERROR_DEVICE_INIT_INCOMPLETE) {
@@ -857,8 +988,13 @@ uint8_t USB::AttemptConfig(uint8_t driver, uint8_t parent, uint8_t port, bool lo
 //TODO: but reset			regWr(rHCTL, bmBUSRST); //issue bus reset
 			delay_ms(102); // delay 102ms, compensate for clock inaccuracy.
 		} else {
-			// reset parent port
-			devConfig[parent]->ResetHubPort(port);
+			// reset parent port, parent is the hub's address
+			for (uint8_t i = 0; i < USB_NUMDEVICES; i++) {
+				if (devConfig[i] && devConfig[i]->GetAddress() == parent) {
+					devConfig[i]->ResetHubPort(port);
+					break;
+				}
+			}
 		}
 	}
 	rcode = devConfig[driver]->Init(parent, port, lowspeed);
@@ -905,7 +1041,7 @@ uint8_t USB::AttemptConfig(uint8_t driver, uint8_t parent, uint8_t port, bool lo
  * 8: if we get here, no driver likes the device plugged in, so exit failure.
  *
  */
-uint8_t USB::Configuring(uint8_t parent, uint8_t port, bool lowspeed) {
+uint8_t USB::Configuring(uint8_t parent, uint8_t port, bool lowspeed, bool highspeed) {
         //uint8_t bAddress = 0;
         //printf("Configuring: parent = %i, port = %i\r\n", parent, port);
         uint8_t devConfigIndex;
@@ -932,11 +1068,14 @@ uint8_t USB::Configuring(uint8_t parent, uint8_t port, bool lowspeed) {
         USBH_Free_Channel(pdev, 1);
 		epInfo.hcNumOut = USBH_Alloc_Channel(pdev, 0x00);	// ep_addr = 0
 		epInfo.hcNumIn = USBH_Alloc_Channel(pdev, 0x80);
-		USBH_Open_Channel(pdev, epInfo.hcNumOut, 0x0, (lowspeed)?bmLOWSPEED:bmFULLSPEED, EP_TYPE_CTRL, 0x8);
-		USBH_Open_Channel(pdev, epInfo.hcNumIn,	0x0, (lowspeed)?bmLOWSPEED:bmFULLSPEED, EP_TYPE_CTRL, 0x8);
+		uint8_t hcspeed = (lowspeed) ? bmLOWSPEED : (highspeed) ? bmHIGHSPEED : bmFULLSPEED;
+		USBH_Open_Channel(pdev, epInfo.hcNumOut, 0x0, hcspeed, EP_TYPE_CTRL, 0x8);
+		USBH_Open_Channel(pdev, epInfo.hcNumIn,	0x0, hcspeed, EP_TYPE_CTRL, 0x8);
 		printf("\nControl Pipe: out = %d (0), in = %d (1)", epInfo.hcNumOut, epInfo.hcNumIn);
 
-        delay_ms(1000);
+        // Devices behind a hub had their reset recovery time in the hub driver already
+        if (!parent)
+			delay_ms(1000);
         AddressPool &addrPool = GetAddressPool();
         // Get pointer to pseudo device with address 0 assigned
         p = addrPool.GetUsbDevicePtr(0);
@@ -954,6 +1093,11 @@ uint8_t USB::Configuring(uint8_t parent, uint8_t port, bool lowspeed) {
         p->epinfo = &epInfo;
 
         p->lowspeed = lowspeed;
+        p->speed = (lowspeed) ? USB_SPEED_LOW : (highspeed) ? USB_SPEED_HIGH : USB_SPEED_FULL; // AllocAddress() hands it on to the new address
+        FindTransactionTranslator(p, parent, port); // and this as well
+
+        // Whatever was at address 0 before is gone, read the new device from the wire
+        descrCache.Unbind(0);
 
         // Get device descriptor
         rcode = getDevDescr(0, 0, 8, (uint8_t*)buf);	// 8 should be enough, sizeof (USB_DEVICE_DESCRIPTOR)
@@ -981,13 +1125,42 @@ uint8_t USB::Configuring(uint8_t parent, uint8_t port, bool lowspeed) {
         rcode = getDevDescr(0, 0, sizeof(USB_DEVICE_DESCRIPTOR), (uint8_t*)buf);
         printf("\nControl - Got 2nd 18 bytes desc.");
 
+        // Known devices get the rest of their descriptors from the cache
+        if (!rcode)
+                AttachDescriptorCache((USB_DEVICE_DESCRIPTOR*)buf);
+
         uint16_t vid = (uint16_t)((USB_DEVICE_DESCRIPTOR*)buf)->idVendor;
         uint16_t pid = (uint16_t)((USB_DEVICE_DESCRIPTOR*)buf)->idProduct;
         uint8_t klass = ((USB_DEVICE_DESCRIPTOR*)buf)->bDeviceClass;
 
+        // Indexed lookup. Drivers with a match table are only attempted if the device matches it,
+        // most specific entries first, so they don't have to read descriptors just to say no.
+        // If the descriptors could not be read whole, "no match" means nothing: the indexed
+        // drivers that were not tried yet are probed the old way below.
+        UsbMatchKey key;
+        bool tried[USB_NUMDEVICES];
+
+        memset(&key, 0, sizeof (key));
+        memset(tried, 0, sizeof (tried));
+        if (!rcode)
+                BuildMatchKey((USB_DEVICE_DESCRIPTOR*)buf, &key);
+
+        for (uint8_t i = 0; i < matchIndexCount; i++) {
+                devConfigIndex = matchIndex[i].driver;
+                if (tried[devConfigIndex]) continue;
+                if (devConfig[devConfigIndex]->GetAddress()) continue; // consumed
+                if (!MatchEntry(matchIndex[i].pe, &key)) continue;
+
+                tried[devConfigIndex] = true;
+                rcode = AttemptConfig(devConfigIndex, parent, port, lowspeed);
+                if (!(rcode == USB_DEV_CONFIG_ERROR_DEVICE_NOT_SUPPORTED || rcode == USB_ERROR_CLASS_INSTANCE_ALREADY_IN_USE))
+                        return rcode;
+        }
+
         // Attempt to configure if VID/PID or device class matches with a driver
         for (devConfigIndex = 0; devConfigIndex < USB_NUMDEVICES; devConfigIndex++) {
                 if (!devConfig[devConfigIndex]) continue; // no driver
+                if (devIndexed[devConfigIndex] && (key.complete || tried[devConfigIndex])) continue; // already looked up above
                 if (devConfig[devConfigIndex]->GetAddress()) continue; // consumed
                 if (devConfig[devConfigIndex]->VIDPIDOK(vid, pid)) {
 					rcode = AttemptConfig(devConfigIndex, parent, port, lowspeed);
@@ -1006,6 +1179,7 @@ uint8_t USB::Configuring(uint8_t parent, uint8_t port, bool lowspeed) {
         // blindly attempt to configure
         for (devConfigIndex = 0; devConfigIndex < USB_NUMDEVICES; devConfigIndex++) {
                 if (!devConfig[devConfigIndex]) continue;
+                if (devIndexed[devConfigIndex] && (key.complete || tried[devConfigIndex])) continue;
                 if (devConfig[devConfigIndex]->GetAddress()) continue; // consumed
                 rcode = AttemptConfig(devConfigIndex, parent, port, lowspeed);
 
@@ -1025,10 +1199,133 @@ uint8_t USB::Configuring(uint8_t parent, uint8_t port, bool lowspeed) {
         return rcode;
 }
 
+/* Adds the match table of devConfig[driver] to the index, keeping it sorted by priority: */
+/* VID/PID entries first, then interface class, then device class. */
+void USB::IndexMatchTable(uint8_t driver) {
+        uint8_t count;
+        const UsbMatchEntry *table = devConfig[driver]->GetMatchTable(&count);
+
+        if (!table)
+                return;
+
+        devIndexed[driver] = true;
+
+        for (uint8_t j = 0; j < count; j++) {
+                const UsbMatchEntry *pe = &table[j];
+                uint8_t prio;
+
+                if (!pe->bmMatch)
+                        continue;
+
+                if (matchIndexCount == USB_MATCH_INDEX_SIZE) {
+                        // No room, let the driver be probed the old way
+                        devIndexed[driver] = false;
+                        printf("\nUSB_MATCH_INDEX_SIZE too small");
+                        return;
+                }
+
+                if (pe->bmMatch & USB_MATCH_VIDPID)
+                        prio = 0;
+                else if ((pe->bmMatch & USB_MATCH_IF_ALL) == USB_MATCH_IF_ALL)
+                        prio = 1;
+                else if (pe->bmMatch & USB_MATCH_IF_ALL)
+                        prio = 2;
+                else
+                        prio = 3;
+
+                uint8_t i = matchIndexCount++;
+
+                for (; i && matchIndex[i - 1].prio > prio; i--)
+                        matchIndex[i] = matchIndex[i - 1];
+
+                matchIndex[i].pe = pe;
+                matchIndex[i].driver = driver;
+                matchIndex[i].prio = prio;
+        }
+}
+
+/* Collects VID/PID, device class and the interface triples of configuration 0 of the device at address 0. */
+/* Thanks to the descriptor cache, the configuration descriptor read here is the only one drivers need. */
+void USB::BuildMatchKey(USB_DEVICE_DESCRIPTOR *dd, UsbMatchKey *pk) {
+        uint8_t buf[256];
+
+        pk->vid = dd->idVendor;
+        pk->pid = dd->idProduct;
+        pk->klass = dd->bDeviceClass;
+        pk->numIfaces = 0;
+        pk->complete = false;
+
+        if (getConfDescr(0, 0, sizeof (buf) - 1, 0, buf))
+                return;
+
+        uint16_t total = ((USB_CONFIGURATION_DESCRIPTOR*)buf)->wTotalLength;
+        const uint8_t *p = buf;
+        const uint8_t *end = buf + ((total < sizeof (buf)) ? total : sizeof (buf) - 1);
+
+        // Past the buffer, interfaces the key does not hold may follow
+        pk->complete = (total < sizeof (buf));
+        while (end - p >= 2 && p[0] >= 2 && p[0] <= end - p) {
+                const USB_INTERFACE_DESCRIPTOR *pif = (const USB_INTERFACE_DESCRIPTOR*)p;
+
+                // Alternate settings count as well, UAS sits behind a Bulk-Only setting 0
+                if (pif->bDescriptorType == USB_DESCRIPTOR_INTERFACE && pif->bLength >= sizeof (USB_INTERFACE_DESCRIPTOR)) {
+                        if (pk->numIfaces == USB_MATCH_MAX_INTERFACES) {
+                                pk->complete = false;
+                                break;
+                        }
+                        pk->iface[pk->numIfaces].klass = pif->bInterfaceClass;
+                        pk->iface[pk->numIfaces].subklass = pif->bInterfaceSubClass;
+                        pk->iface[pk->numIfaces].proto = pif->bInterfaceProtocol;
+                        pk->numIfaces++;
+                }
+                p += p[0];
+        }
+        if (p != end)
+                pk->complete = false; // a broken descriptor ended the walk
+}
+
+bool USB::MatchEntry(const UsbMatchEntry *pe, const UsbMatchKey *pk) {
+        if (!pe->bmMatch)
+                return false;
+
+        if ((pe->bmMatch & USB_MATCH_VIDPID) && (pe->vid != pk->vid || pe->pid != pk->pid))
+                return false;
+
+        if (!(pe->bmMatch & USB_MATCH_IF_ALL))
+                return !(pe->bmMatch & USB_MATCH_DEV_CLASS) || pe->klass == pk->klass;
+
+        for (uint8_t i = 0; i < pk->numIfaces; i++) {
+                if ((pe->bmMatch & USB_MATCH_IF_CLASS) && pe->klass != pk->iface[i].klass) continue;
+                if ((pe->bmMatch & USB_MATCH_IF_SUBCLASS) && pe->subklass != pk->iface[i].subklass) continue;
+                if ((pe->bmMatch & USB_MATCH_IF_PROTOCOL) && pe->proto != pk->iface[i].proto) continue;
+                return true;
+        }
+        return false;
+}
+
+/* Looks the device at address 0 up in the descriptor cache and binds the entry to it. */
+/* The serial number costs one string request, but saves the configuration and class descriptor reads of a known device. */
+void USB::AttachDescriptorCache(USB_DEVICE_DESCRIPTOR *dd) {
+        uint32_t serial = 0;
+
+        if (dd->iSerialNumber) {
+                uint8_t sbuf[USB_DESCR_CACHE_SERIAL_SIZE];
+
+                if (!getStrDescr(0, 0, sizeof (sbuf), dd->iSerialNumber, 0x0409, sbuf) && sbuf[0] > 2)
+                        serial = DescriptorCache::Hash(sbuf + 2, ((sbuf[0] > sizeof (sbuf)) ? sizeof (sbuf) : sbuf[0]) - 2);
+        }
+
+        DescriptorCacheEntry *pe = descrCache.Attach(dd, serial);
+
+        if (pe && (pe->bmValid & bmDESCR_CACHE_CONF))
+                printf("\nDescriptor cache hit %04x:%04x", dd->idVendor, dd->idProduct);
+}
+
 uint8_t USB::ReleaseDevice(uint8_t addr) {
         if (!addr)
                 return 0;
         USB_OTG_CORE_HANDLE *pdev = coreConfig;
+        descrCache.Unbind(addr);
         for (uint8_t i = 0; i < USB_NUMDEVICES; i++) {
                 if(!devConfig[i]) continue;
                 if (devConfig[i]->GetAddress() == addr)
@@ -1041,12 +1338,21 @@ uint8_t USB::ReleaseDevice(uint8_t addr) {
 //get device descriptor
 
 uint8_t USB::getDevDescr(uint8_t addr, uint8_t ep, uint16_t nbytes, uint8_t* dataptr) {
+        if (descrCache.GetDevDescr(addr, nbytes, dataptr))
+                return 0;
         return ( ctrlReq(addr, ep, bmREQ_GET_DESCR, USB_REQUEST_GET_DESCRIPTOR, 0x00, USB_DESCRIPTOR_DEVICE, 0x0000, nbytes, nbytes, dataptr, NULL));
 }
 //get configuration descriptor
 
 uint8_t USB::getConfDescr(uint8_t addr, uint8_t ep, uint16_t nbytes, uint8_t conf, uint8_t* dataptr) {
-        return ( ctrlReq(addr, ep, bmREQ_GET_DESCR, USB_REQUEST_GET_DESCRIPTOR, conf, USB_DESCRIPTOR_CONFIGURATION, 0x0000, nbytes, nbytes, dataptr, NULL));
+        if (descrCache.GetConfDescr(addr, conf, nbytes, dataptr))
+                return 0;
+
+        uint8_t rcode = ctrlReq(addr, ep, bmREQ_GET_DESCR, USB_REQUEST_GET_DESCRIPTOR, conf, USB_DESCRIPTOR_CONFIGURATION, 0x0000, nbytes, nbytes, dataptr, NULL);
+
+        if (!rcode)
+                descrCache.PutConfDescr(addr, conf, nbytes, dataptr);
+        return rcode;
 }
 
 uint8_t USB::getConfDescr(uint8_t addr, uint8_t ep, uint8_t conf, USBReadParser *p) {
@@ -1054,7 +1360,9 @@ uint8_t USB::getConfDescr(uint8_t addr, uint8_t ep, uint8_t conf, USBReadParser
         									// we need a large buffer for BTD class, which has a 177 bytes desc.
         uint8_t buf[bufSize];
 
-        uint8_t ret = getConfDescr(addr, ep, 8, conf, buf);
+        // No separate 8 byte header read: ask for the whole buffer, the device stops at wTotalLength.
+        // 255, not 256, some devices only look at the low byte of wLength.
+        uint8_t ret = getConfDescr(addr, ep, bufSize - 1, conf, buf);
 
         if (ret)
 			return ret;
@@ -1063,6 +1371,13 @@ uint8_t USB::getConfDescr(uint8_t addr, uint8_t ep, uint8_t conf, USBReadParser
 
         //USBTRACE2("\r\ntotal conf.size:", total);
 
+        // Got it whole (or from the cache), hand it to the parser in one go.
+        // Otherwise it is read again and parsed in bufSize pieces.
+        if (total < bufSize) {
+                p->Parse(total, buf, 0);
+                return 0;
+        }
+
         return ( ctrlReq(addr, ep, bmREQ_GET_DESCR, USB_REQUEST_GET_DESCRIPTOR, conf, USB_DESCRIPTOR_CONFIGURATION, 0x0000, total, bufSize, buf, p));
 }
 
@@ -1074,7 +1389,11 @@ uint8_t USB::getStrDescr(uint8_t addr, uint8_t ep, uint16_t ns, uint8_t index, u
 //set address
 
 uint8_t USB::setAddr(uint8_t oldaddr, uint8_t ep, uint8_t newaddr) {
-        return ( ctrlReq(oldaddr, ep, bmREQ_SET, USB_REQUEST_SET_ADDRESS, newaddr, 0x00, 0x0000, 0x0000, 0x0000, NULL, NULL));
+        uint8_t rcode = ctrlReq(oldaddr, ep, bmREQ_SET, USB_REQUEST_SET_ADDRESS, newaddr, 0x00, 0x0000, 0x0000, 0x0000, NULL, NULL);
+
+        if (!rcode)
+                descrCache.Rebind(oldaddr, newaddr);
+        return rcode;
 }
 //set configuration
 
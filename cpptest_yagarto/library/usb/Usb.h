@@ -32,6 +32,8 @@ e-mail   :  support@circuitsathome.com
 #include "usbhost.h"
 #include "usb_ch9.h"
 #include "address.h"
+#include "devcache.h"
+#include "usbfault.h"
 
 #include "message.h"
 
@@ -92,7 +94,10 @@ e-mail   :  support@circuitsathome.com
 #define USB_RETRY_LIMIT		3       // 3 retry limit for a transfer
 #define USB_SETTLE_DELAY	200     //settle delay in milliseconds
 
-#define USB_NUMDEVICES		16	//number of USB devices
+#define USB_NUMDEVICES		16	//number of USB device drivers
+#ifndef USB_NUMADDRESSES
+#define USB_NUMADDRESSES	32	//number of address pool entries, address 0 included. Addresses themselves go up to 127
+#endif
 //#define HUB_MAX_HUBS		7	// maximum number of hubs that can be attached to the host controller
 #define HUB_PORT_RESET_DELAY	20	// hub port reset delay 10 ms recomended, can be up to 20 ms
 
@@ -114,6 +119,49 @@ e-mail   :  support@circuitsathome.com
 #define USB_STATE_RUNNING                                   0x90
 #define USB_STATE_ERROR                                     0xa0
 
+/* Driver match tables */
+#define USB_MATCH_INDEX_SIZE		24	// match table entries of all registered drivers together
+#define USB_MATCH_MAX_INTERFACES	8	// interfaces and alternate settings of configuration 0 looked at
+
+#define USB_MATCH_VIDPID		0x01	// idVendor/idProduct
+#define USB_MATCH_DEV_CLASS		0x02	// bDeviceClass
+#define USB_MATCH_IF_CLASS		0x04	// bInterfaceClass of any interface
+#define USB_MATCH_IF_SUBCLASS		0x08	// bInterfaceSubClass of the same interface
+#define USB_MATCH_IF_PROTOCOL		0x10	// bInterfaceProtocol of the same interface
+#define USB_MATCH_IF_ALL		(USB_MATCH_IF_CLASS | USB_MATCH_IF_SUBCLASS | USB_MATCH_IF_PROTOCOL)
+
+// One line of a driver's match table. klass/subklass/proto hold the interface triple if any USB_MATCH_IF_xxx
+// bit is set, the device class otherwise. An entry with bmMatch == 0 never matches.
+struct UsbMatchEntry {
+        uint8_t bmMatch; // USB_MATCH_xxx
+        uint16_t vid;
+        uint16_t pid;
+        uint8_t klass;
+        uint8_t subklass;
+        uint8_t proto;
+};
+
+// What the core knows about the device at address 0 before any driver is asked
+struct UsbMatchKey {
+        uint16_t vid;
+        uint16_t pid;
+        uint8_t klass;
+        uint8_t numIfaces;
+        bool complete; // every interface is in iface[], a driver that does not match can be skipped
+
+        struct {
+                uint8_t klass;
+                uint8_t subklass;
+                uint8_t proto;
+        } iface[USB_MATCH_MAX_INTERFACES];
+};
+
+struct UsbMatchIndex {
+        const UsbMatchEntry *pe;
+        uint8_t driver; // devConfig[] index
+        uint8_t prio; // 0 is tried first
+};
+
 class USBDeviceConfig {
 public:
         virtual uint8_t Init(uint8_t parent, uint8_t port, bool lowspeed) { return 0; }
@@ -122,8 +170,11 @@ public:
         virtual uint8_t Poll() { return 0; }
         virtual uint8_t GetAddress() { return 0; }
         virtual void ResetHubPort(uint8_t port) { return; } // Note used for hubs only!
+        virtual uint8_t ClearTTBuffer(uint8_t addr, uint8_t ep, uint8_t eptype) { return 0; } // Note used for hubs only!
         virtual uint8_t VIDPIDOK(uint16_t vid, uint16_t pid) { return false; }
         virtual uint8_t DEVCLASSOK(uint8_t klass) { return false; }
+        // Drivers returning a table are only attempted for devices matching it. Without one, they get probed.
+        virtual const UsbMatchEntry* GetMatchTable(uint8_t *count) { *count = 0; return NULL; }
 };
 
 /* USB Setup Packet Structure   */
@@ -165,30 +216,35 @@ class b {};
 typedef STM32F2<a, b> STM32F207;
 
 class USB : public STM32F207 {
-        AddressPoolImpl<USB_NUMDEVICES> addrPool;
+        AddressPoolImpl<USB_NUMADDRESSES> addrPool;
         USBDeviceConfig* devConfig[USB_NUMDEVICES];
         //uint8_t devConfigIndex;
-        uint8_t bmHubPre;
+        uint8_t usb_task_state; // USB_STATE_xxx, this bus only
+        uint8_t usb_error;
+        unsigned long qTaskDelay; // settle/reset delays of Task()
+        bool bResetInitiated; // a hub port is being reset, its device owns address 0
+        uint32_t toggleErrors; // transfers failed with a data toggle mismatch
+        DescriptorCache descrCache;
+        UsbMatchIndex matchIndex[USB_MATCH_INDEX_SIZE];
+        uint8_t matchIndexCount;
+        bool devIndexed[USB_NUMDEVICES];
 
 public:
-        USB(USB_OTG_CORE_HANDLE *pDev);
-
-        void SetHubPreMask() {
-                bmHubPre |= bmHUBPRE;
-        };
-
-        void ResetHubPreMask() {
-                bmHubPre &= (~bmHUBPRE);
-        };
+        USB(USB_OTG_CORE_HANDLE *pDev, USB_OTG_CORE_ID_TypeDef core = USB_HOST_CORE_ID);
 
         AddressPool& GetAddressPool() {
 			return(AddressPool&) addrPool;
         };
 
+        DescriptorCache& GetDescriptorCache() {
+                return descrCache;
+        };
+
         uint8_t RegisterDeviceClass(USBDeviceConfig *pdev) {
                 for(uint8_t i = 0; i < USB_NUMDEVICES; i++) {
 					if(!devConfig[i]) {
 						devConfig[i] = pdev;
+						IndexMatchTable(i);
 						return 0;
 					}
                 }
@@ -198,9 +254,51 @@ public:
         void ForEachUsbDevice(UsbDeviceHandleFunc pfunc) {
                 addrPool.ForEachUsbDevice(pfunc);
         };
+
+        // Host channel speed (HPRT0_PRTSPD_xxx) of an addressed device, for USBH_Open_Channel()
+        uint8_t GetHcSpeed(uint8_t addr) {
+                UsbDevice *p = addrPool.GetUsbDevicePtr(addr);
+
+                if (!p || p->speed == USB_SPEED_FULL)
+                        return bmFULLSPEED;
+                return (p->speed == USB_SPEED_LOW) ? bmLOWSPEED : bmHIGHSPEED;
+        };
+
+        // Interrupt endpoint bInterval in ms. High speed counts 2^(bInterval-1) microframes.
+        uint16_t GetPollInterval(uint8_t addr, uint8_t bInterval) {
+                UsbDevice *p = addrPool.GetUsbDevicePtr(addr);
+
+                if (!p || p->speed != USB_SPEED_HIGH)
+                        return bInterval;
+                if (bInterval < 4)
+                        return 1;
+                if (bInterval > 16)
+                        bInterval = 16;
+                return (1U << (bInterval - 1)) >> 3;
+        };
         uint8_t getUsbTaskState(void);
         void setUsbTaskState(uint8_t state);
 
+        // Hubs on this bus take turns with address 0
+        bool IsResetInitiated() {
+                return bResetInitiated;
+        };
+
+        void SetResetInitiated(bool state) {
+                bResetInitiated = state;
+        };
+
+        uint32_t GetToggleErrors() {
+                return toggleErrors;
+        };
+
+        // Error counters of an addressed device, NULL if there is none
+        UsbHealth* GetDeviceHealth(uint8_t addr) {
+                UsbDevice *p = addrPool.GetUsbDevicePtr(addr);
+
+                return (p) ? &p->health : NULL;
+        };
+
         EpInfo* getEpInfoEntry(uint8_t addr, uint8_t ep);
         uint8_t setEpInfoEntry(uint8_t addr, uint8_t epcount, EpInfo* eprecord_ptr);
 
@@ -221,12 +319,12 @@ public:
         USBH_Status USBH_InterruptReceiveData(uint8_t *buff, uint8_t length, uint8_t hc_num);
         uint8_t inTransfer(uint8_t addr, uint8_t ep, uint16_t *nbytesptr, uint8_t* data);
         uint8_t outTransfer(uint8_t addr, uint8_t ep, uint16_t nbytes, uint8_t* data);
-        uint8_t dispatchPkt(uint8_t token, uint8_t ep, uint16_t nak_limit, uint8_t * data_p, uint16_t nbytes, uint8_t hcnum);
+        uint8_t dispatchPkt(uint8_t token, uint8_t ep, uint16_t nak_limit, uint8_t * data_p, uint16_t nbytes, uint8_t hcnum) __RAMFUNC;
 
         void Task(USB_OTG_CORE_HANDLE *pdev);
 
         uint8_t DefaultAddressing(uint8_t parent, uint8_t port, bool lowspeed);
-        uint8_t Configuring(uint8_t parent, uint8_t port, bool lowspeed);
+        uint8_t Configuring(uint8_t parent, uint8_t port, bool lowspeed, bool highspeed = false);
         uint8_t ReleaseDevice(uint8_t addr);
 
         uint8_t ctrlReq(uint8_t addr, uint8_t ep, uint8_t bmReqType, uint8_t bRequest, uint8_t wValLo, uint8_t wValHi,
@@ -235,9 +333,18 @@ public:
 private:
         void init();
         uint8_t SetAddress(uint8_t addr, uint8_t ep, EpInfo **ppep, uint16_t &nak_limit);
+        void FindTransactionTranslator(UsbDevice *p, uint8_t parent, uint8_t port);
+        void SetHcSplit(uint8_t hcnum, UsbDevice *p);
+        void ClearTTBuffer(UsbDevice *p, uint8_t hcnum);
+        void ResetToggle(uint8_t addr, uint8_t ep);
+        void RecordHealth(uint8_t addr, uint8_t rcode);
         uint8_t OutTransfer(EpInfo *pep, uint16_t nak_limit, uint16_t nbytes, uint8_t *data);
         uint8_t InTransfer(EpInfo *pep, uint16_t nak_limit, uint16_t *nbytesptr, uint8_t *data);
         uint8_t AttemptConfig(uint8_t driver, uint8_t parent, uint8_t port, bool lowspeed);
+        void AttachDescriptorCache(USB_DEVICE_DESCRIPTOR *dd);
+        void IndexMatchTable(uint8_t driver);
+        void BuildMatchKey(USB_DEVICE_DESCRIPTOR *dd, UsbMatchKey *pk);
+        static bool MatchEntry(const UsbMatchEntry *pe, const UsbMatchKey *pk);
 };
 
 #if 0 //defined(USB_METHODS_INLINE)
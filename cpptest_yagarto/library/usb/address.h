@@ -19,6 +19,7 @@ e-mail   :  support@circuitsathome.com
 
 #include <inttypes.h>
 #include <stddef.h>
+#include "usbretry.h"
 //#include "max3421e.h"
 
 /* NAK powers. To save space in endpoint data structure, amount of retries before giving up and returning 0x4 is stored in */
@@ -30,7 +31,7 @@ e-mail   :  support@circuitsathome.com
 
 struct EpInfo {
         uint8_t epAddr; // Endpoint address
-        uint8_t maxPktSize; // Maximum packet size
+        uint16_t maxPktSize; // Maximum packet size, bits 0..10 of wMaxPacketSize
         union {
         	uint8_t hcNumber;	// Host Channel Number.
         	struct {
@@ -44,56 +45,51 @@ struct EpInfo {
                 struct {
                         uint8_t bmSndToggle : 1; // Send toggle, when zero bmSNDTOG0, bmSNDTOG1 otherwise
                         uint8_t bmRcvToggle : 1; // Send toggle, when zero bmRCVTOG0, bmRCVTOG1 otherwise
-                        uint8_t bmNakPower : 6; // Binary order for NAK_LIMIT value
+                        uint8_t bmNakPower : 4; // Binary order for NAK_LIMIT value
+                        uint8_t bmMult : 2; // Additional transactions per microframe, bits 11..12 of wMaxPacketSize
                 } __attribute__((packed));
         };
 } __attribute__((packed));
 
-//	  7   6   5   4   3   2   1   0
-//  ---------------------------------
-//  |   | H | P | P | P | A | A | A |
-//  ---------------------------------
-//
-// H - if 1 the address is a hub address
-// P - parent hub address
-// A - device address / port number in case of hub
-//
+#define USB_MAX_ADDRESS			127	// highest USB device address
+#define USB_MAX_TIER			6	// device tiers below the root hub, 5 hubs deep at most, per USB 2.0 section 4.1.1
 
-struct UsbDeviceAddress {
+/* Device speeds */
+#define USB_SPEED_FULL			0
+#define USB_SPEED_LOW			1
+#define USB_SPEED_HIGH			2
 
-        union {
-
-                struct {
-                        uint8_t bmAddress : 3; // device address/port number
-                        uint8_t bmParent : 3; // parent hub address
-                        uint8_t bmHub : 1; // hub flag
-                        uint8_t bmReserved : 1; // reserved, must be zerro
-                } __attribute__((packed));
-                uint8_t devAddress;
-        };
-} __attribute__((packed));
-
-#define bmUSB_DEV_ADDR_ADDRESS		0x07
-#define bmUSB_DEV_ADDR_PARENT		0x38
-#define bmUSB_DEV_ADDR_HUB		0x40
+// Device addresses are plain numbers 1..127. Where a device sits in the bus is kept
+// separately in its pool entry: parent hub address (0 for the root port), hub port, tier and speed.
 
 struct UsbDevice {
 	EpInfo *epinfo; // endpoint info pointer
 	uint8_t address; // address, should be the device address which was stored in HCCHARx. bit DAD
 	uint8_t epcount; // number of endpoints
 	bool lowspeed; // indicates if a device is the low speed one
+	uint8_t parent; // address of the hub the device is plugged in, 0 for the root port
+	uint8_t port; // port number on the parent hub, 0 for the root port
+	uint8_t tier; // 1 for the root port, one more for every hub in between
+	uint8_t speed; // USB_SPEED_xxx
+	bool hub; // device is a hub, its children go when it goes
+	uint8_t ttHub; // full/low speed device on a high speed bus: address of the high speed hub whose TT it is reached through, 0 otherwise
+	uint8_t ttPort; // port of that hub leading to the device
+	UsbHealth health; // error counters, see USB::GetDeviceHealth()
 
 } __attribute__((packed));
 
+typedef void (*UsbDeviceHandleFunc)(UsbDevice *pdev);
+
 class AddressPool {
 public:
         virtual UsbDevice* GetUsbDevicePtr(uint8_t addr) = 0;
         virtual uint8_t AllocAddress(uint8_t parent, bool is_hub = false, uint8_t port = 0) = 0;
         virtual void FreeAddress(uint8_t addr) = 0;
+        virtual uint8_t FindChildAddress(uint8_t parent, uint8_t port) = 0;
+        virtual void ForEachUsbDevice(UsbDeviceHandleFunc pfunc) = 0;
+        virtual uint8_t GetNumDevices() = 0;
 };
 
-typedef void (*UsbDeviceHandleFunc)(UsbDevice *pdev);
-
 #define ADDR_ERROR_INVALID_INDEX		0xFF
 #define ADDR_ERROR_INVALID_ADDRESS		0xFF
 
@@ -101,8 +97,10 @@ template <const uint8_t MAX_DEVICES_ALLOWED>
 class AddressPoolImpl : public AddressPool {
         EpInfo dev0ep; //Endpoint data structure used during enumeration for uninitialized device
 
-        uint8_t hubCounter; // hub counter is kept
-        // in order to avoid hub address duplication
+        uint8_t lastAddress; // allocation continues after the last address handed out,
+        // so that a stale address of an unplugged device is not reused right away
+
+        uint8_t addrIndex[USB_MAX_ADDRESS + 1]; // address -> thePool index, 0 if the address is free
 
         UsbDevice thePool[MAX_DEVICES_ALLOWED];
 
@@ -113,22 +111,33 @@ class AddressPoolImpl : public AddressPool {
                 thePool[index].epcount = 1;
                 thePool[index].lowspeed = 0;
                 thePool[index].epinfo = &dev0ep;
+                thePool[index].parent = 0;
+                thePool[index].port = 0;
+                thePool[index].tier = 0;
+                thePool[index].speed = USB_SPEED_FULL;
+                thePool[index].hub = false;
+                thePool[index].ttHub = 0;
+                thePool[index].ttPort = 0;
+                UsbHealthClear(&thePool[index].health);
         };
-        // Returns thePool index for a given address
+        // Returns first unused thePool index
 
-        uint8_t FindAddressIndex(uint8_t address = 0) {
+        uint8_t FindFreeIndex() {
 			for(uint8_t i = 1; i < MAX_DEVICES_ALLOWED; i++) {
-				if(thePool[i].address == address)
+				if(!thePool[i].address)
 					return i;
 			}
 			return 0;
         };
-        // Returns thePool child index for a given parent
+        // Returns first unused address after lastAddress
 
-        uint8_t FindChildIndex(UsbDeviceAddress addr, uint8_t start = 1) {
-                for(uint8_t i = (start < 1 || start >= MAX_DEVICES_ALLOWED) ? 1 : start; i < MAX_DEVICES_ALLOWED; i++) {
-                        if(((UsbDeviceAddress*) & thePool[i].address)->bmParent == addr.bmAddress)
-                                return i;
+        uint8_t FindFreeAddress() {
+                uint8_t addr = lastAddress;
+
+                for(uint8_t i = 0; i < USB_MAX_ADDRESS; i++) {
+                        addr = (addr >= USB_MAX_ADDRESS) ? 1 : addr + 1;
+                        if(!addrIndex[addr])
+                                return addr;
                 }
                 return 0;
         };
@@ -140,14 +149,12 @@ class AddressPoolImpl : public AddressPool {
 					return;
 
                 // If a hub was switched off all port addresses should be freed
-                if(((UsbDeviceAddress*) & thePool[index].address)->bmHub == 1) {
-                        for(uint8_t i = 1; (i = FindChildIndex(*((UsbDeviceAddress*) & thePool[index].address), i));)
-                                FreeAddressByIndex(i);
-
-                        // If the hub had the last allocated address, hubCounter should be decremented
-                        if(hubCounter == ((UsbDeviceAddress*) & thePool[index].address)->bmAddress)
-                                hubCounter--;
+                if(thePool[index].hub) {
+                        for(uint8_t i = 1; i < MAX_DEVICES_ALLOWED; i++)
+                                if(thePool[i].address && thePool[i].parent == thePool[index].address)
+                                        FreeAddressByIndex(i);
                 }
+                addrIndex[thePool[index].address] = 0;
                 InitEntry(index);
         }
         // Initializes the whole address pool at once
@@ -156,12 +163,15 @@ class AddressPoolImpl : public AddressPool {
                 for(uint8_t i = 1; i < MAX_DEVICES_ALLOWED; i++)
                         InitEntry(i);
 
-                hubCounter = 0;
+                for(uint8_t i = 0; i <= USB_MAX_ADDRESS; i++)
+                        addrIndex[i] = 0;
+
+                lastAddress = 0;
         };
 
 public:
 
-        AddressPoolImpl() : hubCounter(0) {
+        AddressPoolImpl() : lastAddress(0) {
                 // Zero address is reserved
                 InitEntry(0);
 
@@ -180,14 +190,17 @@ public:
 			if(!addr)
 				return thePool;
 
-			uint8_t index = FindAddressIndex(addr);
+			if(addr > USB_MAX_ADDRESS)
+				return NULL;
+
+			uint8_t index = addrIndex[addr];
 
 			return(!index) ? NULL : thePool + index;
         };
 
         // Performs an operation specified by pfunc for each addressed device
 
-        void ForEachUsbDevice(UsbDeviceHandleFunc pfunc) {
+        virtual void ForEachUsbDevice(UsbDeviceHandleFunc pfunc) {
                 if(!pfunc)
                         return;
 
@@ -196,83 +209,79 @@ public:
                                 pfunc(thePool + i);
         };
         // Allocates new address
+        // parent is the address of the hub the device is plugged in (0 for the root port), port its port number.
+        // Speed and transaction translator are taken over from address 0, where the device was enumerated.
 
         virtual uint8_t AllocAddress(uint8_t parent, bool is_hub = false, uint8_t port = 0) {
-                /* if (parent != 0 && port == 0)
-                        USB_HOST_SERIAL.println("PRT:0"); */
+                uint8_t tier = 1;
 
-                if(parent > 127 || port > 7)
+                if(parent > USB_MAX_ADDRESS)
 					return 0;
 
-                if(is_hub && hubCounter == 7)
-					return 0;
+                if(parent) {
+                        uint8_t pindex = addrIndex[parent];
+
+                        if(!pindex || !thePool[pindex].hub)
+                                return 0;
+
+                        tier = thePool[pindex].tier + 1;
+
+                        if(tier > USB_MAX_TIER)
+                                return 0;
+                }
 
                 // finds first empty address entry starting from one
-                uint8_t index = FindAddressIndex(0);
+                uint8_t index = FindFreeIndex();
 
                 if(!index) // if empty entry is not found
 					return 0;
 
-                if(parent == 0) {
-					if(is_hub) {
-						thePool[index].address = 0x41;
-						hubCounter++;
-					} else
-						thePool[index].address = 1;
+                uint8_t addr = FindFreeAddress();
 
-					return thePool[index].address;
-                }
+                if(!addr)
+                        return 0;
 
-                UsbDeviceAddress addr;
-                addr.devAddress = 0; // Ensure all bits are zero
+                InitEntry(index);
+                thePool[index].address = addr;
+                thePool[index].parent = parent;
+                thePool[index].port = port;
+                thePool[index].tier = tier;
+                thePool[index].speed = thePool[0].speed;
+                thePool[index].ttHub = thePool[0].ttHub;
+                thePool[index].ttPort = thePool[0].ttPort;
+                thePool[index].hub = is_hub;
+                addrIndex[addr] = index;
+                lastAddress = addr;
+
+                return addr;
+        };
+        // Empties pool entry, and those of everything behind it if it is a hub
 
-                addr.bmParent = ((UsbDeviceAddress*) & parent)->bmAddress;
+        virtual void FreeAddress(uint8_t addr) {
+                if(!addr || addr > USB_MAX_ADDRESS)
+                        return;
 
-                if(is_hub) {
-                        addr.bmHub = 1;
-                        addr.bmAddress = ++hubCounter;
-                } else {
-                        addr.bmHub = 0;
-                        addr.bmAddress = port;
-                }
-                thePool[index].address = *((uint8_t*) & addr);
-                /*
-                                USB_HOST_SERIAL.print("Addr:");
-                                USB_HOST_SERIAL.print(addr.bmHub, HEX);
-                                USB_HOST_SERIAL.print(".");
-                                USB_HOST_SERIAL.print(addr.bmParent, HEX);
-                                USB_HOST_SERIAL.print(".");
-                                USB_HOST_SERIAL.println(addr.bmAddress, HEX);
-                 */
-                return thePool[index].address;
+                FreeAddressByIndex(addrIndex[addr]);
         };
-        // Empties pool entry
+        // Returns the address of the device plugged in a hub port, 0 if there is none
 
-        virtual void FreeAddress(uint8_t addr) {
-                // if the root hub is disconnected all the addresses should be initialized
-                if(addr == 0x41) {
-					InitAllAddresses();
-					return;
-                }
-                uint8_t index = FindAddressIndex(addr);
-                FreeAddressByIndex(index);
+        virtual uint8_t FindChildAddress(uint8_t parent, uint8_t port) {
+                for(uint8_t i = 1; i < MAX_DEVICES_ALLOWED; i++)
+                        if(thePool[i].address && thePool[i].parent == parent && thePool[i].port == port)
+                                return thePool[i].address;
+                return 0;
+        };
+        // Returns number of addressed devices
+
+        virtual uint8_t GetNumDevices() {
+        	uint8_t counter = 0;
+
+        	for (uint8_t i = 1; i < MAX_DEVICES_ALLOWED; i++)
+        		if (thePool[i].address)
+        			counter++;
+
+        	return counter;
         };
-        // Returns number of hubs attached
-        // It can be rather helpfull to find out if there are hubs attached than getting the exact number of hubs.
-        //uint8_t GetNumHubs()
-        //{
-        //	return hubCounter;
-        //};
-        //uint8_t GetNumDevices()
-        //{
-        //	uint8_t counter = 0;
-
-        //	for (uint8_t i=1; i<MAX_DEVICES_ALLOWED; i++)
-        //		if (thePool[i].address != 0);
-        //			counter ++;
-
-        //	return counter;
-        //};
 };
 
 #endif // __ADDRESS_H__
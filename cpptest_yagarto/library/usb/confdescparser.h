@@ -18,6 +18,7 @@ e-mail   :  support@circuitsathome.com
 #define __CONFDESCPARSER_H__
 
 #include <inttypes.h>
+#include <string.h>
 
 //#include <avr/pgmspace.h>
 #include "message.h"
@@ -30,6 +31,9 @@ public:
         //virtual void ConfigXtract(const USB_CONFIGURATION_DESCRIPTOR *conf) = 0;
         //virtual void InterfaceXtract(uint8_t conf, const USB_INTERFACE_DESCRIPTOR *iface) = 0;
         virtual void EndpointXtract(uint8_t conf, uint8_t iface, uint8_t alt, uint8_t proto, const USB_ENDPOINT_DESCRIPTOR *ep) = 0;
+        // Class specific and other descriptors of a matching interface, in the order they come. ConfigDescWalker only.
+        virtual void DescriptorXtract(uint8_t conf, uint8_t iface, uint8_t alt, const uint8_t *desc) {
+        };
 };
 
 #define CP_MASK_COMPARE_CLASS			1
@@ -171,6 +175,151 @@ bool ConfigDescParser<CLASS_ID, SUBCLASS_ID, PROTOCOL_ID, MASK>::ParseDescriptor
         return true;
 }
 
+// Single pass configuration descriptor walker.
+// USB::getConfDescr() hands descriptors shorter than its buffer over in one piece. The walker casts typed
+// views straight onto the buffer (no copy) and calls EndpointXtract for every endpoint of a matching
+// interface. The class/subclass/protocol compare is resolved at compile time from the template arguments.
+// Longer descriptors arrive in pieces. Only a descriptor split between two pieces is copied, into
+// carry[]. One longer than carry[] is skipped, none of the standard ones are.
+
+#define CP_WALK_CARRY 16
+
+template <const uint8_t CLASS_ID, const uint8_t SUBCLASS_ID, const uint8_t PROTOCOL_ID, const uint8_t MASK>
+class ConfigDescWalker : public USBReadParser {
+        UsbConfigXtracter *theXtractor;
+        uint8_t carry[CP_WALK_CARRY]; // start of a descriptor the last piece cut off
+        uint8_t carryLen; // bytes of it in carry[]
+        uint8_t skipLen; // bytes of a descriptor too long for carry[] still to come
+        bool stopped; // a zero length descriptor, nothing after it can be trusted
+
+        bool isGoodInterface;
+        uint8_t confValue;
+        uint8_t ifaceNumber;
+        uint8_t ifaceAltSet;
+        uint8_t protoValue;
+        uint8_t numEP;
+
+        void Descriptor(const uint8_t *p);
+
+public:
+
+        ConfigDescWalker(UsbConfigXtracter *xtractor) : theXtractor(xtractor) {
+                Reset();
+        };
+
+        static bool Match(const USB_INTERFACE_DESCRIPTOR *pif) {
+                return (!(MASK & CP_MASK_COMPARE_CLASS) || pif->bInterfaceClass == CLASS_ID) &&
+                        (!(MASK & CP_MASK_COMPARE_SUBCLASS) || pif->bInterfaceSubClass == SUBCLASS_ID) &&
+                        (!(MASK & CP_MASK_COMPARE_PROTOCOL) || pif->bInterfaceProtocol == PROTOCOL_ID);
+        };
+
+        void Reset() {
+                carryLen = 0;
+                skipLen = 0;
+                stopped = false;
+                isGoodInterface = false;
+                confValue = 0;
+                ifaceNumber = 0;
+                ifaceAltSet = 0;
+                protoValue = 0;
+                numEP = 0;
+        };
+
+        uint8_t Walk(const uint8_t *pbuf, uint16_t len);
+
+        virtual void Parse(const uint16_t len, const uint8_t *pbuf, const uint16_t &offset) {
+                if (!offset)
+                        Reset();
+                Walk(pbuf, len);
+        };
+};
+
+template <const uint8_t CLASS_ID, const uint8_t SUBCLASS_ID, const uint8_t PROTOCOL_ID, const uint8_t MASK>
+void ConfigDescWalker<CLASS_ID, SUBCLASS_ID, PROTOCOL_ID, MASK>::Descriptor(const uint8_t *p) {
+        uint8_t dscrLen = p[0];
+
+        switch (p[1]) {
+                case USB_DESCRIPTOR_CONFIGURATION:
+                        if (dscrLen >= sizeof (USB_CONFIGURATION_DESCRIPTOR))
+                                confValue = ((const USB_CONFIGURATION_DESCRIPTOR*)p)->bConfigurationValue;
+                        break;
+                case USB_DESCRIPTOR_INTERFACE:
+                {
+                        const USB_INTERFACE_DESCRIPTOR *pif = (const USB_INTERFACE_DESCRIPTOR*)p;
+
+                        isGoodInterface = (dscrLen >= sizeof (USB_INTERFACE_DESCRIPTOR)) && Match(pif);
+                        if (isGoodInterface) {
+                                ifaceNumber = pif->bInterfaceNumber;
+                                ifaceAltSet = pif->bAlternateSetting;
+                                protoValue = pif->bInterfaceProtocol;
+                        }
+                        break;
+                }
+                case USB_DESCRIPTOR_ENDPOINT:
+                        if (isGoodInterface && theXtractor && dscrLen >= sizeof (USB_ENDPOINT_DESCRIPTOR)) {
+                                theXtractor->EndpointXtract(confValue, ifaceNumber, ifaceAltSet, protoValue, (const USB_ENDPOINT_DESCRIPTOR*)p);
+                                numEP++;
+                        }
+                        break;
+                default:
+                        if (isGoodInterface && theXtractor)
+                                theXtractor->DescriptorXtract(confValue, ifaceNumber, ifaceAltSet, p);
+                        break;
+        }
+}
+
+// Walks one piece, picking up where the last one ended. Returns the number of endpoints handed to the extractor so far.
+template <const uint8_t CLASS_ID, const uint8_t SUBCLASS_ID, const uint8_t PROTOCOL_ID, const uint8_t MASK>
+uint8_t ConfigDescWalker<CLASS_ID, SUBCLASS_ID, PROTOCOL_ID, MASK>::Walk(const uint8_t *pbuf, uint16_t len) {
+        const uint8_t *p = pbuf;
+        const uint8_t *end = pbuf + len;
+
+        if (stopped)
+                return numEP;
+        if (skipLen) {
+                uint8_t n = (skipLen < len) ? skipLen : len;
+
+                p += n;
+                skipLen -= n;
+        }
+        if (carryLen) {
+                // carry[0] is the length, 2..CP_WALK_CARRY
+                uint8_t n = carry[0] - carryLen;
+
+                if (n > end - p)
+                        n = end - p;
+                memcpy(carry + carryLen, p, n);
+                carryLen += n;
+                p += n;
+                if (carryLen < carry[0])
+                        return numEP;
+                Descriptor(carry);
+                carryLen = 0;
+        }
+
+        while (p < end) {
+                uint8_t dscrLen = p[0];
+
+                // Zero length would loop forever
+                if (dscrLen < 2) {
+                        stopped = true;
+                        break;
+                }
+                if (dscrLen > end - p) {
+                        // the rest comes with the next piece
+                        if (dscrLen <= CP_WALK_CARRY) {
+                                carryLen = end - p;
+                                memcpy(carry, p, carryLen);
+                        } else
+                                skipLen = dscrLen - (end - p);
+                        break;
+                }
+                Descriptor(p);
+                p += dscrLen;
+        }
+        return numEP;
+}
+
 template <const uint8_t CLASS_ID, const uint8_t SUBCLASS_ID, const uint8_t PROTOCOL_ID, const uint8_t MASK>
 void ConfigDescParser<CLASS_ID, SUBCLASS_ID, PROTOCOL_ID, MASK>::PrintHidDescriptor(const USB_HID_DESCRIPTOR *pDesc) {
         Notify(PSTR("\r\n\r\nHID Descriptor:\r\n"), 0x80);
@@ -0,0 +1,275 @@
+/*
+ * devcache.cpp
+ *
+ * Descriptor and capability cache, see devcache.h
+ */
+
+#include <string.h>
+#include "devcache.h"
+
+struct DescriptorCacheHeader {
+        uint32_t magic;
+        uint8_t version;
+        uint8_t count;
+        uint16_t entrySize;
+} __attribute__((packed));
+
+DescriptorCache::DescriptorCache() {
+        Clear();
+}
+
+/* FNV-1a, good enough to tell serial numbers apart */
+uint32_t DescriptorCache::Hash(const uint8_t *p, uint16_t len) {
+        uint32_t h = 2166136261UL;
+
+        while (len--) {
+                h ^= *p++;
+                h *= 16777619UL;
+        }
+        return h;
+}
+
+void DescriptorCache::Clear() {
+        memset(theCache, 0, sizeof (theCache));
+        memset(&stats, 0, sizeof (stats));
+
+        for (uint8_t i = 0; i < USB_DESCR_CACHE_ENTRIES; i++) {
+                theCache[i].bAddress = USB_DESCR_CACHE_UNBOUND;
+                theCache[i].bAge = 0xFF;
+        }
+}
+
+DescriptorCacheEntry* DescriptorCache::FindByKey(uint16_t vid, uint16_t pid, uint16_t bcd, uint32_t serial) {
+        for (uint8_t i = 0; i < USB_DESCR_CACHE_ENTRIES; i++) {
+                DescriptorCacheEntry *pe = &theCache[i];
+
+                if (!(pe->bmValid & bmDESCR_CACHE_DEV))
+                        continue;
+                if (pe->vid == vid && pe->pid == pid && pe->bcdDevice == bcd && pe->serial == serial)
+                        return pe;
+        }
+        return NULL;
+}
+
+/* An empty entry, otherwise the oldest one which is not in use */
+DescriptorCacheEntry* DescriptorCache::FindVictim() {
+        DescriptorCacheEntry *victim = NULL;
+
+        for (uint8_t i = 0; i < USB_DESCR_CACHE_ENTRIES; i++) {
+                DescriptorCacheEntry *pe = &theCache[i];
+
+                if (!pe->bmValid)
+                        return pe;
+                if (pe->bAddress != USB_DESCR_CACHE_UNBOUND)
+                        continue;
+                if (!victim || pe->bAge > victim->bAge)
+                        victim = pe;
+        }
+        return victim;
+}
+
+void DescriptorCache::Touch(DescriptorCacheEntry *pe) {
+        for (uint8_t i = 0; i < USB_DESCR_CACHE_ENTRIES; i++)
+                if (theCache[i].bAge < pe->bAge)
+                        theCache[i].bAge++;
+        pe->bAge = 0;
+}
+
+/* Called with the device descriptor of the device sitting at address 0. */
+/* Returns the entry bound to address 0, or NULL if the cache is full of devices in use. */
+DescriptorCacheEntry* DescriptorCache::Attach(const USB_DEVICE_DESCRIPTOR *dd, uint32_t serial) {
+        Unbind(0);
+
+        DescriptorCacheEntry *pe = FindByKey(dd->idVendor, dd->idProduct, dd->bcdDevice, serial);
+
+        if (pe && pe->bAddress != USB_DESCR_CACHE_UNBOUND)
+                // Same device twice (no serial number), don't share the entry
+                pe = NULL;
+
+        if (pe && !memcmp(&pe->devDescr, dd, sizeof (USB_DEVICE_DESCRIPTOR))) {
+                stats.hits++;
+        } else {
+                if (!pe)
+                        pe = FindVictim();
+                if (!pe)
+                        return NULL;
+
+                stats.misses++;
+                memset(pe, 0, sizeof (DescriptorCacheEntry));
+                pe->vid = dd->idVendor;
+                pe->pid = dd->idProduct;
+                pe->bcdDevice = dd->bcdDevice;
+                pe->serial = serial;
+                memcpy(&pe->devDescr, dd, sizeof (USB_DEVICE_DESCRIPTOR));
+                pe->bmValid = bmDESCR_CACHE_DEV;
+                pe->bAge = 0xFF;
+        }
+        pe->bAddress = 0;
+        Touch(pe);
+        return pe;
+}
+
+DescriptorCacheEntry* DescriptorCache::Find(uint8_t addr) {
+        if (addr == USB_DESCR_CACHE_UNBOUND)
+                return NULL;
+
+        for (uint8_t i = 0; i < USB_DESCR_CACHE_ENTRIES; i++)
+                if (theCache[i].bmValid && theCache[i].bAddress == addr)
+                        return &theCache[i];
+        return NULL;
+}
+
+/* Follows SET_ADDRESS, so that the entry is found by the new address */
+void DescriptorCache::Rebind(uint8_t oldaddr, uint8_t newaddr) {
+        DescriptorCacheEntry *pe = Find(oldaddr);
+
+        if (pe)
+                pe->bAddress = newaddr;
+}
+
+void DescriptorCache::Unbind(uint8_t addr) {
+        DescriptorCacheEntry *pe;
+
+        while ((pe = Find(addr)))
+                pe->bAddress = USB_DESCR_CACHE_UNBOUND;
+}
+
+void DescriptorCache::UnbindAll() {
+        for (uint8_t i = 0; i < USB_DESCR_CACHE_ENTRIES; i++)
+                theCache[i].bAddress = USB_DESCR_CACHE_UNBOUND;
+}
+
+bool DescriptorCache::GetDevDescr(uint8_t addr, uint16_t nbytes, uint8_t *dataptr) {
+        DescriptorCacheEntry *pe = Find(addr);
+
+        if (!pe || !(pe->bmValid & bmDESCR_CACHE_DEV))
+                return false;
+
+        if (nbytes > sizeof (USB_DEVICE_DESCRIPTOR))
+                nbytes = sizeof (USB_DEVICE_DESCRIPTOR);
+
+        memcpy(dataptr, &pe->devDescr, nbytes);
+        stats.served++;
+        return true;
+}
+
+bool DescriptorCache::GetConfDescr(uint8_t addr, uint8_t conf, uint16_t nbytes, uint8_t *dataptr) {
+        DescriptorCacheEntry *pe = Find(addr);
+
+        if (!pe || !(pe->bmValid & bmDESCR_CACHE_CONF) || pe->bConf != conf)
+                return false;
+
+        // Only what the device sent is cached, more has to come from the device
+        if (nbytes > pe->confLen)
+                return false;
+
+        memcpy(dataptr, pe->confDescr, nbytes);
+        stats.served++;
+        return true;
+}
+
+/* Only a complete configuration descriptor (wTotalLength bytes) is kept */
+void DescriptorCache::PutConfDescr(uint8_t addr, uint8_t conf, uint16_t nbytes, const uint8_t *dataptr) {
+        DescriptorCacheEntry *pe = Find(addr);
+
+        if (!pe || nbytes < sizeof (USB_CONFIGURATION_DESCRIPTOR))
+                return;
+
+        uint16_t total = ((USB_CONFIGURATION_DESCRIPTOR*)dataptr)->wTotalLength;
+
+        if (nbytes < total || total > USB_DESCR_CACHE_CONF_SIZE)
+                return;
+
+        memcpy(pe->confDescr, dataptr, total);
+        pe->confLen = total;
+        pe->bConf = conf;
+        pe->bmValid |= bmDESCR_CACHE_CONF;
+}
+
+bool DescriptorCache::GetClassDescr(uint8_t addr, uint8_t type, uint8_t nbytes, uint8_t *dataptr) {
+        DescriptorCacheEntry *pe = Find(addr);
+
+        if (!pe || !(pe->bmValid & bmDESCR_CACHE_CLASS) || pe->classType != type)
+                return false;
+
+        if (nbytes > pe->classLen)
+                return false;
+
+        memcpy(dataptr, pe->classDescr, nbytes);
+        stats.served++;
+        return true;
+}
+
+void DescriptorCache::PutClassDescr(uint8_t addr, uint8_t type, uint8_t nbytes, const uint8_t *dataptr) {
+        DescriptorCacheEntry *pe = Find(addr);
+
+        if (!pe || nbytes > USB_DESCR_CACHE_CLASS_SIZE)
+                return;
+
+        memcpy(pe->classDescr, dataptr, nbytes);
+        pe->classLen = nbytes;
+        pe->classType = type;
+        pe->bmValid |= bmDESCR_CACHE_CLASS;
+}
+
+/* Writes all known devices into buf. Returns the number of bytes used, 0 if buf is too small. */
+uint16_t DescriptorCache::Export(uint8_t *buf, uint16_t len) {
+        DescriptorCacheHeader *ph = (DescriptorCacheHeader*)buf;
+        uint8_t *p = buf + sizeof (DescriptorCacheHeader);
+
+        if (len < sizeof (DescriptorCacheHeader))
+                return 0;
+
+        ph->magic = USB_DESCR_CACHE_MAGIC;
+        ph->version = USB_DESCR_CACHE_VERSION;
+        ph->count = 0;
+        ph->entrySize = sizeof (DescriptorCacheEntry);
+
+        for (uint8_t i = 0; i < USB_DESCR_CACHE_ENTRIES; i++) {
+                if (!theCache[i].bmValid)
+                        continue;
+                if ((uint16_t)(p - buf) + sizeof (DescriptorCacheEntry) > len)
+                        return 0;
+
+                memcpy(p, &theCache[i], sizeof (DescriptorCacheEntry));
+                ((DescriptorCacheEntry*)p)->bAddress = USB_DESCR_CACHE_UNBOUND;
+                p += sizeof (DescriptorCacheEntry);
+                ph->count++;
+        }
+        return (uint16_t)(p - buf);
+}
+
+/* Merges a blob made by Export() into the cache. Returns 0 on success. */
+uint8_t DescriptorCache::Import(const uint8_t *buf, uint16_t len) {
+        const DescriptorCacheHeader *ph = (const DescriptorCacheHeader*)buf;
+        const uint8_t *p = buf + sizeof (DescriptorCacheHeader);
+
+        if (len < sizeof (DescriptorCacheHeader))
+                return 1;
+        if (ph->magic != USB_DESCR_CACHE_MAGIC || ph->version != USB_DESCR_CACHE_VERSION || ph->entrySize != sizeof (DescriptorCacheEntry))
+                return 1;
+        if (len < sizeof (DescriptorCacheHeader) + (uint32_t)ph->count * sizeof (DescriptorCacheEntry))
+                return 1;
+
+        for (uint8_t i = 0; i < ph->count; i++, p += sizeof (DescriptorCacheEntry)) {
+                const DescriptorCacheEntry *src = (const DescriptorCacheEntry*)p;
+
+                if (!(src->bmValid & bmDESCR_CACHE_DEV))
+                        continue;
+                // A corrupt blob must not make the Get*Descr copies run past the arrays
+                if (src->confLen > USB_DESCR_CACHE_CONF_SIZE || src->classLen > USB_DESCR_CACHE_CLASS_SIZE)
+                        continue;
+                if (FindByKey(src->vid, src->pid, src->bcdDevice, src->serial))
+                        continue;
+
+                DescriptorCacheEntry *pe = FindVictim();
+
+                if (!pe)
+                        break;
+
+                memcpy(pe, src, sizeof (DescriptorCacheEntry));
+                pe->bAddress = USB_DESCR_CACHE_UNBOUND;
+                pe->bAge = 0xFF;
+        }
+        return 0;
+}
@@ -0,0 +1,95 @@
+/*
+ * devcache.h
+ *
+ * Descriptor and capability cache. Devices that were enumerated before are
+ * recognized by VID/PID/bcdDevice/serial, and their device, configuration and
+ * class specific descriptors are served from RAM instead of the control pipe.
+ * The cache can be exported to a blob and imported again, so the application
+ * may keep it on a FAT volume or in internal flash.
+ */
+
+#if !defined(__DEVCACHE_H__)
+#define __DEVCACHE_H__
+
+#include <inttypes.h>
+#include <stddef.h>
+#include "usb_ch9.h"
+
+#ifndef USB_DESCR_CACHE_ENTRIES
+#define USB_DESCR_CACHE_ENTRIES		4	// number of devices remembered, 0 disables lookups
+#endif
+#ifndef USB_DESCR_CACHE_CONF_SIZE
+#define USB_DESCR_CACHE_CONF_SIZE	256	// largest configuration descriptor kept, same as getConfDescr() buffer
+#endif
+#ifndef USB_DESCR_CACHE_CLASS_SIZE
+#define USB_DESCR_CACHE_CLASS_SIZE	16	// class specific descriptor area (hub descriptor etc.)
+#endif
+#define USB_DESCR_CACHE_SERIAL_SIZE	64	// bytes of the serial number string used for the key
+
+#define USB_DESCR_CACHE_UNBOUND		0xFF	// entry is not bound to a device address
+
+#define USB_DESCR_CACHE_MAGIC		0x43445355UL	// "USDC"
+#define USB_DESCR_CACHE_VERSION		1
+
+#define bmDESCR_CACHE_DEV		0x01	// device descriptor is valid
+#define bmDESCR_CACHE_CONF		0x02	// configuration descriptor is valid
+#define bmDESCR_CACHE_CLASS		0x04	// class specific descriptor is valid
+
+struct DescriptorCacheEntry {
+        uint16_t vid; // key: idVendor
+        uint16_t pid; // key: idProduct
+        uint16_t bcdDevice; // key: device release number
+        uint32_t serial; // key: hash of the serial number string, 0 if none
+        uint8_t bmValid; // bmDESCR_CACHE_xxx
+        uint8_t bAddress; // address the entry is currently bound to
+        uint8_t bConf; // configuration index held in confDescr
+        uint8_t bAge; // LRU age, 0 is the most recently used
+        uint16_t confLen; // bytes valid in confDescr
+        uint8_t classType; // descriptor type held in classDescr
+        uint8_t classLen; // bytes valid in classDescr
+        USB_DEVICE_DESCRIPTOR devDescr;
+        uint8_t confDescr[USB_DESCR_CACHE_CONF_SIZE];
+        uint8_t classDescr[USB_DESCR_CACHE_CLASS_SIZE];
+} __attribute__((packed));
+
+struct DescriptorCacheStats {
+        uint16_t hits; // attaches of a known device
+        uint16_t misses; // attaches of a new device
+        uint16_t served; // control transfers answered from the cache
+} __attribute__((packed));
+
+class DescriptorCache {
+        DescriptorCacheEntry theCache[USB_DESCR_CACHE_ENTRIES];
+        DescriptorCacheStats stats;
+
+        DescriptorCacheEntry* FindByKey(uint16_t vid, uint16_t pid, uint16_t bcd, uint32_t serial);
+        DescriptorCacheEntry* FindVictim();
+        void Touch(DescriptorCacheEntry *pe);
+
+public:
+        DescriptorCache();
+
+        static uint32_t Hash(const uint8_t *p, uint16_t len);
+
+        void Clear();
+        DescriptorCacheEntry* Attach(const USB_DEVICE_DESCRIPTOR *dd, uint32_t serial);
+        DescriptorCacheEntry* Find(uint8_t addr);
+        void Rebind(uint8_t oldaddr, uint8_t newaddr);
+        void Unbind(uint8_t addr);
+        void UnbindAll();
+
+        bool GetDevDescr(uint8_t addr, uint16_t nbytes, uint8_t *dataptr);
+        bool GetConfDescr(uint8_t addr, uint8_t conf, uint16_t nbytes, uint8_t *dataptr);
+        void PutConfDescr(uint8_t addr, uint8_t conf, uint16_t nbytes, const uint8_t *dataptr);
+        bool GetClassDescr(uint8_t addr, uint8_t type, uint8_t nbytes, uint8_t *dataptr);
+        void PutClassDescr(uint8_t addr, uint8_t type, uint8_t nbytes, const uint8_t *dataptr);
+
+        uint16_t Export(uint8_t *buf, uint16_t len);
+        uint8_t Import(const uint8_t *buf, uint16_t len);
+
+        const DescriptorCacheStats& GetStats() {
+                return stats;
+        };
+};
+
+#endif // __DEVCACHE_H__
@@ -205,6 +205,15 @@ public:
                 return bAddress;
         };
 
+        virtual const UsbMatchEntry* GetMatchTable(uint8_t *count) {
+                static const UsbMatchEntry table[] = {
+                        { (BOOT_PROTOCOL & HID_PROTOCOL_KEYBOARD) ? USB_MATCH_IF_ALL : 0, 0, 0, USB_CLASS_HID, HID_BOOT_INTF_SUBCLASS, HID_PROTOCOL_KEYBOARD },
+                        { (BOOT_PROTOCOL & HID_PROTOCOL_MOUSE) ? USB_MATCH_IF_ALL : 0, 0, 0, USB_CLASS_HID, HID_BOOT_INTF_SUBCLASS, HID_PROTOCOL_MOUSE }
+                };
+                *count = sizeof (table) / sizeof (UsbMatchEntry);
+                return table;
+        };
+
         // UsbConfigXtracter implementation
         virtual void EndpointXtract(uint8_t conf, uint8_t iface, uint8_t alt, uint8_t proto, const USB_ENDPOINT_DESCRIPTOR *ep);
 };
@@ -349,7 +358,7 @@ uint8_t HIDBoot<BOOT_PROTOCOL>::Init(uint8_t parent, uint8_t port, bool lowspeed
         // GCC will optimize unused stuff away.
         if(BOOT_PROTOCOL & HID_PROTOCOL_KEYBOARD) {
                 for(uint8_t i = 0; i < num_of_conf; i++) {
-                        ConfigDescParser<
+                        ConfigDescWalker<
                                 USB_CLASS_HID,
                                 HID_BOOT_INTF_SUBCLASS,
                                 HID_PROTOCOL_KEYBOARD,
@@ -364,7 +373,7 @@ uint8_t HIDBoot<BOOT_PROTOCOL>::Init(uint8_t parent, uint8_t port, bool lowspeed
         // GCC will optimize unused stuff away.
         if(BOOT_PROTOCOL & HID_PROTOCOL_MOUSE) {
                 for(uint8_t i = 0; i < num_of_conf; i++) {
-                        ConfigDescParser<
+                        ConfigDescWalker<
                                 USB_CLASS_HID,
                                 HID_BOOT_INTF_SUBCLASS,
                                 HID_PROTOCOL_MOUSE,
@@ -422,7 +431,8 @@ uint8_t HIDBoot<BOOT_PROTOCOL>::Init(uint8_t parent, uint8_t port, bool lowspeed
 
         // Assign epInfo to epinfo pointer
         rcode = pUsb->setEpInfoEntry(bAddress, bNumEP, epInfo);
-        USB::USBH_Open_Channel(pUsb->coreConfig, hcnum, bAddress, (lowspeed)?bmLOWSPEED:bmFULLSPEED, EP_TYPE_INTR, epInfo[1].maxPktSize);
+        USB::USBH_Open_Channel(pUsb->coreConfig, hcnum, bAddress, pUsb->GetHcSpeed(bAddress), EP_TYPE_INTR,
+                epInfo[1].maxPktSize | ((uint16_t)epInfo[1].bmMult << 11));
         pUsb->coreConfig->host.hc[hcnum].toggle_in = 0x0;
 
         return 0;
@@ -485,9 +495,10 @@ void HIDBoot<BOOT_PROTOCOL>::EndpointXtract(uint8_t conf, uint8_t iface, uint8_t
 		// Fill in the endpoint info structure
 		//st bsp needs full address(0x81 for in channel)
 		epInfo[index].epAddr = pep->bEndpointAddress;	// (pep->bEndpointAddress & 0x0F);
-		epInfo[index].maxPktSize = (uint8_t) pep->wMaxPacketSize;
+		epInfo[index].maxPktSize = pep->wMaxPacketSize & 0x7FF;
 		epInfo[index].epAttribs = 0;
 		epInfo[index].bmNakPower = USB_NAK_NOWAIT;
+		epInfo[index].bmMult = (pep->wMaxPacketSize >> 11) & 0x3;
 
 		bNumEP++;
 	}
@@ -1,9 +1,47 @@
+#include <string.h>
 #include "masstorage.h"
 
 const uint8_t BulkOnly::epDataInIndex = 1;
 const uint8_t BulkOnly::epDataOutIndex = 2;
 const uint8_t BulkOnly::epInterruptInIndex = 3;
 
+// Devices known to need workarounds, the first match wins. Put your own in front with
+//      #define MASS_QUIRKS_USER { 0x1234, 0x5678, NULL, NULL, MASS_QUIRK_NO_LOCK, 0, 0 },
+static const MassQuirk MassQuirks[] = {
+#ifdef MASS_QUIRKS_USER
+        MASS_QUIRKS_USER
+#endif
+        // Genesys Logic USB 2.0 IDE adapters: wrong residue, slow, and trouble with large transfers
+        { 0x05e3, 0x0701, NULL, NULL, MASS_QUIRK_IGNORE_RESIDUE, 1, 32768UL },
+        { 0x05e3, 0x0702, NULL, NULL, MASS_QUIRK_IGNORE_RESIDUE, 1, 32768UL },
+};
+
+// Hands the data phases of a streaming read on to the caller's parser. Offsets
+// count from the start of the read. A retried command delivers again from its
+// start, what the parser already has is dropped here.
+class MassStream : public USBReadParser {
+public:
+        USBReadParser *prs;
+        uint32_t base; // stream offset of the current command's data
+        uint32_t pos; // bytes the parser has
+
+        MassStream(USBReadParser *p) : prs(p), base(0), pos(0) {
+        };
+
+        void Parse(const uint16_t len, const uint8_t *pbuf, const uint16_t &offset) {
+                uint32_t at = base + offset;
+                uint16_t skip;
+                uint16_t off;
+
+                if (at + len <= pos)
+                        return;
+                skip = (at < pos) ? pos - at : 0;
+                off = at + skip;
+                prs->Parse(len - skip, pbuf + skip, off);
+                pos = at + len;
+        };
+};
+
 ////////////////////////////////////////////////////////////////////////////////
 
 // Interface code
@@ -18,10 +56,22 @@ const uint8_t BulkOnly::epInterruptInIndex = 3;
  */
 uint32_t BulkOnly::GetCapacity(uint8_t lun) {
         if (LUNOk[lun])
-                return CurrentCapacity[lun];
+                return (CurrentCapacity[lun] > 0xffffffffLLU) ? 0xffffffffLU : (uint32_t)CurrentCapacity[lun];
         return 0LU;
 }
 
+/**
+ * Get the capacity of the media, beyond 32 bits
+ *
+ * @param lun Logical Unit Number
+ * @return media capacity
+ */
+uint64_t BulkOnly::GetCapacity64(uint8_t lun) {
+        if (LUNOk[lun])
+                return CurrentCapacity[lun];
+        return 0LLU;
+}
+
 /**
  * Get the sector (block) size used on the media
  *
@@ -34,6 +84,19 @@ uint16_t BulkOnly::GetSectorSize(uint8_t lun) {
         return 0U;
 }
 
+/**
+ * Get the physical block size of the media, the unit it is best written in.
+ * Only known if the LUN answered READ CAPACITY(16), else the sector size.
+ *
+ * @param lun Logical Unit Number
+ * @return media physical block size
+ */
+uint32_t BulkOnly::GetPhysicalSectorSize(uint8_t lun) {
+        if (LUNOk[lun])
+                return (uint32_t)CurrentSectorSize[lun] << CurrentPhysExp[lun];
+        return 0LU;
+}
+
 /**
  * Test if LUN is ready for use
  *
@@ -44,6 +107,18 @@ bool BulkOnly::LUNIsGood(uint8_t lun) {
         return LUNOk[lun];
 }
 
+/**
+ * Turn idle media polling of a LUN on or off. Without it, a LUN only learns
+ * about media changes from the results of reads and writes.
+ *
+ * @param lun Logical Unit Number
+ * @param enable true to poll, the default
+ */
+void BulkOnly::SetMediaPoll(uint8_t lun, bool enable) {
+        if (lun < MASS_MAX_SUPPORTED_LUN)
+                PollOk[lun] = enable;
+}
+
 /**
  * Test if LUN is write protected
  *
@@ -63,6 +138,7 @@ uint8_t BulkOnly::WriteProtected(uint8_t lun) {
  * @return
  */
 uint8_t BulkOnly::LockMedia(uint8_t lun, uint8_t lock) {
+        if (bQuirks & MASS_QUIRK_NO_LOCK) return MASS_ERR_SUCCESS;
         Notify(PSTR("\r\nLockMedia\r\n"), 0x80);
         Notify(PSTR("---------\r\n"), 0x80);
 
@@ -130,7 +206,7 @@ uint8_t BulkOnly::MediaCTL(uint8_t lun, uint8_t ctl) {
  * @param buf memory that is able to hold the requested data
  * @return 0 on success
  */
-uint8_t BulkOnly::Read(uint8_t lun, uint32_t addr, uint16_t bsize, uint8_t blocks, uint8_t *buf) {
+uint8_t BulkOnly::Read(uint8_t lun, uint64_t addr, uint16_t bsize, uint16_t blocks, uint8_t *buf) {
         if (!LUNOk[lun]) return MASS_ERR_NO_MEDIA;
         Notify(PSTR("\r\nRead LUN:\t"), 0x80);
         D_PrintHex<uint8_t > (lun, 0x90);
@@ -138,38 +214,37 @@ uint8_t BulkOnly::Read(uint8_t lun, uint32_t addr, uint16_t bsize, uint8_t block
         Notify(PSTR("\r\nLBA:\t\t"), 0x90);
         D_PrintHex<uint32_t > (addr, 0x90);
         Notify(PSTR("\r\nblocks:\t\t"), 0x90);
-        D_PrintHex<uint8_t > (blocks, 0x90);
+        D_PrintHex<uint16_t > (blocks, 0x90);
         Notify(PSTR("\r\nblock size:\t"), 0x90);
         D_PrintHex<uint16_t > (bsize, 0x90);
         Notify(PSTR("\r\n---------\r\n"), 0x80);
-        CommandBlockWrapper cbw;
-
-again:
-        cbw.dCBWSignature = MASS_CBW_SIGNATURE;
-        cbw.dCBWDataTransferLength = ((uint32_t)bsize * blocks);
-        cbw.bmCBWFlags = MASS_CMD_DIR_IN;
-        cbw.bmCBWLUN = lun;
-        cbw.bmCBWCBLength = 10;
-
-        for (uint8_t i = 0; i < 16; i++)
-                cbw.CBWCB[i] = 0;
+        return ReadWrite(lun, addr, bsize, blocks, buf, false);
+}
 
-        cbw.CBWCB[0] = SCSI_CMD_READ_10;
-        cbw.CBWCB[1] = lun << 5;
-        cbw.CBWCB[2] = ((addr >> 24) & 0xff);
-        cbw.CBWCB[3] = ((addr >> 16) & 0xff);
-        cbw.CBWCB[4] = ((addr >> 8) & 0xff);
-        cbw.CBWCB[5] = (addr & 0xff);
-        cbw.CBWCB[8] = blocks;
-        cbw.dCBWTag = ++dCBWTag;
-        SetCurLUN(lun);
-        uint8_t er = HandleSCSIError(Transaction(&cbw, bsize, buf, 0));
-        if (er == MASS_ERR_STALL) {
-                MediaCTL(lun, 1);
-                delay(150);
-                if (!TestUnitReady(lun)) goto again;
-        }
-        return er;
+/**
+ * Read data from media without storing it. Each piece of a data phase goes
+ * to the parser straight from the buffer the host channel received it in,
+ * MASS_CALLBACK_CHUNK bytes at most. Only that buffer is needed, however
+ * much is read.
+ *
+ * @param lun Logical Unit Number
+ * @param addr LBA address on media to read
+ * @param bsize size of a block
+ * @param blocks how many blocks to read
+ * @param prs gets the data in order, each byte once, offsets modulo 64K
+ * @return 0 on success
+ */
+uint8_t BulkOnly::Read(uint8_t lun, uint64_t addr, uint16_t bsize, uint16_t blocks, USBReadParser * prs) {
+        if (!LUNOk[lun]) return MASS_ERR_NO_MEDIA;
+        Notify(PSTR("\r\nRead (With parser) LUN:\t"), 0x80);
+        D_PrintHex<uint8_t > (lun, 0x90);
+        Notify(PSTR("\r\nLBA:\t\t"), 0x90);
+        D_PrintHex<uint32_t > (addr, 0x90);
+        Notify(PSTR("\r\nblocks:\t\t"), 0x90);
+        D_PrintHex<uint16_t > (blocks, 0x90);
+        Notify(PSTR("\r\n---------\r\n"), 0x80);
+        MassStream stream(prs);
+        return ReadWrite(lun, addr, bsize, blocks, NULL, false, &stream);
 }
 
 /**
@@ -182,7 +257,7 @@ again:
  * @param buf memory that contains the data to write
  * @return 0 on success
  */
-uint8_t BulkOnly::Write(uint8_t lun, uint32_t addr, uint16_t bsize, uint8_t blocks, const uint8_t * buf) {
+uint8_t BulkOnly::Write(uint8_t lun, uint64_t addr, uint16_t bsize, uint16_t blocks, const uint8_t * buf) {
         if (!LUNOk[lun]) return MASS_ERR_NO_MEDIA;
         if (!WriteOk[lun]) return MASS_ERR_WRITE_PROTECTED;
         Notify(PSTR("\r\nWrite LUN:\t"), 0x80);
@@ -191,39 +266,61 @@ uint8_t BulkOnly::Write(uint8_t lun, uint32_t addr, uint16_t bsize, uint8_t bloc
         Notify(PSTR("\r\nLBA:\t\t"), 0x90);
         D_PrintHex<uint32_t > (addr, 0x90);
         Notify(PSTR("\r\nblocks:\t\t"), 0x90);
-        D_PrintHex<uint8_t > (blocks, 0x90);
+        D_PrintHex<uint16_t > (blocks, 0x90);
         Notify(PSTR("\r\nblock size:\t"), 0x90);
         D_PrintHex<uint16_t > (bsize, 0x90);
         Notify(PSTR("\r\n---------\r\n"), 0x80);
         //MediaCTL(lun, 0x01);
-        CommandBlockWrapper cbw;
-
-again:
-        cbw.dCBWSignature = MASS_CBW_SIGNATURE;
-        cbw.dCBWTag = ++dCBWTag;
-        cbw.dCBWDataTransferLength = ((uint32_t)bsize * blocks);
-        cbw.bmCBWFlags = MASS_CMD_DIR_OUT;
-        cbw.bmCBWLUN = lun;
-        cbw.bmCBWCBLength = 10;
-
-        for (uint8_t i = 0; i < 16; i++)
-                cbw.CBWCB[i] = 0;
-
-        cbw.CBWCB[0] = SCSI_CMD_WRITE_10;
-        cbw.CBWCB[1] = lun << 5;
-        cbw.CBWCB[2] = ((addr >> 24) & 0xff);
-        cbw.CBWCB[3] = ((addr >> 16) & 0xff);
-        cbw.CBWCB[4] = ((addr >> 8) & 0xff);
-        cbw.CBWCB[5] = (addr & 0xff);
-        cbw.CBWCB[8] = 1;
+        return ReadWrite(lun, addr, bsize, blocks, (uint8_t*)buf, true);
+}
 
+/**
+ * Starts a READ/WRITE and returns once the device has the command. The device
+ * seeks, reads ahead or takes the write while the host talks to other devices.
+ * Finish() has to come before anything else is sent to this device.
+ *
+ * @param lun Logical Unit Number
+ * @param addr LBA address on media
+ * @param bsize size of a block
+ * @param blocks how many blocks, GetMaxTransfer() bytes at most
+ * @param buf data, it has to stay around until Finish()
+ * @param write true for WRITE
+ * @return 0 on success, MASS_ERR_UNIT_BUSY if a command is already pending
+ */
+uint8_t BulkOnly::Submit(uint8_t lun, uint64_t addr, uint16_t bsize, uint16_t blocks, uint8_t *buf, bool write) {
+        if (bPending) return MASS_ERR_UNIT_BUSY;
+        if (!LUNOk[lun]) return MASS_ERR_NO_MEDIA;
+        if (write && !WriteOk[lun]) return MASS_ERR_WRITE_PROTECTED;
+        if (!blocks || (uint32_t)bsize * blocks > dMaxTransfer) return MASS_ERR_BAD_LBA;
+        BuildReadWrite(&pendCBW, lun, addr, bsize, blocks, write);
         SetCurLUN(lun);
-        uint8_t er = HandleSCSIError(Transaction(&cbw, bsize, (void*)buf, 0));
-        if (er == MASS_ERR_WRITE_STALL) {
-                MediaCTL(lun, 1);
-                delay(150);
-                if (!TestUnitReady(lun)) goto again;
-        }
+        pendBuf = buf;
+        pendAddr = addr;
+        bPendResult = CommandStage(&pendCBW);
+        bPending = true;
+        return MASS_ERR_SUCCESS;
+}
+
+/**
+ * Moves the data of the command from Submit() and waits for its status.
+ * A stall is retried the way Read()/Write() do it.
+ *
+ * @return 0 on success
+ */
+uint8_t BulkOnly::Finish() {
+        bool write = (pendCBW.bmCBWFlags & MASS_CMD_DIR_IN) != MASS_CMD_DIR_IN;
+        uint16_t bsize;
+        uint8_t er;
+
+        if (!bPending) return MASS_ERR_SUCCESS;
+        er = HandleSCSIError(DataStatusStage(&pendCBW, pendCBW.dCBWDataTransferLength, pendBuf, 0, bPendResult));
+        bPending = false;
+        if (er == ((write) ? MASS_ERR_WRITE_STALL : MASS_ERR_STALL)) {
+                bsize = CurrentSectorSize[pendCBW.bmCBWLUN];
+                if (bsize)
+                        er = ReadWrite(pendCBW.bmCBWLUN, pendAddr, bsize, pendCBW.dCBWDataTransferLength / bsize, pendBuf, write);
+        } else
+                NoteMedia(pendCBW.bmCBWLUN, er);
         return er;
 }
 
@@ -242,9 +339,12 @@ bAddress(0),
 bIface(0),
 bNumEP(1),
 qNextPollTime(0),
+qLastIOTime(0),
+wPollInterval(MASS_POLL_MIN),
 bPollEnable(false),
 dCBWTag(0),
-bLastUsbError(0) {
+bLastUsbError(0),
+bPending(false) {
         ClearAllEP();
         dCBWTag = 0;
         if (pUsb)
@@ -326,6 +426,8 @@ uint8_t BulkOnly::ConfigureDevice(uint8_t parent, uint8_t port, bool lowspeed) {
 
 	// Extract Max Packet Size from the device descriptor
 	epInfo[0].maxPktSize = (uint8_t)((USB_DEVICE_DESCRIPTOR*)buf)->bMaxPacketSize0;
+	wVID = ((USB_DEVICE_DESCRIPTOR*)buf)->idVendor;
+	wPID = ((USB_DEVICE_DESCRIPTOR*)buf)->idProduct;
 	// Steal and abuse from epInfo structure to save on memory.
 	epInfo[1].epAddr = ((USB_DEVICE_DESCRIPTOR*)buf)->bNumConfigurations;
 	// </TECHNICAL>
@@ -391,7 +493,7 @@ uint8_t BulkOnly::Init(uint8_t parent, uint8_t port, bool lowspeed) {
                 goto FailSetDevTblEntry;
 
         for (uint8_t i = 0; i < num_of_conf; i++) {
-                ConfigDescParser< USB_CLASS_MASS_STORAGE,
+                ConfigDescWalker< USB_CLASS_MASS_STORAGE,
                         MASS_SUBCLASS_SCSI,
                         MASS_PROTO_BBB,
                         CP_MASK_COMPARE_CLASS |
@@ -446,19 +548,23 @@ uint8_t BulkOnly::Init(uint8_t parent, uint8_t port, bool lowspeed) {
 			goto FailSetDevTblEntry;
 
         USB::USBH_Open_Channel(pUsb->coreConfig, epInfo[1].hcNumIn, bAddress,
-        		(lowspeed)?bmLOWSPEED:bmFULLSPEED, EP_TYPE_BULK, epInfo[1].maxPktSize);
+        		pUsb->GetHcSpeed(bAddress), EP_TYPE_BULK, epInfo[1].maxPktSize);
         USB::USBH_Open_Channel(pUsb->coreConfig, epInfo[2].hcNumOut, bAddress,
-        		(lowspeed)?bmLOWSPEED:bmFULLSPEED, EP_TYPE_BULK, epInfo[2].maxPktSize);
+        		pUsb->GetHcSpeed(bAddress), EP_TYPE_BULK, epInfo[2].maxPktSize);
 
         printf("\nMSC Pipe EP1 in = %x, addr = 0x%x(0x81)", epInfo[1].hcNumIn, epInfo[1].epAddr);
         printf("\nMSC Pipe EP2 out = %x, addr = 0x%x(0x2)", epInfo[2].hcNumOut, epInfo[2].epAddr);
 
+        ApplyQuirks(NULL);
         for (uint8_t lun = 0; lun <= bMaxLUN; lun++) {
                 InquiryResponse response;
                 rcode = Inquiry(lun, sizeof (InquiryResponse), (uint8_t*) & response);
                 if (rcode) {
                         ErrorMessage<uint8_t > (PSTR("Inquiry"), rcode);
                 } else {
+                        if (!lun)
+                                ApplyQuirks(&response);
+                        SCSIVersion[lun] = response.Version;
                         uint8_t tries = 0xf0;
                         while (rcode = TestUnitReady(lun)) {
 							if (rcode == 0x08) break; // break on no media, this is OK to do.
@@ -582,7 +688,7 @@ void BulkOnly::EndpointXtract(uint8_t conf, uint8_t iface, uint8_t alt, uint8_t
         // Fill in the endpoint info structure
 		//st bsp needs full address(0x81 for in channel)
         epInfo[index].epAddr = pep->bEndpointAddress;	//(pep->bEndpointAddress & 0x0F);
-        epInfo[index].maxPktSize = (uint8_t)pep->wMaxPacketSize;
+        epInfo[index].maxPktSize = pep->wMaxPacketSize & 0x7FF;
         epInfo[index].epAttribs = 0;
 
         bNumEP++;
@@ -605,6 +711,7 @@ uint8_t BulkOnly::Release() {
 		USB::USBH_Free_Channel(pUsb->coreConfig, epInfo[2].hcNumOut);
 	}
 	ClearAllEP();
+	bPending = false;
 	pUsb->GetAddressPool().FreeAddress(bAddress);
 	return 0;
 }
@@ -629,15 +736,34 @@ uint8_t BulkOnly::CheckLUN(uint8_t lun) {
         for (uint8_t i = 0; i<sizeof (Capacity); i++)
                 D_PrintHex<uint8_t > (capacity.data[i], 0x80);
         Notify(PSTR("\r\n\r\n"), 0x80);
-        // Only 512/1024/2048/4096 are valid values!
         uint32_t c = ((uint32_t)capacity.data[4] << 24) + ((uint32_t)capacity.data[5] << 16) + ((uint32_t)capacity.data[6] << 8) + (uint32_t)capacity.data[7];
+        uint64_t last = ((uint32_t)capacity.data[0] << 24) + ((uint32_t)capacity.data[1] << 16) + ((uint32_t)capacity.data[2] << 8) + (uint32_t)capacity.data[3];
+
+        CurrentPhysExp[lun] = 0;
+        // More than 2^32 blocks reads as 0xffffffff, only READ CAPACITY(16) has the real size.
+        // It also tells the physical block size, 4K behind 512 byte logical blocks.
+        if (last == 0xffffffffLLU || (MASS_RC16_SPC3 && !(bQuirks & MASS_QUIRK_NO_RC16) && SCSIVersion[lun] >= 5)) {
+                Capacity16 capacity16;
+                for (uint8_t i = 0; i<sizeof (Capacity16); i++) capacity16.data[i] = 0;
+
+                rcode = ReadCapacity16(lun, sizeof (Capacity16), (uint8_t*) & capacity16);
+                if (!rcode) {
+                        last = 0;
+                        for (uint8_t i = 0; i < 8; i++)
+                                last = (last << 8) | capacity16.data[i];
+                        c = ((uint32_t)capacity16.data[8] << 24) + ((uint32_t)capacity16.data[9] << 16) + ((uint32_t)capacity16.data[10] << 8) + (uint32_t)capacity16.data[11];
+                        CurrentPhysExp[lun] = capacity16.data[13] & 0x0f;
+                } else
+                        ErrorMessage<uint8_t > (PSTR(">>>>>>>>>>>>>>>>READ CAPACITY(16) FAIL ON LUN"), lun);
+        }
+        // Only 512/1024/2048/4096 are valid values!
         if (c != 0x0200LU && c != 0x0400LU && c != 0x0800LU && c != 0x1000LU) {
                 return false;
         }
         // Store capacity information.
         CurrentSectorSize[lun] = (uint16_t)(c & 0xFFFF);
-        CurrentCapacity[lun] = ((uint32_t)capacity.data[0] << 24) + ((uint32_t)capacity.data[1] << 16) + ((uint32_t)capacity.data[2] << 8) + (uint32_t)capacity.data[3];
-        if (CurrentCapacity[lun] == 0xffffffffLU || CurrentCapacity[lun] == 0x00LU) {
+        CurrentCapacity[lun] = last;
+        if (CurrentCapacity[lun] == 0xffffffffLLU || CurrentCapacity[lun] == 0x00LLU) {
                 // Buggy firmware will report 0xffffffff or 0 for no media
                 if (CurrentCapacity[lun])
                         ErrorMessage<uint8_t > (PSTR(">>>>>>>>>>>>>>>>BUGGY FIRMWARE. CAPACITY FAIL ON LUN"), lun);
@@ -649,19 +775,56 @@ uint8_t BulkOnly::CheckLUN(uint8_t lun) {
         return false;
 }
 
+/**
+ * For driver use only.
+ *
+ * Looks the device up in MassQuirks[]. Entries with INQUIRY strings only
+ * match once the INQUIRY data is there.
+ *
+ * @param inq INQUIRY data of LUN 0, NULL to match on VID/PID alone
+ */
+void BulkOnly::ApplyQuirks(const InquiryResponse *inq) {
+        bQuirks = 0;
+        bCmdDelay = 0;
+        dMaxTransfer = MASS_MAX_TRANSFER_LENGTH;
+        for (uint8_t i = 0; i < sizeof (MassQuirks) / sizeof (MassQuirk); i++) {
+                const MassQuirk *q = &MassQuirks[i];
+
+                if ((q->idVendor && q->idVendor != wVID) || (q->idProduct && q->idProduct != wPID))
+                        continue;
+                if ((q->vendor || q->product) && !inq)
+                        continue;
+                if (q->vendor && strncmp(q->vendor, (const char *)inq->VendorID, strlen(q->vendor)))
+                        continue;
+                if (q->product && strncmp(q->product, (const char *)inq->ProductID, strlen(q->product)))
+                        continue;
+                bQuirks = q->flags;
+                bCmdDelay = q->cmdDelay;
+                if (q->maxTransfer && q->maxTransfer < MASS_MAX_TRANSFER_LENGTH)
+                        dMaxTransfer = q->maxTransfer;
+                ErrorMessage<uint8_t > (PSTR("Quirks"), bQuirks);
+                break;
+        }
+}
+
 /**
  * For driver use only.
  *
  * Scan for media change on all LUNs
  */
 void BulkOnly::CheckMedia() {
+        bool changed = false;
+
         for (uint8_t lun = 0; lun <= bMaxLUN; lun++) {
-                if (TestUnitReady(lun)) {
-                        LUNOk[lun] = false;
+                bool was = LUNOk[lun];
+
+                if (!PollOk[lun])
                         continue;
-                }
-                if (!LUNOk[lun])
+                if (TestUnitReady(lun))
+                        LUNOk[lun] = false;
+                else if (!LUNOk[lun])
                         LUNOk[lun] = CheckLUN(lun);
+                changed |= (LUNOk[lun] != was);
         }
 #if 0
         printf("}}}}}}}}}}}}}}}}STATUS ");
@@ -672,7 +835,36 @@ void BulkOnly::CheckMedia() {
         }
         printf("\r\n");
 #endif
-        qNextPollTime = millis() + 2000;
+        // back off while nothing happens
+        if (changed)
+                wPollInterval = MASS_POLL_MIN;
+        else if (wPollInterval < MASS_POLL_MAX)
+                wPollInterval = (wPollInterval > MASS_POLL_MAX / 2) ? MASS_POLL_MAX : wPollInterval * 2;
+        qNextPollTime = millis() + wPollInterval;
+}
+
+/**
+ * For driver use only.
+ *
+ * Media state from the result of a read or write, so the device needs no
+ * polling while it is busy.
+ *
+ * @param lun Logical Unit Number
+ * @param er result
+ */
+void BulkOnly::NoteMedia(uint8_t lun, uint8_t er) {
+        switch (er) {
+                case MASS_ERR_SUCCESS:
+                        qLastIOTime = millis();
+                        break;
+                case MASS_ERR_NO_MEDIA:
+                case MASS_ERR_MEDIA_CHANGED:
+                        // gone, or a new one that needs CheckLUN() before use
+                        LUNOk[lun] = false;
+                        wPollInterval = MASS_POLL_MIN;
+                        qNextPollTime = millis() + MASS_POLL_MIN;
+                        break;
+        }
 }
 
 /**
@@ -683,11 +875,15 @@ void BulkOnly::CheckMedia() {
 uint8_t BulkOnly::Poll() {
         //uint8_t rcode = 0;
 
-        if (!bPollEnable)
+        if (!bPollEnable || bPending)
 			return 0;
 
         if (qNextPollTime <= millis()) {
-                CheckMedia();
+                // busy, reads and writes tell about the media
+                if (millis() - qLastIOTime < MASS_POLL_IDLE)
+                        qNextPollTime = qLastIOTime + MASS_POLL_IDLE;
+                else
+                        CheckMedia();
         }
         //rcode = 0;
 
@@ -851,6 +1047,38 @@ uint8_t BulkOnly::ReadCapacity(uint8_t lun, uint16_t bsize, uint8_t *buf) {
         return HandleSCSIError(Transaction(&cbw, bsize, buf, 0));
 }
 
+/**
+ * For driver use only.
+ *
+ * @param lun Logical Unit Number
+ * @param bsize
+ * @param buf
+ * @return
+ */
+uint8_t BulkOnly::ReadCapacity16(uint8_t lun, uint16_t bsize, uint8_t *buf) {
+        Notify(PSTR("\r\nReadCapacity16\r\n"), 0x80);
+        Notify(PSTR("---------------\r\n"), 0x80);
+        CommandBlockWrapper cbw;
+
+        SetCurLUN(lun);
+        cbw.dCBWSignature = MASS_CBW_SIGNATURE;
+        cbw.dCBWTag = ++dCBWTag;
+        cbw.dCBWDataTransferLength = bsize;
+        cbw.bmCBWFlags = MASS_CMD_DIR_IN;
+        cbw.bmCBWLUN = lun;
+        cbw.bmCBWCBLength = 16;
+
+        for (uint8_t i = 0; i < 16; i++)
+                cbw.CBWCB[i] = 0;
+
+        cbw.CBWCB[0] = SCSI_CMD_SERVICE_ACTION_IN_16;
+        cbw.CBWCB[1] = SCSI_SA_READ_CAPACITY_16;
+        cbw.CBWCB[12] = ((bsize >> 8) & 0xff);
+        cbw.CBWCB[13] = (bsize & 0xff);
+
+        return HandleSCSIError(Transaction(&cbw, bsize, buf, 0));
+}
+
 /**
  * For driver use only.
  *
@@ -898,6 +1126,8 @@ uint8_t BulkOnly::Page3F(uint8_t lun) {
                 buf[i] = 0x00;
         }
         WriteOk[lun] = true;
+        if (bQuirks & MASS_QUIRK_NO_MODE_SENSE)
+                return 0;
         uint8_t rc = ModeSense(lun, 0, 0x3f, 0, 192, buf);
         if (!rc) {
                 WriteOk[lun] = ((buf[2] & 0x80) == 0);
@@ -942,13 +1172,7 @@ uint8_t BulkOnly::ClearEpHalt(uint8_t index) {
                 ErrorMessage<uint8_t > (PSTR("EP"), ((index == epDataInIndex) ? (0x80 | epInfo[index].epAddr) : epInfo[index].epAddr));
                 return ret;
         }
-        epInfo[index].bmSndToggle = 0;
-        epInfo[index].bmRcvToggle = 0;
-
-        USB_OTG_CORE_HANDLE *pdev = pUsb->coreConfig;
-        pdev->host.hc[epInfo[index].hcNumIn].toggle_in = 0;
-        pdev->host.hc[epInfo[index].hcNumOut].toggle_out = 0;
-        // epAttribs = 0;
+        // ctrlReq() put the endpoint's toggle back to DATA0
         return 0;
 }
 
@@ -966,6 +1190,8 @@ void BulkOnly::Reset() {
  * @return 0 if successful
  */
 uint8_t BulkOnly::ResetRecovery() {
+        USB_FAULT_PROBE(USB_FAULT_PROBE_RESET_RECOVERY);
+
         Notify(PSTR("\r\nResetRecovery\r\n"), 0x80);
         Notify(PSTR("-----------------\r\n"), 0x80);
 //todo: need recover HC also
@@ -993,17 +1219,28 @@ void BulkOnly::ClearAllEP() {
                 epInfo[i].hcNumber = 0;
         }
 
+        wVID = 0;
+        wPID = 0;
+        bQuirks = 0;
+        bCmdDelay = 0;
+        dMaxTransfer = MASS_MAX_TRANSFER_LENGTH;
         for (uint8_t i = 0; i < MASS_MAX_SUPPORTED_LUN; i++) {
                 LUNOk[i] = false;
                 WriteOk[i] = false;
-                CurrentCapacity[i] = 0lu;
+                PollOk[i] = true;
+                memset(&LUNStats[i], 0, sizeof (MassLUNStats));
+                CurrentCapacity[i] = 0llu;
                 CurrentSectorSize[i] = 0;
+                CurrentPhysExp[i] = 0;
+                SCSIVersion[i] = 0;
         }
         bIface = 0;
         bNumEP = 1;
 
         bAddress = 0;
         qNextPollTime = 0;
+        qLastIOTime = 0;
+        wPollInterval = MASS_POLL_MIN;
         bPollEnable = false;
         bLastUsbError = 0;
         bMaxLUN = 0;
@@ -1028,6 +1265,13 @@ bool BulkOnly::IsValidCSW(CommandStatusWrapper *pcsw, CommandBlockWrapperBase *p
                 //printf("%lx != %lx\r\n", pcsw->dCSWTag, pcbw->dCBWTag);
                 return false;
         }
+        // Known garbage is dropped, more than was asked for is clamped like Linux does
+        if (bQuirks & MASS_QUIRK_IGNORE_RESIDUE)
+                pcsw->dCSWDataResidue = 0;
+        else if (pcsw->dCSWDataResidue > pcbw->dCBWDataTransferLength) {
+                Notify(PSTR("CSW:Residue clamped\r\n"), 0x80);
+                pcsw->dCSWDataResidue = pcbw->dCBWDataTransferLength;
+        }
         return true;
 }
 
@@ -1039,6 +1283,7 @@ bool BulkOnly::IsValidCSW(CommandStatusWrapper *pcsw, CommandBlockWrapperBase *p
  * @return
  */
 uint8_t BulkOnly::HandleUsbError(uint8_t error, uint8_t index) {
+        USB_FAULT_PROBE(USB_FAULT_PROBE_HANDLE_USB_ERROR);
         uint8_t count = 3;
 
         bLastUsbError = error;
@@ -1097,6 +1342,144 @@ uint8_t BulkOnly::HandleUsbError(uint8_t error, uint8_t index) {
         return ((error && !count) ? MASS_ERR_GENERAL_USB_ERROR : MASS_ERR_SUCCESS);
 }
 
+/**
+ * For driver use only.
+ *
+ * READ or WRITE, split into commands of at most GetMaxTransfer() bytes.
+ * The 10 byte CDBs are used as long as the LBAs fit 32 bits, 16 byte ones beyond.
+ *
+ * @param lun Logical Unit Number
+ * @param addr LBA address on media
+ * @param bsize size of a block
+ * @param blocks how many blocks to move
+ * @param buf data, bsize * blocks bytes
+ * @param write true for WRITE(10)
+ * @param stream instead of buf, for reads handed to a parser
+ * @return 0 on success
+ */
+uint8_t BulkOnly::ReadWrite(uint8_t lun, uint64_t addr, uint16_t bsize, uint16_t blocks, uint8_t *buf, bool write, MassStream *stream) {
+        uint32_t most = (bsize) ? dMaxTransfer / bsize : 1;
+        uint8_t stall = (write) ? MASS_ERR_WRITE_STALL : MASS_ERR_STALL;
+        uint8_t er = MASS_ERR_SUCCESS;
+        CommandBlockWrapper cbw;
+
+        if (!most)
+                most = 1;
+        if (bPending)
+                return MASS_ERR_UNIT_BUSY;
+        while (blocks && !er) {
+                uint16_t n = (blocks > most) ? most : blocks;
+                UsbRetry retry(&UsbRetryStorage, GetHealth());
+                MassLUNStats *st = &LUNStats[lun];
+                bool erred = false;
+                uint32_t t0 = 0;
+
+                // Fatal sense (ILLEGAL REQUEST, DATA PROTECT, no medium) fails at once,
+                // NOT READY and the like back off exponentially, see UsbRetryStorage.
+                for (;;) {
+                        BuildReadWrite(&cbw, lun, addr, bsize, n, write);
+                        SetCurLUN(lun);
+                        if (stream)
+                                er = HandleSCSIError(Transaction(&cbw, cbw.dCBWDataTransferLength, stream, MASS_TRANS_FLG_CALLBACK));
+                        else
+                                er = HandleSCSIError(Transaction(&cbw, cbw.dCBWDataTransferLength, buf, 0));
+                        // The CSW of a stalled command went with the reset recovery, the sense tells what it was
+                        if (er == stall) {
+                                uint8_t sense = FetchSense(lun);
+                                if (sense != MASS_ERR_GENERAL_SCSI_ERROR)
+                                        er = sense;
+                        }
+                        if (er && !erred) {
+                                erred = true;
+                                st->errors++;
+                                t0 = millis();
+                        }
+                        if (er == MASS_ERR_START_REQUIRED)
+                                MediaCTL(lun, 1);
+                        // the caller has to hear of a new medium before reading it
+                        if (er == MASS_ERR_MEDIA_CHANGED || !retry.Again(ErrorClass(er)))
+                                break;
+                        st->retries++;
+                }
+                if (erred) {
+                        st->recoveryTime += millis() - t0;
+                        if (er)
+                                st->failed++;
+                        else
+                                st->recovered++;
+                }
+                NoteMedia(lun, er);
+                addr += n;
+                blocks -= n;
+                if (stream)
+                        stream->base += (uint32_t)bsize * n;
+                else
+                        buf += (uint32_t)bsize * n;
+        }
+        return er;
+}
+
+/**
+ * For driver use only.
+ *
+ * Fills in a CBW for READ/WRITE(10), or (16) past 2^32 blocks.
+ *
+ * @param pcbw CBW to fill in
+ * @param lun Logical Unit Number
+ * @param addr first block
+ * @param bsize block size
+ * @param n blocks, GetMaxTransfer() bytes at most
+ * @param write true for WRITE
+ */
+void BulkOnly::BuildReadWrite(CommandBlockWrapper *pcbw, uint8_t lun, uint64_t addr, uint16_t bsize, uint16_t n, bool write) {
+        bool cdb16 = (addr + n - 1 > 0xffffffffLLU) || (bQuirks & MASS_QUIRK_CDB16);
+
+        pcbw->dCBWSignature = MASS_CBW_SIGNATURE;
+        pcbw->dCBWTag = ++dCBWTag;
+        pcbw->dCBWDataTransferLength = ((uint32_t)bsize * n);
+        pcbw->bmCBWFlags = (write) ? MASS_CMD_DIR_OUT : MASS_CMD_DIR_IN;
+        pcbw->bmCBWLUN = lun;
+        pcbw->bmCBWCBLength = (cdb16) ? 16 : 10;
+
+        for (uint8_t i = 0; i < 16; i++)
+                pcbw->CBWCB[i] = 0;
+
+        if (cdb16) {
+                pcbw->CBWCB[0] = (write) ? SCSI_CMD_WRITE_16 : SCSI_CMD_READ_16;
+                for (uint8_t i = 0; i < 8; i++)
+                        pcbw->CBWCB[2 + i] = ((addr >> (56 - 8 * i)) & 0xff);
+                pcbw->CBWCB[12] = ((n >> 8) & 0xff);
+                pcbw->CBWCB[13] = (n & 0xff);
+        } else {
+                pcbw->CBWCB[0] = (write) ? SCSI_CMD_WRITE_10 : SCSI_CMD_READ_10;
+                pcbw->CBWCB[1] = lun << 5;
+                pcbw->CBWCB[2] = ((addr >> 24) & 0xff);
+                pcbw->CBWCB[3] = ((addr >> 16) & 0xff);
+                pcbw->CBWCB[4] = ((addr >> 8) & 0xff);
+                pcbw->CBWCB[5] = (addr & 0xff);
+                pcbw->CBWCB[7] = ((n >> 8) & 0xff);
+                pcbw->CBWCB[8] = (n & 0xff);
+        }
+}
+
+/**
+ * For driver use only.
+ *
+ * Largest piece of a data phase one inTransfer()/outTransfer() moves: whole
+ * packets, no more than a channel takes at once, and within 16 bits.
+ *
+ * @param index endpoint index
+ * @return bytes
+ */
+uint16_t BulkOnly::DataChunk(uint8_t index) {
+        uint16_t pkt = (epInfo[index].maxPktSize) ? epInfo[index].maxPktSize : 64;
+        uint32_t most = (uint32_t)pkt * USBH_MAX_HC_PKT_COUNT;
+
+        if (most > 0xFFFF)
+                most = 0xFFFF - (0xFFFF % pkt);
+        return most;
+}
+
 /**
  * For driver use only.
  *
@@ -1106,15 +1489,24 @@ uint8_t BulkOnly::HandleUsbError(uint8_t error, uint8_t index) {
  * @param flags
  * @return
  */
-uint8_t BulkOnly::Transaction(CommandBlockWrapper *pcbw, uint16_t buf_size, void *buf, uint8_t flags) {
-        uint16_t bytes = (pcbw->dCBWDataTransferLength > buf_size) ? buf_size : pcbw->dCBWDataTransferLength;
-        uint8_t write = (pcbw->bmCBWFlags & MASS_CMD_DIR_IN) != MASS_CMD_DIR_IN;
-        uint8_t callback = (flags & MASS_TRANS_FLG_CALLBACK) == MASS_TRANS_FLG_CALLBACK;
-        uint8_t ret = 0;
+uint8_t BulkOnly::Transaction(CommandBlockWrapper *pcbw, uint32_t buf_size, void *buf, uint8_t flags) {
+        return DataStatusStage(pcbw, buf_size, buf, flags, CommandStage(pcbw));
+}
+
+/**
+ * For driver use only.
+ *
+ * Sends the CBW.
+ *
+ * @param pcbw
+ * @return 0 on success
+ */
+uint8_t BulkOnly::CommandStage(CommandBlockWrapper *pcbw) {
+        uint8_t ret;
         uint8_t usberr;
-        URB_STATE URB_Status;
 
-        CommandStatusWrapper csw; // up here, we allocate ahead to save cpu cycles.
+        if (bCmdDelay)
+                delay(bCmdDelay);
         // Fix reserved bits.
         pcbw->bmReserved1 = 0;
         pcbw->bmReserved2 = 0;
@@ -1130,23 +1522,63 @@ uint8_t BulkOnly::Transaction(CommandBlockWrapper *pcbw, uint16_t buf_size, void
         //ret = HandleUsbError(pUsb->outTransfer(bAddress, epInfo[epDataOutIndex].epAddr, sizeof (CommandBlockWrapper), (uint8_t*)pcbw), epDataOutIndex);
         if (ret) {
                 ErrorMessage<uint8_t > (PSTR("============================ CBW"), ret);
-        } else {
+        }
+        return ret;
+}
+
+/**
+ * For driver use only.
+ *
+ * Moves the data of a command whose CBW is out and takes its CSW.
+ *
+ * @param pcbw
+ * @param buf_size
+ * @param buf
+ * @param flags
+ * @param ret result of CommandStage()
+ * @return
+ */
+uint8_t BulkOnly::DataStatusStage(CommandBlockWrapper *pcbw, uint32_t buf_size, void *buf, uint8_t flags, uint8_t ret) {
+        uint32_t bytes = (pcbw->dCBWDataTransferLength > buf_size) ? buf_size : pcbw->dCBWDataTransferLength;
+        uint8_t write = (pcbw->bmCBWFlags & MASS_CMD_DIR_IN) != MASS_CMD_DIR_IN;
+        uint8_t callback = (flags & MASS_TRANS_FLG_CALLBACK) == MASS_TRANS_FLG_CALLBACK;
+        uint8_t usberr = 0;
+
+        CommandStatusWrapper csw; // up here, we allocate ahead to save cpu cycles.
+
+        if (!ret) {
                 if (bytes) {
-                        if (!write) {
-                                if (callback) {
-                                        uint8_t rbuf[bytes];
-                                        while ((usberr = pUsb->inTransfer(bAddress, epInfo[epDataInIndex].epAddr, &bytes, rbuf)) == hrBUSY) delay(1);
-                                        if (usberr == hrSUCCESS) ((USBReadParser*)buf)->Parse(bytes, rbuf, 0);
+                        uint8_t index = (write) ? epDataOutIndex : epDataInIndex;
+                        uint16_t most = DataChunk(index);
+                        uint8_t *p = (uint8_t*)buf;
+                        uint32_t done = 0;
+
+                        if (callback && most > MASS_CALLBACK_CHUNK)
+                                most = MASS_CALLBACK_CHUNK;
+                        // the whole data phase, in pieces the host takes in one go
+                        while (done < bytes && !ret) {
+                                uint16_t len = (bytes - done > most) ? most : (uint16_t)(bytes - done);
+                                uint16_t moved = len;
+
+                                if (!write) {
+                                        if (callback) {
+                                                uint8_t rbuf[MASS_CALLBACK_CHUNK];
+                                                while ((usberr = pUsb->inTransfer(bAddress, epInfo[epDataInIndex].epAddr, &moved, rbuf)) == hrBUSY) delay(1);
+                                                if (usberr == hrSUCCESS) ((USBReadParser*)buf)->Parse(moved, rbuf, (uint16_t)done);
+                                        } else {
+                                                //while ((usberr = pUsb->inTransfer(bAddress, epInfo[epDataInIndex].epAddr, &bytes, (uint8_t*)buf)) == hrBUSY) delay(1);
+                                                usberr = pUsb->inTransfer(bAddress, epInfo[epDataInIndex].epAddr, &moved, p + done);
+                                        }
                                 } else {
-                                        //while ((usberr = pUsb->inTransfer(bAddress, epInfo[epDataInIndex].epAddr, &bytes, (uint8_t*)buf)) == hrBUSY) delay(1);
-                                	usberr = pUsb->inTransfer(bAddress, epInfo[epDataInIndex].epAddr, &bytes, (uint8_t*)buf);
+                                        //while ((usberr = pUsb->outTransfer(bAddress, epInfo[epDataOutIndex].epAddr, bytes, (uint8_t*)buf)) == hrBUSY) delay(1);
+                                        usberr = pUsb->outTransfer(bAddress, epInfo[epDataOutIndex].epAddr, len, p + done);
+                                        STM_EVAL_LEDToggle(LED1);
                                 }
-                                ret = HandleUsbError(usberr, epDataInIndex);
-                        } else {
-                                //while ((usberr = pUsb->outTransfer(bAddress, epInfo[epDataOutIndex].epAddr, bytes, (uint8_t*)buf)) == hrBUSY) delay(1);
-                        	usberr = pUsb->outTransfer(bAddress, epInfo[epDataOutIndex].epAddr, bytes, (uint8_t*)buf);
-                        	STM_EVAL_LEDToggle(LED1);
-                        	ret = HandleUsbError(usberr, epDataOutIndex);
+                                ret = HandleUsbError(usberr, index);
+                                done += moved;
+                                // a short packet ends the data phase, the CSW residue has the rest
+                                if (moved < len)
+                                        break;
                         }
                         if (ret) {
                                 ErrorMessage<uint8_t > (PSTR("============================ DAT"), ret);
@@ -1156,12 +1588,12 @@ uint8_t BulkOnly::Transaction(CommandBlockWrapper *pcbw, uint16_t buf_size, void
 
         //if (!ret || ret == MASS_ERR_WRITE_STALL || ret == MASS_ERR_STALL) {
         {	//receive csw
-                bytes = sizeof (CommandStatusWrapper);
+                uint16_t cswlen = sizeof (CommandStatusWrapper);
                 int tries = 2;
                 while (tries--) {
                         //while ((usberr = pUsb->inTransfer(bAddress, epInfo[epDataInIndex].epAddr, &bytes, (uint8_t*) & csw)) == hrBUSY) delay(1);
 
-                	usberr = pUsb->inTransfer(bAddress, epInfo[epDataInIndex].epAddr, &bytes, (uint8_t*) & csw);
+                	usberr = pUsb->inTransfer(bAddress, epInfo[epDataInIndex].epAddr, &cswlen, (uint8_t*) & csw);
                 	STM_EVAL_LEDToggle(LED1);
 
 					if (!usberr) break;
@@ -1195,6 +1627,7 @@ uint8_t BulkOnly::Transaction(CommandBlockWrapper *pcbw, uint16_t buf_size, void
                                 // I own one... 05e3:0701 Genesys Logic, Inc. USB 2.0 IDE Adapter.
                                 // Other devices that exhibit this behavior exist in the wild too.
                                 // Be sure to check for quirks on Linux before reporting a bug. --xxxajk
+                                // Known ones go into MassQuirks[] with MASS_QUIRK_IGNORE_RESIDUE.
                                 Notify(PSTR("Invalid CSW\r\n"), 0x80);
                                 ResetRecovery();
                                 //return MASS_ERR_SUCCESS;
@@ -1254,6 +1687,43 @@ uint8_t BulkOnly::SetCurLUN(uint8_t lun) {
         return MASS_ERR_SUCCESS;
 };
 
+/**
+ * Sort a result of the driver into a retry class
+ *
+ * @param err MASS_ERR_xxx, or a host result passed through
+ * @return USB_ERR_CLASS_xxx
+ */
+uint8_t BulkOnly::ErrorClass(uint8_t err) {
+        switch (err) {
+                case MASS_ERR_SUCCESS:
+                        return USB_ERR_CLASS_NONE;
+                case MASS_ERR_UNIT_NOT_READY:
+                case MASS_ERR_START_REQUIRED:
+                case MASS_ERR_UNIT_BUSY:
+                case MASS_ERR_MEDIA_CHANGED:
+                case MASS_ERR_READ_NAKS:
+                case MASS_ERR_WRITE_NAKS:
+                        return USB_ERR_CLASS_TRANSIENT;
+                case MASS_ERR_PHASE_ERROR:
+                case MASS_ERR_STALL:
+                case MASS_ERR_WRITE_STALL:
+                case MASS_ERR_INVALID_CSW:
+                case MASS_ERR_GENERAL_SCSI_ERROR:
+                case MASS_ERR_GENERAL_USB_ERROR:
+                        return USB_ERR_CLASS_PROTOCOL;
+                case MASS_ERR_CMD_NOT_SUPPORTED:
+                case MASS_ERR_NO_MEDIA:
+                case MASS_ERR_BAD_LBA:
+                case MASS_ERR_DEVICE_DISCONNECTED:
+                case MASS_ERR_UNABLE_TO_RECOVER:
+                case MASS_ERR_INVALID_LUN:
+                case MASS_ERR_WRITE_PROTECTED:
+                        return USB_ERR_CLASS_FATAL;
+                default:
+                        return UsbErrorClass(err);
+        }
+}
+
 /**
  * For driver use only.
  *
@@ -1261,8 +1731,6 @@ uint8_t BulkOnly::SetCurLUN(uint8_t lun) {
  * @return
  */
 uint8_t BulkOnly::HandleSCSIError(uint8_t status) {
-        uint8_t ret = 0;
-
         switch (status) {
                 case 0: return MASS_ERR_SUCCESS;
                         //case 4: return MASS_ERR_UNIT_BUSY; // Busy means retry later.
@@ -1276,57 +1744,7 @@ uint8_t BulkOnly::HandleSCSIError(uint8_t status) {
                 case 1:
                         ErrorMessage<uint8_t > (PSTR("SCSI Error"), status);
                         ErrorMessage<uint8_t > (PSTR("LUN"), bTheLUN);
-                        RequestSenseResponce rsp;
-
-                        ret = RequestSense(bTheLUN, sizeof (RequestSenseResponce), (uint8_t*) & rsp);
-
-                        if (ret) {
-                                //ResetRecovery();
-                                return MASS_ERR_GENERAL_SCSI_ERROR;
-                        }
-                        ErrorMessage<uint8_t > (PSTR("Response Code"), rsp.bResponseCode);
-                        if (rsp.bResponseCode & 0x80) {
-                                Notify(PSTR("Information field: "), 0x80);
-                                for (int i = 0; i < 4; i++) {
-                                        D_PrintHex<uint8_t > (rsp.CmdSpecificInformation[i], 0x80);
-                                        Notify(PSTR(" "), 0x80);
-                                }
-                                Notify(PSTR("\r\n"), 0x80);
-                        }
-                        ErrorMessage<uint8_t > (PSTR("Sense Key"), rsp.bmSenseKey);
-                        ErrorMessage<uint8_t > (PSTR("Add Sense Code"), rsp.bAdditionalSenseCode);
-                        ErrorMessage<uint8_t > (PSTR("Add Sense Qual"), rsp.bAdditionalSenseQualifier);
-                        // warning, this is not testing ASQ, only SK and ASC.
-                        switch (rsp.bmSenseKey) {
-                                        /* bug...
-                                        case 0:
-                                                return MASS_ERR_SUCCESS;
-                                         */
-                                case SCSI_S_UNIT_ATTENTION:
-                                        switch (rsp.bAdditionalSenseCode) {
-                                                case SCSI_ASC_MEDIA_CHANGED:
-                                                        return MASS_ERR_MEDIA_CHANGED;
-                                                default:
-                                                        return MASS_ERR_UNIT_NOT_READY;
-                                        }
-                                case SCSI_S_NOT_READY:
-                                        switch (rsp.bAdditionalSenseCode) {
-                                                case SCSI_ASC_MEDIUM_NOT_PRESENT:
-                                                        return MASS_ERR_NO_MEDIA;
-                                                        //return MASS_ERR_SUCCESS;
-                                                default:
-                                                        return MASS_ERR_UNIT_NOT_READY;
-                                        }
-                                case SCSI_S_ILLEGAL_REQUEST:
-                                        switch (rsp.bAdditionalSenseCode) {
-                                                case SCSI_ASC_LBA_OUT_OF_RANGE:
-                                                        return MASS_ERR_BAD_LBA;
-                                                default:
-                                                        return MASS_ERR_CMD_NOT_SUPPORTED;
-                                        }
-                                default:
-                                        return MASS_ERR_GENERAL_SCSI_ERROR;
-                        }
+                        return FetchSense(bTheLUN);
 
                 default:
                         // Should have been handled already in HandleUsbError.
@@ -1337,6 +1755,78 @@ uint8_t BulkOnly::HandleSCSIError(uint8_t status) {
         } // switch
 }
 
+/**
+ * For driver use only.
+ *
+ * REQUEST SENSE, decoded. The sense is kept in the statistics of the LUN.
+ *
+ * @param lun Logical Unit Number
+ * @return MASS_ERR_xxx for the sense, MASS_ERR_GENERAL_SCSI_ERROR if there is none
+ */
+uint8_t BulkOnly::FetchSense(uint8_t lun) {
+        RequestSenseResponce rsp;
+        uint8_t ret = RequestSense(lun, sizeof (RequestSenseResponce), (uint8_t*) & rsp);
+
+        if (ret) {
+                //ResetRecovery();
+                return MASS_ERR_GENERAL_SCSI_ERROR;
+        }
+        ErrorMessage<uint8_t > (PSTR("Response Code"), rsp.bResponseCode);
+        if (rsp.bResponseCode & 0x80) {
+                Notify(PSTR("Information field: "), 0x80);
+                for (int i = 0; i < 4; i++) {
+                        D_PrintHex<uint8_t > (rsp.CmdSpecificInformation[i], 0x80);
+                        Notify(PSTR(" "), 0x80);
+                }
+                Notify(PSTR("\r\n"), 0x80);
+        }
+        ErrorMessage<uint8_t > (PSTR("Sense Key"), rsp.bmSenseKey);
+        ErrorMessage<uint8_t > (PSTR("Add Sense Code"), rsp.bAdditionalSenseCode);
+        ErrorMessage<uint8_t > (PSTR("Add Sense Qual"), rsp.bAdditionalSenseQualifier);
+        if (lun < MASS_MAX_SUPPORTED_LUN) {
+                LUNStats[lun].senseKey = rsp.bmSenseKey;
+                LUNStats[lun].asc = rsp.bAdditionalSenseCode;
+                LUNStats[lun].ascq = rsp.bAdditionalSenseQualifier;
+        }
+        // ASCQ only matters to NOT READY, for the rest SK and ASC do.
+        switch (rsp.bmSenseKey) {
+                        /* bug...
+                        case 0:
+                                return MASS_ERR_SUCCESS;
+                         */
+                case SCSI_S_UNIT_ATTENTION:
+                        switch (rsp.bAdditionalSenseCode) {
+                                case SCSI_ASC_MEDIA_CHANGED:
+                                        return MASS_ERR_MEDIA_CHANGED;
+                                default:
+                                        return MASS_ERR_UNIT_NOT_READY;
+                        }
+                case SCSI_S_NOT_READY:
+                        switch (rsp.bAdditionalSenseCode) {
+                                case SCSI_ASC_MEDIUM_NOT_PRESENT:
+                                        return MASS_ERR_NO_MEDIA;
+                                        //return MASS_ERR_SUCCESS;
+                                case SCSI_ASC_NOT_READY:
+                                        if (rsp.bAdditionalSenseQualifier == SCSI_ASCQ_START_REQUIRED)
+                                                return MASS_ERR_START_REQUIRED;
+                                        return MASS_ERR_UNIT_NOT_READY; // becoming ready, format or the like in progress
+                                default:
+                                        return MASS_ERR_UNIT_NOT_READY;
+                        }
+                case SCSI_S_ILLEGAL_REQUEST:
+                        switch (rsp.bAdditionalSenseCode) {
+                                case SCSI_ASC_LBA_OUT_OF_RANGE:
+                                        return MASS_ERR_BAD_LBA;
+                                default:
+                                        return MASS_ERR_CMD_NOT_SUPPORTED;
+                        }
+                case SCSI_S_DATA_PROTECT:
+                        return MASS_ERR_WRITE_PROTECTED;
+                default:
+                        return MASS_ERR_GENERAL_SCSI_ERROR;
+        }
+}
+
 
 ////////////////////////////////////////////////////////////////////////////////
 
@@ -1376,36 +1866,6 @@ void BulkOnly::PrintEndpointDescriptor(const USB_ENDPOINT_DESCRIPTOR * ep_ptr) {
 
 ////////////////////////////////////////////////////////////////////////////////
 
-/* We won't be needing this... */
-uint8_t BulkOnly::Read(uint8_t lun, uint32_t addr, uint16_t bsize, uint8_t blocks, USBReadParser * prs) {
-        if (!LUNOk[lun]) return MASS_ERR_NO_MEDIA;
-#if 0
-        Notify(PSTR("\r\nRead (With parser)\r\n"), 0x80);
-        Notify(PSTR("---------\r\n"), 0x80);
-
-        CommandBlockWrapper cbw;
-
-        cbw.dCBWSignature = MASS_CBW_SIGNATURE;
-        cbw.dCBWTag = ++dCBWTag;
-        cbw.dCBWDataTransferLength = ((uint32_t)bsize * blocks);
-        cbw.bmCBWFlags = MASS_CMD_DIR_IN,
-                cbw.bmCBWLUN = lun;
-        cbw.bmCBWCBLength = 10;
-
-        for (uint8_t i = 0; i < 16; i++)
-                cbw.CBWCB[i] = 0;
-
-        cbw.CBWCB[0] = SCSI_CMD_READ_10;
-        cbw.CBWCB[8] = blocks;
-        cbw.CBWCB[2] = ((addr >> 24) & 0xff);
-        cbw.CBWCB[3] = ((addr >> 16) & 0xff);
-        cbw.CBWCB[4] = ((addr >> 8) & 0xff);
-        cbw.CBWCB[5] = (addr & 0xff);
-
-        return HandleSCSIError(Transaction(&cbw, bsize, prs, 1));
-#endif
-}
-
 #if 0
 // TO-DO: Unify CBW creation as much as possible.
 // Make and submit CBW.
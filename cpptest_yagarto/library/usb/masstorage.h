@@ -68,6 +68,10 @@
 #define SCSI_CMD_READ_6			0x08
 #define SCSI_CMD_READ_10		0x28
 #define SCSI_CMD_READ_CAPACITY_10	0x25
+#define SCSI_CMD_READ_16		0x88
+#define SCSI_CMD_WRITE_16		0x8A
+#define SCSI_CMD_SERVICE_ACTION_IN_16	0x9E
+#define SCSI_SA_READ_CAPACITY_16	0x10	// service action of SERVICE ACTION IN(16)
 #define SCSI_CMD_TEST_UNIT_READY	0x00
 #define SCSI_CMD_WRITE_6		0x0A
 #define SCSI_CMD_WRITE_10		0x2A
@@ -79,10 +83,13 @@
 #define SCSI_S_MEDIUM_ERROR		0x03
 #define SCSI_S_ILLEGAL_REQUEST		0x05
 #define SCSI_S_UNIT_ATTENTION		0x06
+#define SCSI_S_DATA_PROTECT		0x07
 
 #define SCSI_ASC_MEDIUM_NOT_PRESENT     0x3A
 #define SCSI_ASC_LBA_OUT_OF_RANGE       0x21
 #define SCSI_ASC_MEDIA_CHANGED          0x28
+#define SCSI_ASC_NOT_READY		0x04	// LOGICAL UNIT NOT READY, the ASCQ says why
+#define SCSI_ASCQ_START_REQUIRED	0x02	// ... INITIALIZING COMMAND REQUIRED
 
 #define MASS_ERR_SUCCESS		0x00
 #define MASS_ERR_PHASE_ERROR		0x02
@@ -101,6 +108,7 @@
 #define MASS_ERR_READ_NAKS              0x15
 #define MASS_ERR_WRITE_NAKS             0x16
 #define MASS_ERR_WRITE_PROTECTED        0x17
+#define MASS_ERR_START_REQUIRED		0x18	// Not ready until START STOP UNIT
 #define MASS_ERR_GENERAL_SCSI_ERROR	0xFE
 #define MASS_ERR_GENERAL_USB_ERROR	0xFF
 #define MASS_ERR_USER			0xA0	// For subclasses to define their own error codes
@@ -111,12 +119,52 @@
 
 #define MASS_MAX_ENDPOINTS		3
 
+// Largest READ(10)/WRITE(10) sent, longer requests are split. The data phase of
+// each command streams straight between the bulk pipe and the caller's buffer.
+#ifndef MASS_MAX_TRANSFER_LENGTH
+#define MASS_MAX_TRANSFER_LENGTH	65536UL
+#endif
+#define MASS_CALLBACK_CHUNK		512	// bytes handed to a USBReadParser at a time
+
+// Ask LUNs claiming SPC-3 or later for READ CAPACITY(16) to learn the physical
+// block size. Set to 0 for bridges that choke on it, it is still used above 2 TiB.
+#ifndef MASS_RC16_SPC3
+#define MASS_RC16_SPC3			1
+#endif
+
+// Workarounds for mass storage devices that need them, see MassQuirks[] in masstorage.cpp
+#define MASS_QUIRK_NO_MODE_SENSE	0x01	// no MODE SENSE (Page 3F), the medium is taken as writable
+#define MASS_QUIRK_NO_LOCK		0x02	// no PREVENT ALLOW MEDIUM REMOVAL
+#define MASS_QUIRK_IGNORE_RESIDUE	0x04	// the CSW residue is garbage, taken as 0
+#define MASS_QUIRK_NO_RC16		0x08	// READ CAPACITY(16) only past 2^32 blocks
+#define MASS_QUIRK_CDB16		0x10	// READ/WRITE(16) also below 2^32 blocks
+
+// Media polling. TEST UNIT READY only goes out once the device has been idle for
+// MASS_POLL_IDLE ms, until then the results of reads and writes tell about the
+// media. The interval doubles from MASS_POLL_MIN up to MASS_POLL_MAX while
+// nothing changes.
+#ifndef MASS_POLL_IDLE
+#define MASS_POLL_IDLE			1000
+#endif
+#ifndef MASS_POLL_MIN
+#define MASS_POLL_MIN			2000
+#endif
+#ifndef MASS_POLL_MAX
+#define MASS_POLL_MAX			16000
+#endif
+
 struct Capacity {
         uint8_t data[8];
         //uint32_t dwBlockAddress;
         //uint32_t dwBlockLength;
 } __attribute__((packed));
 
+struct Capacity16 {
+        uint8_t data[32];
+        // 0-7 last LBA, 8-11 block length, 13 bits 0-3 logical blocks per physical block exponent,
+        // 14-15 lowest aligned LBA
+} __attribute__((packed));
+
 struct InquiryResponse {
         uint8_t DeviceType : 5;
         uint8_t PeripheralQualifier : 3;
@@ -164,8 +212,8 @@ struct CommandBlockWrapper : public CommandBlockWrapperBase {
         };
 
         struct {
-                uint8_t bmCBWCBLength : 4;
-                uint8_t bmReserved2 : 4;
+                uint8_t bmCBWCBLength : 5;
+                uint8_t bmReserved2 : 3;
         };
 
         uint8_t CBWCB[16];
@@ -197,6 +245,30 @@ struct RequestSenseResponce {
         uint8_t SenseKeySpecific[3];
 } __attribute__((packed));
 
+class MassStream;
+
+struct MassQuirk {
+        uint16_t idVendor; // 0 matches any
+        uint16_t idProduct; // 0 matches any
+        const char *vendor; // start of the INQUIRY vendor, NULL matches any
+        const char *product; // start of the INQUIRY product, NULL matches any
+        uint8_t flags; // MASS_QUIRK_xxx
+        uint8_t cmdDelay; // ms before each command
+        uint32_t maxTransfer; // bytes per READ/WRITE, 0 for MASS_MAX_TRANSFER_LENGTH
+};
+
+// Error recovery of reads and writes, per LUN
+struct MassLUNStats {
+        uint32_t errors; // reads and writes that failed at least once
+        uint32_t retries; // attempts after a failure
+        uint32_t recovered; // ... that ended well
+        uint32_t failed; // ... that did not
+        uint32_t recoveryTime; // ms from the first failure to the end, summed up
+        uint8_t senseKey; // last sense
+        uint8_t asc;
+        uint8_t ascq;
+};
+
 class BulkOnly : public USBDeviceConfig, public UsbConfigXtracter {
 protected:
         static const uint8_t epDataInIndex; // DataIn endpoint index
@@ -209,6 +281,8 @@ protected:
         uint8_t bIface; // interface value
         uint8_t bNumEP; // total number of EP in the configuration
         uint32_t qNextPollTime; // next poll time
+        uint32_t qLastIOTime; // last read or write that reached the media
+        uint16_t wPollInterval; // ms, MASS_POLL_MIN to MASS_POLL_MAX
         bool bPollEnable; // poll enable flag
 
         EpInfo epInfo[MASS_MAX_ENDPOINTS];
@@ -218,10 +292,24 @@ protected:
         uint8_t bLastUsbError; // Last USB error
         uint8_t bMaxLUN; // Max LUN
         uint8_t bTheLUN; // Active LUN
-        uint32_t CurrentCapacity[MASS_MAX_SUPPORTED_LUN]; // Total sectors
-        uint16_t CurrentSectorSize[MASS_MAX_SUPPORTED_LUN]; // Sector size, clipped to 16 bits
+        uint64_t CurrentCapacity[MASS_MAX_SUPPORTED_LUN]; // Total sectors
+        uint16_t CurrentSectorSize[MASS_MAX_SUPPORTED_LUN]; // Sector size, 512 to 4096
+        uint8_t CurrentPhysExp[MASS_MAX_SUPPORTED_LUN]; // logical blocks per physical block, log2
+        uint8_t SCSIVersion[MASS_MAX_SUPPORTED_LUN]; // INQUIRY version, 5 and up is SPC-3
         bool LUNOk[MASS_MAX_SUPPORTED_LUN]; // use this to check for media changes.
         bool WriteOk[MASS_MAX_SUPPORTED_LUN];
+        bool PollOk[MASS_MAX_SUPPORTED_LUN]; // TEST UNIT READY when idle
+        MassLUNStats LUNStats[MASS_MAX_SUPPORTED_LUN];
+        uint16_t wVID; // from the device descriptor, for the quirks
+        uint16_t wPID;
+        uint8_t bQuirks; // MASS_QUIRK_xxx
+        uint8_t bCmdDelay; // ms before each command
+        uint32_t dMaxTransfer; // bytes per READ/WRITE
+        CommandBlockWrapper pendCBW; // READ/WRITE between Submit() and Finish()
+        uint8_t *pendBuf;
+        uint64_t pendAddr;
+        uint8_t bPendResult; // of its CBW
+        bool bPending;
         void PrintEndpointDescriptor(const USB_ENDPOINT_DESCRIPTOR* ep_ptr);
 
 
@@ -245,16 +333,45 @@ public:
                 return bTheLUN; // Active LUN
         }
 
+        UsbHealth* GetHealth() {
+                return pUsb->GetDeviceHealth(bAddress);
+        }
+
+        uint8_t GetQuirks() {
+                return bQuirks;
+        }
+
+        uint32_t GetMaxTransfer() {
+                return dMaxTransfer;
+        }
+
+        MassLUNStats* GetLUNStats(uint8_t lun) {
+                return (lun < MASS_MAX_SUPPORTED_LUN) ? &LUNStats[lun] : NULL;
+        }
+
+        static uint8_t ErrorClass(uint8_t err);
+
         uint8_t WriteProtected(uint8_t lun);
         uint8_t MediaCTL(uint8_t lun, uint8_t ctl);
-        uint8_t Read(uint8_t lun, uint32_t addr, uint16_t bsize, uint8_t blocks, uint8_t *buf);
-        uint8_t Read(uint8_t lun, uint32_t addr, uint16_t bsize, uint8_t blocks, USBReadParser *prs);
-        uint8_t Write(uint8_t lun, uint32_t addr, uint16_t bsize, uint8_t blocks, const uint8_t *buf);
+        uint8_t Read(uint8_t lun, uint64_t addr, uint16_t bsize, uint16_t blocks, uint8_t *buf);
+        uint8_t Read(uint8_t lun, uint64_t addr, uint16_t bsize, uint16_t blocks, USBReadParser *prs);
+        uint8_t Write(uint8_t lun, uint64_t addr, uint16_t bsize, uint16_t blocks, const uint8_t *buf);
         uint8_t LockMedia(uint8_t lun, uint8_t lock);
+        void SetMediaPoll(uint8_t lun, bool enable);
+
+        // Split READ/WRITE, so commands to other devices can go in between
+        uint8_t Submit(uint8_t lun, uint64_t addr, uint16_t bsize, uint16_t blocks, uint8_t *buf, bool write);
+        uint8_t Finish();
+
+        bool Pending() {
+                return bPending;
+        };
 
         bool LUNIsGood(uint8_t lun);
         uint32_t GetCapacity(uint8_t lun);
+        uint64_t GetCapacity64(uint8_t lun);
         uint16_t GetSectorSize(uint8_t lun);
+        uint32_t GetPhysicalSectorSize(uint8_t lun);
 
         // USBDeviceConfig implementation
         virtual uint8_t Init(uint8_t parent, uint8_t port, bool lowspeed);
@@ -271,19 +388,31 @@ public:
         virtual void EndpointXtract(uint8_t conf, uint8_t iface, uint8_t alt, uint8_t proto, const USB_ENDPOINT_DESCRIPTOR *ep);
         virtual uint8_t DEVCLASSOK(uint8_t klass) { return (klass == USB_CLASS_MASS_STORAGE); }
 
+        virtual const UsbMatchEntry* GetMatchTable(uint8_t *count) {
+                static const UsbMatchEntry table[] = {
+                        { USB_MATCH_IF_ALL, 0, 0, USB_CLASS_MASS_STORAGE, MASS_SUBCLASS_SCSI, MASS_PROTO_BBB }
+                };
+                *count = sizeof (table) / sizeof (UsbMatchEntry);
+                return table;
+        };
+
 
 private:
         uint8_t Inquiry(uint8_t lun, uint16_t size, uint8_t *buf);
         uint8_t TestUnitReady(uint8_t lun);
         uint8_t RequestSense(uint8_t lun, uint16_t size, uint8_t *buf);
+        uint8_t FetchSense(uint8_t lun);
+        void ApplyQuirks(const InquiryResponse *inq);
         uint8_t ModeSense(uint8_t lun, uint8_t pc, uint8_t page, uint8_t subpage, uint8_t len, uint8_t *buf);
         uint8_t GetMaxLUN(uint8_t *max_lun);
         uint8_t SetCurLUN(uint8_t lun);
         void Reset();
         uint8_t ResetRecovery();
         uint8_t ReadCapacity(uint8_t lun, uint16_t size, uint8_t *buf);
+        uint8_t ReadCapacity16(uint8_t lun, uint16_t size, uint8_t *buf);
         void ClearAllEP();
         void CheckMedia();
+        void NoteMedia(uint8_t lun, uint8_t er);
         uint8_t CheckLUN(uint8_t lun);
         uint8_t Page3F(uint8_t lun);
         bool IsValidCBW(uint8_t size, uint8_t *pcbw);
@@ -292,7 +421,12 @@ private:
         bool IsValidCSW(CommandStatusWrapper *pcsw, CommandBlockWrapperBase *pcbw);
 
         uint8_t ClearEpHalt(uint8_t index);
-        uint8_t Transaction(CommandBlockWrapper *cbw, uint16_t bsize, void *buf, uint8_t flags);
+        uint8_t Transaction(CommandBlockWrapper *cbw, uint32_t buf_size, void *buf, uint8_t flags);
+        uint8_t CommandStage(CommandBlockWrapper *pcbw);
+        uint8_t DataStatusStage(CommandBlockWrapper *pcbw, uint32_t buf_size, void *buf, uint8_t flags, uint8_t ret);
+        void BuildReadWrite(CommandBlockWrapper *pcbw, uint8_t lun, uint64_t addr, uint16_t bsize, uint16_t n, bool write);
+        uint8_t ReadWrite(uint8_t lun, uint64_t addr, uint16_t bsize, uint16_t blocks, uint8_t *buf, bool write, MassStream *stream = NULL);
+        uint16_t DataChunk(uint8_t index);
         uint8_t HandleUsbError(uint8_t error, uint8_t index);
         uint8_t HandleSCSIError(uint8_t status);
 
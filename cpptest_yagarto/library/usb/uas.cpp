@@ -0,0 +1,926 @@
+/*
+ * uas.cpp
+ *
+ * USB Attached SCSI class driver, see uas.h
+ */
+
+#include <string.h>
+#include "uas.h"
+
+UAS::UAS(USB *p) :
+pUsb(p),
+bAddress(0),
+bConfNum(0),
+bIface(0),
+bAltSet(0),
+bNumEP(1),
+bLastPipe(0),
+qNextPollTime(0),
+bPollEnable(false),
+bLastUsbError(0),
+bMaxLUN(0) {
+        ClearAllEP();
+        if (pUsb)
+                pUsb->RegisterDeviceClass(this);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+// Interface code
+
+////////////////////////////////////////////////////////////////////////////////
+
+uint32_t UAS::GetCapacity(uint8_t lun) {
+        if (LUNOk[lun])
+                return (CurrentCapacity[lun] > 0xffffffffLLU) ? 0xffffffffLU : (uint32_t)CurrentCapacity[lun];
+        return 0LU;
+}
+
+uint64_t UAS::GetCapacity64(uint8_t lun) {
+        if (LUNOk[lun])
+                return CurrentCapacity[lun];
+        return 0LLU;
+}
+
+uint16_t UAS::GetSectorSize(uint8_t lun) {
+        if (LUNOk[lun])
+                return CurrentSectorSize[lun];
+        return 0U;
+}
+
+uint32_t UAS::GetPhysicalSectorSize(uint8_t lun) {
+        if (LUNOk[lun])
+                return (uint32_t)CurrentSectorSize[lun] << CurrentPhysExp[lun];
+        return 0LU;
+}
+
+bool UAS::LUNIsGood(uint8_t lun) {
+        return LUNOk[lun];
+}
+
+uint8_t UAS::WriteProtected(uint8_t lun) {
+        return WriteOk[lun];
+}
+
+/**
+ * Read data from media. Requests longer than MASS_MAX_TRANSFER_LENGTH go out
+ * as several commands, queued in the device together.
+ *
+ * @param lun Logical Unit Number
+ * @param addr LBA address on media to read
+ * @param bsize size of a block
+ * @param blocks how many blocks to read
+ * @param buf memory that is able to hold the requested data
+ * @return 0 on success
+ */
+uint8_t UAS::Read(uint8_t lun, uint64_t addr, uint16_t bsize, uint16_t blocks, uint8_t *buf) {
+        if (!LUNOk[lun]) return MASS_ERR_NO_MEDIA;
+        return ReadWrite(lun, addr, bsize, blocks, buf, false);
+}
+
+/**
+ * Write data to media
+ *
+ * @param lun Logical Unit Number
+ * @param addr LBA address on media to write
+ * @param bsize size of a block
+ * @param blocks how many blocks to write
+ * @param buf memory that contains the data to write
+ * @return 0 on success
+ */
+uint8_t UAS::Write(uint8_t lun, uint64_t addr, uint16_t bsize, uint16_t blocks, const uint8_t *buf) {
+        if (!LUNOk[lun]) return MASS_ERR_NO_MEDIA;
+        if (!WriteOk[lun]) return MASS_ERR_WRITE_PROTECTED;
+        return ReadWrite(lun, addr, bsize, blocks, (uint8_t*)buf, true);
+}
+
+/**
+ * Queue a command in the device, it runs while the caller gets on.
+ *
+ * @param lun Logical Unit Number
+ * @param cdb command descriptor block
+ * @param cdblen 6 to 16
+ * @param length bytes of the data phase, 0 for none
+ * @param buf data, it has to stay around until Wait() on the tag returned
+ * @param write true if the data goes to the device
+ * @param ptag tag of the command
+ * @return 0 on success, MASS_ERR_UNIT_BUSY if all tags are in flight
+ */
+uint8_t UAS::Submit(uint8_t lun, const uint8_t *cdb, uint8_t cdblen, uint32_t length, uint8_t *buf, bool write, uint8_t *ptag) {
+        if (!bAddress)
+                return MASS_ERR_DEVICE_DISCONNECTED;
+        if (cdblen > sizeof (((UASCommandIU*)0)->CDB))
+                return MASS_ERR_CMD_NOT_SUPPORTED;
+
+        uint8_t i = 0;
+
+        while (i < UAS_MAX_TAGS && tags[i].state != UAS_TAG_FREE)
+                i++;
+        if (i == UAS_MAX_TAGS)
+                return MASS_ERR_UNIT_BUSY;
+
+        UASCommandIU iu;
+
+        memset(&iu, 0, sizeof (iu));
+        iu.bIUID = UAS_IU_COMMAND;
+        iu.wTag[1] = i + 1;
+        iu.bAttribute = UAS_TASK_SIMPLE;
+        iu.LUN[1] = lun; // single level LUN, peripheral device addressing
+        memcpy(iu.CDB, cdb, cdblen);
+
+        UASTag *t = &tags[i];
+
+        t->buf = buf;
+        t->length = length;
+        t->done = 0;
+        t->lun = lun;
+        t->write = write;
+        t->result = MASS_ERR_SUCCESS;
+        t->state = UAS_TAG_QUEUED;
+
+        uint8_t rcode = pUsb->outTransfer(bAddress, epInfo[UAS_PIPE_COMMAND].epAddr, sizeof (iu), (uint8_t*) & iu);
+
+        if (rcode) {
+                t->state = UAS_TAG_FREE;
+                return HandleUsbError(rcode, UAS_PIPE_COMMAND);
+        }
+        *ptag = i + 1;
+        return MASS_ERR_SUCCESS;
+}
+
+/**
+ * Service the status pipe until a command is complete. Other commands get
+ * their data moved and their status taken along the way.
+ *
+ * @param tag from Submit()
+ * @return result of the command, MASS_ERR_xxx
+ */
+uint8_t UAS::Wait(uint8_t tag) {
+        if (!tag || tag > UAS_MAX_TAGS || tags[tag - 1].state == UAS_TAG_FREE)
+                return MASS_ERR_GENERAL_SCSI_ERROR;
+
+        UASTag *t = &tags[tag - 1];
+        uint32_t timeout = millis() + UAS_COMMAND_TIMEOUT;
+
+        while (t->state != UAS_TAG_DONE) {
+                uint8_t rcode = Service();
+
+                if (rcode == UAS_ERR_IDLE) {
+                        if ((int32_t)(millis() - timeout) >= 0) {
+                                // The device lost track, and nobody can tell which of the queued commands did what
+                                ResetInterface();
+                                AbortAll(MASS_ERR_UNABLE_TO_RECOVER);
+                        }
+                        continue;
+                }
+                if (rcode) {
+                        if (rcode != MASS_ERR_DEVICE_DISCONNECTED)
+                                ResetInterface();
+                        AbortAll(rcode);
+                        break;
+                }
+                timeout = millis() + UAS_COMMAND_TIMEOUT;
+        }
+        t->state = UAS_TAG_FREE;
+        return t->result;
+}
+
+/**
+ * One command, start to finish
+ */
+uint8_t UAS::Command(uint8_t lun, const uint8_t *cdb, uint8_t cdblen, uint32_t length, uint8_t *buf, bool write) {
+        uint8_t tag;
+        uint8_t rcode = Submit(lun, cdb, cdblen, length, buf, write, &tag);
+
+        if (rcode)
+                return rcode;
+        return Wait(tag);
+}
+
+uint8_t UAS::GetQueued() {
+        uint8_t n = 0;
+
+        for (uint8_t i = 0; i < UAS_MAX_TAGS; i++)
+                if (tags[i].state == UAS_TAG_QUEUED)
+                        n++;
+        return n;
+}
+
+// End of user functions, the remaining code below is driver internals.
+
+////////////////////////////////////////////////////////////////////////////////
+
+// Main driver code
+
+////////////////////////////////////////////////////////////////////////////////
+
+/**
+ * Same as BulkOnly::ConfigureDevice()
+ */
+uint8_t UAS::ConfigureDevice(uint8_t parent, uint8_t port, bool lowspeed) {
+        const uint8_t constBufSize = sizeof (USB_DEVICE_DESCRIPTOR);
+
+        uint8_t buf[constBufSize];
+        uint8_t rcode;
+        UsbDevice *p = NULL;
+        EpInfo *oldep_ptr = NULL;
+
+        USBTRACE("\nUAS ConfigureDevice\r\n");
+        AddressPool &addrPool = pUsb->GetAddressPool();
+
+        if (bAddress)
+                return USB_ERROR_CLASS_INSTANCE_ALREADY_IN_USE;
+        ClearAllEP();
+
+        // Get pointer to pseudo device with address 0 assigned
+        p = addrPool.GetUsbDevicePtr(0);
+        if (!p)
+                return USB_ERROR_ADDRESS_NOT_FOUND_IN_POOL;
+
+        if (!p->epinfo)
+                return USB_ERROR_EPINFO_IS_NULL;
+
+        // Save old pointer to EP_RECORD of address 0
+        oldep_ptr = p->epinfo;
+
+        // Temporary assign new pointer to epInfo to p->epinfo in order to avoid toggle inconsistence
+        p->epinfo = epInfo;
+
+        // still use mother's host channel
+        p->epinfo->hcNumber = oldep_ptr->hcNumber;
+
+        p->lowspeed = lowspeed;
+        // Get device descriptor
+        rcode = pUsb->getDevDescr(0, 0, 8, (uint8_t*)buf);
+        if (!rcode) {
+                p->epinfo->maxPktSize = (uint8_t)((USB_DEVICE_DESCRIPTOR*)buf)->bMaxPacketSize0;
+                rcode = pUsb->getDevDescr(0, 0, constBufSize, (uint8_t*)buf);
+        }
+        // Restore p->epinfo
+        p->epinfo = oldep_ptr;
+
+        if (rcode) {
+#ifdef DEBUG_USB_HOST
+                NotifyFailGetDevDescr(rcode);
+#endif
+                Release();
+                return USB_ERROR_FailGetDevDescr;
+        }
+
+        // Allocate new address according to device class
+        bAddress = addrPool.AllocAddress(parent, false, port);
+
+        if (!bAddress)
+                return USB_ERROR_OUT_OF_ADDRESS_SPACE_IN_POOL;
+
+        // Extract Max Packet Size from the device descriptor
+        epInfo[0].maxPktSize = (uint8_t)((USB_DEVICE_DESCRIPTOR*)buf)->bMaxPacketSize0;
+        // Steal and abuse from epInfo structure to save on memory.
+        epInfo[1].epAddr = ((USB_DEVICE_DESCRIPTOR*)buf)->bNumConfigurations;
+        return USB_ERROR_CONFIG_REQUIRES_ADDITIONAL_RESET;
+}
+
+uint8_t UAS::Init(uint8_t parent, uint8_t port, bool lowspeed) {
+        uint8_t rcode;
+        uint8_t num_of_conf = epInfo[1].epAddr; // number of configurations
+        epInfo[1].epAddr = 0;
+        USBTRACE("\nUAS Init");
+
+        AddressPool &addrPool = pUsb->GetAddressPool();
+        UsbDevice *p = addrPool.GetUsbDevicePtr(bAddress);
+
+        if (!p)
+                return USB_ERROR_ADDRESS_NOT_FOUND_IN_POOL;
+
+        // Still at address 0: without the four pipes the device is left to BulkOnly
+        rcode = FindPipes(num_of_conf);
+        if (rcode) {
+                Release();
+                return rcode;
+        }
+
+        rcode = pUsb->setAddr(0, 0, bAddress);
+        if (rcode) {
+                addrPool.FreeAddress(bAddress);
+                bAddress = 0;
+                USBTRACE2("setAddr:", rcode);
+                return rcode;
+        }
+
+        printf("\nUAS Addr:%d", bAddress);
+
+        p = addrPool.GetUsbDevicePtr(bAddress);
+        if (!p)
+                return USB_ERROR_ADDRESS_NOT_FOUND_IN_POOL;
+
+        p->lowspeed = lowspeed;
+
+        rcode = pUsb->setEpInfoEntry(bAddress, UAS_MAX_ENDPOINTS, epInfo);
+        if (rcode)
+                goto Fail;
+
+        rcode = pUsb->setConf(bAddress, 0, bConfNum);
+        if (rcode)
+                goto Fail;
+
+        // Setting 0 is Bulk-Only on most devices
+        rcode = ResetInterface();
+        if (rcode)
+                goto Fail;
+
+        rcode = OpenPipes();
+        if (rcode)
+                goto Fail;
+
+        ReportLUNs();
+
+        for (uint8_t lun = 0; lun <= bMaxLUN; lun++) {
+                InquiryResponse response;
+
+                if (Inquiry(lun, sizeof (InquiryResponse), (uint8_t*) & response))
+                        continue;
+                SCSIVersion[lun] = response.Version;
+                for (uint8_t tries = 0; tries < 10; tries++) {
+                        rcode = TestUnitReady(lun);
+                        if (!rcode || rcode == MASS_ERR_NO_MEDIA)
+                                break;
+                        delay(100);
+                }
+                if (!rcode)
+                        LUNOk[lun] = CheckLUN(lun);
+        }
+
+        rcode = OnInit();
+        if (rcode)
+                goto Fail;
+
+        USBTRACE("\nUAS configured\r\n\r\n");
+
+        qNextPollTime = millis() + UAS_POLL_INTERVAL;
+        bPollEnable = true;
+        return 0;
+
+Fail:
+#ifdef DEBUG_USB_HOST
+        Notify(PSTR("\r\nUAS Init Failed, error code: "), 0x80);
+        NotifyFail(rcode);
+#endif
+        Release();
+        return rcode;
+}
+
+uint8_t UAS::Release() {
+        uint8_t addr = bAddress;
+
+        for (uint8_t i = 1; i < UAS_MAX_ENDPOINTS; i++) {
+                if (!epInfo[i].hcNumber) // HC0&HC1 are taken by control pipe.
+                        continue;
+
+                uint8_t hc = (epInfo[i].epAddr & 0x80) ? epInfo[i].hcNumIn : epInfo[i].hcNumOut;
+
+                USB::USB_OTG_HC_Halt(pUsb->coreConfig, hc);
+                USB::USBH_Free_Channel(pUsb->coreConfig, hc);
+        }
+        ClearAllEP();
+        pUsb->GetAddressPool().FreeAddress(addr);
+        return 0;
+}
+
+uint8_t UAS::Poll() {
+        if (!bPollEnable)
+                return 0;
+
+        if ((int32_t)(millis() - qNextPollTime) >= 0) {
+                CheckMedia();
+                qNextPollTime = millis() + UAS_POLL_INTERVAL;
+        }
+        return 0;
+}
+
+/**
+ * Endpoints of the UAS setting go to the first free pipe, the Pipe Usage
+ * descriptor right behind moves them where they belong. Without one the
+ * endpoints stay in the order command, status, data-in, data-out.
+ */
+void UAS::EndpointXtract(uint8_t conf, uint8_t iface, uint8_t alt, uint8_t proto, const USB_ENDPOINT_DESCRIPTOR *pep) {
+        if ((pep->bmAttributes & 0x03) != USB_TRANSFER_TYPE_BULK)
+                return;
+
+        uint8_t pipe = UAS_PIPE_COMMAND;
+
+        while (pipe < UAS_MAX_ENDPOINTS && epInfo[pipe].epAddr)
+                pipe++;
+        if (pipe == UAS_MAX_ENDPOINTS)
+                return;
+
+        bConfNum = conf;
+        bIface = iface;
+        bAltSet = alt;
+
+        //st bsp needs full address(0x81 for in channel)
+        epInfo[pipe].epAddr = pep->bEndpointAddress;
+        epInfo[pipe].maxPktSize = pep->wMaxPacketSize & 0x7FF;
+        epInfo[pipe].epAttribs = 0;
+        epInfo[pipe].bmNakPower = (pipe == UAS_PIPE_STATUS) ? USB_NAK_NOWAIT : USB_NAK_DEFAULT;
+        bLastPipe = pipe;
+        bNumEP++;
+}
+
+void UAS::DescriptorXtract(uint8_t conf, uint8_t iface, uint8_t alt, const uint8_t *desc) {
+        if (desc[1] != UAS_DESCRIPTOR_PIPE_USAGE || desc[0] < 4 || !bLastPipe)
+                return;
+
+        uint8_t pipe = desc[2];
+
+        if (pipe < UAS_PIPE_COMMAND || pipe > UAS_PIPE_DATA_OUT || pipe == bLastPipe)
+                return;
+
+        EpInfo ep = epInfo[pipe];
+
+        epInfo[pipe] = epInfo[bLastPipe];
+        epInfo[bLastPipe] = ep;
+        // The status pipe is polled, the others wait for their data
+        epInfo[pipe].bmNakPower = (pipe == UAS_PIPE_STATUS) ? USB_NAK_NOWAIT : USB_NAK_DEFAULT;
+        epInfo[bLastPipe].bmNakPower = (bLastPipe == UAS_PIPE_STATUS) ? USB_NAK_NOWAIT : USB_NAK_DEFAULT;
+        bLastPipe = pipe;
+}
+
+/**
+ * For driver use only.
+ *
+ * Looks for the UAS setting in every configuration.
+ *
+ * @return 0 if all four pipes were found
+ */
+uint8_t UAS::FindPipes(uint8_t num_of_conf) {
+        for (uint8_t i = 0; i < num_of_conf; i++) {
+                ConfigDescWalker< USB_CLASS_MASS_STORAGE,
+                        MASS_SUBCLASS_SCSI,
+                        MASS_PROTO_UAS,
+                        CP_MASK_COMPARE_ALL > UASParser(this);
+
+                for (uint8_t pipe = 1; pipe < UAS_MAX_ENDPOINTS; pipe++)
+                        epInfo[pipe].epAddr = 0;
+                bNumEP = 1;
+                bLastPipe = 0;
+
+                uint8_t rcode = pUsb->getConfDescr(0, 0, i, &UASParser);
+
+                if (rcode)
+                        return rcode;
+                if (bNumEP == UAS_MAX_ENDPOINTS)
+                        break;
+        }
+
+        if (bNumEP != UAS_MAX_ENDPOINTS ||
+                !(epInfo[UAS_PIPE_STATUS].epAddr & 0x80) || !(epInfo[UAS_PIPE_DATA_IN].epAddr & 0x80) ||
+                (epInfo[UAS_PIPE_COMMAND].epAddr & 0x80) || (epInfo[UAS_PIPE_DATA_OUT].epAddr & 0x80)) {
+                printf("\nUAS Dev not supported, bNumEP = %d", bNumEP);
+                return USB_DEV_CONFIG_ERROR_DEVICE_NOT_SUPPORTED;
+        }
+        return 0;
+}
+
+/**
+ * For driver use only.
+ *
+ * A host channel for each pipe
+ */
+uint8_t UAS::OpenPipes() {
+        for (uint8_t i = 1; i < UAS_MAX_ENDPOINTS; i++) {
+                uint8_t hc = USB::USBH_Alloc_Channel(pUsb->coreConfig, epInfo[i].epAddr);
+
+                if (hc >= HC_MAX)
+                        return USB_ERROR_OUT_OF_ADDRESS_SPACE_IN_POOL;
+                if (epInfo[i].epAddr & 0x80)
+                        epInfo[i].hcNumIn = hc;
+                else
+                        epInfo[i].hcNumOut = hc;
+                USB::USBH_Open_Channel(pUsb->coreConfig, hc, bAddress,
+                        pUsb->GetHcSpeed(bAddress), EP_TYPE_BULK, epInfo[i].maxPktSize);
+                printf("\nUAS Pipe %d = %x, addr = 0x%x", i, hc, epInfo[i].epAddr);
+        }
+        return 0;
+}
+
+/**
+ * For driver use only.
+ *
+ * Selects the UAS setting. Selecting it again drops whatever the device had
+ * queued and puts the pipes back to DATA0.
+ */
+uint8_t UAS::ResetInterface() {
+        uint8_t rcode = pUsb->ctrlReq(bAddress, 0, USB_SETUP_HOST_TO_DEVICE | USB_SETUP_TYPE_STANDARD | USB_SETUP_RECIPIENT_INTERFACE,
+                USB_REQUEST_SET_INTERFACE, bAltSet, 0, bIface, 0, 0, NULL, NULL);
+
+        if (rcode)
+                return rcode;
+        for (uint8_t i = 1; i < UAS_MAX_ENDPOINTS; i++) {
+                epInfo[i].bmSndToggle = 0;
+                epInfo[i].bmRcvToggle = 0;
+        }
+        return 0;
+}
+
+void UAS::ClearAllEP() {
+        for (uint8_t i = 0; i < UAS_MAX_ENDPOINTS; i++) {
+                epInfo[i].epAddr = 0;
+                epInfo[i].maxPktSize = (i) ? 0 : 8;
+                epInfo[i].epAttribs = 0;
+                epInfo[i].bmNakPower = USB_NAK_DEFAULT;
+                epInfo[i].hcNumber = 0;
+        }
+
+        for (uint8_t i = 0; i < UAS_MAX_TAGS; i++)
+                tags[i].state = UAS_TAG_FREE;
+
+        for (uint8_t i = 0; i < MASS_MAX_SUPPORTED_LUN; i++) {
+                LUNOk[i] = false;
+                WriteOk[i] = false;
+                CurrentCapacity[i] = 0llu;
+                CurrentSectorSize[i] = 0;
+                CurrentPhysExp[i] = 0;
+                SCSIVersion[i] = 0;
+        }
+        bIface = 0;
+        bAltSet = 0;
+        bNumEP = 1;
+        bLastPipe = 0;
+
+        bAddress = 0;
+        qNextPollTime = 0;
+        bPollEnable = false;
+        bLastUsbError = 0;
+        bMaxLUN = 0;
+}
+
+/**
+ * For driver use only.
+ *
+ * Scan for media change on all LUNs
+ */
+void UAS::CheckMedia() {
+        for (uint8_t lun = 0; lun <= bMaxLUN; lun++) {
+                if (TestUnitReady(lun)) {
+                        LUNOk[lun] = false;
+                        continue;
+                }
+                if (!LUNOk[lun])
+                        LUNOk[lun] = CheckLUN(lun);
+        }
+}
+
+/**
+ * For driver use only. Same rules as BulkOnly::CheckLUN().
+ *
+ * @param lun Logical Unit Number
+ * @return true if LUN is ready for use.
+ */
+uint8_t UAS::CheckLUN(uint8_t lun) {
+        uint8_t cdb[16];
+        Capacity16 capacity;
+
+        memset(cdb, 0, sizeof (cdb));
+        memset(&capacity, 0, sizeof (capacity));
+        cdb[0] = SCSI_CMD_READ_CAPACITY_10;
+        if (Command(lun, cdb, 10, sizeof (Capacity), capacity.data, false))
+                return false;
+
+        uint32_t c = ((uint32_t)capacity.data[4] << 24) + ((uint32_t)capacity.data[5] << 16) + ((uint32_t)capacity.data[6] << 8) + (uint32_t)capacity.data[7];
+        uint64_t last = ((uint32_t)capacity.data[0] << 24) + ((uint32_t)capacity.data[1] << 16) + ((uint32_t)capacity.data[2] << 8) + (uint32_t)capacity.data[3];
+
+        CurrentPhysExp[lun] = 0;
+        if (last == 0xffffffffLLU || (MASS_RC16_SPC3 && SCSIVersion[lun] >= 5)) {
+                memset(&capacity, 0, sizeof (capacity));
+                cdb[0] = SCSI_CMD_SERVICE_ACTION_IN_16;
+                cdb[1] = SCSI_SA_READ_CAPACITY_16;
+                cdb[13] = sizeof (Capacity16);
+                if (!Command(lun, cdb, 16, sizeof (Capacity16), capacity.data, false)) {
+                        last = 0;
+                        for (uint8_t i = 0; i < 8; i++)
+                                last = (last << 8) | capacity.data[i];
+                        c = ((uint32_t)capacity.data[8] << 24) + ((uint32_t)capacity.data[9] << 16) + ((uint32_t)capacity.data[10] << 8) + (uint32_t)capacity.data[11];
+                        CurrentPhysExp[lun] = capacity.data[13] & 0x0f;
+                }
+        }
+        // Only 512/1024/2048/4096 are valid values!
+        if (c != 0x0200LU && c != 0x0400LU && c != 0x0800LU && c != 0x1000LU)
+                return false;
+        // Buggy firmware will report 0xffffffff or 0 for no media
+        if (last == 0xffffffffLLU || last == 0x00LLU)
+                return false;
+        CurrentSectorSize[lun] = (uint16_t)c;
+        CurrentCapacity[lun] = last;
+        Page3F(lun);
+        return !TestUnitReady(lun);
+}
+
+/**
+ * For driver use only.
+ *
+ * UAS has no GET MAX LUN, REPORT LUNS tells. LUNs are taken to be 0..n-1.
+ */
+uint8_t UAS::ReportLUNs() {
+        uint8_t cdb[12];
+        uint8_t buf[8 + 8 * MASS_MAX_SUPPORTED_LUN];
+
+        memset(cdb, 0, sizeof (cdb));
+        memset(buf, 0, sizeof (buf));
+        cdb[0] = SCSI_CMD_REPORT_LUNS;
+        cdb[9] = sizeof (buf);
+
+        bMaxLUN = 0;
+        uint8_t rcode = Command(0, cdb, sizeof (cdb), sizeof (buf), buf, false);
+
+        if (rcode)
+                return rcode;
+
+        uint32_t n = (((uint32_t)buf[0] << 24) + ((uint32_t)buf[1] << 16) + ((uint32_t)buf[2] << 8) + (uint32_t)buf[3]) / 8;
+
+        if (n > MASS_MAX_SUPPORTED_LUN)
+                n = MASS_MAX_SUPPORTED_LUN;
+        if (n)
+                bMaxLUN = n - 1;
+        ErrorMessage<uint8_t > (PSTR("MaxLUN"), bMaxLUN);
+        return 0;
+}
+
+uint8_t UAS::Inquiry(uint8_t lun, uint16_t bsize, uint8_t *buf) {
+        uint8_t cdb[6] = { SCSI_CMD_INQUIRY, 0, 0, (uint8_t)(bsize >> 8), (uint8_t)bsize, 0 };
+
+        return Command(lun, cdb, sizeof (cdb), bsize, buf, false);
+}
+
+uint8_t UAS::TestUnitReady(uint8_t lun) {
+        uint8_t cdb[6] = { SCSI_CMD_TEST_UNIT_READY, 0, 0, 0, 0, 0 };
+
+        return Command(lun, cdb, sizeof (cdb), 0, NULL, false);
+}
+
+/**
+ * For driver use only.
+ *
+ * Page 3F contains write protect status.
+ */
+uint8_t UAS::Page3F(uint8_t lun) {
+        uint8_t buf[192];
+        uint8_t cdb[6] = { SCSI_CMD_MODE_SENSE_6, 0, 0x3f, 0, sizeof (buf), 0 };
+
+        memset(buf, 0, sizeof (buf));
+        WriteOk[lun] = true;
+        uint8_t rc = Command(lun, cdb, sizeof (cdb), sizeof (buf), buf, false);
+        if (!rc)
+                WriteOk[lun] = ((buf[2] & 0x80) == 0);
+        return rc;
+}
+
+/**
+ * For driver use only.
+ *
+ * Splits a transfer in commands of MASS_MAX_TRANSFER_LENGTH at most and keeps
+ * up to UAS_MAX_TAGS of them in the device. They are waited for in order, the
+ * first error stops more from going out.
+ *
+ * @return 0 on success
+ */
+uint8_t UAS::ReadWrite(uint8_t lun, uint64_t addr, uint16_t bsize, uint16_t blocks, uint8_t *buf, bool write) {
+        uint32_t most = (bsize) ? MASS_MAX_TRANSFER_LENGTH / bsize : 1;
+        uint8_t queued[UAS_MAX_TAGS];
+        uint8_t head = 0;
+        uint8_t count = 0;
+        uint8_t er = MASS_ERR_SUCCESS;
+
+        if (!most)
+                most = 1;
+        for (;;) {
+                while (blocks && !er && count < UAS_MAX_TAGS) {
+                        uint16_t n = (blocks > most) ? most : blocks;
+                        bool cdb16 = (addr + n - 1 > 0xffffffffLLU);
+                        uint8_t cdb[16];
+                        uint8_t tag;
+
+                        memset(cdb, 0, sizeof (cdb));
+                        if (cdb16) {
+                                cdb[0] = (write) ? SCSI_CMD_WRITE_16 : SCSI_CMD_READ_16;
+                                for (uint8_t i = 0; i < 8; i++)
+                                        cdb[2 + i] = ((addr >> (56 - 8 * i)) & 0xff);
+                                cdb[12] = ((n >> 8) & 0xff);
+                                cdb[13] = (n & 0xff);
+                        } else {
+                                cdb[0] = (write) ? SCSI_CMD_WRITE_10 : SCSI_CMD_READ_10;
+                                cdb[2] = ((addr >> 24) & 0xff);
+                                cdb[3] = ((addr >> 16) & 0xff);
+                                cdb[4] = ((addr >> 8) & 0xff);
+                                cdb[5] = (addr & 0xff);
+                                cdb[7] = ((n >> 8) & 0xff);
+                                cdb[8] = (n & 0xff);
+                        }
+
+                        er = Submit(lun, cdb, (cdb16) ? 16 : 10, (uint32_t)bsize * n, buf, write, &tag);
+                        if (er)
+                                break;
+                        queued[(head + count) % UAS_MAX_TAGS] = tag;
+                        count++;
+                        addr += n;
+                        blocks -= n;
+                        buf += (uint32_t)bsize * n;
+                }
+                if (!count)
+                        break;
+
+                uint8_t rcode = Wait(queued[head]);
+
+                head = (head + 1) % UAS_MAX_TAGS;
+                count--;
+                if (rcode && !er)
+                        er = rcode;
+        }
+        return er;
+}
+
+/**
+ * For driver use only.
+ *
+ * Reads one IU from the status pipe and acts on it.
+ *
+ * @return UAS_ERR_IDLE if there was none, else 0 or a transport error
+ */
+uint8_t UAS::Service() {
+        uint16_t len = sizeof (bStatusIU);
+        uint8_t rcode = pUsb->inTransfer(bAddress, epInfo[UAS_PIPE_STATUS].epAddr, &len, bStatusIU);
+
+        if (rcode == hrNAK)
+                return UAS_ERR_IDLE;
+        if (rcode)
+                return HandleUsbError(rcode, UAS_PIPE_STATUS);
+        if (len < 4)
+                return MASS_ERR_GENERAL_USB_ERROR;
+
+        uint16_t tag = ((uint16_t)bStatusIU[2] << 8) | bStatusIU[3];
+
+        // Nothing in flight under that tag, an answer to a command given up on
+        if (!tag || tag > UAS_MAX_TAGS || tags[tag - 1].state != UAS_TAG_QUEUED)
+                return MASS_ERR_SUCCESS;
+
+        UASTag *t = &tags[tag - 1];
+
+        switch (bStatusIU[0]) {
+                case UAS_IU_READ_READY:
+                case UAS_IU_WRITE_READY:
+                        if (t->write != (bStatusIU[0] == UAS_IU_WRITE_READY))
+                                return MASS_ERR_PHASE_ERROR;
+                        return DataPhase(t);
+                case UAS_IU_SENSE:
+                {
+                        if (len < 16)
+                                return MASS_ERR_GENERAL_USB_ERROR;
+
+                        uint16_t slen = ((uint16_t)bStatusIU[14] << 8) | bStatusIU[15];
+
+                        if (slen > len - 16)
+                                slen = len - 16;
+                        switch (bStatusIU[6]) {
+                                case 0:
+                                        Complete(t, MASS_ERR_SUCCESS);
+                                        break;
+                                case SCSI_STATUS_CHECK_CONDITION:
+                                        Complete(t, SenseError(&bStatusIU[16], slen));
+                                        break;
+                                case SCSI_STATUS_BUSY:
+                                        Complete(t, MASS_ERR_UNIT_BUSY);
+                                        break;
+                                default:
+                                        Complete(t, MASS_ERR_GENERAL_SCSI_ERROR);
+                                        break;
+                        }
+                        return MASS_ERR_SUCCESS;
+                }
+                case UAS_IU_RESPONSE:
+                        // The command IU itself was refused
+                        ErrorMessage<uint8_t > (PSTR("UAS Response"), (len > 7) ? bStatusIU[7] : 0);
+                        Complete(t, MASS_ERR_GENERAL_SCSI_ERROR);
+                        return MASS_ERR_SUCCESS;
+                default:
+                        return MASS_ERR_GENERAL_USB_ERROR;
+        }
+}
+
+/**
+ * For driver use only.
+ *
+ * Moves the data of a tag the device said it is ready for. A short packet
+ * ends a read early, the rest would come after another READ READY.
+ */
+uint8_t UAS::DataPhase(UASTag *t) {
+        uint8_t pipe = (t->write) ? UAS_PIPE_DATA_OUT : UAS_PIPE_DATA_IN;
+        uint16_t most = DataChunk(pipe);
+
+        while (t->done < t->length) {
+                uint32_t left = t->length - t->done;
+                uint16_t want = (left > most) ? most : left;
+                uint16_t len = want;
+                uint8_t rcode;
+
+                if (t->write)
+                        rcode = pUsb->outTransfer(bAddress, epInfo[pipe].epAddr, len, t->buf + t->done);
+                else
+                        rcode = pUsb->inTransfer(bAddress, epInfo[pipe].epAddr, &len, t->buf + t->done);
+                if (rcode)
+                        return HandleUsbError(rcode, pipe);
+                t->done += len;
+                if (len < want)
+                        break;
+        }
+        return MASS_ERR_SUCCESS;
+}
+
+/**
+ * For driver use only. Same as BulkOnly::DataChunk().
+ */
+uint16_t UAS::DataChunk(uint8_t pipe) {
+        uint16_t pkt = (epInfo[pipe].maxPktSize) ? epInfo[pipe].maxPktSize : 64;
+        uint32_t most = (uint32_t)pkt * USBH_MAX_HC_PKT_COUNT;
+
+        if (most > 0xFFFF)
+                most = 0xFFFF - (0xFFFF % pkt);
+        return most;
+}
+
+void UAS::Complete(UASTag *t, uint8_t result) {
+        t->result = result;
+        t->state = UAS_TAG_DONE;
+}
+
+void UAS::AbortAll(uint8_t result) {
+        for (uint8_t i = 0; i < UAS_MAX_TAGS; i++)
+                if (tags[i].state == UAS_TAG_QUEUED)
+                        Complete(&tags[i], result);
+}
+
+uint8_t UAS::ClearEpHalt(uint8_t pipe) {
+        uint8_t ret = pUsb->ctrlReq(bAddress, 0, USB_SETUP_HOST_TO_DEVICE | USB_SETUP_TYPE_STANDARD | USB_SETUP_RECIPIENT_ENDPOINT,
+                USB_REQUEST_CLEAR_FEATURE, USB_FEATURE_ENDPOINT_HALT, 0, epInfo[pipe].epAddr, 0, 0, NULL, NULL);
+
+        if (ret)
+                ErrorMessage<uint8_t > (PSTR("ClearEpHalt"), ret);
+        // ctrlReq() put the endpoint's toggle back to DATA0
+        return ret;
+}
+
+/**
+ * For driver use only.
+ *
+ * @param error USB error code
+ * @param pipe UAS_PIPE_xxx
+ * @return MASS_ERR_xxx
+ */
+uint8_t UAS::HandleUsbError(uint8_t error, uint8_t pipe) {
+        bLastUsbError = error;
+        switch (error) {
+                case hrSUCCESS:
+                        return MASS_ERR_SUCCESS;
+                case hrBUSY:
+                case hrNAK:
+                        return MASS_ERR_UNIT_BUSY;
+                case hrTIMEOUT:
+                case hrJERR:
+                        return MASS_ERR_DEVICE_DISCONNECTED;
+                case hrSTALL:
+                        ClearEpHalt(pipe);
+                        return (pipe == UAS_PIPE_DATA_OUT || pipe == UAS_PIPE_COMMAND) ? MASS_ERR_WRITE_STALL : MASS_ERR_STALL;
+                default:
+                        ErrorMessage<uint8_t > (PSTR("UAS USB Error"), error);
+                        return MASS_ERR_GENERAL_USB_ERROR;
+        }
+}
+
+/**
+ * For driver use only.
+ *
+ * Sense data of a Sense IU, fixed or descriptor format, to MASS_ERR_xxx
+ * the way BulkOnly::HandleSCSIError() has it.
+ */
+uint8_t UAS::SenseError(const uint8_t *sense, uint16_t len) {
+        uint8_t key;
+        uint8_t asc;
+
+        if (len < 3)
+                return MASS_ERR_GENERAL_SCSI_ERROR;
+        if ((sense[0] & 0x7f) >= 0x72) {
+                key = sense[1] & 0x0f;
+                asc = sense[2];
+        } else {
+                key = sense[2] & 0x0f;
+                asc = (len > 12) ? sense[12] : 0;
+        }
+        switch (key) {
+                case SCSI_S_UNIT_ATTENTION:
+                        return (asc == SCSI_ASC_MEDIA_CHANGED) ? MASS_ERR_MEDIA_CHANGED : MASS_ERR_UNIT_NOT_READY;
+                case SCSI_S_NOT_READY:
+                        return (asc == SCSI_ASC_MEDIUM_NOT_PRESENT) ? MASS_ERR_NO_MEDIA : MASS_ERR_UNIT_NOT_READY;
+                case SCSI_S_ILLEGAL_REQUEST:
+                        return (asc == SCSI_ASC_LBA_OUT_OF_RANGE) ? MASS_ERR_BAD_LBA : MASS_ERR_CMD_NOT_SUPPORTED;
+                default:
+                        return MASS_ERR_GENERAL_SCSI_ERROR;
+        }
+}
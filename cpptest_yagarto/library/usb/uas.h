@@ -0,0 +1,196 @@
+/*
+ * uas.h
+ *
+ * USB Attached SCSI (UAS) class driver, the sibling of BulkOnly for mass storage
+ * interfaces with protocol MASS_PROTO_UAS. The interface has four bulk pipes,
+ * told apart by their Pipe Usage descriptors: command, status, data-in and
+ * data-out. Every command carries a tag, and up to UAS_MAX_TAGS of them are
+ * queued in the device at once.
+ *
+ * The OTG core is a USB 2.0 host, there are no bulk streams. The device says
+ * which tag it is ready to move data for with a READ READY or WRITE READY IU on
+ * the status pipe, and the data pipes serve the tags one by one in that order.
+ * Commands still overlap: the device fetches, seeks and reorders the queued ones
+ * while the data of another is on the bus.
+ *
+ * Storage calls mirror those of BulkOnly, so it plugs into storage_t the same way.
+ */
+
+#if !defined(__UAS_H__)
+#define __UAS_H__
+
+#include "masstorage.h"
+
+#ifndef UAS_MAX_TAGS
+#define UAS_MAX_TAGS			4	// commands in flight
+#endif
+
+#ifndef UAS_COMMAND_TIMEOUT
+#define UAS_COMMAND_TIMEOUT		20000	// ms without a word from the status pipe before a command is given up
+#endif
+
+#define UAS_POLL_INTERVAL		1000	// ms between media checks
+
+// Pipe IDs of the Pipe Usage descriptor, also the epInfo[] index of the pipe
+#define UAS_PIPE_COMMAND		1
+#define UAS_PIPE_STATUS			2
+#define UAS_PIPE_DATA_IN		3
+#define UAS_PIPE_DATA_OUT		4
+#define UAS_MAX_ENDPOINTS		5
+
+#define UAS_DESCRIPTOR_PIPE_USAGE	0x24
+
+// Information unit IDs
+#define UAS_IU_COMMAND			0x01
+#define UAS_IU_SENSE			0x03
+#define UAS_IU_RESPONSE			0x04
+#define UAS_IU_TASK_MANAGEMENT		0x05
+#define UAS_IU_READ_READY		0x06
+#define UAS_IU_WRITE_READY		0x07
+
+#define UAS_TASK_SIMPLE			0x00	// task attribute of a Command IU
+
+#define UAS_STATUS_IU_SIZE		112	// Sense IU header and 96 bytes of sense data
+
+#define UAS_ERR_IDLE			(MASS_ERR_USER + 0)	// Service(): the status pipe had nothing to say
+
+#define UAS_TAG_FREE			0
+#define UAS_TAG_QUEUED			1	// Command IU sent
+#define UAS_TAG_DONE			2	// Sense or Response IU received, result is valid
+
+#define SCSI_STATUS_CHECK_CONDITION	0x02
+#define SCSI_STATUS_BUSY		0x08
+
+struct UASCommandIU {
+        uint8_t bIUID; // UAS_IU_COMMAND
+        uint8_t bReserved1;
+        uint8_t wTag[2]; // big endian, like every field of an IU
+        uint8_t bAttribute; // UAS_TASK_xxx
+        uint8_t bReserved5;
+        uint8_t bAddCDBLength; // CDB bytes past 16 in dwords, bits 7..2
+        uint8_t bReserved7;
+        uint8_t LUN[8];
+        uint8_t CDB[16];
+} __attribute__((packed));
+
+struct UASTag {
+        uint8_t *buf;
+        uint32_t length; // data phase, bytes
+        uint32_t done; // moved so far
+        uint8_t lun;
+        uint8_t state; // UAS_TAG_xxx
+        bool write;
+        uint8_t result; // MASS_ERR_xxx, once UAS_TAG_DONE
+};
+
+class UAS : public USBDeviceConfig, public UsbConfigXtracter {
+protected:
+        USB *pUsb;
+        uint8_t bAddress;
+        uint8_t bConfNum; // configuration number
+        uint8_t bIface; // interface value
+        uint8_t bAltSet; // alternate setting with the UAS pipes
+        uint8_t bNumEP; // endpoints of the UAS setting
+        uint8_t bLastPipe; // pipe of the endpoint descriptor seen last, for its Pipe Usage descriptor
+        uint32_t qNextPollTime; // next poll time
+        bool bPollEnable; // poll enable flag
+
+        EpInfo epInfo[UAS_MAX_ENDPOINTS];
+
+        UASTag tags[UAS_MAX_TAGS]; // tag n is tags[n - 1]
+        uint8_t bStatusIU[UAS_STATUS_IU_SIZE];
+        uint8_t bLastUsbError; // Last USB error
+        uint8_t bMaxLUN; // Max LUN
+        uint64_t CurrentCapacity[MASS_MAX_SUPPORTED_LUN]; // Total sectors
+        uint16_t CurrentSectorSize[MASS_MAX_SUPPORTED_LUN]; // Sector size, 512 to 4096
+        uint8_t CurrentPhysExp[MASS_MAX_SUPPORTED_LUN]; // logical blocks per physical block, log2
+        uint8_t SCSIVersion[MASS_MAX_SUPPORTED_LUN]; // INQUIRY version, 5 and up is SPC-3
+        bool LUNOk[MASS_MAX_SUPPORTED_LUN];
+        bool WriteOk[MASS_MAX_SUPPORTED_LUN];
+
+        // Additional Initialization Method for Subclasses
+
+        virtual uint8_t OnInit() {
+                return 0;
+        };
+public:
+        UAS(USB *p);
+
+        uint8_t GetLastUsbError() {
+                return bLastUsbError;
+        };
+
+        uint8_t GetbMaxLUN() {
+                return bMaxLUN;
+        };
+
+        UsbHealth* GetHealth() {
+                return pUsb->GetDeviceHealth(bAddress);
+        };
+
+        uint8_t WriteProtected(uint8_t lun);
+        uint8_t Read(uint8_t lun, uint64_t addr, uint16_t bsize, uint16_t blocks, uint8_t *buf);
+        uint8_t Write(uint8_t lun, uint64_t addr, uint16_t bsize, uint16_t blocks, const uint8_t *buf);
+
+        bool LUNIsGood(uint8_t lun);
+        uint32_t GetCapacity(uint8_t lun);
+        uint64_t GetCapacity64(uint8_t lun);
+        uint16_t GetSectorSize(uint8_t lun);
+        uint32_t GetPhysicalSectorSize(uint8_t lun);
+
+        // Tagged commands. Submit() queues one and returns at once with its tag,
+        // Wait() moves the data of all queued commands until that tag completes.
+        uint8_t Submit(uint8_t lun, const uint8_t *cdb, uint8_t cdblen, uint32_t length, uint8_t *buf, bool write, uint8_t *ptag);
+        uint8_t Wait(uint8_t tag);
+        uint8_t Command(uint8_t lun, const uint8_t *cdb, uint8_t cdblen, uint32_t length, uint8_t *buf, bool write);
+
+        // Commands queued in the device
+        uint8_t GetQueued();
+
+        // USBDeviceConfig implementation
+        virtual uint8_t Init(uint8_t parent, uint8_t port, bool lowspeed);
+        virtual uint8_t ConfigureDevice(uint8_t parent, uint8_t port, bool lowspeed);
+
+        virtual uint8_t Release();
+        virtual uint8_t Poll();
+
+        virtual uint8_t GetAddress() {
+                return bAddress;
+        };
+
+        // UsbConfigXtracter implementation
+        virtual void EndpointXtract(uint8_t conf, uint8_t iface, uint8_t alt, uint8_t proto, const USB_ENDPOINT_DESCRIPTOR *ep);
+        virtual void DescriptorXtract(uint8_t conf, uint8_t iface, uint8_t alt, const uint8_t *desc);
+        virtual uint8_t DEVCLASSOK(uint8_t klass) { return (klass == USB_CLASS_MASS_STORAGE); }
+
+        virtual const UsbMatchEntry* GetMatchTable(uint8_t *count) {
+                static const UsbMatchEntry table[] = {
+                        { USB_MATCH_IF_ALL, 0, 0, USB_CLASS_MASS_STORAGE, MASS_SUBCLASS_SCSI, MASS_PROTO_UAS }
+                };
+                *count = sizeof (table) / sizeof (UsbMatchEntry);
+                return table;
+        };
+
+private:
+        uint8_t FindPipes(uint8_t num_of_conf);
+        uint8_t OpenPipes();
+        void ClearAllEP();
+        void CheckMedia();
+        uint8_t CheckLUN(uint8_t lun);
+        uint8_t ReportLUNs();
+        uint8_t Inquiry(uint8_t lun, uint16_t size, uint8_t *buf);
+        uint8_t TestUnitReady(uint8_t lun);
+        uint8_t Page3F(uint8_t lun);
+        uint8_t ReadWrite(uint8_t lun, uint64_t addr, uint16_t bsize, uint16_t blocks, uint8_t *buf, bool write);
+        uint8_t Service();
+        uint8_t DataPhase(UASTag *t);
+        uint16_t DataChunk(uint8_t pipe);
+        void Complete(UASTag *t, uint8_t result);
+        void AbortAll(uint8_t result);
+        uint8_t ResetInterface();
+        uint8_t ClearEpHalt(uint8_t pipe);
+        uint8_t HandleUsbError(uint8_t error, uint8_t pipe);
+        static uint8_t SenseError(const uint8_t *sense, uint16_t len);
+};
+
+#endif // __UAS_H__
@@ -91,6 +91,9 @@ typedef enum {
   HC_XACTERR,  
   HC_BBLERR,   
   HC_DATATGLERR,  
+  HC_PINGACK,     /* PING answered, the OUT data may follow */
+  HC_SPLIT_ACK,   /* start split taken by the TT, the complete split follows */
+  HC_SPLIT_RETRY, /* start split of the current packet (again) */
 }HC_STATUS;
 
 typedef enum {
@@ -122,20 +125,48 @@ typedef struct USB_OTG_hc
   uint8_t       do_ping;  
   uint8_t       ep_type;
   uint16_t      max_packet;
+  uint8_t       multi_count; /* additional transactions per microframe, high-bandwidth endpoints */
   uint8_t       data_pid;
   uint8_t       *xfer_buff;
   uint32_t      xfer_len;
   uint32_t      xfer_count;  
-  //TODO: i need to cut these two toggle vars, and use the bmSndToggle/bmRcvToggle instead.
+  /* DATA0/1 of the next packet. Loaded from EpInfo::bmRcvToggle/bmSndToggle
+     for each transfer, taken back from HCTSIZ.PID when the channel halts. */
   uint8_t       toggle_in;
-  uint8_t isEvenTimesToggle;
   uint8_t       toggle_out;
   uint16_t		nak_count;
   uint16_t 		nak_limit;
+  /* high speed OUT flow control, per channel and so per endpoint */
+  uint32_t      ping_count;     /* PINGs sent */
+  uint32_t      ping_nak_count; /* PINGs NAKed, the endpoint was still busy */
+  uint32_t      nyet_count;     /* packets accepted with NYET */
+  uint32_t      out_nak_count;  /* data packets NAKed, the bandwidth PING saves */
+  /* split transactions through the Transaction Translator of a high speed hub,
+     one packet per start/complete split pair */
+  uint8_t       do_split;       /* full/low speed device behind a high speed hub */
+  uint8_t       hub_addr;       /* address of that hub */
+  uint8_t       hub_port;       /* hub port the device hangs off */
+  uint8_t       split_complete; /* 0: start split next, 1: complete split next */
+  uint16_t      split_len;      /* bytes of the packet in flight */
+  uint16_t      csplit_nyet;    /* complete splits NYETed for the packet in flight */
+  uint32_t      split_total;    /* bytes of the whole transfer */
+  uint32_t      split_done;     /* bytes of it moved so far */
   uint32_t       dma_addr;  
 }
 USB_OTG_HC , *PUSB_OTG_HC;
 
+/* Channel halts posted by the interrupt handler and finished by
+   USBH_OTG_DeferredHandler(). A halted channel raises no further interrupt
+   until it is restarted, so one slot per channel is always enough. */
+#define USBH_EVENT_QUEUE_SIZE   16   /* power of two, >= host channels */
+
+typedef struct USBH_hc_event
+{
+  uint8_t       chnum;
+  uint8_t       kind;        /* IN, OUT or split channel, see usb_hcd_int.cpp */
+}
+USBH_HC_EVENT;
+
 typedef struct USB_OTG_ep
 {
   uint8_t        num;
@@ -283,6 +314,10 @@ typedef struct _HCD
 	USB_OTG_HC       	hc [USB_OTG_MAX_TX_FIFOS];
 	uint16_t			channel [USB_OTG_MAX_TX_FIFOS];
 	__IO uint32_t 		SofHits;
+	__IO USBH_HC_EVENT	Event[USBH_EVENT_QUEUE_SIZE];
+	__IO uint8_t		EventHead;		// written by the interrupt handler only
+	__IO uint8_t		EventTail;		// written by the deferred handler only
+	__IO uint32_t		EventOverrun;	// halts finished in the interrupt, queue full
 //	uint16_t			hc_num_out;
 //	uint16_t			hc_num_in;
 	uint32_t			port_need_reset;
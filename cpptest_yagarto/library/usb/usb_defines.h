@@ -174,8 +174,22 @@
 #define HCCHAR_BULK                            2
 #define HCCHAR_INTR                            3
 
+#define HCSPLT_XACTPOS_MID                     0
+#define HCSPLT_XACTPOS_END                     1
+#define HCSPLT_XACTPOS_BEGIN                   2
+#define HCSPLT_XACTPOS_ALL                     3
+
 #define  MIN(a, b)      (((a) < (b)) ? (a) : (b))
 
+/* With USB_OTG_RAMFUNC defined the interrupt and FIFO copy paths run from SRAM.
+   The linker scripts gather .ramfunc into .data, so the startup code copies it
+   along with the initialised data. long_call lets flash code reach it. */
+#ifdef USB_OTG_RAMFUNC
+#define __RAMFUNC   __attribute__ ((section (".ramfunc"), noinline, long_call))
+#else
+#define __RAMFUNC
+#endif
+
 /**
   * @}
   */
@@ -54,6 +54,21 @@
 /** @defgroup USB_HCD_INT_Private_Defines
 * @{
 */ 
+#define SPLIT_ERR_LIMIT        3  /* transaction errors in a row before a split transfer fails */
+#define SPLIT_CSPLIT_NYET_MAX  3  /* periodic complete splits NYETed before the start split is repeated */
+
+/* kind of channel a queued halt belongs to, see USBH_HC_EVENT */
+#define HC_EVENT_IN            0
+#define HC_EVENT_OUT           1
+#define HC_EVENT_SPLIT         2
+
+#ifdef USBH_ISR_CYCLE_STATS
+#define DWT_CTRL               (*(volatile uint32_t *)0xE0001000)
+#define DWT_CYCCNT             (*(volatile uint32_t *)0xE0001004)
+#define DWT_CTRL_CYCCNTENA     0x00000001
+#define DEMCR                  (*(volatile uint32_t *)0xE000EDFC)
+#define DEMCR_TRCENA           0x01000000
+#endif
 /**
 * @}
 */ 
@@ -79,6 +94,10 @@
 /** @defgroup USB_HCD_INT_Private_Variables
 * @{
 */ 
+USB_OTG_CORE_HANDLE *USBH_OTG_Core[2];
+#ifdef USBH_ISR_CYCLE_STATS
+volatile USBH_ISR_CYCLES_TypeDef USBH_ISR_Cycles[2];
+#endif
 /**
 * @}
 */ 
@@ -88,18 +107,26 @@
 * @{
 */ 
 
-static uint32_t USB_OTG_USBH_handle_sof_ISR(USB_OTG_CORE_HANDLE *pdev);
+static uint32_t USB_OTG_USBH_handle_sof_ISR(USB_OTG_CORE_HANDLE *pdev) __RAMFUNC;
 static uint32_t USB_OTG_USBH_handle_port_ISR(USB_OTG_CORE_HANDLE *pdev);
-static uint32_t USB_OTG_USBH_handle_hc_ISR (USB_OTG_CORE_HANDLE *pdev);
+static uint32_t USB_OTG_USBH_handle_hc_ISR (USB_OTG_CORE_HANDLE *pdev) __RAMFUNC;
 static uint32_t USB_OTG_USBH_handle_hc_n_In_ISR (USB_OTG_CORE_HANDLE *pdev ,
-                                                 uint32_t num);
+                                                 uint32_t num) __RAMFUNC;
 static uint32_t USB_OTG_USBH_handle_hc_n_Out_ISR (USB_OTG_CORE_HANDLE *pdev , 
-                                                  uint32_t num);
-static uint32_t USB_OTG_USBH_handle_rx_qlvl_ISR (USB_OTG_CORE_HANDLE *pdev);
-static uint32_t USB_OTG_USBH_handle_nptxfempty_ISR (USB_OTG_CORE_HANDLE *pdev);
-static uint32_t USB_OTG_USBH_handle_ptxfempty_ISR (USB_OTG_CORE_HANDLE *pdev);
+                                                  uint32_t num) __RAMFUNC;
+static uint32_t USB_OTG_USBH_handle_hc_n_Split_ISR (USB_OTG_CORE_HANDLE *pdev , 
+                                                    uint32_t num) __RAMFUNC;
+static uint32_t USB_OTG_USBH_handle_rx_qlvl_ISR (USB_OTG_CORE_HANDLE *pdev) __RAMFUNC;
+static uint32_t USB_OTG_USBH_handle_nptxfempty_ISR (USB_OTG_CORE_HANDLE *pdev) __RAMFUNC;
+static uint32_t USB_OTG_USBH_handle_ptxfempty_ISR (USB_OTG_CORE_HANDLE *pdev) __RAMFUNC;
 static uint32_t USB_OTG_USBH_handle_Disconnect_ISR (USB_OTG_CORE_HANDLE *pdev);
 static uint32_t USB_OTG_USBH_handle_IncompletePeriodicXfer_ISR (USB_OTG_CORE_HANDLE *pdev);
+static void USB_OTG_USBH_post_hc_halt (USB_OTG_CORE_HANDLE *pdev, uint32_t num, uint8_t kind) __RAMFUNC;
+static void USB_OTG_USBH_hc_n_Halted (USB_OTG_CORE_HANDLE *pdev , uint32_t num, uint8_t kind) __RAMFUNC;
+static void USB_OTG_USBH_hc_n_In_Halted (USB_OTG_CORE_HANDLE *pdev , uint32_t num) __RAMFUNC;
+static void USB_OTG_USBH_hc_n_Out_Halted (USB_OTG_CORE_HANDLE *pdev , uint32_t num) __RAMFUNC;
+static void USB_OTG_USBH_hc_n_Split_Halted (USB_OTG_CORE_HANDLE *pdev , uint32_t num) __RAMFUNC;
+static void USB_OTG_USBH_sync_toggle (USB_OTG_CORE_HANDLE *pdev , uint32_t num, uint8_t is_in) __RAMFUNC;
 
 /**
 * @}
@@ -110,6 +137,65 @@ static uint32_t USB_OTG_USBH_handle_IncompletePeriodicXfer_ISR (USB_OTG_CORE_HAN
 * @{
 */ 
 
+/**
+* @brief  USBH_OTG_IRQ_Handler 
+*         Routes the interrupt of an OTG core to the host running on it
+* @param  coreID: USB_OTG_FS_CORE_ID or USB_OTG_HS_CORE_ID
+* @retval status 
+*/
+uint32_t USBH_OTG_IRQ_Handler (USB_OTG_CORE_ID_TypeDef coreID)
+{
+  USB_OTG_CORE_HANDLE *pdev = USBH_OTG_Core[coreID];
+  uint32_t retval;
+
+  if (pdev == 0)
+  {
+    return 0;
+  }
+#ifdef USBH_ISR_CYCLE_STATS
+  uint32_t start = DWT_CYCCNT;
+  retval = USBH_OTG_ISR_Handler(pdev);
+  uint32_t cycles = DWT_CYCCNT - start;
+  volatile USBH_ISR_CYCLES_TypeDef *stats = &USBH_ISR_Cycles[coreID];
+
+  stats->last = cycles;
+  if (stats->count == 0 || cycles < stats->min)
+  {
+    stats->min = cycles;
+  }
+  if (cycles > stats->max)
+  {
+    stats->max = cycles;
+  }
+  stats->count++;
+#else
+  retval = USBH_OTG_ISR_Handler(pdev);
+#endif
+  return retval;
+}
+
+#ifdef USBH_ISR_CYCLE_STATS
+/**
+* @brief  USBH_ISR_Cycles_Reset 
+*         Starts the DWT cycle counter and clears the ISR cycle statistics
+* @param  None
+* @retval None
+*/
+void USBH_ISR_Cycles_Reset (void)
+{
+  DEMCR |= DEMCR_TRCENA;
+  DWT_CTRL |= DWT_CTRL_CYCCNTENA;
+
+  for (uint8_t i = 0; i < 2; i++)
+  {
+    USBH_ISR_Cycles[i].count = 0;
+    USBH_ISR_Cycles[i].last = 0;
+    USBH_ISR_Cycles[i].min = 0;
+    USBH_ISR_Cycles[i].max = 0;
+  }
+}
+#endif
+
 /**
 * @brief  HOST_Handle_ISR 
 *         This function handles all USB Host Interrupts
@@ -204,7 +290,11 @@ static uint32_t USB_OTG_USBH_handle_hc_ISR (USB_OTG_CORE_HANDLE *pdev)
     {
       hcchar.d32 = USB_OTG_READ_REG32(&pdev->regs.HC_REGS[i]->HCCHAR);
       
-      if (hcchar.b.epdir)
+      if (pdev->host.hc[i].do_split)
+      {
+        retval |= USB_OTG_USBH_handle_hc_n_Split_ISR (pdev, i);
+      }
+      else if (hcchar.b.epdir)
       {
         retval |= USB_OTG_USBH_handle_hc_n_In_ISR (pdev, i);
       }
@@ -498,6 +588,17 @@ uint32_t USB_OTG_USBH_handle_hc_n_Out_ISR (USB_OTG_CORE_HANDLE *pdev , uint32_t
   else if (hcint.b.ack)
   {
     CLEAR_HC_INT(hcreg , ack);
+    if (pdev->host.hc[num].do_ping)
+    {
+      /* PING ACKed: the endpoint has room, halt and send the data from chhltd */
+      hcintmsk.d32 = USB_OTG_READ_REG32(&hcreg->HCINTMSK);
+      hcintmsk.b.ack = 0;
+      USB_OTG_WRITE_REG32(&hcreg->HCINTMSK, hcintmsk.d32);
+      pdev->host.hc[num].do_ping = 0;
+      UNMASK_HOST_INT_CHH (num);
+      USB::USB_OTG_HC_Halt(pdev, num);
+      pdev->host.HC_Status[num] = HC_PINGACK;
+    }
   }
   else if (hcint.b.frmovrun)
   {
@@ -511,6 +612,13 @@ uint32_t USB_OTG_USBH_handle_hc_n_Out_ISR (USB_OTG_CORE_HANDLE *pdev , uint32_t
     UNMASK_HOST_INT_CHH (num);
     USB::USB_OTG_HC_Halt(pdev, num);
     CLEAR_HC_INT(hcreg , xfercompl);
+    if (hcint.b.nyet)
+    {
+      /* last packet taken, but the next one would be NYETed */
+      CLEAR_HC_INT(hcreg , nyet);
+      pdev->host.hc[num].nyet_count++;
+      pdev->host.hc[num].do_ping = (pdev->host.hc[num].speed == HPRT0_PRTSPD_HIGH_SPEED);
+    }
     pdev->host.HC_Status[num] = HC_XFRC;            
   }
   
@@ -525,6 +633,14 @@ uint32_t USB_OTG_USBH_handle_hc_n_Out_ISR (USB_OTG_CORE_HANDLE *pdev , uint32_t
   else if (hcint.b.nak)
   {
 	pdev->host.ErrCnt[num] = 0;
+	if (pdev->host.hc[num].do_ping)
+		pdev->host.hc[num].ping_nak_count++;
+	else
+		pdev->host.hc[num].out_nak_count++;
+	/* bulk and control OUT at high speed: PING until the endpoint is ready */
+	if (pdev->host.hc[num].speed == HPRT0_PRTSPD_HIGH_SPEED &&
+	    hcchar.b.eptype != EP_TYPE_INTR && hcchar.b.eptype != EP_TYPE_ISOC)
+		pdev->host.hc[num].do_ping = 1;
 	UNMASK_HOST_INT_CHH (num);
 	USB::USB_OTG_HC_Halt(pdev, num);
 	CLEAR_HC_INT(hcreg , nak);
@@ -542,6 +658,8 @@ uint32_t USB_OTG_USBH_handle_hc_n_Out_ISR (USB_OTG_CORE_HANDLE *pdev , uint32_t
   else if (hcint.b.nyet)
   {
     pdev->host.ErrCnt[num] = 0;
+    pdev->host.hc[num].nyet_count++;
+    pdev->host.hc[num].do_ping = (pdev->host.hc[num].speed == HPRT0_PRTSPD_HIGH_SPEED);
     UNMASK_HOST_INT_CHH (num);
     USB::USB_OTG_HC_Halt(pdev, num);
     CLEAR_HC_INT(hcreg , nyet);
@@ -560,47 +678,156 @@ uint32_t USB_OTG_USBH_handle_hc_n_Out_ISR (USB_OTG_CORE_HANDLE *pdev , uint32_t
   else if (hcint.b.chhltd)
   {
     MASK_HOST_INT_CHH (num);
+    CLEAR_HC_INT(hcreg , chhltd);
+    USB_OTG_USBH_post_hc_halt (pdev, num, HC_EVENT_OUT);
+  }
+  
+  
+  return 1;
+}
+#if defined ( __ICCARM__ ) /*!< IAR Compiler */
+#pragma optimize = none
+#endif /* __CC_ARM */
+/**
+* @brief  USB_OTG_USBH_handle_hc_n_Split_ISR 
+*         Handles interrupt for a channel talking to a full/low speed device
+*         through the Transaction Translator of a high speed hub. Every packet
+*         is a start split (ACKed by the TT) followed by complete splits until
+*         the TT has the device's answer. The next packet is started from here,
+*         the URB completes when the whole transfer is through.
+* @param  pdev: Selected device
+* @param  hc_num: Channel number
+* @retval status 
+*/
+uint32_t USB_OTG_USBH_handle_hc_n_Split_ISR (USB_OTG_CORE_HANDLE *pdev , uint32_t num)
+{
+  USB_OTG_HCINTn_TypeDef     hcint;
+  USB_OTG_HCINTMSK_TypeDef  hcintmsk;
+  USB_OTG_HC_REGS *hcreg;
+  USB_OTG_HC *hc = &pdev->host.hc[num];
+  
+  hcreg = pdev->regs.HC_REGS[num];
+  hcint.d32 = USB_OTG_READ_REG32(&hcreg->HCINT);
+  hcintmsk.d32 = USB_OTG_READ_REG32(&hcreg->HCINTMSK);
+  hcint.d32 = hcint.d32 & hcintmsk.d32;
+  
+  if (hcint.b.ahberr)
+  {
+    CLEAR_HC_INT(hcreg ,ahberr);
+    UNMASK_HOST_INT_CHH (num);
+  }
+  else if (hcint.b.stall)
+  {
+    CLEAR_HC_INT(hcreg , stall);
+    UNMASK_HOST_INT_CHH (num);
+    USB::USB_OTG_HC_Halt(pdev, num);
+    pdev->host.HC_Status[num] = HC_STALL;
+  }
+  else if (hcint.b.xfercompl)
+  {
+    /* complete split brought the data (IN) or the device's ACK (OUT) */
+    uint32_t len = (hc->ep_is_in) ? hc->xfer_count - hc->split_done : hc->split_len;
+
+    CLEAR_HC_INT(hcreg , xfercompl);
+    CLEAR_HC_INT(hcreg , ack);
+    pdev->host.ErrCnt[num] = 0;
+    hc->split_done += len;
+    hc->split_complete = 0;
+    if (hc->data_pid != HC_PID_SETUP)
+    {
+      hc->data_pid = (hc->data_pid == HC_PID_DATA0) ? HC_PID_DATA1 : HC_PID_DATA0;
+    }
     
-    if(pdev->host.HC_Status[num] == HC_XFRC)
+    if ((hc->split_done >= hc->split_total) || (hc->ep_is_in && len < hc->max_packet))
     {
-      pdev->host.URB_State[num] = URB_DONE;  
-      
-      if (hcchar.b.eptype == EP_TYPE_BULK)
-      {
-        if(pdev->host.hc[num].isEvenTimesToggle) {	// even times packets has been transfered.
-        	pdev->host.hc[num].isEvenTimesToggle = 0;
-        } else {
-            pdev->host.hc[num].toggle_out ^= 1;
-        }
-      }
+      pdev->host.HC_Status[num] = HC_XFRC;
     }
-    else if(pdev->host.HC_Status[num] == HC_NAK)
+    else
     {
-      pdev->host.URB_State[num] = URB_NOTREADY;      
-    }    
-    else if(pdev->host.HC_Status[num] == HC_NYET)
+      pdev->host.HC_Status[num] = HC_SPLIT_RETRY;
+    }
+    UNMASK_HOST_INT_CHH (num);
+    USB::USB_OTG_HC_Halt(pdev, num);
+  }
+  else if (hcint.b.ack)
+  {
+    CLEAR_HC_INT(hcreg , ack);
+    pdev->host.ErrCnt[num] = 0;
+    if (!hc->split_complete)
     {
-      if(pdev->host.hc[num].do_ping == 1)
-      {
-    	  USB::USB_OTG_HC_DoPing(pdev, num);
-      }
-      pdev->host.URB_State[num] = URB_NOTREADY;      
-    }      
-    else if(pdev->host.HC_Status[num] == HC_STALL)
+      /* start split taken by the TT */
+      hc->split_complete = 1;
+      pdev->host.HC_Status[num] = HC_SPLIT_ACK;
+      UNMASK_HOST_INT_CHH (num);
+      USB::USB_OTG_HC_Halt(pdev, num);
+    }
+  }
+  else if (hcint.b.nyet)
+  {
+    /* the TT has no answer from the device yet */
+    CLEAR_HC_INT(hcreg , nyet);
+    hc->nyet_count++;
+    hc->csplit_nyet++;
+    pdev->host.HC_Status[num] = HC_NYET;
+    UNMASK_HOST_INT_CHH (num);
+    USB::USB_OTG_HC_Halt(pdev, num);
+  }
+  else if (hcint.b.nak)
+  {
+    /* the device NAKed: start the packet over until dispatchPkt()'s NAK limit is hit */
+    CLEAR_HC_INT(hcreg , nak);
+    pdev->host.ErrCnt[num] = 0;
+    hc->nak_count++;
+    hc->split_complete = 0;
+    if (hc->nak_limit && hc->nak_count >= hc->nak_limit)
     {
-      pdev->host.URB_State[num] = URB_STALL;      
-    }  
-    else if(pdev->host.HC_Status[num] == HC_XACTERR)
+      pdev->host.HC_Status[num] = HC_NAK;
+    }
+    else
     {
-      if (pdev->host.ErrCnt[num])	// == 3)
-      {
-        pdev->host.URB_State[num] = URB_ERROR;  
-        pdev->host.ErrCnt[num] = 0;
-      }
+      pdev->host.HC_Status[num] = HC_SPLIT_RETRY;
     }
-    CLEAR_HC_INT(hcreg , chhltd);    
+    UNMASK_HOST_INT_CHH (num);
+    USB::USB_OTG_HC_Halt(pdev, num);
+  }
+  else if (hcint.b.xacterr)
+  {
+    CLEAR_HC_INT(hcreg , xacterr);
+    pdev->host.ErrCnt[num]++;
+    hc->split_complete = 0;
+    if (pdev->host.ErrCnt[num] >= SPLIT_ERR_LIMIT)
+    {
+      pdev->host.HC_Status[num] = HC_XACTERR;
+    }
+    else
+    {
+      pdev->host.HC_Status[num] = HC_SPLIT_RETRY;
+    }
+    UNMASK_HOST_INT_CHH (num);
+    USB::USB_OTG_HC_Halt(pdev, num);
+  }
+  else if (hcint.b.datatglerr)
+  {
+    CLEAR_HC_INT(hcreg , datatglerr);
+    pdev->host.HC_Status[num] = HC_DATATGLERR;
+    UNMASK_HOST_INT_CHH (num);
+    USB::USB_OTG_HC_Halt(pdev, num);
+  }
+  else if (hcint.b.frmovrun)
+  {
+    /* periodic split missed its frame */
+    CLEAR_HC_INT(hcreg ,frmovrun);
+    hc->split_complete = 0;
+    pdev->host.HC_Status[num] = HC_SPLIT_RETRY;
+    UNMASK_HOST_INT_CHH (num);
+    USB::USB_OTG_HC_Halt(pdev, num);
+  }
+  else if (hcint.b.chhltd)
+  {
+    MASK_HOST_INT_CHH (num);
+    CLEAR_HC_INT(hcreg , chhltd);
+    USB_OTG_USBH_post_hc_halt (pdev, num, HC_EVENT_SPLIT);
   }
-  
   
   return 1;
 }
@@ -688,58 +915,23 @@ uint32_t USB_OTG_USBH_handle_hc_n_In_ISR (USB_OTG_CORE_HANDLE *pdev , uint32_t n
       UNMASK_HOST_INT_CHH (num);
       USB::USB_OTG_HC_Halt(pdev, num);
       CLEAR_HC_INT(hcreg , nak); 
-      if(pdev->host.hc[num].isEvenTimesToggle) {	// even times packets has been transfered.
-    	  pdev->host.hc[num].isEvenTimesToggle = 0;
-      } else {
-    	  // todo: 1. need to check why xfercompl happened when the request packets
-    	  // not received completely. (happened only in MSC Mode Sense(6) command.
-    	  uint32_t num_packets = (pdev->host.hc[num].xfer_count + pdev->host.hc[num].max_packet - 1) / pdev->host.hc[num].max_packet;
-    	  if(num_packets & 0x1)
-    		  pdev->host.hc[num].toggle_in ^= 1;
-      }
-      
+      /* the data toggle is worked out once the channel has halted */
     }
     else if(hcchar.b.eptype == EP_TYPE_INTR)
     {
       hcchar.b.oddfrm  = 1;
       USB_OTG_WRITE_REG32(&pdev->regs.HC_REGS[num]->HCCHAR, hcchar.d32); 
+      USB_OTG_USBH_sync_toggle(pdev, num, 1);
       pdev->host.URB_State[num] = URB_DONE;  
-      pdev->host.hc[num].toggle_in ^= 1;
     }
     
   }
   else if (hcint.b.chhltd)
   {
     MASK_HOST_INT_CHH (num);
-    
-    if(pdev->host.HC_Status[num] == HC_XFRC)
-    {
-      pdev->host.URB_State[num] = URB_DONE;      
-    }
-    
-    else if (pdev->host.HC_Status[num] == HC_STALL) 
-    {
-      pdev->host.URB_State[num] = URB_STALL;
-    }   
-    
-    else if((pdev->host.HC_Status[num] == HC_XACTERR) ||
-            (pdev->host.HC_Status[num] == HC_DATATGLERR))
-    {
-      pdev->host.ErrCnt[num] = 0;
-      pdev->host.URB_State[num] = URB_ERROR;  
-      
-    }
-    else if (pdev->host.HC_Status[num] == HC_NAK)
-    {
-    	//if(hcchar.b.eptype == EP_TYPE_INTR)
-    	//	pdev->host.hc[num].toggle_in ^= 1;
-
-    	pdev->host.URB_State[num] = URB_DONE;      // for nak case
-    }
-    
-    CLEAR_HC_INT(hcreg , chhltd);    
-    
-  }    
+    CLEAR_HC_INT(hcreg , chhltd);
+    USB_OTG_USBH_post_hc_halt (pdev, num, HC_EVENT_IN);
+  }
   else if (hcint.b.xacterr)
   {
     UNMASK_HOST_INT_CHH (num);
@@ -779,6 +971,270 @@ uint32_t USB_OTG_USBH_handle_hc_n_In_ISR (USB_OTG_CORE_HANDLE *pdev , uint32_t n
   
 }
 
+/**
+* @brief  USB_OTG_USBH_post_hc_halt 
+*         Queues a halted channel for USBH_OTG_DeferredHandler and pends
+*         PendSV to run it. Called from the interrupt handler only.
+* @param  pdev: Selected device
+* @param  num: Channel number
+* @param  kind: HC_EVENT_IN, HC_EVENT_OUT or HC_EVENT_SPLIT
+* @retval None
+*/
+static void USB_OTG_USBH_post_hc_halt (USB_OTG_CORE_HANDLE *pdev, uint32_t num, uint8_t kind)
+{
+  uint8_t head = pdev->host.EventHead;
+  
+  if ((uint8_t)(head - pdev->host.EventTail) >= USBH_EVENT_QUEUE_SIZE)
+  {
+    /* cannot happen with one halt per channel in flight, but never drop one */
+    pdev->host.EventOverrun++;
+    USB_OTG_USBH_hc_n_Halted (pdev, num, kind);
+    return;
+  }
+  pdev->host.Event[head & (USBH_EVENT_QUEUE_SIZE - 1)].chnum = num;
+  pdev->host.Event[head & (USBH_EVENT_QUEUE_SIZE - 1)].kind = kind;
+  /* publish the slot only after it is written */
+  pdev->host.EventHead = head + 1;
+  
+  SCB->ICSR = SCB_ICSR_PENDSVSET_Msk;
+}
+
+/**
+* @brief  USBH_OTG_DeferredHandler 
+*         Bottom half of the host interrupt: finishes the channel halts the
+*         interrupt handler queued, on every core. Runs from PendSV at the
+*         lowest priority, so SysTick and the UART are not held up by it.
+* @param  None
+* @retval None
+*/
+void USBH_OTG_DeferredHandler (void)
+{
+  uint8_t core;
+  
+  for (core = 0; core < 2; core++)
+  {
+    USB_OTG_CORE_HANDLE *pdev = USBH_OTG_Core[core];
+    
+    if (pdev == 0)
+    {
+      continue;
+    }
+    while (pdev->host.EventTail != pdev->host.EventHead)
+    {
+      uint8_t tail = pdev->host.EventTail;
+      uint8_t num = pdev->host.Event[tail & (USBH_EVENT_QUEUE_SIZE - 1)].chnum;
+      uint8_t kind = pdev->host.Event[tail & (USBH_EVENT_QUEUE_SIZE - 1)].kind;
+      
+      pdev->host.EventTail = tail + 1;
+      USB_OTG_USBH_hc_n_Halted (pdev, num, kind);
+    }
+  }
+}
+
+/**
+* @brief  USB_OTG_USBH_hc_n_Halted 
+*         Completes a channel halt according to the kind of channel
+* @param  pdev: Selected device
+* @param  num: Channel number
+* @param  kind: HC_EVENT_IN, HC_EVENT_OUT or HC_EVENT_SPLIT
+* @retval None
+*/
+static void USB_OTG_USBH_hc_n_Halted (USB_OTG_CORE_HANDLE *pdev , uint32_t num, uint8_t kind)
+{
+  switch (kind)
+  {
+  case HC_EVENT_SPLIT:
+    USB_OTG_USBH_hc_n_Split_Halted (pdev, num);
+    break;
+  case HC_EVENT_IN:
+    USB_OTG_USBH_hc_n_In_Halted (pdev, num);
+    break;
+  default:
+    USB_OTG_USBH_hc_n_Out_Halted (pdev, num);
+    break;
+  }
+}
+
+/**
+* @brief  USB_OTG_USBH_sync_toggle 
+*         Takes the data toggle of the next packet from the PID the core left
+*         in HCTSIZ. The core flips that PID for every packet the device
+*         accepted, so it is right whether the transfer completed, NAKed or
+*         failed half way.
+* @param  pdev: Selected device
+* @param  num: Channel number
+* @param  is_in: IN channel
+* @retval None
+*/
+static void USB_OTG_USBH_sync_toggle (USB_OTG_CORE_HANDLE *pdev , uint32_t num, uint8_t is_in)
+{
+  USB_OTG_HCTSIZn_TypeDef hctsiz;
+  
+  hctsiz.d32 = USB_OTG_READ_REG32(&pdev->regs.HC_REGS[num]->HCTSIZ);
+  
+  /* neither a SETUP stage nor a PING carries a data toggle */
+  if (pdev->host.hc[num].data_pid == HC_PID_SETUP || hctsiz.b.dopng)
+  {
+    return;
+  }
+  if (is_in)
+  {
+    pdev->host.hc[num].toggle_in = (hctsiz.b.pid == HC_PID_DATA1);
+  }
+  else
+  {
+    pdev->host.hc[num].toggle_out = (hctsiz.b.pid == HC_PID_DATA1);
+  }
+}
+
+/**
+* @brief  USB_OTG_USBH_hc_n_Out_Halted 
+*         Turns the halt of an OUT channel into the URB state. A PING answered
+*         with ACK sends the data now.
+* @param  pdev: Selected device
+* @param  num: Channel number
+* @retval None
+*/
+static void USB_OTG_USBH_hc_n_Out_Halted (USB_OTG_CORE_HANDLE *pdev , uint32_t num)
+{
+  USB_OTG_HC_REGS *hcreg = pdev->regs.HC_REGS[num];
+  
+  if(pdev->host.HC_Status[num] == HC_PINGACK)
+  {
+    pdev->host.HC_Status[num] = HC_IDLE;
+    USB::USB_OTG_HC_StartXfer(pdev, num);
+    return;
+  }
+  if(pdev->host.HC_Status[num] == HC_NYET)
+  {
+    USB_OTG_HCTSIZn_TypeDef hctsiz;
+
+    /* NYET on the last packet of the transfer still means the data was taken */
+    hctsiz.d32 = USB_OTG_READ_REG32(&hcreg->HCTSIZ);
+    if (hctsiz.b.pktcnt == 0)
+      pdev->host.HC_Status[num] = HC_XFRC;
+  }
+  USB_OTG_USBH_sync_toggle(pdev, num, 0);
+  if(pdev->host.HC_Status[num] == HC_XFRC)
+  {
+    pdev->host.URB_State[num] = URB_DONE;  
+  }
+  else if(pdev->host.HC_Status[num] == HC_NAK)
+  {
+    pdev->host.URB_State[num] = URB_NOTREADY;      
+  }    
+  else if(pdev->host.HC_Status[num] == HC_NYET)
+  {
+    /* OutTransfer() sends the rest, starting with a PING */
+    pdev->host.URB_State[num] = URB_NOTREADY;      
+  }      
+  else if(pdev->host.HC_Status[num] == HC_STALL)
+  {
+    pdev->host.URB_State[num] = URB_STALL;      
+  }  
+  else if(pdev->host.HC_Status[num] == HC_XACTERR)
+  {
+    if (pdev->host.ErrCnt[num])	// == 3)
+    {
+      pdev->host.URB_State[num] = URB_ERROR;  
+      pdev->host.ErrCnt[num] = 0;
+    }
+  }
+}
+
+/**
+* @brief  USB_OTG_USBH_hc_n_Split_Halted 
+*         Starts the next start or complete split of a split channel, or
+*         turns the halt into the URB state once the transfer is over.
+* @param  pdev: Selected device
+* @param  num: Channel number
+* @retval None
+*/
+static void USB_OTG_USBH_hc_n_Split_Halted (USB_OTG_CORE_HANDLE *pdev , uint32_t num)
+{
+  USB_OTG_HC *hc = &pdev->host.hc[num];
+  
+  switch (pdev->host.HC_Status[num])
+  {
+  case HC_NYET:
+    /* a periodic answer is only kept by the TT for a few microframes */
+    if ((hc->ep_type == EP_TYPE_INTR || hc->ep_type == EP_TYPE_ISOC) &&
+        hc->csplit_nyet > SPLIT_CSPLIT_NYET_MAX)
+    {
+      hc->split_complete = 0;
+    }
+    USB::USB_OTG_HC_SplitXfer(pdev, num);
+    return;
+  case HC_SPLIT_ACK:
+  case HC_SPLIT_RETRY:
+    USB::USB_OTG_HC_SplitXfer(pdev, num);
+    return;
+  case HC_XFRC:
+    pdev->host.URB_State[num] = URB_DONE;
+    break;
+  case HC_NAK:
+    pdev->host.URB_State[num] = URB_NOTREADY;
+    break;
+  case HC_STALL:
+    pdev->host.URB_State[num] = URB_STALL;
+    break;
+  case HC_XACTERR:
+  case HC_DATATGLERR:
+    pdev->host.ErrCnt[num] = 0;
+    pdev->host.URB_State[num] = URB_ERROR;
+    break;
+  default:
+    break;
+  }
+  
+  /* the split code flips data_pid for every packet the TT got through,
+     so it already names the next packet */
+  if (hc->data_pid != HC_PID_SETUP)
+  {
+    if (hc->ep_is_in)
+      hc->toggle_in = (hc->data_pid == HC_PID_DATA1);
+    else
+      hc->toggle_out = (hc->data_pid == HC_PID_DATA1);
+  }
+}
+
+/**
+* @brief  USB_OTG_USBH_hc_n_In_Halted 
+*         Turns the halt of an IN channel into the URB state and the data toggle
+* @param  pdev: Selected device
+* @param  num: Channel number
+* @retval None
+*/
+static void USB_OTG_USBH_hc_n_In_Halted (USB_OTG_CORE_HANDLE *pdev , uint32_t num)
+{
+  USB_OTG_USBH_sync_toggle(pdev, num, 1);
+  
+  if(pdev->host.HC_Status[num] == HC_XFRC)
+  {
+    pdev->host.URB_State[num] = URB_DONE;      
+  }
+  
+  else if (pdev->host.HC_Status[num] == HC_STALL) 
+  {
+    pdev->host.URB_State[num] = URB_STALL;
+  }   
+  
+  else if((pdev->host.HC_Status[num] == HC_XACTERR) ||
+          (pdev->host.HC_Status[num] == HC_DATATGLERR))
+  {
+    pdev->host.ErrCnt[num] = 0;
+    pdev->host.URB_State[num] = URB_ERROR;  
+    
+  }
+  else if (pdev->host.HC_Status[num] == HC_NAK)
+  {
+  	//if(hcchar.b.eptype == EP_TYPE_INTR)
+  	//	pdev->host.hc[num].toggle_in ^= 1;
+
+  	pdev->host.URB_State[num] = URB_DONE;      // for nak case
+  }
+}
+
 /**
 * @brief  USB_OTG_USBH_handle_rx_qlvl_ISR 
 *         Handles the Rx Status Queue Level Interrupt
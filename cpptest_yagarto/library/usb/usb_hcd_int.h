@@ -34,6 +34,7 @@
 /* Includes ------------------------------------------------------------------*/
 //#include "usb_hcd.h"
 #include "usb_core.h"
+#include "usb_defines.h"
 
 
 /** @addtogroup USB_OTG_DRIVER
@@ -122,7 +123,26 @@ extern USBH_HCD_INT_cb_TypeDef *USBH_HCD_INT_fops;
 void ConnectCallback_Handler(USB_OTG_CORE_HANDLE *pdev);
 void Disconnect_Callback_Handler(USB_OTG_CORE_HANDLE *pdev);
 void Overcurrent_Callback_Handler(USB_OTG_CORE_HANDLE *pdev);
-uint32_t USBH_OTG_ISR_Handler (USB_OTG_CORE_HANDLE *pdev);
+uint32_t USBH_OTG_ISR_Handler (USB_OTG_CORE_HANDLE *pdev) __RAMFUNC;
+uint32_t USBH_OTG_IRQ_Handler (USB_OTG_CORE_ID_TypeDef coreID) __RAMFUNC;
+void USBH_OTG_DeferredHandler (void) __RAMFUNC;
+
+/* Handle of the host running on each OTG core, indexed by USB_OTG_CORE_ID_TypeDef */
+extern USB_OTG_CORE_HANDLE *USBH_OTG_Core[2];
+
+#ifdef USBH_ISR_CYCLE_STATS
+/* CPU cycles spent in USBH_OTG_IRQ_Handler, measured with the DWT cycle counter */
+typedef struct
+{
+  uint32_t count;
+  uint32_t last;
+  uint32_t min;
+  uint32_t max;
+} USBH_ISR_CYCLES_TypeDef;
+
+extern volatile USBH_ISR_CYCLES_TypeDef USBH_ISR_Cycles[2];
+void USBH_ISR_Cycles_Reset(void);
+#endif
 
 /**
   * @}
@@ -0,0 +1,135 @@
+/*
+ * usbfault.cpp
+ *
+ * Fault injector, see usbfault.h
+ */
+
+#include <string.h>
+#include "usbhost.h"
+#include "usbfault.h"
+
+#ifdef USBH_FAULT_INJECT
+
+#define DWT_CTRL		(*(volatile uint32_t *)0xE0001000)
+#define DWT_CYCCNT		(*(volatile uint32_t *)0xE0001004)
+#define DWT_CTRL_CYCCNTENA	0x00000001
+#define DEMCR			(*(volatile uint32_t *)0xE000EDFC)
+#define DEMCR_TRCENA		0x01000000
+
+UsbFaultInjector UsbFault;
+
+UsbFaultInjector::UsbFaultInjector() {
+        Clear();
+        ClearLatency();
+}
+
+void UsbFaultInjector::Load(const UsbFaultRule *table, uint32_t s) {
+        Clear();
+        for (nrules = 0; nrules < USB_FAULT_MAX_RULES && table[nrules].fault != USB_FAULT_NONE; nrules++)
+                rule[nrules] = table[nrules];
+        seed = (s) ? s : 1;
+        // the probes run on the cycle counter
+        DEMCR |= DEMCR_TRCENA;
+        DWT_CTRL |= DWT_CTRL_CYCCNTENA;
+}
+
+void UsbFaultInjector::Clear() {
+        nrules = 0;
+        injected = 0;
+        seed = 1;
+        memset(seen, 0, sizeof (seen));
+        memset(left, 0, sizeof (left));
+}
+
+void UsbFaultInjector::ClearLatency() {
+        memset(latency, 0, sizeof (latency));
+}
+
+/* xorshift32, the same sequence for the same seed */
+uint32_t UsbFaultInjector::Random() {
+        seed ^= seed << 13;
+        seed ^= seed >> 17;
+        seed ^= seed << 5;
+        return seed;
+}
+
+bool UsbFaultInjector::Fire(uint8_t i) {
+        seen[i]++;
+        if (left[i]) {
+                left[i]--;
+                return true;
+        }
+        if ((rule[i].at && seen[i] == rule[i].at) || (rule[i].rate && !(Random() % rule[i].rate))) {
+                left[i] = (rule[i].burst) ? rule[i].burst - 1 : 0;
+                return true;
+        }
+        return false;
+}
+
+/* First rule of the device and endpoint that fires, -1 if none */
+int8_t UsbFaultInjector::Match(uint8_t addr, uint8_t ep, bool shortpkt) {
+        for (uint8_t i = 0; i < nrules; i++) {
+                if ((rule[i].fault == USB_FAULT_SHORT) != shortpkt)
+                        continue;
+                if (rule[i].addr != USB_FAULT_ANY && rule[i].addr != addr)
+                        continue;
+                if (rule[i].ep != USB_FAULT_ANY && rule[i].ep != ep)
+                        continue;
+                if (Fire(i))
+                        return i;
+        }
+        return -1;
+}
+
+uint8_t UsbFaultInjector::Filter(USB_OTG_CORE_HANDLE *pdev, uint8_t hcnum, uint8_t rcode) {
+        if (!nrules)
+                return rcode;
+
+        USB_OTG_HC *hc = &pdev->host.hc[hcnum];
+        int8_t i = Match(hc->dev_addr, hc->ep_num | ((hc->ep_is_in) ? 0x80 : 0x00), false);
+
+        if (i < 0)
+                return rcode;
+        injected++;
+        switch (rule[i].fault) {
+                case USB_FAULT_NAK:
+                        hc->nak_count++; // dispatchPkt() holds it against nak_limit
+                        return hrNAK;
+                case USB_FAULT_TIMEOUT:
+                        return hrTIMEOUT;
+                case USB_FAULT_STALL:
+                        return hrSTALL;
+                case USB_FAULT_TOGGLE:
+                        return hrTOGERR;
+                default:
+                        return hrJERR;
+        }
+}
+
+void UsbFaultInjector::Shorten(USB_OTG_CORE_HANDLE *pdev, uint8_t hcnum, uint16_t *nbytes) {
+        if (!nrules || *nbytes < 2)
+                return;
+
+        USB_OTG_HC *hc = &pdev->host.hc[hcnum];
+
+        if (Match(hc->dev_addr, hc->ep_num | 0x80, true) < 0)
+                return;
+        injected++;
+        *nbytes >>= 1;
+}
+
+uint32_t UsbFaultInjector::Cycles() {
+        return DWT_CYCCNT;
+}
+
+UsbFaultProbe::~UsbFaultProbe() {
+        UsbFaultLatency *l = &UsbFault.latency[probe];
+
+        l->last = UsbFaultInjector::Cycles() - start;
+        l->total += l->last;
+        if (l->last > l->max)
+                l->max = l->last;
+        l->count++;
+}
+
+#endif // USBH_FAULT_INJECT
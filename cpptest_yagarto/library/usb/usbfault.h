@@ -0,0 +1,120 @@
+/*
+ * usbfault.h
+ *
+ * Fault injector for robustness and recovery benchmarks, compiled in with
+ * USBH_FAULT_INJECT. It sits where the host reads the outcome of a channel
+ * from the HCD (dispatchPkt(), OutTransfer()) and replaces it following a rule
+ * table: NAK storms, bus timeouts, STALLs, toggle errors, short packets and
+ * disconnects, at random with a given rate or at scripted transaction indices.
+ * The bus transaction itself did happen, the injector only lies about it, so
+ * the device sees a host that lost its handshake.
+ *
+ * Probes placed in the recovery paths record how long they took, in CPU cycles.
+ * Without USBH_FAULT_INJECT all hooks compile to nothing.
+ */
+
+#if !defined(__USBFAULT_H__)
+#define __USBFAULT_H__
+
+#include <inttypes.h>
+#include <stddef.h>
+#include "usb_core.h"
+
+#define USB_FAULT_NONE			0	// ends a rule table
+#define USB_FAULT_NAK			1	// hrNAK, with a burst that is a NAK storm
+#define USB_FAULT_TIMEOUT		2	// hrTIMEOUT, no handshake from the device
+#define USB_FAULT_STALL			3	// hrSTALL
+#define USB_FAULT_TOGGLE		4	// hrTOGERR
+#define USB_FAULT_SHORT			5	// IN transfer reports half of the bytes
+#define USB_FAULT_DISCONNECT		6	// hrJERR, as if the device was pulled
+
+#define USB_FAULT_ANY			0xFF	// rule matches every device or endpoint
+
+// Recovery paths with a latency probe
+#define USB_FAULT_PROBE_HANDLE_USB_ERROR	0	// BulkOnly::HandleUsbError()
+#define USB_FAULT_PROBE_RESET_RECOVERY		1	// BulkOnly::ResetRecovery()
+#define USB_FAULT_PROBE_HUB_PORT_RESET		2	// USBHub::ResetHubPort()
+#define USB_FAULT_PROBES			3
+
+#ifdef USBH_FAULT_INJECT
+
+#ifndef USB_FAULT_MAX_RULES
+#define USB_FAULT_MAX_RULES		4
+#endif
+
+struct UsbFaultRule {
+        uint8_t fault; // USB_FAULT_xxx
+        uint8_t addr; // device address, USB_FAULT_ANY for all
+        uint8_t ep; // endpoint address with the direction bit, USB_FAULT_ANY for all
+        uint16_t rate; // fires about once in 'rate' matching transactions, 0 for scripted only
+        uint32_t at; // fires at this matching transaction, counted from 1 after Load(), 0 for none
+        uint16_t burst; // transactions faulted in a row once fired, 0 counts as 1
+};
+
+struct UsbFaultLatency {
+        uint32_t count;
+        uint32_t last; // CPU cycles
+        uint32_t max;
+        uint32_t total;
+};
+
+class UsbFaultInjector {
+        UsbFaultRule rule[USB_FAULT_MAX_RULES];
+        uint32_t seen[USB_FAULT_MAX_RULES]; // matching transactions so far
+        uint16_t left[USB_FAULT_MAX_RULES]; // rest of the running burst
+        uint8_t nrules;
+        uint32_t seed;
+        uint32_t injected;
+
+        uint32_t Random();
+        bool Fire(uint8_t i);
+        int8_t Match(uint8_t addr, uint8_t ep, bool shortpkt);
+
+public:
+        UsbFaultLatency latency[USB_FAULT_PROBES];
+
+        UsbFaultInjector();
+
+        // Copies the rules up to USB_FAULT_NONE, seed makes random runs repeatable
+        void Load(const UsbFaultRule *table, uint32_t seed = 1);
+        void Clear();
+        void ClearLatency();
+
+        // Hooks of the host, see USB_FAULT_FILTER() and USB_FAULT_SHORTEN()
+        uint8_t Filter(USB_OTG_CORE_HANDLE *pdev, uint8_t hcnum, uint8_t rcode);
+        void Shorten(USB_OTG_CORE_HANDLE *pdev, uint8_t hcnum, uint16_t *nbytes);
+
+        // Transactions faulted since Load()
+        uint32_t GetInjected() {
+                return injected;
+        };
+
+        static uint32_t Cycles();
+};
+
+extern UsbFaultInjector UsbFault;
+
+// Records the time from construction to the end of the enclosing scope
+class UsbFaultProbe {
+        uint8_t probe;
+        uint32_t start;
+
+public:
+        UsbFaultProbe(uint8_t id) : probe(id), start(UsbFaultInjector::Cycles()) {
+        };
+        ~UsbFaultProbe();
+};
+
+#define USB_FAULT_FILTER(pdev, hcnum, rcode)		UsbFault.Filter((pdev), (hcnum), (rcode))
+#define USB_FAULT_SHORTEN(pdev, hcnum, nbytesptr)	UsbFault.Shorten((pdev), (hcnum), (nbytesptr))
+#define USB_FAULT_PROBE(id)				UsbFaultProbe fault_probe(id)
+
+#else
+
+#define USB_FAULT_FILTER(pdev, hcnum, rcode)		(rcode)
+#define USB_FAULT_SHORTEN(pdev, hcnum, nbytesptr)
+#define USB_FAULT_PROBE(id)
+
+#endif // USBH_FAULT_INJECT
+
+#endif // __USBFAULT_H__
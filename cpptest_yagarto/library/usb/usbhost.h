@@ -33,9 +33,37 @@ e-mail   :  support@circuitsathome.com
 #define TXH_NP_FS_FIFOSIZ                        128	// 96
 #define TXH_P_FS_FIFOSIZ                         128	// 96
 
+// HS core, 1280 words in all. Room for two 512 byte bulk packets each way.
+#define RX_FIFO_HS_SIZE                          512
+#define TXH_NP_HS_FIFOSIZ                        256
+#define TXH_P_HS_FIFOSIZ                         256
+
+// Core used by a host constructed without one. USE_USB_OTG_HS selects the HS core.
+// The HS core uses an external ULPI PHY if USB_OTG_ULPI_PHY_ENABLED is defined as well.
+// Both cores can run a host at the same time, each with its own USB object.
+#ifdef USE_USB_OTG_HS
+#define USB_HOST_CORE_ID                         USB_OTG_HS_CORE_ID
+#else
+#define USB_HOST_CORE_ID                         USB_OTG_FS_CORE_ID
+#endif
+
+// NVIC priorities of the OTG interrupt. It only acknowledges, drains the FIFOs
+// and queues channel halts; the rest runs from PendSV at the lowest priority.
+// Override from the build to rank the USB interrupt against SysTick and the UART.
+#ifndef USBH_NVIC_PRIORITY_GROUP
+#define USBH_NVIC_PRIORITY_GROUP                 NVIC_PriorityGroup_1
+#endif
+#ifndef USBH_IRQ_PREEMPTION_PRIORITY
+#define USBH_IRQ_PREEMPTION_PRIORITY             1
+#endif
+#ifndef USBH_IRQ_SUB_PRIORITY
+#define USBH_IRQ_SUB_PRIORITY                    3
+#endif
+
 #define USBH_SETUP_PKT_SIZE   8
 #define USBH_EP0_EP_NUM       0
 #define USBH_MAX_PACKET_SIZE  0x40
+#define USBH_MAX_HC_PKT_COUNT 256	// packets per channel transfer, USB_OTG_HC_StartXfer() clips longer ones
 
 #define HOST_POWERSW_PORT_RCC            RCC_AHB1Periph_GPIOH
 #define HOST_POWERSW_PORT                GPIOH
@@ -78,11 +106,13 @@ e-mail   :  support@circuitsathome.com
 #define hrJERR      0x0D
 #define hrTIMEOUT   0x0E
 #define hrBABBLE    0x0F
+#define hrNYET      0x10	// STM32: packet accepted, the endpoint has no room for the next one yet
 
 #define SE0     0
 #define SE1     1
 #define FSHOST  2
 #define LSHOST  3
+#define HSHOST  4
 
 #define HC_MAX           8
 
@@ -103,12 +133,13 @@ typedef enum {
 
 
 template< typename SS, typename INTR > class STM32F2 {
-        static uint8_t vbusState;
+        uint8_t vbusState;
+        USB_OTG_CORE_ID_TypeDef coreID; // OTG core this host runs on
 
 public:
         USB_OTG_CORE_HANDLE *coreConfig;
 
-        STM32F2(USB_OTG_CORE_HANDLE *pDev);
+        STM32F2(USB_OTG_CORE_HANDLE *pDev, USB_OTG_CORE_ID_TypeDef core = USB_HOST_CORE_ID);
         void regWr(uint8_t reg, uint8_t data);
         uint8_t* bytesWr(uint8_t reg, uint8_t nbytes, uint8_t* data_p);
         void gpioWr(uint8_t data);
@@ -132,16 +163,17 @@ public:
         uint32_t Task();
         uint32_t HCD_ResetPort(void);
 
-        static uint8_t USB_OTG_IsHostMode(USB_OTG_CORE_HANDLE *pdev);
-        static uint32_t USB_OTG_ReadCoreItr(USB_OTG_CORE_HANDLE *pdev);
-        static USB_OTG_STS USB_OTG_WritePacket(USB_OTG_CORE_HANDLE *pdev, uint8_t *src, uint8_t ch_ep_num, uint16_t len);
-        static void * USB_OTG_ReadPacket(USB_OTG_CORE_HANDLE *pdev, uint8_t *dest, uint16_t len);
+        static uint8_t USB_OTG_IsHostMode(USB_OTG_CORE_HANDLE *pdev) __RAMFUNC;
+        static uint32_t USB_OTG_ReadCoreItr(USB_OTG_CORE_HANDLE *pdev) __RAMFUNC;
+        static USB_OTG_STS USB_OTG_WritePacket(USB_OTG_CORE_HANDLE *pdev, uint8_t *src, uint8_t ch_ep_num, uint16_t len) __RAMFUNC;
+        static void * USB_OTG_ReadPacket(USB_OTG_CORE_HANDLE *pdev, uint8_t *dest, uint16_t len) __RAMFUNC;
 		static uint32_t USB_OTG_GetMode(USB_OTG_CORE_HANDLE *pdev);
-		static USB_OTG_STS USB_OTG_HC_Halt(USB_OTG_CORE_HANDLE *pdev , uint8_t hc_num);
-		static uint32_t USB_OTG_ReadHostAllChannels_intr (USB_OTG_CORE_HANDLE *pdev);
+		static USB_OTG_STS USB_OTG_HC_Halt(USB_OTG_CORE_HANDLE *pdev , uint8_t hc_num) __RAMFUNC;
+		static uint32_t USB_OTG_ReadHostAllChannels_intr (USB_OTG_CORE_HANDLE *pdev) __RAMFUNC;
         static void USB_OTG_InitFSLSPClkSel(USB_OTG_CORE_HANDLE *pdev, uint8_t freq);
         static uint32_t USB_OTG_ResetPort(USB_OTG_CORE_HANDLE *pdev);
         static USB_OTG_STS USB_OTG_HC_DoPing(USB_OTG_CORE_HANDLE *pdev , uint8_t hc_num);
+        static USB_OTG_STS USB_OTG_HC_SplitXfer(USB_OTG_CORE_HANDLE *pdev , uint8_t hc_num);
         static uint32_t USB_OTG_ReadHPRT0(USB_OTG_CORE_HANDLE *pdev);
 
         static uint8_t USBH_Alloc_Channel(USB_OTG_CORE_HANDLE *pdev, uint8_t ep_addr);
@@ -179,12 +211,9 @@ private:
         void USB_OTG_BSP_DriveVBUS(uint8_t state);
 };
 
-template< typename SS, typename INTR >
-        uint8_t STM32F2< SS, INTR >::vbusState = 0;
-
 /* constructor */
 template< typename SS, typename INTR >
-STM32F2< SS, INTR >::STM32F2(USB_OTG_CORE_HANDLE *pDev) : coreConfig(pDev) {
+STM32F2< SS, INTR >::STM32F2(USB_OTG_CORE_HANDLE *pDev, USB_OTG_CORE_ID_TypeDef core) : vbusState(0), coreID(core), coreConfig(pDev) {
 	/* ------- 1. Hardware Init ------- */
 	USB_OTG_BSP_Init();
 
@@ -201,7 +230,10 @@ STM32F2< SS, INTR >::STM32F2(USB_OTG_CORE_HANDLE *pDev) : coreConfig(pDev) {
 	//phost->usr_cb = usr_cb;
 
 	/* ------- 5. Start the USB OTG core ------- */
-	HCD_Init(USB_OTG_FS_CORE_ID);
+	HCD_Init(coreID);
+
+	/* the IRQ handler of the core finds its handle here */
+	USBH_OTG_Core[coreID] = pDev;
 
 	/* ------- 6. Upon Init call usr call back ------- */
 	//phost->usr_cb->Init();
@@ -364,6 +396,9 @@ void STM32F2< SS, INTR >::busprobe() {
 		case(bmLOWSPEED):
 			vbusState = LSHOST;
 			break;
+		case(bmHIGHSPEED):
+			vbusState = HSHOST;
+			break;
 	/*
 		case( bmJSTATUS):
 				if((regRd(rMODE) & bmLOWSPEED) == 0) {
@@ -677,6 +712,64 @@ USB_OTG_STS STM32F2< SS, INTR >::USB_OTG_HC_DoPing(USB_OTG_CORE_HANDLE *pdev , u
   return status;
 }
 
+/**
+* @brief  Issue the start or complete split of the packet at split_done.
+*         The channel ISR moves from start to complete split and on to the
+*         next packet, see USB_OTG_USBH_handle_hc_n_Split_ISR.
+* @param  pdev : Selected device
+* @param  hc_num : Channel number
+* @retval USB_OTG_STS : status
+*/
+template< typename SS, typename INTR >
+USB_OTG_STS STM32F2< SS, INTR >::USB_OTG_HC_SplitXfer(USB_OTG_CORE_HANDLE *pdev , uint8_t hc_num)
+{
+  USB_OTG_STS               status = USB_OTG_OK;
+  USB_OTG_HC                *hc = &pdev->host.hc[hc_num];
+  USB_OTG_HCCHAR_TypeDef    hcchar;
+  USB_OTG_HCTSIZn_TypeDef   hctsiz;
+  USB_OTG_HCSPLT_TypeDef    hcsplt;
+  USB_OTG_HCINTMSK_TypeDef  hcintmsk;
+
+  hc->split_len = (hc->split_total - hc->split_done > hc->max_packet) ?
+    hc->max_packet : hc->split_total - hc->split_done;
+  if (!hc->split_complete)
+    hc->csplit_nyet = 0;
+
+  hcsplt.d32 = 0;
+  hcsplt.b.spltena = 1;
+  hcsplt.b.hubaddr = hc->hub_addr;
+  hcsplt.b.prtaddr = hc->hub_port;
+  hcsplt.b.xactpos = HCSPLT_XACTPOS_ALL;
+  hcsplt.b.compsplt = hc->split_complete;
+  USB_OTG_WRITE_REG32(&pdev->regs.HC_REGS[hc_num]->HCSPLT, hcsplt.d32);
+
+  /* the TT answers both halves with ACK/NYET, which the channel does not report by default */
+  hcintmsk.d32 = 0;
+  hcintmsk.b.ack = 1;
+  hcintmsk.b.nyet = 1;
+  hcintmsk.b.nak = 1;
+  USB_OTG_MODIFY_REG32(&pdev->regs.HC_REGS[hc_num]->HCINTMSK, 0, hcintmsk.d32);
+
+  hctsiz.d32 = 0;
+  hctsiz.b.xfersize = (hc->ep_is_in) ? hc->max_packet : hc->split_len;
+  hctsiz.b.pktcnt = 1;
+  hctsiz.b.pid = hc->data_pid;
+  USB_OTG_WRITE_REG32(&pdev->regs.HC_REGS[hc_num]->HCTSIZ, hctsiz.d32);
+
+  hcchar.d32 = USB_OTG_READ_REG32(&pdev->regs.HC_REGS[hc_num]->HCCHAR);
+  hcchar.b.oddfrm = USB_OTG_IsEvenFrame(pdev);
+  hcchar.b.chen = 1;
+  hcchar.b.chdis = 0;
+  USB_OTG_WRITE_REG32(&pdev->regs.HC_REGS[hc_num]->HCCHAR, hcchar.d32);
+
+  /* OUT data goes with the start split only, a packet fits the FIFO at full speed */
+  if (!hc->ep_is_in && !hc->split_complete && hc->split_len > 0)
+  {
+    USB_OTG_WritePacket(pdev, hc->xfer_buff + hc->split_done, hc_num, hc->split_len);
+  }
+  return status;
+}
+
 /**
 * @brief  USB_OTG_ReadHPRT0 : Reads HPRT0 to modify later
 * @param  pdev : Selected device
@@ -743,9 +836,10 @@ uint16_t STM32F2< SS, INTR >::USBH_GetFreeChannel(USB_OTG_CORE_HANDLE *pdev)
   * @param  pdev : Selected device
   * @param  hc_num: Host channel Number
   * @param  dev_address: USB Device address allocated to attached device
-  * @param  speed : USB device speed (Full/Low)
+  * @param  speed : USB device speed (High/Full/Low)
   * @param  ep_type: end point type (Bulk/int/ctl)
-  * @param  mps: max pkt size
+  * @param  mps: max pkt size, wMaxPacketSize format: bits 11..12 are the
+  *         additional transactions per microframe of high-bandwidth endpoints
   * @retval Status
   */
 template< typename SS, typename INTR >
@@ -761,15 +855,20 @@ uint8_t STM32F2< SS, INTR >::USBH_Open_Channel  (USB_OTG_CORE_HANDLE *pdev,
   pdev->host.hc[hc_num].ep_is_in = (pdev->host.channel[hc_num] & 0x80 ) == 0x80;
   pdev->host.hc[hc_num].dev_addr = dev_address;
   pdev->host.hc[hc_num].ep_type = ep_type;
-  pdev->host.hc[hc_num].max_packet = mps;
+  pdev->host.hc[hc_num].max_packet = mps & 0x7FF;
+  pdev->host.hc[hc_num].multi_count = (mps >> 11) & 0x3;
   pdev->host.hc[hc_num].speed = speed;
   pdev->host.hc[hc_num].toggle_in = 0;
-  pdev->host.hc[hc_num].isEvenTimesToggle = 0;
   pdev->host.hc[hc_num].toggle_out = 0;
-  if(speed == HPRT0_PRTSPD_HIGH_SPEED)
-  {
-    pdev->host.hc[hc_num].do_ping = 1;
-  }
+  /* data first, PING only once the endpoint has NAKed or NYETed */
+  pdev->host.hc[hc_num].do_ping = 0;
+  pdev->host.hc[hc_num].ping_count = 0;
+  pdev->host.hc[hc_num].ping_nak_count = 0;
+  pdev->host.hc[hc_num].nyet_count = 0;
+  pdev->host.hc[hc_num].out_nak_count = 0;
+  /* USB::SetAddress() turns splits on for devices behind a high speed hub */
+  pdev->host.hc[hc_num].do_split = 0;
+  pdev->host.hc[hc_num].split_complete = 0;
 
   USB_OTG_HC_Init(pdev, hc_num) ;
 
@@ -873,10 +972,6 @@ USB_OTG_STS STM32F2< SS, INTR >::USB_OTG_HC_Init(USB_OTG_CORE_HANDLE *pdev , uin
     else
     {
       hcintmsk.b.nyet = 1;
-      if (pdev->host.hc[hc_num].do_ping)
-      {
-        hcintmsk.b.ack = 1;
-      }
     }
     break;
   case EP_TYPE_INTR:
@@ -926,10 +1021,16 @@ USB_OTG_STS STM32F2< SS, INTR >::USB_OTG_HC_Init(USB_OTG_CORE_HANDLE *pdev , uin
   hcchar.b.lspddev = (pdev->host.hc[hc_num].speed == HPRT0_PRTSPD_LOW_SPEED);
   hcchar.b.eptype  = pdev->host.hc[hc_num].ep_type;
   hcchar.b.mps     = pdev->host.hc[hc_num].max_packet;
+  hcchar.b.multicnt = 1;
   if (pdev->host.hc[hc_num].ep_type == HCCHAR_INTR)
   {
     hcchar.b.oddfrm  = 1;
   }
+  if (pdev->host.hc[hc_num].ep_type == HCCHAR_INTR || pdev->host.hc[hc_num].ep_type == HCCHAR_ISOC)
+  {
+    /* transactions per (micro)frame */
+    hcchar.b.multicnt = 1 + pdev->host.hc[hc_num].multi_count;
+  }
   USB_OTG_WRITE_REG32(&pdev->regs.HC_REGS[hc_num]->HCCHAR, hcchar.d32);
   return status;
 }
@@ -1010,18 +1111,42 @@ USB_OTG_STS STM32F2< SS, INTR >::USB_OTG_HC_StartXfer(USB_OTG_CORE_HANDLE *pdev
   uint16_t num_packets;
   uint16_t max_hc_pkt_count;
 
-  max_hc_pkt_count = 256;
+  max_hc_pkt_count = USBH_MAX_HC_PKT_COUNT;
   hctsiz.d32 = 0;
   hcchar.d32 = 0;
   intmsk.d32 = 0;
 
+  /* High speed OUT to an endpoint that NAKed or NYETed last time: PING first.
+     The ISR sends the data once the PING is ACKed, a NAKed PING costs 3 bytes instead of a full packet. */
+  if (pdev->host.hc[hc_num].do_ping && !pdev->host.hc[hc_num].ep_is_in &&
+      pdev->host.hc[hc_num].data_pid != HC_PID_SETUP &&
+      pdev->host.hc[hc_num].speed == HPRT0_PRTSPD_HIGH_SPEED && pdev->cfg.dma_enable == 0)
+  {
+    USB_OTG_HCINTMSK_TypeDef hcintmsk;
+
+    hcintmsk.d32 = 0;
+    hcintmsk.b.ack = 1;
+    USB_OTG_MODIFY_REG32(&pdev->regs.HC_REGS[hc_num]->HCINTMSK, 0, hcintmsk.d32);
+    pdev->host.hc[hc_num].ping_count++;
+    return USB_OTG_HC_DoPing(pdev, hc_num);
+  }
+
+  /* Full/low speed device behind a high speed hub: one packet per start/complete split,
+     the ISR runs the splits until the transfer is done */
+  if (pdev->host.hc[hc_num].do_split && pdev->cfg.dma_enable == 0)
+  {
+    pdev->host.hc[hc_num].split_total = pdev->host.hc[hc_num].xfer_len;
+    pdev->host.hc[hc_num].split_done = 0;
+    pdev->host.hc[hc_num].split_complete = 0;
+    return USB_OTG_HC_SplitXfer(pdev, hc_num);
+  }
+  USB_OTG_WRITE_REG32(&pdev->regs.HC_REGS[hc_num]->HCSPLT, 0);
+
   /* Compute the expected number of packets associated to the transfer */
   if (pdev->host.hc[hc_num].xfer_len > 0)
   {
     num_packets = (pdev->host.hc[hc_num].xfer_len + \
       pdev->host.hc[hc_num].max_packet - 1) / pdev->host.hc[hc_num].max_packet;
-    if(!(num_packets & 0x1))
-    	pdev->host.hc[hc_num].isEvenTimesToggle = 1;
 
     if (num_packets > max_hc_pkt_count)
     {
@@ -1193,8 +1318,10 @@ uint8_t STM32F2< SS, INTR >::HCD_GetHCState (USB_OTG_CORE_HANDLE *pdev ,  uint8_
 		case HC_DATATGLERR:
 			rcode = hrTOGERR;
 			break;
-		case HC_HALTED:
 		case HC_NYET:
+			rcode = hrNYET;
+			break;
+		case HC_HALTED:
 		case HC_IDLE:	//todo: what does this mean?
 			rcode = hrPKTERR;	// no matching error, so just use pkterr tempxxly
 			break;
@@ -1214,32 +1341,89 @@ template< typename SS, typename INTR >
 void STM32F2< SS, INTR >::USB_OTG_BSP_Init(void) {
 	GPIO_InitTypeDef GPIO_InitStructure;
 
-	RCC_AHB1PeriphClockCmd( RCC_AHB1Periph_GPIOA , ENABLE);
-
-	/* Configure SOF VBUS ID DM DP Pins */
-	GPIO_InitStructure.GPIO_Pin = GPIO_Pin_8 | GPIO_Pin_9 | GPIO_Pin_11 | GPIO_Pin_12;
-	GPIO_InitStructure.GPIO_Speed = GPIO_Speed_100MHz;
-	GPIO_InitStructure.GPIO_Mode = GPIO_Mode_AF;
-	GPIO_InitStructure.GPIO_OType = GPIO_OType_PP;
-	GPIO_InitStructure.GPIO_PuPd = GPIO_PuPd_NOPULL ;
-	GPIO_Init(GPIOA, &GPIO_InitStructure);
-
-	GPIO_PinAFConfig(GPIOA,GPIO_PinSource8,GPIO_AF_OTG1_FS) ;
-	GPIO_PinAFConfig(GPIOA,GPIO_PinSource9,GPIO_AF_OTG1_FS) ;
-	GPIO_PinAFConfig(GPIOA,GPIO_PinSource11,GPIO_AF_OTG1_FS) ;
-	GPIO_PinAFConfig(GPIOA,GPIO_PinSource12,GPIO_AF_OTG1_FS) ;
-
-	/* this for ID line debug */
-	GPIO_InitStructure.GPIO_Pin =  GPIO_Pin_10;
-	GPIO_InitStructure.GPIO_OType = GPIO_OType_OD;
-	GPIO_InitStructure.GPIO_PuPd = GPIO_PuPd_UP ;
-	GPIO_InitStructure.GPIO_Speed = GPIO_Speed_100MHz;
-	GPIO_Init(GPIOA, &GPIO_InitStructure);
-	GPIO_PinAFConfig(GPIOA,GPIO_PinSource10,GPIO_AF_OTG1_FS) ;
-
-	RCC_APB2PeriphClockCmd(RCC_APB2Periph_SYSCFG, ENABLE);
-	RCC_AHB2PeriphClockCmd(RCC_AHB2Periph_OTG_FS, ENABLE) ;
-
+	if (coreID == USB_OTG_HS_CORE_ID) {
+#ifdef USB_OTG_ULPI_PHY_ENABLED
+		/* ULPI pins, as on the STM3220G-EVAL board */
+		RCC_AHB1PeriphClockCmd( RCC_AHB1Periph_GPIOA | RCC_AHB1Periph_GPIOB | RCC_AHB1Periph_GPIOC |
+				RCC_AHB1Periph_GPIOH | RCC_AHB1Periph_GPIOI, ENABLE);
+
+		GPIO_PinAFConfig(GPIOA,GPIO_PinSource3, GPIO_AF_OTG2_HS) ; // D0
+		GPIO_PinAFConfig(GPIOA,GPIO_PinSource5, GPIO_AF_OTG2_HS) ; // CLK
+		GPIO_PinAFConfig(GPIOB,GPIO_PinSource0, GPIO_AF_OTG2_HS) ; // D1
+		GPIO_PinAFConfig(GPIOB,GPIO_PinSource1, GPIO_AF_OTG2_HS) ; // D2
+		GPIO_PinAFConfig(GPIOB,GPIO_PinSource5, GPIO_AF_OTG2_HS) ; // D7
+		GPIO_PinAFConfig(GPIOB,GPIO_PinSource10,GPIO_AF_OTG2_HS) ; // D3
+		GPIO_PinAFConfig(GPIOB,GPIO_PinSource11,GPIO_AF_OTG2_HS) ; // D4
+		GPIO_PinAFConfig(GPIOB,GPIO_PinSource12,GPIO_AF_OTG2_HS) ; // D5
+		GPIO_PinAFConfig(GPIOB,GPIO_PinSource13,GPIO_AF_OTG2_HS) ; // D6
+		GPIO_PinAFConfig(GPIOH,GPIO_PinSource4, GPIO_AF_OTG2_HS) ; // NXT
+		GPIO_PinAFConfig(GPIOI,GPIO_PinSource11,GPIO_AF_OTG2_HS) ; // DIR
+		GPIO_PinAFConfig(GPIOC,GPIO_PinSource0, GPIO_AF_OTG2_HS) ; // STP
+
+		GPIO_InitStructure.GPIO_Speed = GPIO_Speed_100MHz;
+		GPIO_InitStructure.GPIO_Mode = GPIO_Mode_AF;
+		GPIO_InitStructure.GPIO_OType = GPIO_OType_PP;
+		GPIO_InitStructure.GPIO_PuPd = GPIO_PuPd_NOPULL;
+
+		GPIO_InitStructure.GPIO_Pin = GPIO_Pin_3 | GPIO_Pin_5;
+		GPIO_Init(GPIOA, &GPIO_InitStructure);
+		GPIO_InitStructure.GPIO_Pin = GPIO_Pin_0 | GPIO_Pin_1 | GPIO_Pin_5 | GPIO_Pin_10 |
+				GPIO_Pin_11 | GPIO_Pin_12 | GPIO_Pin_13;
+		GPIO_Init(GPIOB, &GPIO_InitStructure);
+		GPIO_InitStructure.GPIO_Pin = GPIO_Pin_0;
+		GPIO_Init(GPIOC, &GPIO_InitStructure);
+		GPIO_InitStructure.GPIO_Pin = GPIO_Pin_4;
+		GPIO_Init(GPIOH, &GPIO_InitStructure);
+		GPIO_InitStructure.GPIO_Pin = GPIO_Pin_11;
+		GPIO_Init(GPIOI, &GPIO_InitStructure);
+
+		RCC_AHB1PeriphClockCmd( RCC_AHB1Periph_OTG_HS | RCC_AHB1Periph_OTG_HS_ULPI, ENABLE) ;
+#else
+		/* HS core with its embedded FS PHY */
+		RCC_AHB1PeriphClockCmd( RCC_AHB1Periph_GPIOB , ENABLE);
+
+		GPIO_InitStructure.GPIO_Pin = GPIO_Pin_12 | GPIO_Pin_13 | GPIO_Pin_14 | GPIO_Pin_15;
+		GPIO_InitStructure.GPIO_Speed = GPIO_Speed_100MHz;
+		GPIO_InitStructure.GPIO_Mode = GPIO_Mode_AF;
+		GPIO_InitStructure.GPIO_OType = GPIO_OType_PP;
+		GPIO_InitStructure.GPIO_PuPd = GPIO_PuPd_NOPULL ;
+		GPIO_Init(GPIOB, &GPIO_InitStructure);
+
+		GPIO_PinAFConfig(GPIOB,GPIO_PinSource12, GPIO_AF_OTG2_FS) ;
+		GPIO_PinAFConfig(GPIOB,GPIO_PinSource13, GPIO_AF_OTG2_FS) ;
+		GPIO_PinAFConfig(GPIOB,GPIO_PinSource14, GPIO_AF_OTG2_FS) ;
+		GPIO_PinAFConfig(GPIOB,GPIO_PinSource15, GPIO_AF_OTG2_FS) ;
+
+		RCC_AHB1PeriphClockCmd( RCC_AHB1Periph_OTG_HS, ENABLE) ;
+#endif
+		RCC_APB2PeriphClockCmd(RCC_APB2Periph_SYSCFG, ENABLE);
+	} else {
+		RCC_AHB1PeriphClockCmd( RCC_AHB1Periph_GPIOA , ENABLE);
+
+		/* Configure SOF VBUS ID DM DP Pins */
+		GPIO_InitStructure.GPIO_Pin = GPIO_Pin_8 | GPIO_Pin_9 | GPIO_Pin_11 | GPIO_Pin_12;
+		GPIO_InitStructure.GPIO_Speed = GPIO_Speed_100MHz;
+		GPIO_InitStructure.GPIO_Mode = GPIO_Mode_AF;
+		GPIO_InitStructure.GPIO_OType = GPIO_OType_PP;
+		GPIO_InitStructure.GPIO_PuPd = GPIO_PuPd_NOPULL ;
+		GPIO_Init(GPIOA, &GPIO_InitStructure);
+
+		GPIO_PinAFConfig(GPIOA,GPIO_PinSource8,GPIO_AF_OTG1_FS) ;
+		GPIO_PinAFConfig(GPIOA,GPIO_PinSource9,GPIO_AF_OTG1_FS) ;
+		GPIO_PinAFConfig(GPIOA,GPIO_PinSource11,GPIO_AF_OTG1_FS) ;
+		GPIO_PinAFConfig(GPIOA,GPIO_PinSource12,GPIO_AF_OTG1_FS) ;
+
+		/* this for ID line debug */
+		GPIO_InitStructure.GPIO_Pin =  GPIO_Pin_10;
+		GPIO_InitStructure.GPIO_OType = GPIO_OType_OD;
+		GPIO_InitStructure.GPIO_PuPd = GPIO_PuPd_UP ;
+		GPIO_InitStructure.GPIO_Speed = GPIO_Speed_100MHz;
+		GPIO_Init(GPIOA, &GPIO_InitStructure);
+		GPIO_PinAFConfig(GPIOA,GPIO_PinSource10,GPIO_AF_OTG1_FS) ;
+
+		RCC_APB2PeriphClockCmd(RCC_APB2Periph_SYSCFG, ENABLE);
+		RCC_AHB2PeriphClockCmd(RCC_AHB2Periph_OTG_FS, ENABLE) ;
+	}
 }
 
 /**
@@ -1330,10 +1514,8 @@ USB_OTG_STS STM32F2< SS, INTR >::USB_OTG_SelectCore(USB_OTG_CORE_ID_TypeDef core
 #ifdef USB_OTG_ULPI_PHY_ENABLED
     pdev->cfg.phy_itface       = USB_OTG_ULPI_PHY;
 #else
-#ifdef USB_OTG_EMBEDDED_PHY_ENABLED
     pdev->cfg.phy_itface       = USB_OTG_EMBEDDED_PHY;
 #endif
-#endif
 
 #ifdef USB_OTG_HS_INTERNAL_DMA_ENABLED
     pdev->cfg.dma_enable       = 1;
@@ -1496,14 +1678,16 @@ template< typename SS, typename INTR >
 void STM32F2< SS, INTR >::USB_OTG_BSP_EnableInterrupt(void) {
   NVIC_InitTypeDef NVIC_InitStructure;
 
-  NVIC_PriorityGroupConfig(NVIC_PriorityGroup_1);
+  NVIC_PriorityGroupConfig(USBH_NVIC_PRIORITY_GROUP);
 
-  NVIC_InitStructure.NVIC_IRQChannel = OTG_FS_IRQn;
-  NVIC_InitStructure.NVIC_IRQChannelPreemptionPriority = 1;
-  NVIC_InitStructure.NVIC_IRQChannelSubPriority = 3;
+  NVIC_InitStructure.NVIC_IRQChannel = (coreID == USB_OTG_HS_CORE_ID) ? OTG_HS_IRQn : OTG_FS_IRQn;
+  NVIC_InitStructure.NVIC_IRQChannelPreemptionPriority = USBH_IRQ_PREEMPTION_PRIORITY;
+  NVIC_InitStructure.NVIC_IRQChannelSubPriority = USBH_IRQ_SUB_PRIORITY;
   NVIC_InitStructure.NVIC_IRQChannelCmd = ENABLE;
   NVIC_Init(&NVIC_InitStructure);
 
+  /* deferred channel handling, below every other interrupt */
+  NVIC_SetPriority(PendSV_IRQn, (1 << __NVIC_PRIO_BITS) - 1);
 }
 
 /**
@@ -1664,6 +1848,18 @@ USB_OTG_STS STM32F2< SS, INTR >::USB_OTG_CoreInitHost(void)
     ptxfifosize.b.depth     = TXH_P_FS_FIFOSIZ;
     USB_OTG_WRITE_REG32(&pdev->regs.GREGS->HPTXFSIZ, ptxfifosize.d32);
   }
+  else if (pdev->cfg.coreID == USB_OTG_HS_CORE_ID)
+  {
+    /* set Rx FIFO size */
+    USB_OTG_WRITE_REG32(&pdev->regs.GREGS->GRXFSIZ, RX_FIFO_HS_SIZE);
+    nptxfifosize.b.startaddr = RX_FIFO_HS_SIZE;
+    nptxfifosize.b.depth = TXH_NP_HS_FIFOSIZ;
+    USB_OTG_WRITE_REG32(&pdev->regs.GREGS->DIEPTXF0_HNPTXFSIZ, nptxfifosize.d32);
+
+    ptxfifosize.b.startaddr = RX_FIFO_HS_SIZE + TXH_NP_HS_FIFOSIZ;
+    ptxfifosize.b.depth     = TXH_P_HS_FIFOSIZ;
+    USB_OTG_WRITE_REG32(&pdev->regs.GREGS->HPTXFSIZ, ptxfifosize.d32);
+  }
 #endif
 
   /* Make sure the FIFOs are flushed. */
@@ -1909,7 +2105,10 @@ void STM32F2< SS, INTR >::USB_OTG_BSP_DriveVBUS(uint8_t state)
   The application uses this field to control power to this port, and the core
   clears this bit on an overcurrent condition.
   */
-#ifndef USE_USB_OTG_HS
+  /* the power switch on the board feeds the FS connector */
+  if (coreID != USB_OTG_FS_CORE_ID)
+    return;
+
   if (0 == state)
   {
     /* DISABLE is needed on output of the Power Switch */
@@ -1920,6 +2119,5 @@ void STM32F2< SS, INTR >::USB_OTG_BSP_DriveVBUS(uint8_t state)
     /*ENABLE the Power Switch by driving the Enable LOW */
     GPIO_ResetBits(HOST_POWERSW_PORT, HOST_POWERSW_VBUS);
   }
-#endif
 }
 #endif //_USBHOST_H_
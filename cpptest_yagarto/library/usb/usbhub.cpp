@@ -14,17 +14,24 @@ Circuits At Home, LTD
 Web      :  http://www.circuitsathome.com
 e-mail   :  support@circuitsathome.com
  */
+#include <string.h>
 #include "usbhub.h"
 
-bool USBHub::bResetInitiated = false;
-
 USBHub::USBHub(USB *p) :
 pUsb(p),
 bAddress(0),
 bNbrPorts(0),
 //bInitState(0),
 qNextPollTime(0),
-bPollEnable(false) {
+bInterval(HUB_POLL_INTERVAL),
+bPollEnable(false),
+bRescan(false),
+bPending(0),
+bEnumPort(0),
+bEnumState(HUB_ENUM_IDLE),
+bBringUpCount(0) {
+        memset(bmPending, 0, sizeof (bmPending));
+
         epInfo[0].epAddr = 0;
         epInfo[0].maxPktSize = 8;
         epInfo[0].epAttribs = 0;
@@ -122,7 +129,7 @@ uint8_t USBHub::Init(uint8_t parent, uint8_t port, bool lowspeed) {
                         // Restore p->epinfo
                         p->epinfo = oldep_ptr;
 
-                        // we need to assign hcnumber for this new bAddress(0x41)
+                        // we need to assign hcnumber for this new bAddress
                         p = addrPool.GetUsbDevicePtr(bAddress);
                         p->epinfo->hcNumber = epInfo[0].hcNumber;
                         p->epinfo->maxPktSize = epInfo[0].maxPktSize;
@@ -188,16 +195,17 @@ uint8_t USBHub::Init(uint8_t parent, uint8_t port, bool lowspeed) {
                         for (uint8_t j = 1; j <= bNbrPorts; j++)
 							SetPortFeature(HUB_FEATURE_PORT_POWER, j, 0); //HubPortPowerOn(j);
 
-                        pUsb->SetHubPreMask();
                         bPollEnable = true;
+                        bRescan = true; // pick up devices which are already there
 
                         epInfo[1].epAddr = buf[20];
+                        bInterval = (buf[24]) ? pUsb->GetPollInterval(bAddress, buf[24]) : HUB_POLL_INTERVAL;
                         epInfo[1].hcNumIn = USB::USBH_Alloc_Channel(pUsb->coreConfig, epInfo[1].epAddr);
                         printf("\nHub Pipe in = %d (EP_TYPE_INTR)", epInfo[1].hcNumIn);
 
                         // Assign epInfo to epinfo pointer
                         rcode = pUsb->setEpInfoEntry(bAddress, 2, epInfo);
-                        USB::USBH_Open_Channel(pUsb->coreConfig, epInfo[1].hcNumIn, bAddress, (lowspeed)?bmLOWSPEED:bmFULLSPEED, EP_TYPE_INTR, epInfo[1].maxPktSize);
+                        USB::USBH_Open_Channel(pUsb->coreConfig, epInfo[1].hcNumIn, bAddress, pUsb->GetHcSpeed(bAddress), EP_TYPE_INTR, epInfo[1].maxPktSize);
                         pUsb->coreConfig->host.hc[epInfo[1].hcNumIn].toggle_in = 0x0;
 
         //                bInitState = 0;
@@ -235,15 +243,25 @@ uint8_t USBHub::Release() {
 	//todo: we need un-install epInfo either.
 	epInfo[1].hcNumber = 0;
 
-	pUsb->GetAddressPool().FreeAddress(bAddress);
+	// Devices behind the hub go first, FreeAddress() below takes their addresses anyway
+	for (uint8_t port = 1; bAddress && port <= bNbrPorts; port++) {
+		uint8_t child = pUsb->GetAddressPool().FindChildAddress(bAddress, port);
 
-	if (bAddress == 0x41)
-		pUsb->SetHubPreMask();
+		if (child)
+			pUsb->ReleaseDevice(child);
+	}
+	pUsb->GetAddressPool().FreeAddress(bAddress);
 
 	bAddress = 0;
 	bNbrPorts = 0;
 	qNextPollTime = 0;
 	bPollEnable = false;
+	bRescan = false;
+
+	EndPortEnum();
+	memset(bmPending, 0, sizeof (bmPending));
+	bPending = 0;
+	bBringUpCount = 0;
 	return 0;
 }
 
@@ -255,23 +273,131 @@ uint8_t USBHub::Poll() {
 
         if (qNextPollTime <= millis()) {
 			rcode = CheckHubStatus();
-			qNextPollTime = millis() + 100;
+			qNextPollTime = millis() + bInterval;
+        }
+        if (bPending || bEnumState != HUB_ENUM_IDLE || bBringUpCount) {
+			uint8_t rc = ServicePorts();
+
+			if (!rcode)
+				rcode = rc;
         }
         return rcode;
 }
 
+// Gives address 0 back, the next port may go
+
+void USBHub::EndPortEnum() {
+        if (bEnumPort)
+			pUsb->SetResetInitiated(false);
+
+        bEnumPort = 0;
+        bEnumState = HUB_ENUM_IDLE;
+}
+
+// Moves the port enumeration pipeline one step on. Never waits, the deadlines are checked on every Poll().
+
+uint8_t USBHub::ServicePorts() {
+        HubEvent evt;
+        uint8_t rcode = 0;
+
+        switch (bEnumState) {
+                case HUB_ENUM_IDLE:
+                        if (!bPending) {
+							// Batch done
+							printf("\r\nHub 0x%x: %u device(s) enumerated in %lu ms", bAddress, bBringUpCount, millis() - qBringUpStart);
+							bBringUpCount = 0;
+							return 0;
+                        }
+                        if (pUsb->IsResetInitiated() || millis() < qDebounceTime)
+							return 0;
+
+                        for (uint8_t port = 1; port <= bNbrPorts; port++) {
+							if (!(bmPending[port >> 3] & (1 << (port & 7))))
+								continue;
+
+							bmPending[port >> 3] &= ~(1 << (port & 7));
+							bPending--;
+
+							evt.bmEvent = 0;
+							rcode = GetPortStatus(port, 4, evt.evtBuff);
+
+							if (rcode) {
+								bRescan = true;
+								return rcode;
+							}
+							if (!(evt.bmStatus & bmHUB_PORT_STATUS_PORT_CONNECTION))
+								return 0; // gone again
+
+							rcode = SetPortFeature(HUB_FEATURE_PORT_RESET, port, 0);
+
+							if (rcode) {
+								bRescan = true;
+								return rcode;
+							}
+							pUsb->SetResetInitiated(true);
+							bEnumPort = port;
+							bEnumState = HUB_ENUM_RESET;
+							qEnumTime = millis() + HUB_PORT_RESET_DELAY;
+							qEnumTimeout = millis() + HUB_PORT_RESET_TIMEOUT;
+							return 0;
+                        }
+                        bPending = 0; // only ports beyond bNbrPorts were left
+                        return 0;
+
+                case HUB_ENUM_RESET:
+                        if (millis() < qEnumTime)
+							return 0;
+
+                        evt.bmEvent = 0;
+                        rcode = GetPortStatus(bEnumPort, 4, evt.evtBuff);
+
+                        if (!rcode && (evt.bmChange & bmHUB_PORT_STATUS_C_PORT_RESET) && (evt.bmStatus & bmHUB_PORT_STATUS_PORT_ENABLE)) {
+							ClearPortFeature(HUB_FEATURE_C_PORT_RESET, bEnumPort, 0);
+							ClearPortFeature(HUB_FEATURE_C_PORT_CONNECTION, bEnumPort, 0);
+							bEnumLowSpeed = (evt.bmStatus & bmHUB_PORT_STATUS_PORT_LOW_SPEED) ? true : false;
+							bEnumHighSpeed = (evt.bmStatus & bmHUB_PORT_STATUS_PORT_HIGH_SPEED) ? true : false;
+							bEnumState = HUB_ENUM_RECOVERY;
+							qEnumTime = millis() + HUB_PORT_RECOVERY_DELAY;
+							return 0;
+                        }
+                        if (rcode || !(evt.bmStatus & bmHUB_PORT_STATUS_PORT_CONNECTION) || millis() >= qEnumTimeout) {
+							EndPortEnum();
+							bRescan = true;
+							return rcode;
+                        }
+                        qEnumTime = millis() + HUB_PORT_RESET_POLL;
+                        return 0;
+
+                case HUB_ENUM_RECOVERY:
+                        if (millis() < qEnumTime)
+							return 0;
+
+                        rcode = pUsb->Configuring(bAddress, bEnumPort, bEnumLowSpeed, bEnumHighSpeed);
+                        bBringUpCount++;
+                        EndPortEnum();
+                        return rcode;
+        }
+        return 0;
+}
+
 uint8_t USBHub::CheckHubStatus() {
         uint8_t rcode;
-        uint8_t buf[8];
-        uint16_t read = 1;
+        uint8_t buf[32];
+        uint16_t read = (bNbrPorts + 8) >> 3; // status change bitmap, bit 0 is the hub itself
 
         rcode = pUsb->inTransfer(bAddress, epInfo[1].epAddr, &read, buf);
-        if(rcode != hrSUCCESS) {
-        	//STM_EVAL_LEDToggle(LED1);
+
+        // The interrupt endpoint NAKs as long as nothing has changed, which costs no control transfer at all
+        if (rcode == hrNAK) {
+			rcode = 0;
+			read = 0;
         }
-        if (rcode)
+        if (rcode) {
+			bRescan = true;
 			return rcode;
-        STM_EVAL_LEDToggle(LED1);
+        }
+        if (read)
+			STM_EVAL_LEDToggle(LED1);
         //if (buf[0] & 0x01) // Hub Status Change
         //{
         //        pUsb->PrintHubStatus(addr);
@@ -283,34 +409,46 @@ uint8_t USBHub::CheckHubStatus() {
         //        	return rcode;
         //        }
         //}
-        for (uint8_t port = 1, mask = 0x02; port < 8; mask <<= 1, port++) {
-			if (buf[0] & mask) {
+        for (uint8_t port = 1; port <= bNbrPorts && port < (read << 3); port++) {
+			if (buf[port >> 3] & (1 << (port & 7))) {
 				HubEvent evt;
 				evt.bmEvent = 0;
 
 				rcode = GetPortStatus(port, 4, evt.evtBuff);
 
-				if (rcode)
+				if (rcode) {
+					bRescan = true;
 					continue;
+				}
 
 				rcode = PortStatusChange(port, evt);
 
 				if (rcode == HUB_ERROR_PORT_HAS_BEEN_RESET)
 					return 0;
 
-				if (rcode)
+				if (rcode) {
+					bRescan = true;
 					return rcode;
+				}
 			}
         } // for
 
+        // Full scan for connects that may have been missed, only after errors and port resets
+        if (!bRescan)
+			return 0;
+
+        bRescan = false;
+
         for (uint8_t port = 1; port <= bNbrPorts; port++) {
                 HubEvent evt;
                 evt.bmEvent = 0;
 
                 rcode = GetPortStatus(port, 4, evt.evtBuff);
 
-                if (rcode)
+                if (rcode) {
+					bRescan = true;
 					continue;
+                }
 
                 if ((evt.bmStatus & bmHUB_PORT_STATE_CHECK_DISABLED) != bmHUB_PORT_STATE_DISABLED)
 					continue;
@@ -323,13 +461,16 @@ uint8_t USBHub::CheckHubStatus() {
                 if (rcode == HUB_ERROR_PORT_HAS_BEEN_RESET)
                         return 0;
 
-                if (rcode)
+                if (rcode) {
+                        bRescan = true;
                         return rcode;
+                }
         } // for
         return 0;
 }
 
 void USBHub::ResetHubPort(uint8_t port) {
+        USB_FAULT_PROBE(USB_FAULT_PROBE_HUB_PORT_RESET);
         HubEvent evt;
         evt.bmEvent = 0;
         uint8_t rcode;
@@ -350,6 +491,19 @@ void USBHub::ResetHubPort(uint8_t port) {
         ClearPortFeature(HUB_FEATURE_C_PORT_RESET, port, 0);
         ClearPortFeature(HUB_FEATURE_C_PORT_CONNECTION, port, 0);
         delay_ms(20);
+        bRescan = true;
+}
+
+// Drops a bulk/control transaction to a full/low speed device that was left in the TT half way.
+// The hub runs its default interface, a single TT for all ports, so the TT is addressed as port 1.
+uint8_t USBHub::ClearTTBuffer(uint8_t addr, uint8_t ep, uint8_t eptype) {
+        uint16_t wValue = (ep & 0x0F) | ((uint16_t)addr << 4) | ((uint16_t)(eptype & 0x03) << 11) | ((ep & 0x80) ? 0x8000 : 0);
+        uint8_t rcode = pUsb->ctrlReq(bAddress, 0, bmREQ_CLEAR_TT_BUFFER, HUB_REQUEST_CLEAR_TT_BUFFER, (uint8_t)wValue, (uint8_t)(wValue >> 8), 1, 0, 0, NULL, NULL);
+
+        // A TT that does not take the request is put back to a known state
+        if (rcode)
+                rcode = ResetTT(1);
+        return rcode;
 }
 
 uint8_t USBHub::PortStatusChange(uint8_t port, HubEvent &evt) {
@@ -357,41 +511,43 @@ uint8_t USBHub::PortStatusChange(uint8_t port, HubEvent &evt) {
                         // Device connected event
                 case bmHUB_PORT_EVENT_CONNECT:
                 case bmHUB_PORT_EVENT_LS_CONNECT:
-                        if (bResetInitiated)
-                                return 0;
-
                         ClearPortFeature(HUB_FEATURE_C_PORT_ENABLE, port, 0);
                         ClearPortFeature(HUB_FEATURE_C_PORT_CONNECTION, port, 0);
-                        SetPortFeature(HUB_FEATURE_PORT_RESET, port, 0);
-                        bResetInitiated = true;
-                        return HUB_ERROR_PORT_HAS_BEEN_RESET;
+
+                        if (port == bEnumPort)
+                                return 0;
+
+                        // Queue the port, ServicePorts() resets it once the connection is stable and address 0 is free
+                        if (!(bmPending[port >> 3] & (1 << (port & 7)))) {
+                                bmPending[port >> 3] |= (1 << (port & 7));
+                                bPending++;
+                        }
+                        if (!bBringUpCount && bEnumState == HUB_ENUM_IDLE && bPending == 1)
+                                qBringUpStart = millis();
+                        qDebounceTime = millis() + HUB_PORT_DEBOUNCE_DELAY;
+                        return 0;
 
                         // Device disconnected event
                 case bmHUB_PORT_EVENT_DISCONNECT:
                         ClearPortFeature(HUB_FEATURE_C_PORT_ENABLE, port, 0);
                         ClearPortFeature(HUB_FEATURE_C_PORT_CONNECTION, port, 0);
-                        bResetInitiated = false;
-
-                        UsbDeviceAddress a;
-                        a.devAddress = 0;	// var init first
-                        a.bmHub = 0;
-                        a.bmParent = bAddress;
-                        a.bmAddress = port;
-                        pUsb->ReleaseDevice(a.devAddress);
+
+                        if (bmPending[port >> 3] & (1 << (port & 7))) {
+                                bmPending[port >> 3] &= ~(1 << (port & 7));
+                                bPending--;
+                        }
+                        if (port == bEnumPort)
+                                EndPortEnum();
+
+                        pUsb->ReleaseDevice(pUsb->GetAddressPool().FindChildAddress(bAddress, port));
                         return 0;
 
                         // Reset complete event
                 case bmHUB_PORT_EVENT_RESET_COMPLETE:
                 case bmHUB_PORT_EVENT_LS_RESET_COMPLETE:
-                        ClearPortFeature(HUB_FEATURE_C_PORT_RESET, port, 0);
-                        ClearPortFeature(HUB_FEATURE_C_PORT_CONNECTION, port, 0);
-
-                        delay_ms(20);
-
-                        a.devAddress = bAddress;
-
-                        pUsb->Configuring(a.bmAddress, port, (evt.bmStatus & bmHUB_PORT_STATUS_PORT_LOW_SPEED));
-                        bResetInitiated = false;
+                        // The port being enumerated is seen to by ServicePorts()
+                        if (port != bEnumPort)
+                                ClearPortFeature(HUB_FEATURE_C_PORT_RESET, port, 0);
                         break;
 
         } // switch (evt.bmEvent)
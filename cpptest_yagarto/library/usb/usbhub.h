@@ -119,6 +119,18 @@ e-mail   :  support@circuitsathome.com
 // Additional Error Codes
 #define HUB_ERROR_PORT_HAS_BEEN_RESET		0xb1
 
+#define HUB_POLL_INTERVAL			100	// ms, if the interrupt endpoint has no bInterval
+
+#define HUB_PORT_DEBOUNCE_DELAY			100	// connect debounce interval, per section 7.1.7.3 of USB 2.0 spec
+#define HUB_PORT_RECOVERY_DELAY			10	// reset recovery time, per section 7.1.7.5 of USB 2.0 spec
+#define HUB_PORT_RESET_POLL			5	// port status is read this often while a reset is on
+#define HUB_PORT_RESET_TIMEOUT			500	// a port reset that takes longer is given up
+
+/* Port enumeration pipeline states */
+#define HUB_ENUM_IDLE				0	// waiting for a debounced port and for address 0 to be free
+#define HUB_ENUM_RESET				1	// port reset issued, waiting for C_PORT_RESET
+#define HUB_ENUM_RECOVERY			2	// reset complete, waiting for the recovery interval
+
 // The bit mask to check for all necessary state bits
 #define bmHUB_PORT_STATUS_ALL_MAIN		((0UL  | bmHUB_PORT_STATUS_C_PORT_CONNECTION  | bmHUB_PORT_STATUS_C_PORT_ENABLE  | bmHUB_PORT_STATUS_C_PORT_SUSPEND  | bmHUB_PORT_STATUS_C_PORT_RESET) << 16) | bmHUB_PORT_STATUS_PORT_POWER | bmHUB_PORT_STATUS_PORT_ENABLE | bmHUB_PORT_STATUS_PORT_CONNECTION | bmHUB_PORT_STATUS_PORT_SUSPEND)
 
@@ -169,8 +181,6 @@ struct HubEvent {
 } __attribute__((packed));
 
 class USBHub : USBDeviceConfig {
-        static bool bResetInitiated; // True when reset is triggered
-
         USB *pUsb; // USB class instance pointer
 
         EpInfo epInfo[2]; // interrupt endpoint info structure
@@ -179,10 +189,28 @@ class USBHub : USBDeviceConfig {
         uint8_t bNbrPorts; // number of ports
 //        uint8_t bInitState; // initialization state variable
         uint32_t qNextPollTime; // next poll time
+        uint16_t bInterval; // interrupt endpoint polling interval, ms
         bool bPollEnable; // poll enable flag
+        bool bRescan; // all ports are to be checked on the next poll, not just the changed ones
+
+        // Port enumeration pipeline. Connected ports debounce side by side, reset and
+        // address assignment go one port at a time since there is only one address 0.
+        uint8_t bmPending[32]; // ports with a connect waiting for their reset, bit per port
+        uint8_t bPending; // number of bits set in bmPending
+        uint8_t bEnumPort; // port owning address 0 right now, 0 if none
+        uint8_t bEnumState; // HUB_ENUM_xxx
+        bool bEnumLowSpeed; // speed of the device at bEnumPort
+        bool bEnumHighSpeed; // ditto, high speed
+        uint32_t qEnumTime; // next step of the pipeline is due
+        uint32_t qEnumTimeout; // the reset at bEnumPort is given up
+        uint32_t qDebounceTime; // pending ports are stable from then on
+        uint32_t qBringUpStart; // first connect of the current batch
+        uint8_t bBringUpCount; // devices enumerated in the current batch
 
         uint8_t CheckHubStatus();
         uint8_t PortStatusChange(uint8_t port, HubEvent &evt);
+        uint8_t ServicePorts();
+        void EndPortEnum();
 
 public:
         USBHub(USB *p);
@@ -195,6 +223,7 @@ public:
         uint8_t SetHubDescriptor(uint8_t port, uint16_t nbytes, uint8_t* dataptr);
         uint8_t SetHubFeature(uint8_t fid);
         uint8_t SetPortFeature(uint8_t fid, uint8_t port, uint8_t sel = 0);
+        uint8_t ResetTT(uint8_t port);
 
         void PrintHubStatus();
 
@@ -202,11 +231,20 @@ public:
         virtual uint8_t Release();
         virtual uint8_t Poll();
         virtual void ResetHubPort(uint8_t port);
+        virtual uint8_t ClearTTBuffer(uint8_t addr, uint8_t ep, uint8_t eptype);
         virtual uint8_t GetAddress() {
 			return bAddress;
         };
         virtual uint8_t DEVCLASSOK(uint8_t klass) { return (klass == 0x09); }
 
+        virtual const UsbMatchEntry* GetMatchTable(uint8_t *count) {
+                static const UsbMatchEntry table[] = {
+                        { USB_MATCH_DEV_CLASS, 0, 0, USB_CLASS_HUB, 0, 0 }
+                };
+                *count = sizeof (table) / sizeof (UsbMatchEntry);
+                return table;
+        };
+
 };
 
 // Clear Hub Feature
@@ -222,7 +260,16 @@ inline uint8_t USBHub::ClearPortFeature(uint8_t fid, uint8_t port, uint8_t sel)
 // Get Hub Descriptor
 
 inline uint8_t USBHub::GetHubDescriptor(uint8_t index, uint16_t nbytes, uint8_t *dataptr) {
-        return( pUsb->ctrlReq(bAddress, 0, bmREQ_GET_HUB_DESCRIPTOR, USB_REQUEST_GET_DESCRIPTOR, index, 0x29, 0, nbytes, nbytes, dataptr, NULL));
+        DescriptorCache &cache = pUsb->GetDescriptorCache();
+
+        if (cache.GetClassDescr(bAddress, 0x29, nbytes, dataptr))
+                return 0;
+
+        uint8_t rcode = pUsb->ctrlReq(bAddress, 0, bmREQ_GET_HUB_DESCRIPTOR, USB_REQUEST_GET_DESCRIPTOR, index, 0x29, 0, nbytes, nbytes, dataptr, NULL);
+
+        if (!rcode)
+                cache.PutClassDescr(bAddress, 0x29, nbytes, dataptr);
+        return rcode;
 }
 // Get Hub Status
 
@@ -249,6 +296,11 @@ inline uint8_t USBHub::SetHubFeature(uint8_t fid) {
 inline uint8_t USBHub::SetPortFeature(uint8_t fid, uint8_t port, uint8_t sel) {
         return( pUsb->ctrlReq(bAddress, 0, bmREQ_SET_PORT_FEATURE, USB_REQUEST_SET_FEATURE, fid, 0, (((0x0000 | sel) << 8) | port), 0, 0, NULL, NULL));
 }
+// Reset TT
+
+inline uint8_t USBHub::ResetTT(uint8_t port) {
+        return( pUsb->ctrlReq(bAddress, 0, bmREQ_RESET_TT, HUB_REQUEST_RESET_TT, 0, 0, port, 0, 0, NULL, NULL));
+}
 
 void PrintHubPortStatus(USB *usbptr, uint8_t addr, uint8_t port, bool print_changes = false);
 
@@ -0,0 +1,95 @@
+/*
+ * usbretry.cpp
+ *
+ * Error classes, retry policy and device health, see usbretry.h
+ */
+
+#include <string.h>
+#include "usbhost.h"
+#include "Usb.h"
+#include "bsp.h"
+
+const UsbRetryPolicy UsbRetryBus = { USB_RETRY_LIMIT, USB_RETRY_LIMIT, 0, 0 };
+const UsbRetryPolicy UsbRetryStorage = { USB_RETRY_STORAGE_TRIES, USB_RETRY_STORAGE_PROTOCOL, USB_RETRY_BACKOFF_MIN, USB_RETRY_BACKOFF_MAX };
+
+uint8_t UsbErrorClass(uint8_t rcode) {
+        switch (rcode) {
+                case hrSUCCESS:
+                        return USB_ERR_CLASS_NONE;
+                case hrBUSY:
+                case hrNAK:
+                case hrNYET:
+                case hrTIMEOUT:
+                case hrCRCERR: // line noise, the packet is sent again
+                case hrPKTERR:
+                case USB_ERROR_TRANSFER_TIMEOUT:
+                        return USB_ERR_CLASS_TRANSIENT;
+                case hrSTALL:
+                case hrTOGERR:
+                case hrWRONGPID:
+                case hrBADBC:
+                case hrPIDERR:
+                case hrBABBLE:
+                        return USB_ERR_CLASS_PROTOCOL;
+                default: // hrJERR is the device going away, the rest are addressing and configuration errors
+                        return USB_ERR_CLASS_FATAL;
+        }
+}
+
+void UsbHealthClear(UsbHealth *h) {
+        memset(h, 0, sizeof (UsbHealth));
+}
+
+void UsbHealthRecord(UsbHealth *h, uint8_t errclass) {
+        h->transfers++;
+        switch (errclass) {
+                case USB_ERR_CLASS_NONE:
+                        h->failStreak = 0;
+                        return;
+                case USB_ERR_CLASS_TRANSIENT:
+                        h->transient++;
+                        break;
+                case USB_ERR_CLASS_PROTOCOL:
+                        h->protocol++;
+                        break;
+                default:
+                        h->fatal++;
+                        break;
+        }
+        if (h->failStreak < 0xFFFF)
+                h->failStreak++;
+}
+
+UsbRetry::UsbRetry(const UsbRetryPolicy *p, UsbHealth *h) :
+policy(p),
+health(h),
+attempts(0),
+limit(p->transientTries),
+backoff(p->backoffMin) {
+}
+
+bool UsbRetry::Again(uint8_t errclass) {
+        if (errclass == USB_ERR_CLASS_NONE) {
+                if (attempts && health)
+                        health->recovered++;
+                return false;
+        }
+        attempts++;
+        if (errclass == USB_ERR_CLASS_FATAL)
+                return false;
+        // one protocol error and the budget shrinks for the rest of the operation
+        if (errclass == USB_ERR_CLASS_PROTOCOL && limit > policy->protocolTries)
+                limit = policy->protocolTries;
+        if (attempts >= limit) {
+                if (health)
+                        health->exhausted++;
+                return false;
+        }
+        if (health)
+                health->retries++;
+        if (backoff) {
+                delay(backoff);
+                backoff = (backoff < policy->backoffMax / 2) ? backoff << 1 : policy->backoffMax;
+        }
+        return true;
+}
@@ -0,0 +1,88 @@
+/*
+ * usbretry.h
+ *
+ * Retry policy shared by the host and the class drivers. A failed attempt is
+ * put into a class first: transient errors (NAK limit, bus timeout, busy unit)
+ * are retried with a bounded exponential backoff, protocol errors (STALL, data
+ * toggle, broken CSW) get a short budget after the driver's own recovery, and
+ * fatal errors (disconnect, no media, write protect) are not retried at all.
+ * Every addressed device keeps health counters, see USB::GetDeviceHealth().
+ */
+
+#if !defined(__USBRETRY_H__)
+#define __USBRETRY_H__
+
+#include <inttypes.h>
+#include <stddef.h>
+
+#define USB_ERR_CLASS_NONE		0	// success
+#define USB_ERR_CLASS_TRANSIENT		1	// may well work on the next attempt
+#define USB_ERR_CLASS_PROTOCOL		2	// worth a try or two once the pipe was recovered
+#define USB_ERR_CLASS_FATAL		3	// will never succeed, give up at once
+
+#ifndef USB_RETRY_STORAGE_TRIES
+#define USB_RETRY_STORAGE_TRIES		10	// block read/write attempts on transient errors
+#endif
+#ifndef USB_RETRY_STORAGE_PROTOCOL
+#define USB_RETRY_STORAGE_PROTOCOL	3	// block read/write attempts once a protocol error was seen
+#endif
+#ifndef USB_RETRY_BACKOFF_MIN
+#define USB_RETRY_BACKOFF_MIN		10	// ms before the first storage retry, doubled on every further one
+#endif
+#ifndef USB_RETRY_BACKOFF_MAX
+#define USB_RETRY_BACKOFF_MAX		400	// ms, the backoff doesn't grow past this
+#endif
+
+struct UsbRetryPolicy {
+        uint8_t transientTries; // attempts in all while the errors are transient
+        uint8_t protocolTries; // attempts in all once a protocol error was seen
+        uint16_t backoffMin; // ms before the first retry, 0 retries at once
+        uint16_t backoffMax; // ms, upper bound of the doubling
+};
+
+struct UsbHealth {
+        uint32_t transfers; // transfers finished, NAK terminated polls aside
+        uint32_t transient; // transfers failed with a transient error
+        uint32_t protocol; // ... with a protocol error
+        uint32_t fatal; // ... with a fatal error
+        uint32_t retries; // retries granted by the policy
+        uint32_t recovered; // operations that succeeded on a retry
+        uint32_t exhausted; // operations the policy gave up on
+        uint16_t failStreak; // transfers failed in a row, 0 for a healthy device
+} __attribute__((packed));
+
+extern const UsbRetryPolicy UsbRetryBus; // packet level, no backoff: dispatchPkt(), OutTransfer()
+extern const UsbRetryPolicy UsbRetryStorage; // mass storage block I/O
+
+// Class of a host result, hrXXX or USB_ERROR_XXX
+uint8_t UsbErrorClass(uint8_t rcode);
+
+void UsbHealthClear(UsbHealth *h);
+void UsbHealthRecord(UsbHealth *h, uint8_t errclass);
+
+// One per operation:
+//
+//      UsbRetry retry(&UsbRetryStorage, health);
+//      do {
+//              rcode = attempt();
+//      } while (retry.Again(class_of(rcode)));
+
+class UsbRetry {
+        const UsbRetryPolicy *policy;
+        UsbHealth *health;
+        uint8_t attempts; // failed attempts so far
+        uint8_t limit;
+        uint16_t backoff;
+
+public:
+        UsbRetry(const UsbRetryPolicy *p, UsbHealth *h = NULL);
+
+        // Returns true if the operation should be attempted again, after the backoff was waited out
+        bool Again(uint8_t errclass);
+
+        uint8_t GetAttempts() {
+                return attempts;
+        };
+};
+
+#endif // __USBRETRY_H__